@@ -47,9 +47,18 @@ LOCAL_MODULE := libfirewalld
 LOCAL_SRC_FILES := \
     dbus_bindings/dbus-service-config.json \
     dbus_bindings/org.chromium.Firewalld.dbus-xml \
+    app_socket_filter.cc \
+    bpf_program.cc \
+    conntrack.cc \
     firewall_daemon.cc \
     firewall_service.cc \
-    iptables.cc
+    handoff.cc \
+    hole_profiles.cc \
+    iptables.cc \
+    ipv6_address_monitor.cc \
+    uid_range_rules.cc \
+    xdp_filter.cc \
+    xtables_lock.cc
 $(eval $(firewalld_common))
 include $(BUILD_STATIC_TEST_LIBRARY)
 
@@ -71,9 +80,51 @@ ifdef BRILLO
   LOCAL_MODULE_TAGS := debug
 endif
 LOCAL_SRC_FILES := \
+    conntrack_unittest.cc \
+    firewall_service_unittest.cc \
     iptables_unittest.cc \
     mock_iptables.cc \
     run_all_tests.cc
-LOCAL_STATIC_LIBRARIES := libfirewalld libgmock
+LOCAL_STATIC_LIBRARIES := \
+    libfirewalld \
+    libgmock \
+    libbrillo-test-helpers \
+    libchrome_test_helpers
 $(eval $(firewalld_common))
 include $(BUILD_NATIVE_TEST)
+
+# === dataplane benchmark ===
+include $(CLEAR_VARS)
+LOCAL_MODULE := firewalld_dataplane_benchmark
+ifdef BRILLO
+  LOCAL_MODULE_TAGS := debug
+endif
+LOCAL_SRC_FILES := \
+    dataplane_benchmark.cc
+LOCAL_STATIC_LIBRARIES := libfirewalld
+$(eval $(firewalld_common))
+include $(BUILD_EXECUTABLE)
+
+# === pipeline benchmark ===
+include $(CLEAR_VARS)
+LOCAL_MODULE := firewalld_pipeline_benchmark
+ifdef BRILLO
+  LOCAL_MODULE_TAGS := debug
+endif
+LOCAL_SRC_FILES := \
+    pipeline_benchmark.cc
+LOCAL_STATIC_LIBRARIES := libfirewalld
+$(eval $(firewalld_common))
+include $(BUILD_EXECUTABLE)
+
+# === backend equivalence test ===
+include $(CLEAR_VARS)
+LOCAL_MODULE := firewalld_backend_equivalence_test
+ifdef BRILLO
+  LOCAL_MODULE_TAGS := debug
+endif
+LOCAL_SRC_FILES := \
+    backend_equivalence_test.cc
+LOCAL_STATIC_LIBRARIES := libfirewalld
+$(eval $(firewalld_common))
+include $(BUILD_EXECUTABLE)
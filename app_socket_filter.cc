@@ -0,0 +1,371 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "app_socket_filter.h"
+
+#include <fcntl.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <base/bind.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_split.h>
+
+#include "bpf_program.h"
+
+namespace {
+
+const char kCgroupRoot[] = "/sys/fs/cgroup";
+
+const uint32_t kMaxScopes = 4096;
+const size_t kInotifyBufferSize = 4096;
+
+// Key of the scope map.
+struct ScopeKey {
+  uint8_t protocol;
+  uint8_t pad;
+  uint16_t port;  // network byte order
+};
+
+// Value of the scope map. UID scopes have no cgroup ID.
+struct ScopeValue {
+  uint64_t cgroup_id;
+  uint32_t uid;
+  // Depth of the cgroup below the root.
+  uint32_t level;
+};
+
+// The program. Packets start at the network header; offsets are those of
+// IPv4, IPv6, TCP and UDP, struct __sk_buff and struct ScopeValue. Returning
+// 0 drops the packet and 1 lets it through.
+std::vector<struct bpf_insn> ScopeProgram(int map_fd) {
+  const uint8_t r0 = BPF_REG_0, r1 = BPF_REG_1, r2 = BPF_REG_2,
+                r3 = BPF_REG_3, r4 = BPF_REG_4, r5 = BPF_REG_5,
+                r6 = BPF_REG_6, r7 = BPF_REG_7, r8 = BPF_REG_8,
+                r9 = BPF_REG_9, fp = BPF_REG_10;
+  enum Label {
+    kPass,
+    kIpv4,
+    kIpv6,
+    kTransport,
+    kLookup,
+    kUid,
+    kDrop,
+    kLabelCount
+  };
+  firewalld::BpfAssembler a(kLabelCount);
+
+  // r6 = ctx, r2 = data, r3 = data_end.
+  a.Mov(r6, r1);
+  a.Load(BPF_W, r2, r6, offsetof(struct __sk_buff, data));
+  a.Load(BPF_W, r3, r6, offsetof(struct __sk_buff, data_end));
+  a.Load(BPF_W, r5, r6, offsetof(struct __sk_buff, protocol));
+  a.JumpImm(BPF_JEQ, r5, htons(ETH_P_IP), kIpv4);
+  a.JumpImm(BPF_JEQ, r5, htons(ETH_P_IPV6), kIpv6);
+  a.Goto(kPass);
+
+  // IPv4: r7 = protocol, r2 = transport header.
+  a.Bind(kIpv4);
+  a.Mov(r4, r2);
+  a.Alu(BPF_ADD, r4, 20);
+  a.JumpReg(BPF_JGT, r4, r3, kPass);
+  a.Load(BPF_B, r7, r2, 9);
+  a.Load(BPF_B, r5, r2, 0);  // header length
+  a.Alu(BPF_AND, r5, 0x0f);
+  a.Alu(BPF_LSH, r5, 2);
+  a.JumpImm(BPF_JLT, r5, 20, kPass);
+  a.AddReg(r2, r5);
+  a.Goto(kTransport);
+
+  // IPv6: r7 = next header, r2 = transport header.
+  a.Bind(kIpv6);
+  a.Mov(r4, r2);
+  a.Alu(BPF_ADD, r4, 40);
+  a.JumpReg(BPF_JGT, r4, r3, kPass);
+  a.Load(BPF_B, r7, r2, 6);
+  a.Alu(BPF_ADD, r2, 40);
+
+  a.Bind(kTransport);
+  a.JumpImm(BPF_JEQ, r7, IPPROTO_TCP, kLookup);
+  a.JumpImm(BPF_JEQ, r7, IPPROTO_UDP, kLookup);
+  a.Goto(kPass);
+
+  // Look the scope of the destination port up; r9 = scope.
+  a.Bind(kLookup);
+  a.Mov(r4, r2);
+  a.Alu(BPF_ADD, r4, 4);
+  a.JumpReg(BPF_JGT, r4, r3, kPass);
+  a.Load(BPF_H, r8, r2, 2);  // destination port
+  a.Store(BPF_B, fp, -4, r7);
+  a.StoreImm(BPF_B, fp, -3, 0);
+  a.Store(BPF_H, fp, -2, r8);
+  a.LoadMapFd(r1, map_fd);
+  a.Mov(r2, fp);
+  a.Alu(BPF_ADD, r2, -4);
+  a.Call(BPF_FUNC_map_lookup_elem);
+  a.JumpImm(BPF_JEQ, r0, 0, kPass);
+  a.Mov(r9, r0);
+
+  // The socket's cgroup, or its ancestor at the scope's level, must be the
+  // scope's.
+  a.Load(BPF_DW, r1, r9, offsetof(ScopeValue, cgroup_id));
+  a.JumpImm(BPF_JEQ, r1, 0, kUid);
+  a.Mov(r1, r6);
+  a.Load(BPF_W, r2, r9, offsetof(ScopeValue, level));
+  a.Call(BPF_FUNC_skb_ancestor_cgroup_id);
+  a.Load(BPF_DW, r1, r9, offsetof(ScopeValue, cgroup_id));
+  a.JumpReg(BPF_JEQ, r0, r1, kPass);
+  a.Goto(kDrop);
+
+  a.Bind(kUid);
+  a.Mov(r1, r6);
+  a.Call(BPF_FUNC_get_socket_uid);
+  a.Load(BPF_W, r1, r9, offsetof(ScopeValue, uid));
+  a.JumpReg(BPF_JEQ, r0, r1, kPass);
+
+  a.Bind(kDrop);
+  a.MovImm(r0, 0);
+  a.Exit();
+
+  a.Bind(kPass);
+  a.MovImm(r0, 1);
+  a.Exit();
+  return a.Finish();
+}
+
+}  // namespace
+
+namespace firewalld {
+
+AppSocketFilter::AppSocketFilter() {
+}
+
+AppSocketFilter::~AppSocketFilter() {
+  if (watch_task_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(watch_task_);
+  }
+}
+
+bool AppSocketFilter::Init(const CgroupCallback& callback) {
+  if (IsInitialized()) {
+    // Starting over would close the inotify fd still being watched.
+    return true;
+  }
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_HASH;
+  attr.key_size = sizeof(ScopeKey);
+  attr.value_size = sizeof(ScopeValue);
+  attr.max_entries = kMaxScopes;
+  map_fd_.reset(Bpf(BPF_MAP_CREATE, &attr));
+  if (!map_fd_.is_valid()) {
+    PLOG(ERROR) << "Could not create app scope map";
+    return false;
+  }
+
+  program_fd_ = LoadBpfProgram(BPF_PROG_TYPE_CGROUP_SKB,
+                               BPF_CGROUP_INET_INGRESS,
+                               ScopeProgram(map_fd_.get()));
+  base::ScopedFD cgroup_fd(
+      HANDLE_EINTR(open(kCgroupRoot, O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+  if (!program_fd_.is_valid() || !cgroup_fd.is_valid()) {
+    LOG(ERROR) << "Could not load app socket filter for " << kCgroupRoot;
+    map_fd_.reset();
+    program_fd_.reset();
+    return false;
+  }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = program_fd_.get();
+  attr.link_create.target_fd = cgroup_fd.get();
+  attr.link_create.attach_type = BPF_CGROUP_INET_INGRESS;
+  link_fd_.reset(Bpf(BPF_LINK_CREATE, &attr));
+  inotify_fd_.reset(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+  if (!link_fd_.is_valid() || !inotify_fd_.is_valid()) {
+    PLOG(ERROR) << "Could not link app socket filter to " << kCgroupRoot;
+    map_fd_.reset();
+    program_fd_.reset();
+    link_fd_.reset();
+    inotify_fd_.reset();
+    return false;
+  }
+
+  callback_ = callback;
+  watch_task_ = brillo::MessageLoop::current()->WatchFileDescriptor(
+      FROM_HERE, inotify_fd_.get(), brillo::MessageLoop::kWatchRead,
+      true /* persistent */,
+      base::Bind(&AppSocketFilter::OnInotifyReadable,
+                 base::Unretained(this)));
+  return true;
+}
+
+bool AppSocketFilter::AddHole(uint8_t protocol,
+                              uint16_t port,
+                              const std::string& cgroup,
+                              uint32_t uid) {
+  const auto key = std::make_pair(protocol, port);
+  auto existing = holes_.find(key);
+  if (existing != holes_.end()) {
+    if (existing->second.cgroup != cgroup ||
+        (cgroup.empty() && existing->second.uid != uid)) {
+      LOG(ERROR) << "Port " << port << " is already scoped to another app";
+      return false;
+    }
+    existing->second.holes++;
+    return true;
+  }
+
+  ScopeValue value;
+  memset(&value, 0, sizeof(value));
+  if (cgroup.empty()) {
+    value.uid = uid;
+  } else {
+    const std::string path = kCgroupRoot + cgroup;
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+      PLOG(ERROR) << "Could not find cgroup " << path;
+      return false;
+    }
+    // The ID of a cgroup v2 is the inode number of its directory.
+    value.cgroup_id = st.st_ino;
+    value.level = base::SplitString(cgroup, "/", base::KEEP_WHITESPACE,
+                                    base::SPLIT_WANT_NONEMPTY)
+                      .size();
+    if (!Watch(cgroup)) {
+      return false;
+    }
+  }
+
+  ScopeKey scope_key;
+  memset(&scope_key, 0, sizeof(scope_key));
+  scope_key.protocol = protocol;
+  scope_key.port = htons(port);
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd_.get();
+  attr.key = PointerToU64(&scope_key);
+  attr.value = PointerToU64(&value);
+  attr.flags = BPF_ANY;
+  if (Bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+    PLOG(ERROR) << "Could not scope port " << port;
+    Unwatch(cgroup);
+    return false;
+  }
+  holes_[key] = Scope{cgroup, uid, 1};
+  return true;
+}
+
+bool AppSocketFilter::RemoveHole(uint8_t protocol, uint16_t port) {
+  auto existing = holes_.find(std::make_pair(protocol, port));
+  if (existing == holes_.end()) {
+    return true;
+  }
+  if (--existing->second.holes > 0) {
+    return true;
+  }
+
+  ScopeKey scope_key;
+  memset(&scope_key, 0, sizeof(scope_key));
+  scope_key.protocol = protocol;
+  scope_key.port = htons(port);
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd_.get();
+  attr.key = PointerToU64(&scope_key);
+  bool success = Bpf(BPF_MAP_DELETE_ELEM, &attr) == 0 || errno == ENOENT;
+  if (!success) {
+    PLOG(ERROR) << "Could not unscope port " << port;
+  }
+
+  const std::string cgroup = existing->second.cgroup;
+  holes_.erase(existing);
+  Unwatch(cgroup);
+  return success;
+}
+
+bool AppSocketFilter::Watch(const std::string& cgroup) {
+  if (watches_.find(cgroup) != watches_.end()) {
+    return true;
+  }
+  const std::string path = kCgroupRoot + cgroup;
+  int watch = inotify_add_watch(inotify_fd_.get(), path.c_str(),
+                                IN_DELETE_SELF);
+  if (watch < 0) {
+    PLOG(ERROR) << "Could not watch cgroup " << path;
+    return false;
+  }
+  watches_[cgroup] = watch;
+  watched_cgroups_[watch] = cgroup;
+  return true;
+}
+
+void AppSocketFilter::Unwatch(const std::string& cgroup) {
+  auto watch = watches_.find(cgroup);
+  if (watch == watches_.end()) {
+    return;
+  }
+  for (const auto& hole : holes_) {
+    if (hole.second.cgroup == cgroup) {
+      return;
+    }
+  }
+  inotify_rm_watch(inotify_fd_.get(), watch->second);
+  watched_cgroups_.erase(watch->second);
+  watches_.erase(watch);
+}
+
+void AppSocketFilter::OnInotifyReadable() {
+  alignas(struct inotify_event) char buffer[kInotifyBufferSize];
+  while (true) {
+    ssize_t length =
+        HANDLE_EINTR(read(inotify_fd_.get(), buffer, sizeof(buffer)));
+    if (length <= 0) {
+      if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        PLOG(ERROR) << "Could not read cgroup events";
+      }
+      return;
+    }
+
+    std::vector<std::string> removed;
+    for (ssize_t offset = 0; offset < length;) {
+      const struct inotify_event* event =
+          reinterpret_cast<const struct inotify_event*>(buffer + offset);
+      offset += sizeof(*event) + event->len;
+      // The watch goes away along with the cgroup.
+      auto cgroup = watched_cgroups_.find(event->wd);
+      if (cgroup == watched_cgroups_.end() ||
+          !(event->mask & (IN_DELETE_SELF | IN_IGNORED))) {
+        continue;
+      }
+      removed.push_back(cgroup->second);
+      watches_.erase(cgroup->second);
+      watched_cgroups_.erase(cgroup);
+    }
+    for (const auto& cgroup : removed) {
+      LOG(INFO) << "Cgroup " << cgroup << " removed";
+      callback_.Run(cgroup);
+    }
+  }
+}
+
+}  // namespace firewalld
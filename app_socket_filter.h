@@ -0,0 +1,103 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIREWALLD_APP_SOCKET_FILTER_H_
+#define FIREWALLD_APP_SOCKET_FILTER_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <utility>
+
+#include <base/callback.h>
+#include <base/files/scoped_file.h>
+#include <base/macros.h>
+#include <brillo/message_loops/message_loop.h>
+
+namespace firewalld {
+
+// Restricts the holes scoped to an app to the sockets of that app, with a
+// cgroup_skb program linked to the root of the cgroup v2 hierarchy. The
+// program sees every packet on its way to a local socket, and drops those to
+// the port of a scoped hole unless the socket belongs to the hole's cgroup,
+// or to one below it, or to the hole's UID. Scopes are looked up in a BPF
+// hash map keyed by protocol and port, so each app hole is one element of it
+// and the INPUT rules of a scoped hole are those of any other hole.
+//
+// The cgroups of scoped holes are watched with inotify, so that their holes
+// can be plugged once the app's cgroup is removed.
+class AppSocketFilter {
+ public:
+  using CgroupCallback = base::Callback<void(const std::string& cgroup)>;
+
+  AppSocketFilter();
+  virtual ~AppSocketFilter();
+
+  // Creates the scope map, loads the program and links it to the root
+  // cgroup. Removed cgroups are reported through |callback|. The program is
+  // unlinked when the filter, or the process, goes away; a new instance of
+  // the daemon links its own and fills it from the holes it takes over.
+  // Does nothing once initialized, e.g. when a failed handoff falls back to
+  // a fresh start.
+  bool Init(const CgroupCallback& callback);
+
+  // Whether |Init| succeeded.
+  bool IsInitialized() const { return link_fd_.is_valid(); }
+
+  // Scopes |port| over |protocol| (IPPROTO_TCP or IPPROTO_UDP) to the
+  // sockets in |cgroup|, a path from the cgroup root such as "/apps/browser",
+  // or, if |cgroup| is empty, to the sockets of |uid|. The scope applies to
+  // the port on every interface, so holes on several interfaces can only
+  // share a port if they share its scope; it goes away with the last of them.
+  virtual bool AddHole(uint8_t protocol,
+                       uint16_t port,
+                       const std::string& cgroup,
+                       uint32_t uid);
+  virtual bool RemoveHole(uint8_t protocol, uint16_t port);
+
+  // Ports with a scope.
+  size_t hole_count() const { return holes_.size(); }
+
+ private:
+  struct Scope {
+    std::string cgroup;
+    uint32_t uid;
+    // Holes sharing the scope.
+    int holes;
+  };
+
+  bool Watch(const std::string& cgroup);
+  void Unwatch(const std::string& cgroup);
+  void OnInotifyReadable();
+
+  base::ScopedFD map_fd_;
+  base::ScopedFD program_fd_;
+  base::ScopedFD link_fd_;
+  base::ScopedFD inotify_fd_;
+  brillo::MessageLoop::TaskId watch_task_{brillo::MessageLoop::kTaskIdNull};
+  CgroupCallback callback_;
+
+  // Scopes by protocol and port.
+  std::map<std::pair<uint8_t, uint16_t>, Scope> holes_;
+  // Inotify watches of the cgroups in |holes_|, both ways.
+  std::map<std::string, int> watches_;
+  std::map<int, std::string> watched_cgroups_;
+
+  DISALLOW_COPY_AND_ASSIGN(AppSocketFilter);
+};
+
+}  // namespace firewalld
+
+#endif  // FIREWALLD_APP_SOCKET_FILTER_H_
@@ -0,0 +1,644 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks that the ways IpTables can apply holes are interchangeable. The
+// same randomized sequences of punches and plugs are driven through each
+// backend in a network namespace:
+//  - "exec": one request at a time, as the D-Bus methods come in, with an
+//    'iptables' run per rule for holes without options;
+//  - "batch": consecutive punches applied with PunchHolesInBatch, and plugs
+//    with PlugHoleGroup, all through 'iptables-restore';
+//  - "xdp": like "exec", with the XDP filter attached to the receiving end.
+// After each sequence, the rules left in the kernel are normalized and
+// compared across backends, and every port the sequence used is probed with
+// TCP connections and UDP datagrams from a second namespace. Divergences
+// between backends, or from the holes the sequence should have left open,
+// are reported and make the exit status 1. Must be run as root.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <base/files/scoped_file.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <brillo/flag_helper.h>
+#include <brillo/process.h>
+#include <brillo/variant_dictionary.h>
+
+#include "dbus_interface.h"
+#include "iptables.h"
+#include "xdp_filter.h"
+
+namespace {
+
+#if defined(__ANDROID__)
+const char kIpPath[] = "/system/bin/ip";
+const char kIpTablesPath[] = "/system/bin/iptables";
+const char kIp6TablesPath[] = "/system/bin/ip6tables";
+const char kIpTablesSavePath[] = "/system/bin/iptables-save";
+const char kIp6TablesSavePath[] = "/system/bin/ip6tables-save";
+#else
+const char kIpPath[] = "/bin/ip";
+const char kIpTablesPath[] = "/sbin/iptables";
+const char kIp6TablesPath[] = "/sbin/ip6tables";
+const char kIpTablesSavePath[] = "/sbin/iptables-save";
+const char kIp6TablesSavePath[] = "/sbin/ip6tables-save";
+#endif  // __ANDROID__
+
+const char kReceiverNamespace[] = "fweq-rx";
+const char kSenderNamespace[] = "fweq-tx";
+const char kReceiverAddress[] = "10.98.0.1";
+const char kSenderAddress[] = "10.98.0.2";
+// Holes on an interface that doesn't exist must not let anything in.
+const char kMissingInterface[] = "fweq-none";
+
+// Sequences use a handful of ports, so that they punch and plug the same
+// holes over and over.
+const uint16_t kFirstPort = 21000;
+const int kPortCount = 6;
+
+const int kProbeTimeoutMs = 200;
+
+bool RunCommand(const std::vector<std::string>& argv) {
+  brillo::ProcessImpl process;
+  for (const auto& arg : argv) {
+    process.AddArg(arg);
+  }
+  if (process.Run() != 0) {
+    LOG(ERROR) << "'" << base::JoinString(argv, " ") << "' failed";
+    return false;
+  }
+  return true;
+}
+
+bool RunCommandWithOutput(const std::vector<std::string>& argv,
+                          std::string* output) {
+  brillo::ProcessImpl process;
+  for (const auto& arg : argv) {
+    process.AddArg(arg);
+  }
+  process.RedirectUsingPipe(STDOUT_FILENO, false /* is_input */);
+  if (!process.Start()) {
+    LOG(ERROR) << "Could not start '" << argv[0] << "'";
+    return false;
+  }
+  output->clear();
+  int fd = process.GetPipe(STDOUT_FILENO);
+  char buffer[4096];
+  ssize_t length;
+  while ((length = HANDLE_EINTR(read(fd, buffer, sizeof(buffer)))) > 0) {
+    output->append(buffer, length);
+  }
+  return process.Wait() == 0 && length == 0;
+}
+
+bool EnterNamespace(const std::string& name) {
+  base::ScopedFD fd(
+      HANDLE_EINTR(open(("/var/run/netns/" + name).c_str(),
+                        O_RDONLY | O_CLOEXEC)));
+  if (!fd.is_valid() || setns(fd.get(), CLONE_NEWNET) < 0) {
+    PLOG(ERROR) << "Could not enter network namespace " << name;
+    return false;
+  }
+  return true;
+}
+
+// Creates the namespaces and the veth pair between them, and deletes them
+// when destroyed.
+class NamespacePair {
+ public:
+  NamespacePair() = default;
+  ~NamespacePair() {
+    RunCommand({kIpPath, "netns", "delete", kReceiverNamespace});
+    RunCommand({kIpPath, "netns", "delete", kSenderNamespace});
+  }
+
+  bool SetUp() {
+    return RunCommand({kIpPath, "netns", "add", kReceiverNamespace}) &&
+           RunCommand({kIpPath, "netns", "add", kSenderNamespace}) &&
+           RunCommand({kIpPath, "link", "add", kReceiverNamespace, "netns",
+                       kReceiverNamespace, "type", "veth", "peer", "name",
+                       kSenderNamespace, "netns", kSenderNamespace}) &&
+           SetUpEnd(kReceiverNamespace, kReceiverAddress) &&
+           SetUpEnd(kSenderNamespace, kSenderAddress);
+  }
+
+ private:
+  // Each end of the veth pair is named after its namespace.
+  bool SetUpEnd(const std::string& name, const std::string& address) {
+    return RunCommand({kIpPath, "-n", name, "addr", "add", address + "/24",
+                       "dev", name}) &&
+           RunCommand({kIpPath, "-n", name, "link", "set", "lo", "up"}) &&
+           RunCommand({kIpPath, "-n", name, "link", "set", name, "up"});
+  }
+
+  DISALLOW_COPY_AND_ASSIGN(NamespacePair);
+};
+
+// Empties every table of the current namespace and installs a base ruleset
+// like the one holes are punched into on a device.
+bool ResetRules() {
+  for (const char* path : {kIpTablesPath, kIp6TablesPath}) {
+    for (const char* table : {"filter", "raw", "mangle"}) {
+      if (!RunCommand({path, "-t", table, "-F"}) ||
+          !RunCommand({path, "-t", table, "-X"})) {
+        return false;
+      }
+    }
+    if (!RunCommand({path, "-P", "INPUT", "DROP"}) ||
+        !RunCommand({path, "-A", "INPUT", "-i", "lo", "-j", "ACCEPT"}) ||
+        !RunCommand({path, "-A", "INPUT", "-m", "conntrack", "--ctstate",
+                     "ESTABLISHED,RELATED", "-j", "ACCEPT"})) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The rules of every table, as dumped by 'iptables-save' and
+// 'ip6tables-save', without what depends on when and how they were added:
+// comments, counters, and the order of the rules within a table, which holes
+// don't depend on.
+bool DumpNormalizedRules(std::vector<std::string>* rules) {
+  rules->clear();
+  for (const char* path : {kIpTablesSavePath, kIp6TablesSavePath}) {
+    std::string dump;
+    if (!RunCommandWithOutput({path}, &dump)) {
+      return false;
+    }
+    const std::string family = path == kIpTablesSavePath ? "4 " : "6 ";
+    std::string table;
+    for (const auto& line : base::SplitString(
+             dump, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+      if (line[0] == '#' || line == "COMMIT") {
+        continue;
+      }
+      if (line[0] == '*') {
+        table = line.substr(1);
+        continue;
+      }
+      if (line[0] == ':') {
+        // Chain policy, without the counters.
+        rules->push_back(family + table + " " +
+                         line.substr(0, line.find(" [")));
+        continue;
+      }
+      rules->push_back(family + table + " " + line);
+    }
+  }
+  std::sort(rules->begin(), rules->end());
+  return true;
+}
+
+struct Operation {
+  bool punch;
+  firewalld::ProtocolEnum protocol;
+  uint16_t port;
+  std::string interface;
+  brillo::VariantDictionary options;
+};
+
+std::string Describe(const Operation& operation) {
+  std::string description = operation.punch ? "punch " : "plug ";
+  description += operation.protocol == firewalld::kProtocolTcp ? "tcp " : "udp ";
+  description += std::to_string(operation.port) + " '" +
+                 operation.interface + "'";
+  for (const auto& option : operation.options) {
+    description += " " + option.first;
+  }
+  return description;
+}
+
+// Options that change the rules but not whether a single probe gets through.
+// Some don't apply to every protocol, which every backend must refuse alike.
+brillo::VariantDictionary RandomOptions(std::mt19937* random) {
+  brillo::VariantDictionary options;
+  switch ((*random)() % 4) {
+    case 0:
+      options[firewalld::kHoleOptionNoTrack] = true;
+      break;
+    case 1:
+      options[firewalld::kHoleOptionRateLimit] = static_cast<uint32_t>(1000);
+      break;
+    default:
+      break;
+  }
+  return options;
+}
+
+std::vector<Operation> RandomSequence(std::mt19937* random, int length) {
+  const std::vector<std::string> interfaces = {"", kReceiverNamespace,
+                                               kMissingInterface};
+  std::vector<Operation> sequence;
+  for (int i = 0; i < length; i++) {
+    Operation operation;
+    operation.punch = (*random)() % 3 != 0;
+    operation.protocol =
+        (*random)() % 2 ? firewalld::kProtocolTcp : firewalld::kProtocolUdp;
+    operation.port = kFirstPort + (*random)() % kPortCount;
+    operation.interface = interfaces[(*random)() % interfaces.size()];
+    if (operation.punch) {
+      operation.options = RandomOptions(random);
+    }
+    sequence.push_back(operation);
+  }
+  return sequence;
+}
+
+// Drives sequences through one backend, starting each of them from the base
+// ruleset.
+class Backend {
+ public:
+  explicit Backend(const std::string& name) : name_(name) {}
+
+  const std::string& name() const { return name_; }
+
+  // Returns the result of each operation.
+  bool Apply(const std::vector<Operation>& sequence,
+             std::vector<bool>* results) {
+    // Rules left by the previous sequence go with the flush, so the previous
+    // instance forgets rather than plugs its holes.
+    if (iptables_) {
+      iptables_->ForgetAllHoles();
+    }
+    iptables_.reset();
+    xdp_filter_.reset();
+    if (!ResetRules()) {
+      return false;
+    }
+    iptables_.reset(new firewalld::IpTables());
+    if (name_ == "xdp") {
+      xdp_filter_.reset(new firewalld::XdpFilter());
+      if (!xdp_filter_->Init() ||
+          !xdp_filter_->Attach(kReceiverNamespace, true /* filter_udp */)) {
+        return false;
+      }
+      iptables_->SetXdpFilter(xdp_filter_.get());
+    }
+
+    results->clear();
+    if (name_ == "batch") {
+      ApplyInBatches(sequence, results);
+    } else {
+      for (const auto& operation : sequence) {
+        results->push_back(ApplyOne(operation));
+      }
+    }
+    return true;
+  }
+
+ private:
+  bool ApplyOne(const Operation& operation) {
+    const bool tcp = operation.protocol == firewalld::kProtocolTcp;
+    if (!operation.punch) {
+      return tcp ? iptables_->PlugTcpHole(operation.port, operation.interface)
+                 : iptables_->PlugUdpHole(operation.port, operation.interface);
+    }
+    return tcp ? iptables_->PunchTcpHoleWithOptions(
+                     operation.port, operation.interface, operation.options)
+               : iptables_->PunchUdpHoleWithOptions(
+                     operation.port, operation.interface, operation.options);
+  }
+
+  void ApplyInBatches(const std::vector<Operation>& sequence,
+                      std::vector<bool>* results) {
+    size_t i = 0;
+    while (i < sequence.size()) {
+      if (!sequence[i].punch) {
+        firewalld::IpTables::GroupHole hole{sequence[i].protocol,
+                                            sequence[i].port,
+                                            firewalld::HoleOptions()};
+        results->push_back(
+            iptables_->PlugHoleGroup({hole}, sequence[i].interface));
+        i++;
+        continue;
+      }
+      std::vector<firewalld::IpTables::HoleRequest> requests;
+      for (; i < sequence.size() && sequence[i].punch; i++) {
+        requests.push_back({sequence[i].protocol, sequence[i].port,
+                            sequence[i].interface, sequence[i].options});
+      }
+      for (bool result : iptables_->PunchHolesInBatch(requests)) {
+        results->push_back(result);
+      }
+    }
+  }
+
+  const std::string name_;
+  std::unique_ptr<firewalld::XdpFilter> xdp_filter_;
+  std::unique_ptr<firewalld::IpTables> iptables_;
+
+  DISALLOW_COPY_AND_ASSIGN(Backend);
+};
+
+// The holes a sequence should leave open, as (protocol, port) reachable from
+// the sender, given which of its operations succeeded.
+std::set<std::pair<firewalld::ProtocolEnum, uint16_t>> ExpectedReachable(
+    const std::vector<Operation>& sequence, const std::vector<bool>& results) {
+  std::set<std::tuple<firewalld::ProtocolEnum, uint16_t, std::string>> holes;
+  for (size_t i = 0; i < sequence.size(); i++) {
+    const Operation& operation = sequence[i];
+    if (!results[i]) {
+      continue;
+    }
+    auto hole = std::make_tuple(operation.protocol, operation.port,
+                                operation.interface);
+    if (operation.punch) {
+      holes.insert(hole);
+    } else {
+      holes.erase(hole);
+    }
+  }
+  std::set<std::pair<firewalld::ProtocolEnum, uint16_t>> reachable;
+  for (const auto& hole : holes) {
+    if (std::get<2>(hole) != kMissingInterface) {
+      reachable.insert(std::make_pair(std::get<0>(hole), std::get<1>(hole)));
+    }
+  }
+  return reachable;
+}
+
+sockaddr_in Address(const std::string& address, uint16_t port) {
+  struct sockaddr_in result;
+  memset(&result, 0, sizeof(result));
+  result.sin_family = AF_INET;
+  result.sin_port = htons(port);
+  inet_pton(AF_INET, address.c_str(), &result.sin_addr);
+  return result;
+}
+
+bool WaitReadable(int fd, short events) {
+  struct pollfd poll_fd = {fd, events, 0};
+  return HANDLE_EINTR(poll(&poll_fd, 1, kProbeTimeoutMs)) == 1;
+}
+
+// Listeners on every port, in the receiver's namespace, and probes of them
+// from sockets opened in the sender's.
+class Prober {
+ public:
+  Prober() = default;
+
+  // Must be called from the receiver's namespace. Sockets opened here stay
+  // in it.
+  bool Listen() {
+    for (int i = 0; i < kPortCount; i++) {
+      const struct sockaddr_in address =
+          Address(kReceiverAddress, kFirstPort + i);
+      base::ScopedFD tcp(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+      base::ScopedFD udp(
+          socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0));
+      int one = 1;
+      if (!tcp.is_valid() || !udp.is_valid() ||
+          setsockopt(tcp.get(), SOL_SOCKET, SO_REUSEADDR, &one,
+                     sizeof(one)) < 0 ||
+          bind(tcp.get(), reinterpret_cast<const struct sockaddr*>(&address),
+               sizeof(address)) < 0 ||
+          listen(tcp.get(), 16) < 0 ||
+          bind(udp.get(), reinterpret_cast<const struct sockaddr*>(&address),
+               sizeof(address)) < 0) {
+        PLOG(ERROR) << "Could not listen on port " << kFirstPort + i;
+        return false;
+      }
+      tcp_listeners_.push_back(std::move(tcp));
+      udp_receivers_.push_back(std::move(udp));
+    }
+    return true;
+  }
+
+  // Must be called from the sender's namespace, which has to be entered
+  // again for each round of probes: IpTables runs in the receiver's.
+  std::set<std::pair<firewalld::ProtocolEnum, uint16_t>> Probe() {
+    std::set<std::pair<firewalld::ProtocolEnum, uint16_t>> reachable;
+    for (int i = 0; i < kPortCount; i++) {
+      const uint16_t port = kFirstPort + i;
+      if (ProbeTcp(i)) {
+        reachable.insert(std::make_pair(firewalld::kProtocolTcp, port));
+      }
+      if (ProbeUdp(i)) {
+        reachable.insert(std::make_pair(firewalld::kProtocolUdp, port));
+      }
+    }
+    return reachable;
+  }
+
+ private:
+  bool ProbeTcp(int index) {
+    const struct sockaddr_in address =
+        Address(kReceiverAddress, kFirstPort + index);
+    // A new socket, and source port, every time, so that conntrack has
+    // nothing to go on from earlier probes.
+    base::ScopedFD fd(
+        socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0));
+    if (!fd.is_valid()) {
+      return false;
+    }
+    if (connect(fd.get(), reinterpret_cast<const struct sockaddr*>(&address),
+                sizeof(address)) < 0 &&
+        errno != EINPROGRESS) {
+      return false;
+    }
+    int error = 0;
+    socklen_t length = sizeof(error);
+    const bool connected =
+        WaitReadable(fd.get(), POLLOUT) &&
+        getsockopt(fd.get(), SOL_SOCKET, SO_ERROR, &error, &length) == 0 &&
+        error == 0;
+    if (connected) {
+      base::ScopedFD accepted(HANDLE_EINTR(
+          accept4(tcp_listeners_[index].get(), nullptr, nullptr,
+                  SOCK_CLOEXEC)));
+    }
+    return connected;
+  }
+
+  bool ProbeUdp(int index) {
+    const struct sockaddr_in address =
+        Address(kReceiverAddress, kFirstPort + index);
+    base::ScopedFD fd(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+    const char payload[] = "probe";
+    if (!fd.is_valid() ||
+        sendto(fd.get(), payload, sizeof(payload), 0,
+               reinterpret_cast<const struct sockaddr*>(&address),
+               sizeof(address)) < 0) {
+      return false;
+    }
+    int receiver = udp_receivers_[index].get();
+    if (!WaitReadable(receiver, POLLIN)) {
+      return false;
+    }
+    char buffer[sizeof(payload)];
+    while (recv(receiver, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+    }
+    return true;
+  }
+
+  std::vector<base::ScopedFD> tcp_listeners_;
+  std::vector<base::ScopedFD> udp_receivers_;
+
+  DISALLOW_COPY_AND_ASSIGN(Prober);
+};
+
+std::string DescribeReachable(
+    const std::set<std::pair<firewalld::ProtocolEnum, uint16_t>>& reachable) {
+  std::vector<std::string> holes;
+  for (const auto& hole : reachable) {
+    holes.push_back(
+        (hole.first == firewalld::kProtocolTcp ? "tcp:" : "udp:") +
+        std::to_string(hole.second));
+  }
+  return "{" + base::JoinString(holes, " ") + "}";
+}
+
+// Describes the rules only one of |a| and |b| has.
+void AppendRuleDifference(const std::string& a_name,
+                          const std::vector<std::string>& a,
+                          const std::string& b_name,
+                          const std::vector<std::string>& b,
+                          std::vector<std::string>* problems) {
+  std::vector<std::string> only_a;
+  std::vector<std::string> only_b;
+  std::set_difference(a.begin(), a.end(), b.begin(), b.end(),
+                      std::back_inserter(only_a));
+  std::set_difference(b.begin(), b.end(), a.begin(), a.end(),
+                      std::back_inserter(only_b));
+  for (const auto& rule : only_a) {
+    problems->push_back("  only " + a_name + ": " + rule);
+  }
+  for (const auto& rule : only_b) {
+    problems->push_back("  only " + b_name + ": " + rule);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  DEFINE_string(backends, "exec,batch",
+                "Comma-separated backends to compare: exec, batch, xdp. The "
+                "first one is the reference.");
+  DEFINE_int32(sequences, 20, "Random sequences to run.");
+  DEFINE_int32(length, 12, "Operations per sequence.");
+  DEFINE_int32(seed, 1, "Seed of the random sequences.");
+  brillo::FlagHelper::Init(argc, argv, "firewalld backend equivalence test");
+  logging::SetMinLogLevel(logging::LOG_WARNING);
+
+  std::vector<std::unique_ptr<Backend>> backends;
+  for (const auto& name : base::SplitString(FLAGS_backends, ",",
+                                            base::TRIM_WHITESPACE,
+                                            base::SPLIT_WANT_NONEMPTY)) {
+    if (name != "exec" && name != "batch" && name != "xdp") {
+      LOG(ERROR) << "Unknown backend '" << name << "'";
+      return 1;
+    }
+    backends.emplace_back(new Backend(name));
+  }
+  if (backends.size() < 2) {
+    LOG(ERROR) << "--backends needs at least two backends";
+    return 1;
+  }
+
+  NamespacePair namespaces;
+  Prober prober;
+  if (!namespaces.SetUp() || !EnterNamespace(kReceiverNamespace) ||
+      !prober.Listen()) {
+    return 1;
+  }
+
+  std::mt19937 random(FLAGS_seed);
+  int divergent = 0;
+  for (int i = 0; i < FLAGS_sequences; i++) {
+    const std::vector<Operation> sequence =
+        RandomSequence(&random, FLAGS_length);
+
+    std::vector<bool> reference_results;
+    std::vector<std::string> reference_rules;
+    std::vector<std::string> problems;
+    for (size_t j = 0; j < backends.size(); j++) {
+      Backend* backend = backends[j].get();
+      std::vector<bool> results;
+      std::vector<std::string> rules;
+      if (!EnterNamespace(kReceiverNamespace) ||
+          !backend->Apply(sequence, &results) ||
+          !DumpNormalizedRules(&rules) || !EnterNamespace(kSenderNamespace)) {
+        LOG(ERROR) << "Could not run sequence " << i << " on "
+                   << backend->name();
+        return 1;
+      }
+      const auto reachable = prober.Probe();
+
+      // Every backend is held to the holes the reference managed to punch;
+      // any other disagreement on results is reported below.
+      if (j == 0) {
+        reference_results = results;
+        reference_rules = rules;
+      }
+      const auto expected = ExpectedReachable(sequence, reference_results);
+      if (reachable != expected) {
+        problems.push_back(backend->name() + " lets in " +
+                           DescribeReachable(reachable) + ", expected " +
+                           DescribeReachable(expected));
+      }
+      if (j == 0) {
+        continue;
+      }
+      for (size_t k = 0; k < sequence.size(); k++) {
+        if (results[k] != reference_results[k]) {
+          problems.push_back(backends[0]->name() + " and " + backend->name() +
+                             " disagree on '" + Describe(sequence[k]) + "'");
+        }
+      }
+      if (rules != reference_rules) {
+        problems.push_back(backends[0]->name() + " and " + backend->name() +
+                           " leave different rules:");
+        AppendRuleDifference(backends[0]->name(), reference_rules,
+                             backend->name(), rules, &problems);
+      }
+    }
+
+    if (problems.empty()) {
+      printf("sequence %d: ok\n", i);
+      continue;
+    }
+    divergent++;
+    printf("sequence %d: DIVERGED\n", i);
+    for (const auto& operation : sequence) {
+      printf("    %s\n", Describe(operation).c_str());
+    }
+    for (const auto& problem : problems) {
+      printf("  %s\n", problem.c_str());
+    }
+    fflush(stdout);
+  }
+
+  printf("%d of %d sequences diverged\n", divergent, FLAGS_sequences);
+  return divergent == 0 ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bpf_program.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+const size_t kVerifierLogSize = 65536;
+
+}  // namespace
+
+namespace firewalld {
+
+int Bpf(int command, union bpf_attr* attr) {
+  return syscall(__NR_bpf, command, attr, sizeof(*attr));
+}
+
+uint64_t PointerToU64(const void* pointer) {
+  return reinterpret_cast<uintptr_t>(pointer);
+}
+
+base::ScopedFD LoadBpfProgram(enum bpf_prog_type type,
+                              enum bpf_attach_type expected_attach_type,
+                              const std::vector<struct bpf_insn>& program) {
+  std::vector<char> log(kVerifierLogSize);
+  const char license[] = "Apache-2.0";
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = type;
+  attr.expected_attach_type = expected_attach_type;
+  attr.insns = PointerToU64(program.data());
+  attr.insn_cnt = program.size();
+  attr.license = PointerToU64(license);
+  attr.log_buf = PointerToU64(log.data());
+  attr.log_size = log.size();
+  attr.log_level = 1;
+  base::ScopedFD program_fd(Bpf(BPF_PROG_LOAD, &attr));
+  if (!program_fd.is_valid()) {
+    PLOG(ERROR) << "Could not load BPF program: " << log.data();
+  }
+  return program_fd;
+}
+
+}  // namespace firewalld
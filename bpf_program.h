@@ -0,0 +1,123 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIREWALLD_BPF_PROGRAM_H_
+#define FIREWALLD_BPF_PROGRAM_H_
+
+#include <linux/bpf.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <utility>
+#include <vector>
+
+#include <base/files/scoped_file.h>
+#include <base/logging.h>
+#include <base/macros.h>
+
+namespace firewalld {
+
+// Builds eBPF instructions, resolving forward jumps to labels. Labels are
+// numbered from 0 to the count given to the constructor.
+class BpfAssembler {
+ public:
+  explicit BpfAssembler(int label_count) : labels_(label_count, -1) {}
+
+  void Emit(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    struct bpf_insn insn;
+    memset(&insn, 0, sizeof(insn));
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    insns_.push_back(insn);
+  }
+
+  void Mov(uint8_t dst, uint8_t src) {
+    Emit(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0);
+  }
+  void MovImm(uint8_t dst, int32_t imm) {
+    Emit(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm);
+  }
+  void Alu(uint8_t op, uint8_t dst, int32_t imm) {
+    Emit(BPF_ALU64 | op | BPF_K, dst, 0, 0, imm);
+  }
+  void AddReg(uint8_t dst, uint8_t src) {
+    Emit(BPF_ALU64 | BPF_ADD | BPF_X, dst, src, 0, 0);
+  }
+  // Converts a 16-bit value loaded from the network to host byte order.
+  void NetworkToHost16(uint8_t dst) {
+    Emit(BPF_ALU | BPF_END | BPF_TO_BE, dst, 0, 0, 16);
+  }
+  void Load(uint8_t size, uint8_t dst, uint8_t src, int16_t off) {
+    Emit(BPF_LDX | size | BPF_MEM, dst, src, off, 0);
+  }
+  void Store(uint8_t size, uint8_t dst, int16_t off, uint8_t src) {
+    Emit(BPF_STX | size | BPF_MEM, dst, src, off, 0);
+  }
+  void StoreImm(uint8_t size, uint8_t dst, int16_t off, int32_t imm) {
+    Emit(BPF_ST | size | BPF_MEM, dst, 0, off, imm);
+  }
+  void LoadMapFd(uint8_t dst, int fd) {
+    Emit(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+    Emit(0, 0, 0, 0, 0);
+  }
+  void Call(int32_t helper) { Emit(BPF_JMP | BPF_CALL, 0, 0, 0, helper); }
+  void Exit() { Emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0); }
+
+  void JumpImm(uint8_t op, uint8_t dst, int32_t imm, int label) {
+    fixups_.push_back(std::make_pair(insns_.size(), label));
+    Emit(BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+  }
+  void JumpReg(uint8_t op, uint8_t dst, uint8_t src, int label) {
+    fixups_.push_back(std::make_pair(insns_.size(), label));
+    Emit(BPF_JMP | op | BPF_X, dst, src, 0, 0);
+  }
+  void Goto(int label) { JumpImm(BPF_JA, 0, 0, label); }
+
+  void Bind(int label) { labels_[label] = insns_.size(); }
+
+  std::vector<struct bpf_insn> Finish() {
+    for (const auto& fixup : fixups_) {
+      CHECK_GE(labels_[fixup.second], 0);
+      insns_[fixup.first].off =
+          labels_[fixup.second] - static_cast<int>(fixup.first) - 1;
+    }
+    return insns_;
+  }
+
+ private:
+  std::vector<struct bpf_insn> insns_;
+  std::vector<int> labels_;
+  std::vector<std::pair<size_t, int>> fixups_;
+
+  DISALLOW_COPY_AND_ASSIGN(BpfAssembler);
+};
+
+// Runs the bpf(2) |command|.
+int Bpf(int command, union bpf_attr* attr);
+
+uint64_t PointerToU64(const void* pointer);
+
+// Loads |program| as a |type| program, logging the verifier's output if it
+// is rejected. |expected_attach_type| is only checked for some types, and
+// can be left 0 for the others.
+base::ScopedFD LoadBpfProgram(enum bpf_prog_type type,
+                              enum bpf_attach_type expected_attach_type,
+                              const std::vector<struct bpf_insn>& program);
+
+}  // namespace firewalld
+
+#endif  // FIREWALLD_BPF_PROGRAM_H_
@@ -0,0 +1,333 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "conntrack.h"
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netlink.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <base/files/scoped_file.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+namespace {
+
+const size_t kReceiveBufferSize = 65536;
+
+// Delete requests are written in chunks that comfortably fit the default
+// socket send buffer.
+const size_t kSendChunkSize = 16384;
+
+firewalld::InterfaceAddresses GetInterfaceAddresses() {
+  firewalld::InterfaceAddresses addresses;
+  struct ifaddrs* ifaddrs;
+  if (getifaddrs(&ifaddrs) < 0) {
+    PLOG(ERROR) << "Could not get interface addresses";
+    return addresses;
+  }
+  for (struct ifaddrs* ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+    if (!ifa->ifa_addr) {
+      continue;
+    }
+    if (ifa->ifa_addr->sa_family == AF_INET) {
+      const struct sockaddr_in* address =
+          reinterpret_cast<const struct sockaddr_in*>(ifa->ifa_addr);
+      addresses[ifa->ifa_name].insert(
+          std::string(reinterpret_cast<const char*>(&address->sin_addr),
+                      sizeof(address->sin_addr)));
+    } else if (ifa->ifa_addr->sa_family == AF_INET6) {
+      const struct sockaddr_in6* address =
+          reinterpret_cast<const struct sockaddr_in6*>(ifa->ifa_addr);
+      addresses[ifa->ifa_name].insert(
+          std::string(reinterpret_cast<const char*>(&address->sin6_addr),
+                      sizeof(address->sin6_addr)));
+    }
+  }
+  freeifaddrs(ifaddrs);
+  return addresses;
+}
+
+const char* AttributeData(const struct nlattr* attribute) {
+  return reinterpret_cast<const char*>(attribute) + NLA_HDRLEN;
+}
+
+size_t AttributeLength(const struct nlattr* attribute) {
+  return attribute->nla_len - NLA_HDRLEN;
+}
+
+// Indexes the attributes in |data| by type into |table|, which has room for
+// types up to |max|. Missing attributes are left null.
+void ParseAttributes(const char* data,
+                     size_t length,
+                     const struct nlattr** table,
+                     int max) {
+  memset(table, 0, sizeof(*table) * (max + 1));
+  while (length >= NLA_HDRLEN) {
+    const struct nlattr* attribute =
+        reinterpret_cast<const struct nlattr*>(data);
+    if (attribute->nla_len < NLA_HDRLEN || attribute->nla_len > length) {
+      return;
+    }
+    int type = attribute->nla_type & NLA_TYPE_MASK;
+    if (type <= max) {
+      table[type] = attribute;
+    }
+    size_t aligned_length = NLA_ALIGN(attribute->nla_len);
+    if (aligned_length >= length) {
+      return;
+    }
+    data += aligned_length;
+    length -= aligned_length;
+  }
+}
+
+// Extracts the protocol, destination port and destination address from an
+// original-direction conntrack tuple.
+bool ParseOriginalTuple(const struct nlattr* tuple,
+                        uint8_t* protocol,
+                        uint16_t* port,
+                        std::string* address) {
+  const struct nlattr* tuple_attributes[CTA_TUPLE_MAX + 1];
+  ParseAttributes(AttributeData(tuple), AttributeLength(tuple),
+                  tuple_attributes, CTA_TUPLE_MAX);
+  const struct nlattr* ip = tuple_attributes[CTA_TUPLE_IP];
+  const struct nlattr* proto = tuple_attributes[CTA_TUPLE_PROTO];
+  if (!ip || !proto) {
+    return false;
+  }
+
+  const struct nlattr* ip_attributes[CTA_IP_MAX + 1];
+  ParseAttributes(AttributeData(ip), AttributeLength(ip), ip_attributes,
+                  CTA_IP_MAX);
+  const struct nlattr* destination = ip_attributes[CTA_IP_V4_DST]
+                                         ? ip_attributes[CTA_IP_V4_DST]
+                                         : ip_attributes[CTA_IP_V6_DST];
+  if (!destination) {
+    return false;
+  }
+  address->assign(AttributeData(destination), AttributeLength(destination));
+
+  const struct nlattr* proto_attributes[CTA_PROTO_MAX + 1];
+  ParseAttributes(AttributeData(proto), AttributeLength(proto),
+                  proto_attributes, CTA_PROTO_MAX);
+  const struct nlattr* number = proto_attributes[CTA_PROTO_NUM];
+  const struct nlattr* destination_port = proto_attributes[CTA_PROTO_DST_PORT];
+  if (!number || AttributeLength(number) < sizeof(uint8_t) ||
+      !destination_port ||
+      AttributeLength(destination_port) < sizeof(uint16_t)) {
+    return false;
+  }
+  *protocol = *reinterpret_cast<const uint8_t*>(AttributeData(number));
+  uint16_t network_port;
+  memcpy(&network_port, AttributeData(destination_port), sizeof(network_port));
+  *port = ntohs(network_port);
+  return true;
+}
+
+bool IsLocalAddress(const firewalld::InterfaceAddresses& interface_addresses,
+                    const std::string& address) {
+  for (const auto& addresses : interface_addresses) {
+    if (addresses.second.find(address) != addresses.second.end()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Matches(const std::vector<firewalld::ConntrackMatch>& matches,
+             const firewalld::InterfaceAddresses& interface_addresses,
+             uint8_t protocol,
+             uint16_t port,
+             const std::string& address) {
+  for (const auto& match : matches) {
+    if (match.protocol != protocol || match.port != port) {
+      continue;
+    }
+    // Outbound and forwarded connections to the port stay.
+    if (match.interface.empty()) {
+      if (IsLocalAddress(interface_addresses, address)) {
+        return true;
+      }
+      continue;
+    }
+    auto addresses = interface_addresses.find(match.interface);
+    if (addresses != interface_addresses.end() &&
+        addresses->second.find(address) != addresses->second.end()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void AppendPadded(const void* data, size_t length, std::string* out) {
+  out->append(reinterpret_cast<const char*>(data), length);
+  out->append(NLMSG_ALIGN(length) - length, '\0');
+}
+
+std::string NetlinkRequest(uint8_t message_type,
+                           uint16_t flags,
+                           uint8_t family,
+                           const std::string& attributes) {
+  struct nlmsghdr header;
+  memset(&header, 0, sizeof(header));
+  header.nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg)) + attributes.size();
+  header.nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | message_type;
+  header.nlmsg_flags = NLM_F_REQUEST | flags;
+
+  struct nfgenmsg message;
+  memset(&message, 0, sizeof(message));
+  message.nfgen_family = family;
+  message.version = NFNETLINK_V0;
+
+  std::string request;
+  AppendPadded(&header, sizeof(header), &request);
+  AppendPadded(&message, sizeof(message), &request);
+  request += attributes;
+  return request;
+}
+
+bool SendAll(int fd, const std::string& data) {
+  if (HANDLE_EINTR(send(fd, data.data(), data.size(), 0)) !=
+      static_cast<ssize_t>(data.size())) {
+    PLOG(ERROR) << "Could not write to ctnetlink socket";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+namespace firewalld {
+
+bool ConntrackTupleMatches(const std::vector<ConntrackMatch>& matches,
+                           const InterfaceAddresses& local_addresses,
+                           const char* tuple,
+                           size_t length) {
+  const struct nlattr* attribute =
+      reinterpret_cast<const struct nlattr*>(tuple);
+  if (length < NLA_HDRLEN || attribute->nla_len < NLA_HDRLEN ||
+      attribute->nla_len > length) {
+    return false;
+  }
+  uint8_t protocol;
+  uint16_t port;
+  std::string address;
+  return ParseOriginalTuple(attribute, &protocol, &port, &address) &&
+         Matches(matches, local_addresses, protocol, port, address);
+}
+
+int DeleteConntrackEntries(const std::vector<ConntrackMatch>& matches) {
+  if (matches.empty()) {
+    return 0;
+  }
+
+  base::ScopedFD fd(socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+                           NETLINK_NETFILTER));
+  if (!fd.is_valid()) {
+    PLOG(ERROR) << "Could not open ctnetlink socket";
+    return -1;
+  }
+
+  // Dump all families at once.
+  if (!SendAll(fd.get(), NetlinkRequest(IPCTNL_MSG_CT_GET, NLM_F_DUMP,
+                                        AF_UNSPEC, std::string()))) {
+    return -1;
+  }
+
+  const InterfaceAddresses interface_addresses = GetInterfaceAddresses();
+  std::vector<std::string> delete_requests;
+  char buffer[kReceiveBufferSize];
+  bool done = false;
+  while (!done) {
+    ssize_t length = HANDLE_EINTR(recv(fd.get(), buffer, sizeof(buffer), 0));
+    if (length < 0) {
+      PLOG(ERROR) << "Could not read from ctnetlink socket";
+      return -1;
+    }
+
+    size_t remaining = static_cast<size_t>(length);
+    for (const struct nlmsghdr* header =
+             reinterpret_cast<const struct nlmsghdr*>(buffer);
+         NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+      if (header->nlmsg_type == NLMSG_DONE) {
+        done = true;
+        break;
+      }
+      if (header->nlmsg_type == NLMSG_ERROR) {
+        const struct nlmsgerr* error =
+            reinterpret_cast<const struct nlmsgerr*>(NLMSG_DATA(header));
+        if (error->error != 0) {
+          LOG(ERROR) << "Conntrack dump failed: " << strerror(-error->error);
+          return -1;
+        }
+        continue;
+      }
+      if (header->nlmsg_len <
+          NLMSG_LENGTH(NLMSG_ALIGN(sizeof(struct nfgenmsg)))) {
+        continue;
+      }
+
+      const struct nfgenmsg* message =
+          reinterpret_cast<const struct nfgenmsg*>(NLMSG_DATA(header));
+      const struct nlattr* attributes[CTA_MAX + 1];
+      ParseAttributes(
+          reinterpret_cast<const char*>(message) +
+              NLMSG_ALIGN(sizeof(struct nfgenmsg)),
+          header->nlmsg_len -
+              NLMSG_LENGTH(NLMSG_ALIGN(sizeof(struct nfgenmsg))),
+          attributes, CTA_MAX);
+      const struct nlattr* tuple = attributes[CTA_TUPLE_ORIG];
+      if (!tuple ||
+          !ConntrackTupleMatches(matches, interface_addresses,
+                                 reinterpret_cast<const char*>(tuple),
+                                 tuple->nla_len)) {
+        continue;
+      }
+
+      // The original tuple, along with the zone if there is one, identifies
+      // the entry.
+      std::string identity;
+      AppendPadded(tuple, tuple->nla_len, &identity);
+      if (attributes[CTA_ZONE]) {
+        AppendPadded(attributes[CTA_ZONE], attributes[CTA_ZONE]->nla_len,
+                     &identity);
+      }
+      delete_requests.push_back(NetlinkRequest(
+          IPCTNL_MSG_CT_DELETE, 0, message->nfgen_family, identity));
+    }
+  }
+
+  std::string chunk;
+  for (const auto& request : delete_requests) {
+    if (chunk.size() + request.size() > kSendChunkSize) {
+      if (!SendAll(fd.get(), chunk)) {
+        return -1;
+      }
+      chunk.clear();
+    }
+    chunk += request;
+  }
+  if (!chunk.empty() && !SendAll(fd.get(), chunk)) {
+    return -1;
+  }
+  return static_cast<int>(delete_requests.size());
+}
+
+}  // namespace firewalld
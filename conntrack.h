@@ -0,0 +1,57 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIREWALLD_CONNTRACK_H_
+#define FIREWALLD_CONNTRACK_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace firewalld {
+
+// Connections to |port| over |protocol| (IPPROTO_TCP or IPPROTO_UDP) whose
+// original destination is an address of |interface|, or any local address if
+// |interface| is empty.
+struct ConntrackMatch {
+  uint8_t protocol;
+  uint16_t port;
+  std::string interface;
+};
+
+// Local addresses, as raw bytes, by interface name.
+using InterfaceAddresses = std::map<std::string, std::set<std::string>>;
+
+// Whether the connection of the original-direction conntrack tuple |tuple|, a
+// CTA_TUPLE_ORIG attribute of |length| bytes header included, matches any of
+// |matches|, given the addresses of the local interfaces.
+bool ConntrackTupleMatches(const std::vector<ConntrackMatch>& matches,
+                           const InterfaceAddresses& local_addresses,
+                           const char* tuple,
+                           size_t length);
+
+// Deletes, over ctnetlink, the conntrack entries of the connections matching
+// any of |matches|. The whole table is walked with a single dump, and the
+// delete requests for all matching entries are batched into as few writes as
+// the socket buffer allows. No process is spawned. The deletes aren't
+// acknowledged: returns the number of entries whose deletion was requested,
+// or -1 on failure.
+int DeleteConntrackEntries(const std::vector<ConntrackMatch>& matches);
+
+}  // namespace firewalld
+
+#endif  // FIREWALLD_CONNTRACK_H_
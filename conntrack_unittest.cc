@@ -0,0 +1,133 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "conntrack.h"
+
+#include <arpa/inet.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netlink.h>
+#include <netinet/in.h>
+
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+std::string Attribute(uint16_t type, const std::string& data) {
+  struct nlattr header;
+  header.nla_len = NLA_HDRLEN + data.size();
+  header.nla_type = type;
+  std::string attribute(reinterpret_cast<const char*>(&header),
+                        sizeof(header));
+  attribute += data;
+  attribute.append(NLA_ALIGN(attribute.size()) - attribute.size(), '\0');
+  return attribute;
+}
+
+std::string Nested(uint16_t type, const std::string& attributes) {
+  return Attribute(type | NLA_F_NESTED, attributes);
+}
+
+std::string Ipv4Address(const char* address) {
+  struct in_addr in;
+  inet_pton(AF_INET, address, &in);
+  return std::string(reinterpret_cast<const char*>(&in), sizeof(in));
+}
+
+// An original-direction tuple to |address|:|port|, as ctnetlink dumps it.
+std::string Tuple(uint8_t protocol,
+                  const std::string& address,
+                  uint16_t port) {
+  const uint16_t network_port = htons(port);
+  return Nested(
+      CTA_TUPLE_ORIG,
+      Nested(CTA_TUPLE_IP,
+             Attribute(CTA_IP_V4_SRC, Ipv4Address("198.51.100.7")) +
+                 Attribute(CTA_IP_V4_DST, address)) +
+          Nested(CTA_TUPLE_PROTO,
+                 Attribute(CTA_PROTO_NUM,
+                           std::string(reinterpret_cast<const char*>(
+                                           &protocol),
+                                       sizeof(protocol))) +
+                     Attribute(CTA_PROTO_DST_PORT,
+                               std::string(reinterpret_cast<const char*>(
+                                               &network_port),
+                                           sizeof(network_port)))));
+}
+
+}  // namespace
+
+namespace firewalld {
+
+class ConntrackTest : public testing::Test {
+ public:
+  ConntrackTest() = default;
+  ~ConntrackTest() override = default;
+
+ protected:
+  bool TupleMatches(const std::vector<ConntrackMatch>& matches,
+                    const std::string& tuple) {
+    return ConntrackTupleMatches(matches, local_addresses_, tuple.data(),
+                                 tuple.size());
+  }
+
+  const InterfaceAddresses local_addresses_{
+      {"eth0", {Ipv4Address("192.0.2.1")}},
+      {"wlan0", {Ipv4Address("192.0.2.2")}},
+  };
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ConntrackTest);
+};
+
+TEST_F(ConntrackTest, MatchesAddressOfInterface) {
+  const std::vector<ConntrackMatch> matches{{IPPROTO_TCP, 80, "eth0"}};
+  EXPECT_TRUE(
+      TupleMatches(matches, Tuple(IPPROTO_TCP, Ipv4Address("192.0.2.1"), 80)));
+  EXPECT_FALSE(
+      TupleMatches(matches, Tuple(IPPROTO_TCP, Ipv4Address("192.0.2.2"), 80)));
+  EXPECT_FALSE(
+      TupleMatches(matches, Tuple(IPPROTO_UDP, Ipv4Address("192.0.2.1"), 80)));
+  EXPECT_FALSE(
+      TupleMatches(matches, Tuple(IPPROTO_TCP, Ipv4Address("192.0.2.1"), 81)));
+}
+
+TEST_F(ConntrackTest, MatchesAnyLocalAddressWithoutInterface) {
+  const std::vector<ConntrackMatch> matches{{IPPROTO_UDP, 53, ""}};
+  EXPECT_TRUE(
+      TupleMatches(matches, Tuple(IPPROTO_UDP, Ipv4Address("192.0.2.1"), 53)));
+  EXPECT_TRUE(
+      TupleMatches(matches, Tuple(IPPROTO_UDP, Ipv4Address("192.0.2.2"), 53)));
+  // The device's own queries, or forwarded ones, go elsewhere.
+  EXPECT_FALSE(TupleMatches(
+      matches, Tuple(IPPROTO_UDP, Ipv4Address("203.0.113.53"), 53)));
+}
+
+TEST_F(ConntrackTest, IgnoresMalformedTuples) {
+  const std::vector<ConntrackMatch> matches{{IPPROTO_TCP, 80, ""}};
+  const std::string tuple = Tuple(IPPROTO_TCP, Ipv4Address("192.0.2.1"), 80);
+  EXPECT_FALSE(TupleMatches(matches, tuple.substr(0, NLA_HDRLEN - 1)));
+  EXPECT_FALSE(TupleMatches(matches, tuple.substr(0, tuple.size() - 4)));
+  // No protocol.
+  EXPECT_FALSE(TupleMatches(
+      matches,
+      Nested(CTA_TUPLE_ORIG,
+             Nested(CTA_TUPLE_IP, Attribute(CTA_IP_V4_DST,
+                                            Ipv4Address("192.0.2.1"))))));
+}
+
+}  // namespace firewalld
@@ -0,0 +1,382 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures what open holes cost the data path. Two network namespaces are
+// joined by a veth pair, holes are punched in the receiving one through
+// IpTables, and UDP traffic is sent to the hole that sits at the bottom of
+// the INPUT chain, so that every packet walks past all of the others.
+// Reports received packets per second under a flood and the round-trip time
+// of single packets, for a growing number of holes. Must be run as root.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/files/scoped_file.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <brillo/flag_helper.h>
+#include <brillo/process.h>
+#include <brillo/variant_dictionary.h>
+
+#include "dbus_interface.h"
+#include "iptables.h"
+
+namespace {
+
+#if defined(__ANDROID__)
+const char kIpPath[] = "/system/bin/ip";
+const char kIpTablesPath[] = "/system/bin/iptables";
+#else
+const char kIpPath[] = "/bin/ip";
+const char kIpTablesPath[] = "/sbin/iptables";
+#endif  // __ANDROID__
+
+const char kReceiverNamespace[] = "fwbench-rx";
+const char kSenderNamespace[] = "fwbench-tx";
+const char kReceiverAddress[] = "10.99.0.1";
+const char kSenderAddress[] = "10.99.0.2";
+
+// The measured hole, and the first of the holes stacked on top of it.
+const uint16_t kMeasuredPort = 20000;
+const uint16_t kFirstExtraPort = 20001;
+
+const size_t kPayloadSize = 64;
+const size_t kBatchSize = 64;
+
+bool RunCommand(const std::vector<std::string>& argv) {
+  brillo::ProcessImpl process;
+  for (const auto& arg : argv) {
+    process.AddArg(arg);
+  }
+  if (process.Run() != 0) {
+    LOG(ERROR) << "'" << base::JoinString(argv, " ") << "' failed";
+    return false;
+  }
+  return true;
+}
+
+bool EnterNamespace(const std::string& name) {
+  base::ScopedFD fd(
+      HANDLE_EINTR(open(("/var/run/netns/" + name).c_str(),
+                        O_RDONLY | O_CLOEXEC)));
+  if (!fd.is_valid() || setns(fd.get(), CLONE_NEWNET) < 0) {
+    PLOG(ERROR) << "Could not enter network namespace " << name;
+    return false;
+  }
+  return true;
+}
+
+// Creates the namespaces and the veth pair between them, and deletes them
+// when destroyed.
+class NamespacePair {
+ public:
+  NamespacePair() = default;
+  ~NamespacePair() {
+    RunCommand({kIpPath, "netns", "delete", kReceiverNamespace});
+    RunCommand({kIpPath, "netns", "delete", kSenderNamespace});
+  }
+
+  bool SetUp() {
+    return RunCommand({kIpPath, "netns", "add", kReceiverNamespace}) &&
+           RunCommand({kIpPath, "netns", "add", kSenderNamespace}) &&
+           RunCommand({kIpPath, "link", "add", kReceiverNamespace, "netns",
+                       kReceiverNamespace, "type", "veth", "peer", "name",
+                       kSenderNamespace, "netns", kSenderNamespace}) &&
+           SetUpEnd(kReceiverNamespace, kReceiverAddress) &&
+           SetUpEnd(kSenderNamespace, kSenderAddress);
+  }
+
+ private:
+  // Each end of the veth pair is named after its namespace.
+  bool SetUpEnd(const std::string& name, const std::string& address) {
+    return RunCommand({kIpPath, "-n", name, "addr", "add", address + "/24",
+                       "dev", name}) &&
+           RunCommand({kIpPath, "-n", name, "link", "set", "lo", "up"}) &&
+           RunCommand({kIpPath, "-n", name, "link", "set", name, "up"});
+  }
+
+  DISALLOW_COPY_AND_ASSIGN(NamespacePair);
+};
+
+// A base ruleset like the one holes are punched into on a device: nothing
+// gets in unless it belongs to a known connection or a hole lets it in.
+bool SetUpBaseRules() {
+  return RunCommand({kIpTablesPath, "-P", "INPUT", "DROP"}) &&
+         RunCommand({kIpTablesPath, "-A", "INPUT", "-i", "lo", "-j",
+                     "ACCEPT"}) &&
+         RunCommand({kIpTablesPath, "-A", "INPUT", "-m", "conntrack",
+                     "--ctstate", "ESTABLISHED,RELATED", "-j", "ACCEPT"});
+}
+
+base::ScopedFD UdpSocket(const std::string& address, uint16_t port) {
+  base::ScopedFD fd(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+  if (!fd.is_valid()) {
+    PLOG(ERROR) << "Could not open UDP socket";
+    return fd;
+  }
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(port);
+  inet_pton(AF_INET, address.c_str(), &local.sin_addr);
+  if (bind(fd.get(), reinterpret_cast<struct sockaddr*>(&local),
+           sizeof(local)) < 0) {
+    PLOG(ERROR) << "Could not bind UDP socket to " << address << ":" << port;
+    fd.reset();
+  }
+  return fd;
+}
+
+bool Connect(int fd, const std::string& address, uint16_t port) {
+  struct sockaddr_in remote;
+  memset(&remote, 0, sizeof(remote));
+  remote.sin_family = AF_INET;
+  remote.sin_port = htons(port);
+  inet_pton(AF_INET, address.c_str(), &remote.sin_addr);
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&remote),
+              sizeof(remote)) < 0) {
+    PLOG(ERROR) << "Could not connect UDP socket";
+    return false;
+  }
+  return true;
+}
+
+void SetReceiveTimeout(int fd, int milliseconds) {
+  struct timeval timeout;
+  timeout.tv_sec = milliseconds / 1000;
+  timeout.tv_usec = (milliseconds % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+double MonotonicSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+struct FloodResult {
+  double sent_pps;
+  double received_pps;
+};
+
+// Sends as fast as possible from |sender| for |seconds| while counting what
+// makes it through to |receiver|.
+FloodResult Flood(int sender, int receiver, int seconds) {
+  std::atomic<bool> sending{true};
+  uint64_t received = 0;
+  std::thread receive_thread([receiver, &sending, &received]() {
+    std::vector<char> buffers(kBatchSize * kPayloadSize);
+    std::vector<struct iovec> iovecs(kBatchSize);
+    std::vector<struct mmsghdr> messages(kBatchSize);
+    for (size_t i = 0; i < kBatchSize; i++) {
+      iovecs[i].iov_base = &buffers[i * kPayloadSize];
+      iovecs[i].iov_len = kPayloadSize;
+      memset(&messages[i], 0, sizeof(messages[i]));
+      messages[i].msg_hdr.msg_iov = &iovecs[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    // Drain until the sender is done and the socket has gone quiet.
+    while (true) {
+      int count = recvmmsg(receiver, messages.data(), kBatchSize, 0, nullptr);
+      if (count > 0) {
+        received += count;
+      } else if (!sending) {
+        break;
+      }
+    }
+  });
+
+  std::vector<char> payload(kPayloadSize);
+  std::vector<struct iovec> iovecs(kBatchSize);
+  std::vector<struct mmsghdr> messages(kBatchSize);
+  for (size_t i = 0; i < kBatchSize; i++) {
+    iovecs[i].iov_base = payload.data();
+    iovecs[i].iov_len = payload.size();
+    memset(&messages[i], 0, sizeof(messages[i]));
+    messages[i].msg_hdr.msg_iov = &iovecs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+  uint64_t sent = 0;
+  const double start = MonotonicSeconds();
+  double elapsed = 0;
+  while (elapsed < seconds) {
+    int count = sendmmsg(sender, messages.data(), kBatchSize, 0);
+    if (count > 0) {
+      sent += count;
+    }
+    elapsed = MonotonicSeconds() - start;
+  }
+  sending = false;
+  receive_thread.join();
+
+  return {sent / elapsed, received / elapsed};
+}
+
+struct LatencyResult {
+  double median_us;
+  double p99_us;
+  int lost;
+};
+
+// Bounces |pings| packets off an echo thread reading |receiver|, one at a
+// time.
+LatencyResult PingPong(int sender, int receiver, int pings) {
+  std::thread echo_thread([receiver, pings]() {
+    char buffer[kPayloadSize];
+    for (int i = 0; i < pings; i++) {
+      struct sockaddr_in from;
+      socklen_t from_length = sizeof(from);
+      ssize_t length =
+          recvfrom(receiver, buffer, sizeof(buffer), 0,
+                   reinterpret_cast<struct sockaddr*>(&from), &from_length);
+      if (length < 0) {
+        continue;
+      }
+      sendto(receiver, buffer, length, 0,
+             reinterpret_cast<struct sockaddr*>(&from), from_length);
+    }
+  });
+
+  std::vector<double> round_trips;
+  int lost = 0;
+  char buffer[kPayloadSize] = {};
+  for (int i = 0; i < pings; i++) {
+    const double start = MonotonicSeconds();
+    if (send(sender, buffer, sizeof(buffer), 0) < 0 ||
+        recv(sender, buffer, sizeof(buffer), 0) < 0) {
+      lost++;
+      continue;
+    }
+    round_trips.push_back((MonotonicSeconds() - start) * 1e6);
+  }
+  echo_thread.join();
+
+  LatencyResult result{0, 0, lost};
+  if (!round_trips.empty()) {
+    std::sort(round_trips.begin(), round_trips.end());
+    result.median_us = round_trips[round_trips.size() / 2];
+    result.p99_us = round_trips[round_trips.size() * 99 / 100];
+  }
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  DEFINE_string(holes, "0,100,1000,10000",
+                "Comma-separated numbers of holes to stack on top of the "
+                "measured one, in increasing order.");
+  DEFINE_int32(seconds, 5, "Duration of each flood.");
+  DEFINE_int32(pings, 10000, "Round trips timed at each step.");
+  DEFINE_bool(notrack, false,
+              "Punch the holes with the 'notrack' option, so that their "
+              "rules are installed with 'iptables-restore' and the traffic "
+              "bypasses conntrack.");
+  brillo::FlagHelper::Init(argc, argv, "firewalld data path benchmark");
+
+  std::vector<int> steps;
+  for (const auto& step : base::SplitString(FLAGS_holes, ",",
+                                            base::TRIM_WHITESPACE,
+                                            base::SPLIT_WANT_NONEMPTY)) {
+    int holes;
+    if (!base::StringToInt(step, &holes) || holes < 0 ||
+        kFirstExtraPort + holes > 65536 ||
+        (!steps.empty() && holes < steps.back())) {
+      LOG(ERROR) << "Invalid --holes";
+      return 1;
+    }
+    steps.push_back(holes);
+  }
+
+  NamespacePair namespaces;
+  if (!namespaces.SetUp()) {
+    return 1;
+  }
+
+  // Open the sender's socket from its namespace; it stays there once this
+  // process moves on to the receiver's.
+  if (!EnterNamespace(kSenderNamespace)) {
+    return 1;
+  }
+  base::ScopedFD sender = UdpSocket(kSenderAddress, 0);
+  if (!sender.is_valid() ||
+      !Connect(sender.get(), kReceiverAddress, kMeasuredPort)) {
+    return 1;
+  }
+  SetReceiveTimeout(sender.get(), 1000);
+
+  if (!EnterNamespace(kReceiverNamespace) || !SetUpBaseRules()) {
+    return 1;
+  }
+  base::ScopedFD receiver = UdpSocket(kReceiverAddress, kMeasuredPort);
+  if (!receiver.is_valid()) {
+    return 1;
+  }
+  SetReceiveTimeout(receiver.get(), 200);
+  int buffer_size = 4 << 20;
+  setsockopt(receiver.get(), SOL_SOCKET, SO_RCVBUF, &buffer_size,
+             sizeof(buffer_size));
+
+  brillo::VariantDictionary options;
+  if (FLAGS_notrack) {
+    options[firewalld::kHoleOptionNoTrack] = true;
+  }
+
+  // The namespaces, along with every rule in them, go away with the process.
+  // Plugging thousands of holes one by one on the way out would only make
+  // the benchmark slower to exit, so the holes are left open.
+  firewalld::IpTables* iptables = new firewalld::IpTables();
+  // The first hole punched ends up at the bottom of the chain.
+  if (!iptables->PunchUdpHoleWithOptions(kMeasuredPort, kReceiverNamespace,
+                                         options)) {
+    return 1;
+  }
+
+  printf("%8s %12s %12s %10s %10s %6s\n", "holes", "sent pps", "recv pps",
+         "rtt p50us", "rtt p99us", "lost");
+  int holes = 0;
+  for (int step : steps) {
+    for (; holes < step; holes++) {
+      if (!iptables->PunchUdpHoleWithOptions(kFirstExtraPort + holes,
+                                             kReceiverNamespace, options)) {
+        return 1;
+      }
+    }
+    const FloodResult flood = Flood(sender.get(), receiver.get(),
+                                    FLAGS_seconds);
+    const LatencyResult latency = PingPong(sender.get(), receiver.get(),
+                                           FLAGS_pings);
+    printf("%8d %12.0f %12.0f %10.1f %10.1f %6d\n", holes, flood.sent_pps,
+           flood.received_pps, latency.median_us, latency.p99_us,
+           latency.lost);
+    fflush(stdout);
+  }
+  return 0;
+}
@@ -20,6 +20,37 @@ namespace firewalld {
 const char kFirewallServicePath[] = "/org/chromium/Firewalld";
 const char kFirewallServiceName[] = "org.chromium.Firewalld";
 
+// Keys of the options dictionary taken by the Punch*HoleWithOptions methods.
+// Boolean. Exempts the hole's traffic from connection tracking, accepting its
+// replies statelessly (UDP only).
+const char kHoleOptionNoTrack[] = "notrack";
+// Boolean. Answers new connections with SYN cookies from the kernel's
+// SYNPROXY, so that only completed handshakes reach the listener (TCP only).
+const char kHoleOptionSynProxy[] = "synproxy";
+// Uint32. Limits each source to this many packets per second through the hole,
+// dropping the excess.
+const char kHoleOptionRateLimit[] = "rate_limit";
+// Uint32. Packets a source can send in a burst before the rate limit applies.
+// Defaults to 5. Requires "rate_limit".
+const char kHoleOptionRateLimitBurst[] = "rate_limit_burst";
+// Boolean. Applies the rate limit to new connections rather than to packets.
+// Requires "rate_limit", and can't be combined with "notrack".
+const char kHoleOptionRateLimitConnections[] = "rate_limit_connections";
+// String. Scopes the hole to an app: only the sockets of processes in the
+// cgroup v2 at this path from the cgroup root, such as "/apps/browser", or in
+// one below it, receive its traffic. Its holes are plugged when the cgroup is
+// removed. Needs the daemon's app socket filter.
+const char kHoleOptionCgroup[] = "cgroup";
+// Uint32. Scopes the hole to the sockets of this UID instead. Can't be
+// combined with "cgroup".
+const char kHoleOptionUid[] = "uid";
+
+// Keys of the options dictionary taken by RequestVpnSetupWithOptions.
+// Boolean. Rejects the traffic of the VPN users that isn't routed through the
+// VPN interface, until the last setup on that interface is removed. Only one
+// interface can be locked down at a time.
+const char kVpnOptionLockdown[] = "lockdown";
+
 }  // namespace firewalld
 
 #endif  // FIREWALLD_DBUS_INTERFACE_H_
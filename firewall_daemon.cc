@@ -14,22 +14,58 @@
 
 #include "firewall_daemon.h"
 
+#include <sysexits.h>
+
 #include <string>
 
+#include <base/bind.h>
 #include <base/logging.h>
 
 namespace firewalld {
 
-FirewallDaemon::FirewallDaemon()
-    : brillo::DBusServiceDaemon{kFirewallServiceName,
-                                dbus::ObjectPath{kFirewallServicePath}} {
+FirewallDaemon::FirewallDaemon(const FirewallService::Options& options)
+    : options_(options) {
 }
 
-void FirewallDaemon::RegisterDBusObjectsAsync(AsyncEventSequencer* sequencer) {
+int FirewallDaemon::OnInit() {
+  int exit_code = brillo::DBusDaemon::OnInit();
+  if (exit_code != EX_OK) {
+    return exit_code;
+  }
+
+  scoped_refptr<AsyncEventSequencer> sequencer(new AsyncEventSequencer());
+  object_manager_.reset(new brillo::dbus_utils::ExportedObjectManager(
+      bus_, dbus::ObjectPath{kFirewallServicePath}));
+  object_manager_->RegisterAsync(
+      sequencer->GetHandler("ObjectManager.RegisterAsync() failed.", true));
   firewall_service_.reset(
-      new firewalld::FirewallService{object_manager_.get()});
+      new firewalld::FirewallService{object_manager_.get(), options_});
+  firewall_service_->set_exit_callback(
+      base::Bind(&FirewallDaemon::Quit, base::Unretained(this)));
   firewall_service_->RegisterAsync(
       sequencer->GetHandler("Service.RegisterAsync() failed.", true));
+  sequencer->OnAllTasksCompletedCall(
+      {base::Bind(&FirewallDaemon::TakeServiceOwnership,
+                  base::Unretained(this))});
+  return EX_OK;
+}
+
+void FirewallDaemon::TakeServiceOwnership(bool success) {
+  CHECK(success) << "Unable to export some of the D-Bus objects.";
+  // Replaces the running instance, if it allows it, as this one will.
+  CHECK(bus_->RequestOwnershipAndBlock(
+      kFirewallServiceName, dbus::Bus::REQUIRE_PRIMARY_ALLOW_REPLACEMENT))
+      << "Unable to take ownership of " << kFirewallServiceName;
+  bus_->ListenForServiceOwnerChange(
+      kFirewallServiceName,
+      base::Bind(&FirewallDaemon::OnServiceOwnerChanged,
+                 base::Unretained(this)));
+}
+
+void FirewallDaemon::OnServiceOwnerChanged(const std::string& owner) {
+  if (owner != bus_->GetConnectionName()) {
+    firewall_service_->OnServiceNameLost();
+  }
 }
 
 }  // namespace firewalld
@@ -15,9 +15,13 @@
 #ifndef FIREWALLD_FIREWALL_DAEMON_H_
 #define FIREWALLD_FIREWALL_DAEMON_H_
 
+#include <memory>
+#include <string>
+
 #include <base/macros.h>
 #include <brillo/daemons/dbus_daemon.h>
 #include <brillo/dbus/async_event_sequencer.h>
+#include <brillo/dbus/exported_object_manager.h>
 
 #include "dbus_interface.h"
 #include "firewall_service.h"
@@ -26,14 +30,23 @@ using brillo::dbus_utils::AsyncEventSequencer;
 
 namespace firewalld {
 
-class FirewallDaemon : public brillo::DBusServiceDaemon {
+// Exports |FirewallService| under the firewalld bus name, which a new
+// instance can take over for a live upgrade.
+class FirewallDaemon : public brillo::DBusDaemon {
  public:
-  FirewallDaemon();
+  explicit FirewallDaemon(const FirewallService::Options& options);
 
  protected:
-  void RegisterDBusObjectsAsync(AsyncEventSequencer* sequencer) override;
+  int OnInit() override;
 
  private:
+  // Like brillo::DBusServiceDaemon, but letting a new instance replace this
+  // one as the owner of the bus name.
+  void TakeServiceOwnership(bool success);
+  void OnServiceOwnerChanged(const std::string& owner);
+
+  const FirewallService::Options options_;
+  std::unique_ptr<brillo::dbus_utils::ExportedObjectManager> object_manager_;
   std::unique_ptr<FirewallService> firewall_service_;
 
   DISALLOW_COPY_AND_ASSIGN(FirewallDaemon);
@@ -14,16 +14,76 @@
 
 #include "firewall_service.h"
 
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include <base/bind.h>
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/rand_util.h>
+
 #include "dbus_interface.h"
+#include "handoff.h"
 #include "iptables.h"
+#include "uid_range_rules.h"
+
+namespace {
+
+// How often, and for how long at most, to check whether the base ruleset has
+// been loaded.
+const int kBaseRulesPollIntervalMs = 100;
+const int kBaseRulesTimeoutSeconds = 60;
+
+// Version of the state a running instance hands over to a new one. A new
+// instance that doesn't know it restores the state from the kernel.
+const uint32_t kHandoffVersion = 11;
+
+// How long a new instance waits for the running one to hand its state over.
+const int kHandoffTimeoutSeconds = 10;
+
+// Bounds of the delay between tests of a held xtables lock, which doubles
+// with each test.
+const int kXtablesLockMinBackoffMs = 5;
+const int kXtablesLockMaxBackoffMs = 500;
+
+}  // namespace
 
 namespace firewalld {
 
 FirewallService::FirewallService(
-    brillo::dbus_utils::ExportedObjectManager* object_manager)
-    : org::chromium::FirewalldAdaptor(&iptables_),
+    brillo::dbus_utils::ExportedObjectManager* object_manager,
+    const Options& options)
+    : FirewallService(object_manager,
+                      options,
+                      std::unique_ptr<IpTables>(new IpTables())) {}
+
+FirewallService::FirewallService(
+    brillo::dbus_utils::ExportedObjectManager* object_manager,
+    const Options& options,
+    std::unique_ptr<IpTables> iptables)
+    : org::chromium::FirewalldAdaptor(this),
+      options_(options),
       dbus_object_{object_manager, object_manager->GetBus(),
-                   org::chromium::FirewalldAdaptor::GetObjectPath()} {}
+                   org::chromium::FirewalldAdaptor::GetObjectPath()},
+      iptables_(std::move(iptables)) {
+  iptables_->set_flush_conntrack_on_plug(options.flush_conntrack_on_plug);
+  if (options.uid_range_vpn_routing) {
+    if (UidRangeRulesSupported()) {
+      iptables_->EnableUidRangeRouting();
+    } else {
+      LOG(WARNING) << "Kernel lacks uidrange rules, "
+                   << "routing VPN users by packet mark";
+    }
+  }
+  if (!options.profiles_path.empty()) {
+    if (!LoadHoleProfiles(base::FilePath(options.profiles_path), &profiles_)) {
+      LOG(WARNING) << "Some hole profiles could not be loaded";
+    }
+    LOG(INFO) << "Loaded " << profiles_.size() << " hole profiles";
+  }
+}
 
 void FirewallService::RegisterAsync(const CompletionAction& callback) {
   RegisterWithDBusObject(&dbus_object_);
@@ -39,13 +99,814 @@ void FirewallService::RegisterAsync(const CompletionAction& callback) {
                  weak_ptr_factory_.GetWeakPtr()));
 #endif  // __ANDROID__
 
+  // Claim the bus name right away; requests wait for the base ruleset, or
+  // for the state of the instance this one takes over from.
+  base_rules_wait_start_ = base::TimeTicks::Now();
+  if (!options_.handoff_socket_path.empty()) {
+    handoff_connection_ = ConnectForHandoff(options_.handoff_socket_path);
+  }
+  if (handoff_connection_.is_valid()) {
+    WaitForHandoff();
+  } else {
+    StartWithoutHandoff();
+  }
+  ArmIdleExitTimer();
   dbus_object_.RegisterAsync(callback);
 }
 
+void FirewallService::PunchTcpHole(std::unique_ptr<BoolResponse> response,
+                                   uint16_t in_port,
+                                   const std::string& in_interface) {
+  Punch(std::move(response), kProtocolTcp, in_port, in_interface,
+        brillo::VariantDictionary(), false /* egress */);
+}
+
+void FirewallService::PunchTcpHoleWithOptions(
+    std::unique_ptr<BoolResponse> response,
+    uint16_t in_port,
+    const std::string& in_interface,
+    const brillo::VariantDictionary& in_options) {
+  Punch(std::move(response), kProtocolTcp, in_port, in_interface, in_options,
+        false /* egress */);
+}
+
+void FirewallService::PunchUdpHole(std::unique_ptr<BoolResponse> response,
+                                   uint16_t in_port,
+                                   const std::string& in_interface) {
+  Punch(std::move(response), kProtocolUdp, in_port, in_interface,
+        brillo::VariantDictionary(), false /* egress */);
+}
+
+void FirewallService::PunchUdpHoleWithOptions(
+    std::unique_ptr<BoolResponse> response,
+    uint16_t in_port,
+    const std::string& in_interface,
+    const brillo::VariantDictionary& in_options) {
+  Punch(std::move(response), kProtocolUdp, in_port, in_interface, in_options,
+        false /* egress */);
+}
+
+void FirewallService::PlugTcpHole(std::unique_ptr<BoolResponse> response,
+                                  uint16_t in_port,
+                                  const std::string& in_interface) {
+  Run(std::move(response),
+      base::Bind(&IpTables::PlugTcpHole, base::Unretained(iptables_.get()),
+                 in_port, in_interface));
+}
+
+void FirewallService::PlugUdpHole(std::unique_ptr<BoolResponse> response,
+                                  uint16_t in_port,
+                                  const std::string& in_interface) {
+  Run(std::move(response),
+      base::Bind(&IpTables::PlugUdpHole, base::Unretained(iptables_.get()),
+                 in_port, in_interface));
+}
+
+void FirewallService::PunchTcpEgressHole(
+    std::unique_ptr<BoolResponse> response,
+    uint16_t in_port,
+    const std::string& in_interface) {
+  Punch(std::move(response), kProtocolTcp, in_port, in_interface,
+        brillo::VariantDictionary(), true /* egress */);
+}
+
+void FirewallService::PunchUdpEgressHole(
+    std::unique_ptr<BoolResponse> response,
+    uint16_t in_port,
+    const std::string& in_interface) {
+  Punch(std::move(response), kProtocolUdp, in_port, in_interface,
+        brillo::VariantDictionary(), true /* egress */);
+}
+
+void FirewallService::PlugTcpEgressHole(std::unique_ptr<BoolResponse> response,
+                                        uint16_t in_port,
+                                        const std::string& in_interface) {
+  Run(std::move(response),
+      base::Bind(&IpTables::PlugTcpEgressHole,
+                 base::Unretained(iptables_.get()), in_port, in_interface));
+}
+
+void FirewallService::PlugUdpEgressHole(std::unique_ptr<BoolResponse> response,
+                                        uint16_t in_port,
+                                        const std::string& in_interface) {
+  Run(std::move(response),
+      base::Bind(&IpTables::PlugUdpEgressHole,
+                 base::Unretained(iptables_.get()), in_port, in_interface));
+}
+
+void FirewallService::ReclaimHoles(
+    std::unique_ptr<BoolResponse> response,
+    const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_holes,
+    const std::vector<std::tuple<uint16_t, std::string>>& in_udp_holes) {
+  Run(std::move(response),
+      base::Bind(&IpTables::ReclaimHoles, base::Unretained(iptables_.get()),
+                 in_tcp_holes, in_udp_holes));
+}
+
+void FirewallService::ReclaimHolesWithEgress(
+    std::unique_ptr<BoolResponse> response,
+    const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_holes,
+    const std::vector<std::tuple<uint16_t, std::string>>& in_udp_holes,
+    const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_egress_holes,
+    const std::vector<std::tuple<uint16_t, std::string>>&
+        in_udp_egress_holes) {
+  Run(std::move(response),
+      base::Bind(&IpTables::ReclaimHolesWithEgress,
+                 base::Unretained(iptables_.get()), in_tcp_holes, in_udp_holes,
+                 in_tcp_egress_holes, in_udp_egress_holes));
+}
+
+void FirewallService::ApplyProfile(std::unique_ptr<BoolResponse> response,
+                                   const std::string& in_profile,
+                                   const std::string& in_interface) {
+  auto profile = profiles_.find(in_profile);
+  if (profile == profiles_.end()) {
+    LOG(ERROR) << "No hole profile named '" << in_profile << "'";
+    response->Return(false);
+    return;
+  }
+  Run(std::move(response),
+      base::Bind(&IpTables::PunchHoleGroup, base::Unretained(iptables_.get()),
+                 profile->second, in_interface));
+}
+
+void FirewallService::RemoveProfile(std::unique_ptr<BoolResponse> response,
+                                    const std::string& in_profile,
+                                    const std::string& in_interface) {
+  auto profile = profiles_.find(in_profile);
+  if (profile == profiles_.end()) {
+    LOG(ERROR) << "No hole profile named '" << in_profile << "'";
+    response->Return(false);
+    return;
+  }
+  Run(std::move(response),
+      base::Bind(&IpTables::PlugHoleGroup, base::Unretained(iptables_.get()),
+                 profile->second, in_interface));
+}
+
+void FirewallService::RequestVpnSetup(
+    std::unique_ptr<BoolResponse> response,
+    const std::vector<std::string>& in_usernames,
+    const std::string& in_interface) {
+  Run(std::move(response),
+      base::Bind(&IpTables::RequestVpnSetup, base::Unretained(iptables_.get()),
+                 in_usernames, in_interface));
+}
+
+void FirewallService::RequestVpnSetupWithOptions(
+    std::unique_ptr<BoolResponse> response,
+    const std::vector<std::string>& in_usernames,
+    const std::string& in_interface,
+    const brillo::VariantDictionary& in_options) {
+  Run(std::move(response),
+      base::Bind(&IpTables::RequestVpnSetupWithOptions,
+                 base::Unretained(iptables_.get()), in_usernames, in_interface,
+                 in_options));
+}
+
+void FirewallService::RemoveVpnSetup(
+    std::unique_ptr<BoolResponse> response,
+    const std::vector<std::string>& in_usernames,
+    const std::string& in_interface) {
+  Run(std::move(response),
+      base::Bind(&IpTables::RemoveVpnSetup, base::Unretained(iptables_.get()),
+                 in_usernames, in_interface));
+}
+
+void FirewallService::AddTcpPortForward(
+    std::unique_ptr<BoolResponse> response,
+    uint16_t in_port,
+    const std::string& in_interface,
+    const std::string& in_destination) {
+  Run(std::move(response),
+      base::Bind(&IpTables::AddPortForward, base::Unretained(iptables_.get()),
+                 kProtocolTcp, in_interface, in_port, in_destination));
+}
+
+void FirewallService::AddUdpPortForward(
+    std::unique_ptr<BoolResponse> response,
+    uint16_t in_port,
+    const std::string& in_interface,
+    const std::string& in_destination) {
+  Run(std::move(response),
+      base::Bind(&IpTables::AddPortForward, base::Unretained(iptables_.get()),
+                 kProtocolUdp, in_interface, in_port, in_destination));
+}
+
+void FirewallService::RemoveTcpPortForward(
+    std::unique_ptr<BoolResponse> response,
+    uint16_t in_port,
+    const std::string& in_interface,
+    const std::string& in_destination) {
+  Run(std::move(response),
+      base::Bind(&IpTables::RemovePortForward,
+                 base::Unretained(iptables_.get()), kProtocolTcp, in_interface,
+                 in_port, in_destination));
+}
+
+void FirewallService::RemoveUdpPortForward(
+    std::unique_ptr<BoolResponse> response,
+    uint16_t in_port,
+    const std::string& in_interface,
+    const std::string& in_destination) {
+  Run(std::move(response),
+      base::Bind(&IpTables::RemovePortForward,
+                 base::Unretained(iptables_.get()), kProtocolUdp, in_interface,
+                 in_port, in_destination));
+}
+
+brillo::VariantDictionary FirewallService::GetStats() {
+  brillo::VariantDictionary stats;
+  // What the processes spawned for each executable cost, e.g.
+  // "child.iptables-restore.user_time_us".
+  for (const auto& usage : iptables_->child_usage()) {
+    const std::string prefix = "child." + usage.first + ".";
+    const IpTables::ChildUsage& child = usage.second;
+    stats[prefix + "runs"] = child.runs;
+    stats[prefix + "user_time_us"] = child.user_time.InMicroseconds();
+    stats[prefix + "system_time_us"] = child.system_time.InMicroseconds();
+    stats[prefix + "max_rss_kb"] = child.max_rss_kb;
+    stats[prefix + "minor_faults"] = child.minor_faults;
+    stats[prefix + "major_faults"] = child.major_faults;
+  }
+  // How long commits waited for the xtables lock, by the process holding
+  // it, e.g. "xtables_lock.iptables.wait_us".
+  for (const auto& wait : xtables_lock_wait_) {
+    stats["xtables_lock." + wait.first + ".wait_us"] =
+        wait.second.InMicroseconds();
+  }
+  // The size of the installed rules and sets, e.g. "gauge.input_depth".
+  for (const auto& gauge : iptables_->GetGauges()) {
+    stats["gauge." + gauge.first] = gauge.second;
+  }
+  return stats;
+}
+
+void FirewallService::Run(std::unique_ptr<BoolResponse> response,
+                          const base::Callback<bool()>& operation) {
+  QueuedRequest request;
+  request.response = std::move(response);
+  request.operation = operation;
+  Enqueue(std::move(request));
+}
+
+void FirewallService::Punch(std::unique_ptr<BoolResponse> response,
+                            ProtocolEnum protocol,
+                            uint16_t port,
+                            const std::string& interface,
+                            const brillo::VariantDictionary& options,
+                            bool egress) {
+  QueuedRequest request;
+  request.response = std::move(response);
+  request.punch.reset(
+      new IpTables::HoleRequest{protocol, port, interface, options, egress});
+  Enqueue(std::move(request));
+}
+
+void FirewallService::Enqueue(QueuedRequest request) {
+  ArmIdleExitTimer();
+  queued_requests_.push_back(std::move(request));
+  if (commit_delayed_ &&
+      queued_requests_.size() >= options_.max_batch_size) {
+    // A full batch doesn't wait.
+    brillo::MessageLoop::current()->CancelTask(commit_task_);
+    commit_task_ = brillo::MessageLoop::kTaskIdNull;
+  }
+  ScheduleCommit();
+}
+
+void FirewallService::ScheduleCommit() {
+  if (!base_rules_ready_ || queued_requests_.empty() ||
+      commit_task_ != brillo::MessageLoop::kTaskIdNull) {
+    return;
+  }
+
+  // The commit runs once every request already received has been queued, so
+  // requests that arrived during the previous commit go together. When the
+  // previous commit had company, more are likely on their way: wait for them
+  // about as long as a commit takes, within bounds.
+  base::TimeDelta delay;
+  if (last_batch_size_ > 1 &&
+      queued_requests_.size() < options_.max_batch_size) {
+    delay = std::min(last_commit_latency_, options_.max_commit_delay);
+  }
+  commit_delayed_ = delay > base::TimeDelta();
+  commit_task_ = brillo::MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&FirewallService::Commit, weak_ptr_factory_.GetWeakPtr(),
+                 false /* force */),
+      delay);
+}
+
+void FirewallService::Commit(bool force) {
+  commit_task_ = brillo::MessageLoop::kTaskIdNull;
+  commit_delayed_ = false;
+  const bool lock_was_held = !xtables_lock_backoff_.is_zero();
+  if (!force && options_.xtables_lock_backoff && !TestXtablesLock()) {
+    // The jitter keeps the tests from falling in step with the holder.
+    const int backoff_us =
+        static_cast<int>(xtables_lock_backoff_.InMicroseconds());
+    commit_task_ = brillo::MessageLoop::current()->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&FirewallService::Commit, weak_ptr_factory_.GetWeakPtr(),
+                   false /* force */),
+        base::TimeDelta::FromMicroseconds(
+            base::RandInt(backoff_us / 2, backoff_us)));
+    return;
+  }
+  // What queued up while the lock was held goes at once, as does everything
+  // a forced commit finds.
+  const size_t batch_size =
+      force || lock_was_held
+          ? queued_requests_.size()
+          : std::min(queued_requests_.size(), options_.max_batch_size);
+  std::vector<QueuedRequest> batch(
+      std::make_move_iterator(queued_requests_.begin()),
+      std::make_move_iterator(queued_requests_.begin() + batch_size));
+  queued_requests_.erase(queued_requests_.begin(),
+                         queued_requests_.begin() + batch_size);
+
+  const base::TimeTicks start = base::TimeTicks::Now();
+  iptables_->RetryPendingIpv6Rules();
+  ApplyBatch(&batch);
+  last_commit_latency_ = base::TimeTicks::Now() - start;
+  last_batch_size_ = batch_size;
+  if (!first_request_served_) {
+    first_request_served_ = true;
+    OnFirstRequestServed();
+  }
+  CheckGaugeThresholds();
+
+  ScheduleCommit();
+}
+
+bool FirewallService::TestXtablesLock() {
+  std::string holder;
+  const bool free = iptables_->XtablesLockIsFree(&holder);
+  const base::TimeTicks now = base::TimeTicks::Now();
+  if (!xtables_lock_backoff_.is_zero()) {
+    // The wait since the last test is put down to whoever held the lock then.
+    xtables_lock_wait_[xtables_lock_holder_] += now - xtables_lock_tested_;
+  }
+  if (free) {
+    if (!xtables_lock_backoff_.is_zero()) {
+      LOG(INFO) << "xtables lock released, committing "
+                << queued_requests_.size() << " queued requests";
+    }
+    xtables_lock_backoff_ = base::TimeDelta();
+    return true;
+  }
+
+  if (holder.empty()) {
+    holder = "unknown";
+  }
+  if (xtables_lock_backoff_.is_zero()) {
+    LOG(INFO) << "xtables lock held by " << holder << ", queuing requests";
+    xtables_lock_backoff_ =
+        base::TimeDelta::FromMilliseconds(kXtablesLockMinBackoffMs);
+  } else {
+    xtables_lock_backoff_ = std::min(
+        xtables_lock_backoff_ * 2,
+        base::TimeDelta::FromMilliseconds(kXtablesLockMaxBackoffMs));
+  }
+  xtables_lock_holder_ = holder;
+  xtables_lock_tested_ = now;
+  return false;
+}
+
+void FirewallService::ApplyBatch(std::vector<QueuedRequest>* batch) {
+  std::vector<QueuedRequest>& requests = *batch;
+  size_t i = 0;
+  while (i < requests.size()) {
+    if (!requests[i].punch) {
+      requests[i].response->Return(requests[i].operation.Run());
+      i++;
+      continue;
+    }
+    // Consecutive punches are applied together. The queued requests are
+    // done with once applied, so their options are moved rather than copied.
+    std::vector<IpTables::HoleRequest> punches;
+    size_t end = i;
+    while (end < requests.size() && requests[end].punch) {
+      end++;
+    }
+    punches.reserve(end - i);
+    for (size_t j = i; j < end; j++) {
+      punches.push_back(std::move(*requests[j].punch));
+    }
+    const std::vector<bool> results = iptables_->PunchHolesInBatch(punches);
+    for (size_t j = i; j < end; j++) {
+      requests[j].response->Return(results[j - i]);
+    }
+    i = end;
+  }
+}
+
+void FirewallService::StartWithoutHandoff() {
+  InitXdpFilter();
+  InitAppSocketFilter();
+
+  // Only install IPv6 rules for holes on interfaces that have IPv6 addresses.
+  if (ipv6_address_monitor_.Start(
+          base::Bind(&IpTables::OnIpv6AddressChanged,
+                     base::Unretained(iptables_.get())))) {
+    iptables_->EnableIpv6RuleDeferral();
+  } else {
+    LOG(WARNING) << "Not monitoring IPv6 addresses, "
+                 << "IPv6 rules will be added for all holes";
+  }
+
+  CheckBaseRulesReady();
+}
+
+void FirewallService::InitXdpFilter() {
+  if (options_.xdp_interfaces.empty() && !xdp_filter_.IsInitialized()) {
+    return;
+  }
+  // An adopted filter only needs the interfaces it isn't attached to yet.
+  if (!xdp_filter_.IsInitialized() && !xdp_filter_.Init()) {
+    LOG(WARNING) << "XDP filter unavailable";
+    return;
+  }
+  for (const auto& interface : options_.xdp_interfaces) {
+    const bool filter_udp =
+        std::find(options_.xdp_udp_interfaces.begin(),
+                  options_.xdp_udp_interfaces.end(),
+                  interface) != options_.xdp_udp_interfaces.end();
+    if (!xdp_filter_.Attach(interface, filter_udp)) {
+      LOG(WARNING) << "Not filtering " << interface << " with XDP";
+    }
+  }
+  iptables_->SetXdpFilter(&xdp_filter_);
+}
+
+void FirewallService::InitAppSocketFilter() {
+  if (!options_.app_scoped_holes) {
+    return;
+  }
+  if (!app_socket_filter_.Init(base::Bind(&IpTables::OnCgroupRemoved,
+                                          base::Unretained(iptables_.get())))) {
+    LOG(WARNING) << "App socket filter unavailable, "
+                 << "holes can't be scoped to an app";
+    return;
+  }
+  iptables_->SetAppSocketFilter(&app_socket_filter_);
+}
+
+void FirewallService::CheckBaseRulesReady() {
+  if (!options_.base_rules_ready_path.empty() &&
+      !base::PathExists(base::FilePath(options_.base_rules_ready_path))) {
+    if (base::TimeTicks::Now() - base_rules_wait_start_ <
+        base::TimeDelta::FromSeconds(kBaseRulesTimeoutSeconds)) {
+      brillo::MessageLoop::current()->PostDelayedTask(
+          FROM_HERE,
+          base::Bind(&FirewallService::CheckBaseRulesReady,
+                     weak_ptr_factory_.GetWeakPtr()),
+          base::TimeDelta::FromMilliseconds(kBaseRulesPollIntervalMs));
+      return;
+    }
+    LOG(WARNING) << "Base ruleset still not loaded after "
+                 << kBaseRulesTimeoutSeconds << "s, applying requests anyway";
+  }
+  OnBaseRulesReady();
+}
+
+void FirewallService::OnBaseRulesReady() {
+  if (!options_.base_rules_ready_path.empty()) {
+    LOG(INFO) << "Base ruleset loaded after "
+              << (base::TimeTicks::Now() - base_rules_wait_start_)
+                     .InMilliseconds()
+              << " ms";
+  }
+  base_rules_ready_ = true;
+
+  // Pick up where the previous instance left off, whether it exited when idle
+  // or crashed.
+  iptables_->RestoreState();
+#if !defined(__ANDROID__)
+  // Restored holes belong to whichever permission_broker is running, if any,
+  // and it has to reclaim them.
+  if (iptables_->HasHoles()) {
+    PlugHolesAfterGracePeriod();
+  }
+#endif  // __ANDROID__
+
+  CheckGaugeThresholds();
+  ListenForNewInstance();
+  if (!queued_requests_.empty()) {
+    LOG(INFO) << "Applying " << queued_requests_.size() << " queued requests";
+  }
+  ScheduleCommit();
+}
+
+void FirewallService::WaitForHandoff() {
+  LOG(INFO) << "Taking over from the running instance";
+  brillo::MessageLoop* message_loop = brillo::MessageLoop::current();
+  handoff_watch_task_ = message_loop->WatchFileDescriptor(
+      FROM_HERE, handoff_connection_.get(), brillo::MessageLoop::kWatchRead,
+      false /* persistent */,
+      base::Bind(&FirewallService::OnHandoffReadable,
+                 weak_ptr_factory_.GetWeakPtr()));
+  handoff_timeout_task_ = message_loop->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&FirewallService::OnHandoffTimeout,
+                 weak_ptr_factory_.GetWeakPtr()),
+      base::TimeDelta::FromSeconds(kHandoffTimeoutSeconds));
+}
+
+void FirewallService::OnHandoffReadable() {
+  handoff_watch_task_ = brillo::MessageLoop::kTaskIdNull;
+  brillo::MessageLoop::current()->CancelTask(handoff_timeout_task_);
+  handoff_timeout_task_ = brillo::MessageLoop::kTaskIdNull;
+
+  std::string state;
+  std::vector<base::ScopedFD> fds;
+  const bool adopted =
+      ReceiveHandoff(handoff_connection_.get(), &state, &fds) &&
+      AdoptHandoffState(state, &fds);
+  handoff_connection_.reset();
+  if (!adopted) {
+    LOG(WARNING) << "Handoff failed, restoring state from the kernel";
+    StartWithoutHandoff();
+    return;
+  }
+
+  LOG(INFO) << "Took over after "
+            << (base::TimeTicks::Now() - base_rules_wait_start_)
+                   .InMilliseconds()
+            << " ms";
+  base_rules_ready_ = true;
+  CheckGaugeThresholds();
+  ListenForNewInstance();
+  if (!queued_requests_.empty()) {
+    LOG(INFO) << "Applying " << queued_requests_.size() << " queued requests";
+  }
+  ScheduleCommit();
+}
+
+void FirewallService::OnHandoffTimeout() {
+  handoff_timeout_task_ = brillo::MessageLoop::kTaskIdNull;
+  brillo::MessageLoop::current()->CancelTask(handoff_watch_task_);
+  handoff_watch_task_ = brillo::MessageLoop::kTaskIdNull;
+  handoff_connection_.reset();
+  LOG(WARNING) << "No handoff after " << kHandoffTimeoutSeconds
+               << "s, restoring state from the kernel";
+  StartWithoutHandoff();
+}
+
+bool FirewallService::AdoptHandoffState(const std::string& data,
+                                        std::vector<base::ScopedFD>* fds) {
+  base::Pickle pickle(data.data(), static_cast<int>(data.size()));
+  base::PickleIterator iterator(pickle);
+  size_t next_fd = 0;
+
+  uint32_t version;
+  bool xdp;
+  if (!iterator.ReadUInt32(&version) || version != kHandoffVersion ||
+      !iterator.ReadBool(&xdp)) {
+    LOG(ERROR) << "Unknown handoff state";
+    return false;
+  }
+  if (xdp) {
+    if (fds->size() < next_fd + 2 ||
+        !xdp_filter_.Adopt(std::move((*fds)[next_fd]),
+                           std::move((*fds)[next_fd + 1]), &iterator)) {
+      LOG(ERROR) << "Malformed XDP filter handoff state";
+      return false;
+    }
+    next_fd += 2;
+  }
+  // Whether adopted or not, the filter is kept in sync from now on.
+  InitXdpFilter();
+  // The app socket filter is not handed over: its program goes away with the
+  // old instance, and the adopted holes are added to a fresh one.
+  InitAppSocketFilter();
+
+  if (!iptables_->AdoptState(&iterator)) {
+    LOG(ERROR) << "Malformed firewall handoff state";
+    return false;
+  }
+
+  // Orphaned holes are plugged when the grace period runs out, as it would
+  // have in the running instance.
+  int64_t grace_period_left_ms = -1;
+  iterator.ReadInt64(&grace_period_left_ms);
+#if !defined(__ANDROID__)
+  if (grace_period_left_ms >= 0) {
+    PlugOrphanedHolesIn(
+        base::TimeDelta::FromMilliseconds(grace_period_left_ms));
+  }
+#endif  // __ANDROID__
+
+  // The address monitor carries on from the address changes still queued on
+  // its socket. Without it, a new one starts from a dump.
+  const Ipv6AddressMonitor::AddressCallback ipv6_address_callback =
+      base::Bind(&IpTables::OnIpv6AddressChanged,
+                 base::Unretained(iptables_.get()));
+  bool monitor;
+  if (!iterator.ReadBool(&monitor) || !monitor || fds->size() <= next_fd ||
+      !ipv6_address_monitor_.Adopt(std::move((*fds)[next_fd]), &iterator,
+                                   ipv6_address_callback)) {
+    if (!ipv6_address_monitor_.Start(ipv6_address_callback)) {
+      LOG(WARNING) << "Not monitoring IPv6 addresses";
+    }
+  }
+  return true;
+}
+
+void FirewallService::ListenForNewInstance() {
+  if (options_.handoff_socket_path.empty()) {
+    return;
+  }
+  handoff_listener_ = ListenForHandoff(options_.handoff_socket_path);
+  if (!handoff_listener_.is_valid()) {
+    LOG(WARNING) << "A new instance will restore the state from the kernel";
+  }
+}
+
+void FirewallService::OnServiceNameLost() {
+  LOG(INFO) << "Another instance took over the bus name";
+  // The new instance connected before taking over the name.
+  base::ScopedFD connection;
+  if (handoff_listener_.is_valid()) {
+    connection = AcceptHandoff(handoff_listener_.get());
+  }
+  if (!connection.is_valid() || !HandOff(connection.get())) {
+    LOG(WARNING) << "Leaving the state for the new instance to restore";
+    iptables_->ForgetAllHoles();
+  }
+  handoff_connection_ = std::move(connection);
+  handoff_listener_.reset();
+  if (!exit_callback_.is_null()) {
+    exit_callback_.Run();
+  }
+}
+
+bool FirewallService::HandOff(int connection) {
+  if (!base_rules_ready_) {
+    // Nothing to hand over yet.
+    return false;
+  }
+
+  // Requests that came in before the name moved are applied here, so that
+  // the state reflects them. The commands wait for the xtables lock
+  // themselves, which beats polling it from here.
+  if (commit_task_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(commit_task_);
+    commit_task_ = brillo::MessageLoop::kTaskIdNull;
+  }
+  if (!queued_requests_.empty()) {
+    Commit(true /* force */);
+  }
+
+  base::Pickle state;
+  std::vector<int> fds;
+  state.WriteUInt32(kHandoffVersion);
+  state.WriteBool(xdp_filter_.IsInitialized());
+  if (xdp_filter_.IsInitialized()) {
+    xdp_filter_.Save(&state, &fds);
+  }
+  iptables_->SaveState(&state);
+  int64_t grace_period_left_ms = -1;
+#if !defined(__ANDROID__)
+  if (plug_orphaned_holes_task_ != brillo::MessageLoop::kTaskIdNull) {
+    grace_period_left_ms = std::max<int64_t>(
+        (plug_orphaned_holes_time_ - base::TimeTicks::Now()).InMilliseconds(),
+        0);
+  }
+#endif  // __ANDROID__
+  state.WriteInt64(grace_period_left_ms);
+  state.WriteBool(ipv6_address_monitor_.IsStarted());
+  if (ipv6_address_monitor_.IsStarted()) {
+    ipv6_address_monitor_.Save(&state, &fds);
+  }
+  if (!SendHandoff(connection, state, fds)) {
+    return false;
+  }
+
+  // Everything now belongs to the new instance.
+  LOG(INFO) << "Handed over to the new instance";
+  iptables_->ForgetAllHoles();
+  xdp_filter_.Release();
+  ipv6_address_monitor_.Release();
+  return true;
+}
+
+void FirewallService::OnFirstRequestServed() {
+  if (options_.start_time.is_null()) {
+    return;
+  }
+  LOG(INFO) << "First request served "
+            << (base::TimeTicks::Now() - options_.start_time).InMilliseconds()
+            << " ms after start";
+}
+
+void FirewallService::CheckGaugeThresholds() {
+  if (options_.gauge_thresholds.empty()) {
+    return;
+  }
+  const std::map<std::string, int64_t> gauges = iptables_->GetGauges();
+  for (const auto& threshold : options_.gauge_thresholds) {
+    auto gauge = gauges.find(threshold.first);
+    const int64_t value = gauge != gauges.end() ? gauge->second : 0;
+    const bool over = value > threshold.second;
+    if (over == (gauges_over_threshold_.count(threshold.first) > 0)) {
+      continue;
+    }
+    if (over) {
+      gauges_over_threshold_.insert(threshold.first);
+      LOG(WARNING) << "Gauge " << threshold.first << " is at " << value
+                   << ", over its threshold of " << threshold.second;
+    } else {
+      gauges_over_threshold_.erase(threshold.first);
+      LOG(INFO) << "Gauge " << threshold.first << " is back to " << value;
+    }
+    SendGaugeThresholdCrossedSignal(threshold.first, value, threshold.second,
+                                    over);
+  }
+}
+
+void FirewallService::ArmIdleExitTimer() {
+  if (options_.idle_exit_timeout <= base::TimeDelta() ||
+      exit_callback_.is_null()) {
+    return;
+  }
+  brillo::MessageLoop* message_loop = brillo::MessageLoop::current();
+  if (idle_exit_task_ != brillo::MessageLoop::kTaskIdNull) {
+    message_loop->CancelTask(idle_exit_task_);
+  }
+  idle_exit_task_ = message_loop->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&FirewallService::OnIdleExitTimeout,
+                 weak_ptr_factory_.GetWeakPtr()),
+      options_.idle_exit_timeout);
+}
+
+void FirewallService::OnIdleExitTimeout() {
+  idle_exit_task_ = brillo::MessageLoop::kTaskIdNull;
+  // The users of a VPN setup and how many setups share its interface are only
+  // known to this instance.
+  if (!base_rules_ready_ || !queued_requests_.empty() ||
+      iptables_->HasVpnSetups()) {
+    ArmIdleExitTimer();
+    return;
+  }
+#if !defined(__ANDROID__)
+  // Holes have to be plugged when permission_broker goes away, which takes a
+  // resident daemon watching it.
+  if (iptables_->HasHoles() ||
+      plug_orphaned_holes_task_ != brillo::MessageLoop::kTaskIdNull) {
+    ArmIdleExitTimer();
+    return;
+  }
+#endif  // __ANDROID__
+
+  LOG(INFO) << "Idle for " << options_.idle_exit_timeout.InSeconds()
+            << "s, exiting";
+  // Leave the holes to the next instance rather than plugging them on
+  // destruction.
+  iptables_->ForgetAllHoles();
+  exit_callback_.Run();
+}
+
 #if !defined(__ANDROID__)
 void FirewallService::OnPermissionBrokerRemoved(const dbus::ObjectPath& path) {
-  LOG(INFO) << "permission_broker died, plugging all firewall holes";
-  iptables_.PlugAllHoles();
+  LOG(INFO) << "permission_broker died";
+  PlugHolesAfterGracePeriod();
+}
+
+void FirewallService::PlugHolesAfterGracePeriod() {
+  if (options_.permission_broker_grace_period <= base::TimeDelta()) {
+    LOG(INFO) << "Plugging all firewall holes";
+    iptables_->PlugAllHoles();
+    return;
+  }
+
+  // Give a restarted permission_broker the chance to reclaim the holes with
+  // ReclaimHoles instead of having them plugged and punched again.
+  LOG(INFO) << "Plugging unclaimed firewall holes in "
+            << options_.permission_broker_grace_period.InSeconds() << "s";
+  iptables_->OrphanAllHoles();
+  PlugOrphanedHolesIn(options_.permission_broker_grace_period);
+}
+
+void FirewallService::PlugOrphanedHolesIn(base::TimeDelta delay) {
+  brillo::MessageLoop* message_loop = brillo::MessageLoop::current();
+  if (plug_orphaned_holes_task_ != brillo::MessageLoop::kTaskIdNull) {
+    message_loop->CancelTask(plug_orphaned_holes_task_);
+  }
+  plug_orphaned_holes_time_ = base::TimeTicks::Now() + delay;
+  plug_orphaned_holes_task_ = message_loop->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&FirewallService::OnPermissionBrokerGracePeriodExpired,
+                 weak_ptr_factory_.GetWeakPtr()),
+      delay);
+}
+
+void FirewallService::OnPermissionBrokerGracePeriodExpired() {
+  plug_orphaned_holes_task_ = brillo::MessageLoop::kTaskIdNull;
+  iptables_->PlugOrphanedHoles();
+  CheckGaugeThresholds();
 }
 #endif  // __ANDROID__
 
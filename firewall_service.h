@@ -15,44 +15,316 @@
 #ifndef FIREWALLD_FIREWALL_SERVICE_H_
 #define FIREWALLD_FIREWALL_SERVICE_H_
 
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
 #include <base/callback.h>
+#include <base/files/scoped_file.h>
 #include <base/macros.h>
 #include <base/memory/scoped_ptr.h>
 #include <base/memory/weak_ptr.h>
+#include <base/time/time.h>
+#include <brillo/dbus/dbus_method_response.h>
 #include <brillo/dbus/dbus_object.h>
+#include <brillo/message_loops/message_loop.h>
 
 #include "dbus_bindings/org.chromium.Firewalld.h"
 #if !defined(__ANDROID__)
 # include "permission_broker/dbus-proxies.h"
 #endif  // __ANDROID__
 
+#include "app_socket_filter.h"
+#include "hole_profiles.h"
 #include "iptables.h"
+#include "ipv6_address_monitor.h"
+#include "xdp_filter.h"
 
 using CompletionAction =
     brillo::dbus_utils::AsyncEventSequencer::CompletionAction;
 
 namespace firewalld {
 
-class FirewallService : public org::chromium::FirewalldAdaptor {
+// Exports |IpTables| over D-Bus. Requests are queued and committed in
+// batches, in which consecutive hole punches are applied together. Nothing is
+// committed until the base ruleset is loaded, or, on a live upgrade, until the
+// running instance has handed its state over.
+class FirewallService : public org::chromium::FirewalldAdaptor,
+                        public org::chromium::FirewalldInterface {
  public:
-  explicit FirewallService(
-      brillo::dbus_utils::ExportedObjectManager* object_manager);
+  using BoolResponse = brillo::dbus_utils::DBusMethodResponse<bool>;
+
+  // Behavior that can be changed from the command line.
+  struct Options {
+    // Delete the conntrack entries of plugged holes.
+    bool flush_conntrack_on_plug = false;
+    // Route VPN users with uidrange policy routing rules when the kernel
+    // supports them.
+    bool uid_range_vpn_routing = false;
+    // Interfaces on which unsolicited traffic to ports without a hole is
+    // dropped by an XDP program.
+    std::vector<std::string> xdp_interfaces;
+    // Those of |xdp_interfaces| on which the XDP program drops UDP to low
+    // ports without a hole as well, replies from low ports included.
+    std::vector<std::string> xdp_udp_interfaces;
+    // Allow holes scoped to the sockets of an app's cgroup or UID, enforced
+    // by a BPF program on the root cgroup.
+    bool app_scoped_holes = false;
+    // How long the holes of a permission_broker that went away stay open,
+    // waiting for its next instance to reclaim them.
+    base::TimeDelta permission_broker_grace_period =
+        base::TimeDelta::FromSeconds(30);
+    // How long the daemon waits for a request before exiting, to be started
+    // again by D-Bus activation. Zero means it never exits on its own.
+    base::TimeDelta idle_exit_timeout;
+    // When the process started, to measure how long the first request takes.
+    base::TimeTicks start_time;
+    // File whose existence tells that the base ruleset has been loaded.
+    // Requests are queued until it appears. Empty means the base ruleset is
+    // already loaded when the daemon starts.
+    std::string base_rules_ready_path;
+    // Requests received while a commit is running are committed together
+    // next, at most |max_batch_size| at a time. Under load, a commit may also
+    // wait up to |max_commit_delay| for more requests.
+    size_t max_batch_size = 64;
+    base::TimeDelta max_commit_delay = base::TimeDelta::FromMilliseconds(5);
+    // Test the xtables lock before each commit instead of letting the
+    // commands block on it. While another process holds it, requests keep
+    // queuing and the test is retried with jittered exponential backoff; the
+    // first commit once the lock is free then takes every queued request.
+    bool xtables_lock_backoff = false;
+    // File defining the hole profiles clients can apply by name. See
+    // |ParseHoleProfiles| for the format.
+    std::string profiles_path;
+    // Unix socket over which a running instance hands its state over to a new
+    // one taking over the bus name. Empty disables live upgrades: a new
+    // instance restores the state from the kernel instead.
+    std::string handoff_socket_path;
+    // Gauges of |IpTables::GetGauges| to watch, with the value above which
+    // the GaugeThresholdCrossed signal is emitted. It is emitted again when
+    // the gauge falls back to the threshold.
+    std::map<std::string, int64_t> gauge_thresholds;
+  };
+
+  FirewallService(brillo::dbus_utils::ExportedObjectManager* object_manager,
+                  const Options& options);
+  // Applies the requests with |iptables|, e.g. a mock in tests.
+  FirewallService(brillo::dbus_utils::ExportedObjectManager* object_manager,
+                  const Options& options,
+                  std::unique_ptr<IpTables> iptables);
   virtual ~FirewallService() = default;
 
   // Connects to D-Bus system bus and exports methods.
   void RegisterAsync(const CompletionAction& callback);
 
+  // D-Bus methods.
+  void PunchTcpHole(std::unique_ptr<BoolResponse> response,
+                    uint16_t in_port,
+                    const std::string& in_interface) override;
+  void PunchTcpHoleWithOptions(
+      std::unique_ptr<BoolResponse> response,
+      uint16_t in_port,
+      const std::string& in_interface,
+      const brillo::VariantDictionary& in_options) override;
+  void PunchUdpHole(std::unique_ptr<BoolResponse> response,
+                    uint16_t in_port,
+                    const std::string& in_interface) override;
+  void PunchUdpHoleWithOptions(
+      std::unique_ptr<BoolResponse> response,
+      uint16_t in_port,
+      const std::string& in_interface,
+      const brillo::VariantDictionary& in_options) override;
+  void PlugTcpHole(std::unique_ptr<BoolResponse> response,
+                   uint16_t in_port,
+                   const std::string& in_interface) override;
+  void PlugUdpHole(std::unique_ptr<BoolResponse> response,
+                   uint16_t in_port,
+                   const std::string& in_interface) override;
+  void PunchTcpEgressHole(std::unique_ptr<BoolResponse> response,
+                          uint16_t in_port,
+                          const std::string& in_interface) override;
+  void PunchUdpEgressHole(std::unique_ptr<BoolResponse> response,
+                          uint16_t in_port,
+                          const std::string& in_interface) override;
+  void PlugTcpEgressHole(std::unique_ptr<BoolResponse> response,
+                         uint16_t in_port,
+                         const std::string& in_interface) override;
+  void PlugUdpEgressHole(std::unique_ptr<BoolResponse> response,
+                         uint16_t in_port,
+                         const std::string& in_interface) override;
+  void ReclaimHoles(
+      std::unique_ptr<BoolResponse> response,
+      const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_holes,
+      const std::vector<std::tuple<uint16_t, std::string>>& in_udp_holes)
+      override;
+  void ReclaimHolesWithEgress(
+      std::unique_ptr<BoolResponse> response,
+      const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_holes,
+      const std::vector<std::tuple<uint16_t, std::string>>& in_udp_holes,
+      const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_egress_holes,
+      const std::vector<std::tuple<uint16_t, std::string>>&
+          in_udp_egress_holes) override;
+  void ApplyProfile(std::unique_ptr<BoolResponse> response,
+                    const std::string& in_profile,
+                    const std::string& in_interface) override;
+  void RemoveProfile(std::unique_ptr<BoolResponse> response,
+                     const std::string& in_profile,
+                     const std::string& in_interface) override;
+  void RequestVpnSetup(std::unique_ptr<BoolResponse> response,
+                       const std::vector<std::string>& in_usernames,
+                       const std::string& in_interface) override;
+  void RequestVpnSetupWithOptions(
+      std::unique_ptr<BoolResponse> response,
+      const std::vector<std::string>& in_usernames,
+      const std::string& in_interface,
+      const brillo::VariantDictionary& in_options) override;
+  void RemoveVpnSetup(std::unique_ptr<BoolResponse> response,
+                      const std::vector<std::string>& in_usernames,
+                      const std::string& in_interface) override;
+  void AddTcpPortForward(std::unique_ptr<BoolResponse> response,
+                         uint16_t in_port,
+                         const std::string& in_interface,
+                         const std::string& in_destination) override;
+  void AddUdpPortForward(std::unique_ptr<BoolResponse> response,
+                         uint16_t in_port,
+                         const std::string& in_interface,
+                         const std::string& in_destination) override;
+  void RemoveTcpPortForward(std::unique_ptr<BoolResponse> response,
+                            uint16_t in_port,
+                            const std::string& in_interface,
+                            const std::string& in_destination) override;
+  void RemoveUdpPortForward(std::unique_ptr<BoolResponse> response,
+                            uint16_t in_port,
+                            const std::string& in_interface,
+                            const std::string& in_destination) override;
+  brillo::VariantDictionary GetStats() override;
+
+  // Called when the daemon should exit: when it has been idle for
+  // |idle_exit_timeout|, or once another instance has taken over.
+  void set_exit_callback(const base::Closure& callback) {
+    exit_callback_ = callback;
+  }
+
+  // Called when another instance takes over the bus name. Applies the queued
+  // requests and hands the state over to it, then exits.
+  void OnServiceNameLost();
+
  private:
+  friend class FirewallServiceTest;
+
+  // A request waiting to be committed.
+  struct QueuedRequest {
+    std::unique_ptr<BoolResponse> response;
+    // Set for hole punches, which are applied together.
+    std::unique_ptr<IpTables::HoleRequest> punch;
+    // Applies any other request.
+    base::Callback<bool()> operation;
+  };
+
+  // Applies |operation| and replies with its result, or queues it.
+  void Run(std::unique_ptr<BoolResponse> response,
+           const base::Callback<bool()>& operation);
+  void Punch(std::unique_ptr<BoolResponse> response,
+             ProtocolEnum protocol,
+             uint16_t port,
+             const std::string& interface,
+             const brillo::VariantDictionary& options,
+             bool egress);
+
+  // Group commit: requests are queued and applied in batches, with one batch
+  // in flight at a time.
+  void Enqueue(QueuedRequest request);
+  void ScheduleCommit();
+  // A forced commit applies the whole queue without testing the xtables lock.
+  void Commit(bool force);
+  void ApplyBatch(std::vector<QueuedRequest>* batch);
+  // Returns whether the xtables lock is free, accounting for the time the
+  // commit waited for it since the last test. Otherwise, backs off further.
+  bool TestXtablesLock();
+
+  // Sets up the XDP filter and the IPv6 address monitor from scratch, then
+  // restores the state from the kernel once the base ruleset is loaded.
+  void StartWithoutHandoff();
+  void InitXdpFilter();
+  void InitAppSocketFilter();
+  void CheckBaseRulesReady();
+  void OnBaseRulesReady();
+
+  // Live upgrade, on the new instance's side.
+  void WaitForHandoff();
+  void OnHandoffReadable();
+  void OnHandoffTimeout();
+  bool AdoptHandoffState(const std::string& data,
+                         std::vector<base::ScopedFD>* fds);
+  // And on the running instance's side.
+  void ListenForNewInstance();
+  bool HandOff(int connection);
+
+  void OnFirstRequestServed();
+  // Emits GaugeThresholdCrossed for the gauges that went over or back under
+  // their threshold since the last check.
+  void CheckGaugeThresholds();
+  void ArmIdleExitTimer();
+  void OnIdleExitTimeout();
+
 #if !defined(__ANDROID__)
   void OnPermissionBrokerRemoved(const dbus::ObjectPath& path);
+  // Plugs the current holes once the grace period is over, unless a new
+  // instance of permission_broker reclaims them first.
+  void PlugHolesAfterGracePeriod();
+  void PlugOrphanedHolesIn(base::TimeDelta delay);
+  void OnPermissionBrokerGracePeriodExpired();
 #endif  // __ANDROID__
 
+  const Options options_;
+  // Loaded once, when the daemon starts.
+  HoleProfiles profiles_;
   brillo::dbus_utils::DBusObject dbus_object_;
 #if !defined(__ANDROID__)
   std::unique_ptr<org::chromium::PermissionBroker::ObjectManagerProxy>
       permission_broker_;
+  brillo::MessageLoop::TaskId plug_orphaned_holes_task_{
+      brillo::MessageLoop::kTaskIdNull};
+  base::TimeTicks plug_orphaned_holes_time_;
 #endif  // __ANDROID__
-  IpTables iptables_;
+  bool base_rules_ready_ = false;
+  base::TimeTicks base_rules_wait_start_;
+  std::vector<QueuedRequest> queued_requests_;
+  brillo::MessageLoop::TaskId commit_task_{brillo::MessageLoop::kTaskIdNull};
+  // Whether |commit_task_| waits for a fuller batch.
+  bool commit_delayed_ = false;
+  size_t last_batch_size_ = 0;
+  base::TimeDelta last_commit_latency_;
+  // While another process holds the xtables lock: the delay before the next
+  // test, zero otherwise, and who held it at the last test, and when.
+  base::TimeDelta xtables_lock_backoff_;
+  std::string xtables_lock_holder_;
+  base::TimeTicks xtables_lock_tested_;
+  // How long commits waited for the xtables lock, by holder.
+  std::map<std::string, base::TimeDelta> xtables_lock_wait_;
+  bool first_request_served_ = false;
+  // Gauges over their threshold at the last check.
+  std::set<std::string> gauges_over_threshold_;
+  base::Closure exit_callback_;
+  brillo::MessageLoop::TaskId idle_exit_task_{brillo::MessageLoop::kTaskIdNull};
+  base::ScopedFD handoff_listener_;
+  // Connection to the other instance during a handoff. Outlives
+  // |xdp_filter_|, so that a new instance falling back to a fresh start after
+  // a failed handoff only does so once the old program is detached.
+  base::ScopedFD handoff_connection_;
+  brillo::MessageLoop::TaskId handoff_watch_task_{
+      brillo::MessageLoop::kTaskIdNull};
+  brillo::MessageLoop::TaskId handoff_timeout_task_{
+      brillo::MessageLoop::kTaskIdNull};
+  // The filters outlive |iptables_|, which removes its holes from them on
+  // destruction.
+  XdpFilter xdp_filter_;
+  AppSocketFilter app_socket_filter_;
+  std::unique_ptr<IpTables> iptables_;
+  Ipv6AddressMonitor ipv6_address_monitor_;
 
   base::WeakPtrFactory<FirewallService> weak_ptr_factory_{this};
   DISALLOW_COPY_AND_ASSIGN(FirewallService);
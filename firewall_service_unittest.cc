@@ -0,0 +1,243 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "firewall_service.h"
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/test/simple_test_clock.h>
+#include <brillo/dbus/exported_object_manager.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <dbus/message.h>
+#include <gtest/gtest.h>
+
+#include "dbus_interface.h"
+#include "mock_iptables.h"
+
+namespace firewalld {
+
+using testing::_;
+using testing::DoAll;
+using testing::NiceMock;
+using testing::Return;
+using testing::SetArgPointee;
+
+class FirewallServiceTest : public testing::Test {
+ public:
+  FirewallServiceTest() = default;
+  ~FirewallServiceTest() override = default;
+
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+ protected:
+  // Creates the service with |options|, applying the requests with
+  // |iptables_|. Requests are queued until |SetBaseRulesReady|.
+  void CreateService(const FirewallService::Options& options) {
+    iptables_ = new NiceMock<MockIpTables>();
+    ON_CALL(*iptables_, AddAcceptRule(_, _, _, _)).WillByDefault(Return(true));
+    ON_CALL(*iptables_, DeleteAcceptRule(_, _, _, _))
+        .WillByDefault(Return(true));
+    ON_CALL(*iptables_, RunRestore(_, _)).WillByDefault(Return(true));
+    ON_CALL(*iptables_, XtablesLockIsFree(_)).WillByDefault(Return(true));
+    service_.reset(new FirewallService(&object_manager_, options,
+                                       std::unique_ptr<IpTables>(iptables_)));
+  }
+
+  void SetBaseRulesReady() { service_->OnBaseRulesReady(); }
+
+  // Makes the next commit look like it follows a batch of |size| requests
+  // that took |latency| to apply.
+  void SetLastCommit(size_t size, base::TimeDelta latency) {
+    service_->last_batch_size_ = size;
+    service_->last_commit_latency_ = latency;
+  }
+
+  // Commits like a handoff does, without waiting for the xtables lock.
+  void ForceCommit() {
+    brillo::MessageLoop::current()->CancelTask(service_->commit_task_);
+    service_->Commit(true /* force */);
+  }
+
+  // Returns a response recording its result as |replies_[id]|.
+  std::unique_ptr<FirewallService::BoolResponse> Response(int id) {
+    method_calls_.emplace_back(
+        new dbus::MethodCall(kFirewallServiceName, "Test"));
+    method_calls_.back()->SetSerial(id + 1);
+    return std::unique_ptr<FirewallService::BoolResponse>(
+        new FirewallService::BoolResponse(
+            method_calls_.back().get(),
+            base::Bind(&FirewallServiceTest::OnReply, base::Unretained(this),
+                       id)));
+  }
+
+  void PunchTcpHole(int id, uint16_t port) {
+    service_->PunchTcpHole(Response(id), port, "iface");
+  }
+
+  base::SimpleTestClock clock_;
+  brillo::FakeMessageLoop loop_{&clock_};
+  brillo::dbus_utils::ExportedObjectManager object_manager_{
+      nullptr, dbus::ObjectPath("/")};
+  // Owned by |service_|.
+  MockIpTables* iptables_ = nullptr;
+  std::unique_ptr<FirewallService> service_;
+  std::map<int, bool> replies_;
+
+ private:
+  void OnReply(int id, std::unique_ptr<dbus::Response> response) {
+    dbus::MessageReader reader(response.get());
+    bool result = false;
+    EXPECT_TRUE(reader.PopBool(&result));
+    replies_[id] = result;
+  }
+
+  std::vector<std::unique_ptr<dbus::MethodCall>> method_calls_;
+
+  DISALLOW_COPY_AND_ASSIGN(FirewallServiceTest);
+};
+
+TEST_F(FirewallServiceTest, CommitsAtOnceWhenIdle) {
+  CreateService(FirewallService::Options());
+  SetBaseRulesReady();
+
+  PunchTcpHole(1, 80);
+  EXPECT_TRUE(replies_.empty());
+  EXPECT_TRUE(loop_.RunOnce(false /* may_block */));
+  EXPECT_EQ((std::map<int, bool>{{1, true}}), replies_);
+}
+
+TEST_F(FirewallServiceTest, WaitsForMoreRequestsWithinMaxCommitDelay) {
+  FirewallService::Options options;
+  options.max_commit_delay = base::TimeDelta::FromMilliseconds(5);
+  CreateService(options);
+  SetBaseRulesReady();
+  // The last commit had company and took longer than the delay allows.
+  SetLastCommit(2, base::TimeDelta::FromSeconds(1));
+
+  PunchTcpHole(1, 80);
+  EXPECT_FALSE(loop_.RunOnce(false /* may_block */));
+  clock_.Advance(base::TimeDelta::FromMilliseconds(4));
+  PunchTcpHole(2, 443);
+  EXPECT_FALSE(loop_.RunOnce(false /* may_block */));
+  EXPECT_TRUE(replies_.empty());
+
+  clock_.Advance(base::TimeDelta::FromMilliseconds(1));
+  EXPECT_TRUE(loop_.RunOnce(false /* may_block */));
+  EXPECT_EQ((std::map<int, bool>{{1, true}, {2, true}}), replies_);
+}
+
+TEST_F(FirewallServiceTest, FullBatchDoesNotWait) {
+  FirewallService::Options options;
+  options.max_batch_size = 3;
+  options.max_commit_delay = base::TimeDelta::FromMilliseconds(5);
+  CreateService(options);
+  SetBaseRulesReady();
+  SetLastCommit(2, base::TimeDelta::FromSeconds(1));
+
+  PunchTcpHole(1, 80);
+  PunchTcpHole(2, 443);
+  EXPECT_FALSE(loop_.RunOnce(false /* may_block */));
+  PunchTcpHole(3, 8080);
+  EXPECT_TRUE(loop_.RunOnce(false /* may_block */));
+  EXPECT_EQ((std::map<int, bool>{{1, true}, {2, true}, {3, true}}), replies_);
+}
+
+TEST_F(FirewallServiceTest, RepliesToEachRequestOfASplitBatch) {
+  FirewallService::Options options;
+  options.max_batch_size = 4;
+  CreateService(options);
+  SetBaseRulesReady();
+
+  // Punches on either side of a plug are applied apart.
+  PunchTcpHole(1, 80);
+  PunchTcpHole(2, 0);
+  service_->PlugTcpHole(Response(3), 22, "iface");
+  PunchTcpHole(4, 443);
+  // Over |max_batch_size|, left for the next commit.
+  PunchTcpHole(5, 8080);
+  service_->PlugTcpHole(Response(6), 80, "iface");
+
+  EXPECT_TRUE(loop_.RunOnce(false /* may_block */));
+  EXPECT_EQ((std::map<int, bool>{{1, true}, {2, false}, {3, false}, {4, true}}),
+            replies_);
+
+  replies_.clear();
+  EXPECT_TRUE(loop_.RunOnce(true /* may_block */));
+  EXPECT_EQ((std::map<int, bool>{{5, true}, {6, true}}), replies_);
+}
+
+TEST_F(FirewallServiceTest, QueuesRequestsUntilBaseRulesAreReady) {
+  CreateService(FirewallService::Options());
+
+  PunchTcpHole(1, 80);
+  PunchTcpHole(2, 443);
+  EXPECT_FALSE(loop_.RunOnce(false /* may_block */));
+  EXPECT_TRUE(replies_.empty());
+
+  // There is no state to restore.
+  EXPECT_CALL(*iptables_, DumpRules(_, _)).WillRepeatedly(Return(false));
+  SetBaseRulesReady();
+  EXPECT_TRUE(loop_.RunOnce(false /* may_block */));
+  EXPECT_EQ((std::map<int, bool>{{1, true}, {2, true}}), replies_);
+}
+
+TEST_F(FirewallServiceTest, BacksOffWhileXtablesLockIsHeld) {
+  FirewallService::Options options;
+  options.max_batch_size = 1;
+  options.xtables_lock_backoff = true;
+  CreateService(options);
+  SetBaseRulesReady();
+
+  EXPECT_CALL(*iptables_, XtablesLockIsFree(_))
+      .WillOnce(DoAll(SetArgPointee<0>("iptables"), Return(false)))
+      .WillOnce(DoAll(SetArgPointee<0>("iptables"), Return(false)))
+      .WillOnce(Return(true));
+
+  PunchTcpHole(1, 80);
+  EXPECT_TRUE(loop_.RunOnce(false /* may_block */));
+  // Requests keep queuing, past |max_batch_size|.
+  PunchTcpHole(2, 443);
+  EXPECT_FALSE(loop_.RunOnce(false /* may_block */));
+  EXPECT_TRUE(loop_.RunOnce(true /* may_block */));
+  EXPECT_TRUE(replies_.empty());
+
+  // The first commit once the lock is free takes every queued request.
+  EXPECT_TRUE(loop_.RunOnce(true /* may_block */));
+  EXPECT_EQ((std::map<int, bool>{{1, true}, {2, true}}), replies_);
+  EXPECT_EQ(1u, service_->GetStats().count("xtables_lock.iptables.wait_us"));
+}
+
+TEST_F(FirewallServiceTest, ForcedCommitDoesNotWaitForXtablesLock) {
+  FirewallService::Options options;
+  options.max_batch_size = 1;
+  options.xtables_lock_backoff = true;
+  CreateService(options);
+  SetBaseRulesReady();
+
+  EXPECT_CALL(*iptables_, XtablesLockIsFree(_)).WillOnce(Return(false));
+
+  PunchTcpHole(1, 80);
+  EXPECT_TRUE(loop_.RunOnce(false /* may_block */));
+  PunchTcpHole(2, 443);
+  EXPECT_TRUE(replies_.empty());
+
+  ForceCommit();
+  EXPECT_EQ((std::map<int, bool>{{1, true}, {2, true}}), replies_);
+  EXPECT_FALSE(loop_.RunOnce(true /* may_block */));
+}
+
+}  // namespace firewalld
@@ -13,9 +13,18 @@
       'target_name': 'libfirewalld',
       'type': 'static_library',
       'sources': [
+        'app_socket_filter.cc',
+        'bpf_program.cc',
+        'conntrack.cc',
         'firewall_daemon.cc',
         'firewall_service.cc',
+        'handoff.cc',
+        'hole_profiles.cc',
         'iptables.cc',
+        'ipv6_address_monitor.cc',
+        'uid_range_rules.cc',
+        'xdp_filter.cc',
+        'xtables_lock.cc',
       ],
     },
     {
@@ -68,17 +77,42 @@
           'type': 'executable',
           'variables': {
             'deps': [
+              'libbrillo-test-<(libbase_ver)',
+              'libchrome-test-<(libbase_ver)',
               'libpermission_broker-client-test',
             ],
           },
           'includes': ['../common-mk/common_test.gypi'],
-          'dependencies': ['libfirewalld'],
+          'dependencies': [
+            'libfirewalld',
+            'firewalld-dbus-adaptor',
+          ],
           'sources': [
+            'conntrack_unittest.cc',
+            'firewall_service_unittest.cc',
             'iptables_unittest.cc',
             'mock_iptables.cc',
             'run_all_tests.cc',
           ],
         },
+        {
+          'target_name': 'firewalld_dataplane_benchmark',
+          'type': 'executable',
+          'dependencies': ['libfirewalld'],
+          'sources': ['dataplane_benchmark.cc'],
+        },
+        {
+          'target_name': 'firewalld_pipeline_benchmark',
+          'type': 'executable',
+          'dependencies': ['libfirewalld'],
+          'sources': ['pipeline_benchmark.cc'],
+        },
+        {
+          'target_name': 'firewalld_backend_equivalence_test',
+          'type': 'executable',
+          'dependencies': ['libfirewalld'],
+          'sources': ['backend_equivalence_test.cc'],
+        },
       ],
     }],
   ],
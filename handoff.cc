@@ -0,0 +1,241 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "handoff.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+namespace {
+
+// The daemon hands over a few descriptors at most.
+const size_t kMaxHandoffFds = 8;
+
+// Neither side waits longer than this for the other once the state is on
+// its way.
+const int kHandoffIoTimeoutSeconds = 5;
+
+// Sent first, along with the descriptors.
+struct HandoffHeader {
+  uint32_t state_size;
+  uint32_t fd_count;
+};
+
+bool MakeAddress(const std::string& path, struct sockaddr_un* address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address->sun_path)) {
+    LOG(ERROR) << "Handoff socket path too long: " << path;
+    return false;
+  }
+  memcpy(address->sun_path, path.data(), path.size());
+  return true;
+}
+
+void SetIoTimeout(int fd) {
+  struct timeval timeout;
+  timeout.tv_sec = kHandoffIoTimeoutSeconds;
+  timeout.tv_usec = 0;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+    PLOG(WARNING) << "Could not set handoff socket timeouts";
+  }
+}
+
+}  // namespace
+
+namespace firewalld {
+
+base::ScopedFD ListenForHandoff(const std::string& path) {
+  struct sockaddr_un address;
+  if (!MakeAddress(path, &address)) {
+    return base::ScopedFD();
+  }
+  base::ScopedFD fd(
+      socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0));
+  if (!fd.is_valid()) {
+    PLOG(ERROR) << "Could not open handoff socket";
+    return base::ScopedFD();
+  }
+  if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+    PLOG(ERROR) << "Could not remove stale handoff socket " << path;
+    return base::ScopedFD();
+  }
+  if (bind(fd.get(), reinterpret_cast<struct sockaddr*>(&address),
+           sizeof(address)) < 0 ||
+      listen(fd.get(), 1) < 0) {
+    PLOG(ERROR) << "Could not listen on handoff socket " << path;
+    return base::ScopedFD();
+  }
+  return fd;
+}
+
+base::ScopedFD ConnectForHandoff(const std::string& path) {
+  struct sockaddr_un address;
+  if (!MakeAddress(path, &address)) {
+    return base::ScopedFD();
+  }
+  base::ScopedFD fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (!fd.is_valid()) {
+    PLOG(ERROR) << "Could not open handoff socket";
+    return base::ScopedFD();
+  }
+  if (HANDLE_EINTR(connect(fd.get(),
+                           reinterpret_cast<struct sockaddr*>(&address),
+                           sizeof(address))) < 0) {
+    // Nobody to take over from.
+    return base::ScopedFD();
+  }
+  SetIoTimeout(fd.get());
+  return fd;
+}
+
+base::ScopedFD AcceptHandoff(int listener) {
+  base::ScopedFD fd(HANDLE_EINTR(accept4(listener, nullptr, nullptr,
+                                         SOCK_CLOEXEC)));
+  if (!fd.is_valid()) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      PLOG(ERROR) << "Could not accept handoff connection";
+    }
+    return base::ScopedFD();
+  }
+  struct ucred credentials;
+  socklen_t length = sizeof(credentials);
+  if (getsockopt(fd.get(), SOL_SOCKET, SO_PEERCRED, &credentials, &length) <
+      0) {
+    PLOG(ERROR) << "Could not get handoff peer credentials";
+    return base::ScopedFD();
+  }
+  if (credentials.uid != geteuid()) {
+    LOG(ERROR) << "Refusing handoff to process " << credentials.pid
+               << " of user " << credentials.uid;
+    return base::ScopedFD();
+  }
+  SetIoTimeout(fd.get());
+  return fd;
+}
+
+bool SendHandoff(int connection,
+                 const base::Pickle& state,
+                 const std::vector<int>& fds) {
+  CHECK_LE(fds.size(), kMaxHandoffFds);
+  HandoffHeader header;
+  header.state_size = static_cast<uint32_t>(state.size());
+  header.fd_count = static_cast<uint32_t>(fds.size());
+
+  struct iovec iov;
+  iov.iov_base = &header;
+  iov.iov_len = sizeof(header);
+  char control[CMSG_SPACE(kMaxHandoffFds * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  if (!fds.empty()) {
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+  }
+  if (HANDLE_EINTR(sendmsg(connection, &message, MSG_NOSIGNAL)) !=
+      static_cast<ssize_t>(sizeof(header))) {
+    PLOG(ERROR) << "Could not send handoff header";
+    return false;
+  }
+
+  const char* data = static_cast<const char*>(state.data());
+  size_t remaining = state.size();
+  while (remaining > 0) {
+    ssize_t sent = HANDLE_EINTR(send(connection, data, remaining,
+                                     MSG_NOSIGNAL));
+    if (sent <= 0) {
+      PLOG(ERROR) << "Could not send handoff state";
+      return false;
+    }
+    data += sent;
+    remaining -= sent;
+  }
+  return true;
+}
+
+bool ReceiveHandoff(int connection,
+                    std::string* state,
+                    std::vector<base::ScopedFD>* fds) {
+  HandoffHeader header;
+  struct iovec iov;
+  iov.iov_base = &header;
+  iov.iov_len = sizeof(header);
+  char control[CMSG_SPACE(kMaxHandoffFds * sizeof(int))];
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t length = HANDLE_EINTR(
+      recvmsg(connection, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC));
+  if (length < 0) {
+    PLOG(ERROR) << "Could not receive handoff header";
+    return false;
+  }
+
+  // Take ownership of whatever came along before looking at it.
+  fds->clear();
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg;
+       cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+    for (size_t i = 0; i < count; i++) {
+      fds->emplace_back(received[i]);
+    }
+  }
+  if (length == 0) {
+    // The other instance gave up on the handoff.
+    return false;
+  }
+  if (length != static_cast<ssize_t>(sizeof(header)) ||
+      (message.msg_flags & MSG_CTRUNC) || header.fd_count != fds->size()) {
+    LOG(ERROR) << "Malformed handoff header";
+    return false;
+  }
+
+  state->resize(header.state_size);
+  size_t received = 0;
+  while (received < state->size()) {
+    ssize_t chunk = HANDLE_EINTR(recv(connection, &(*state)[received],
+                                      state->size() - received, 0));
+    if (chunk <= 0) {
+      PLOG(ERROR) << "Could not receive handoff state";
+      return false;
+    }
+    received += chunk;
+  }
+  return true;
+}
+
+}  // namespace firewalld
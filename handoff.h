@@ -0,0 +1,57 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIREWALLD_HANDOFF_H_
+#define FIREWALLD_HANDOFF_H_
+
+#include <string>
+#include <vector>
+
+#include <base/files/scoped_file.h>
+#include <base/pickle.h>
+
+namespace firewalld {
+
+// A running instance of the daemon hands its state over to a new one through
+// a Unix socket: the new instance connects, takes over the bus name, and the
+// old one answers with a single message carrying its serialized state along
+// with the file descriptors of its kernel objects.
+
+// Listens on |path|, replacing whatever socket a previous instance left
+// there. Returns an invalid descriptor on failure.
+base::ScopedFD ListenForHandoff(const std::string& path);
+
+// Connects to the instance listening on |path|. Returns an invalid
+// descriptor, without logging, if there is none.
+base::ScopedFD ConnectForHandoff(const std::string& path);
+
+// Accepts a connection waiting on |listener|, without blocking. Connections
+// from other users are refused. Returns an invalid descriptor if there is no
+// acceptable connection.
+base::ScopedFD AcceptHandoff(int listener);
+
+// Sends |state| and |fds| over |connection|.
+bool SendHandoff(int connection,
+                 const base::Pickle& state,
+                 const std::vector<int>& fds);
+
+// Receives the state and file descriptors sent with |SendHandoff|. Returns
+// false if |connection| is closed first, or on a malformed message.
+bool ReceiveHandoff(int connection,
+                    std::string* state,
+                    std::vector<base::ScopedFD>* fds);
+
+}  // namespace firewalld
+
+#endif  // FIREWALLD_HANDOFF_H_
@@ -0,0 +1,128 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "hole_profiles.h"
+
+#include <ctype.h>
+
+#include <set>
+#include <tuple>
+
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <brillo/variant_dictionary.h>
+
+namespace {
+
+bool IsValidProfileName(const std::string& name) {
+  for (char c : name) {
+    if (!isalnum(c) && c != '-' && c != '_') {
+      return false;
+    }
+  }
+  return !name.empty();
+}
+
+// Parses the hole described by |fields|, a profile line without the profile
+// name.
+bool ParseProfileHole(const std::vector<std::string>& fields,
+                      firewalld::IpTables::GroupHole* hole) {
+  unsigned port;
+  if (fields.size() < 2 || (fields[0] != "tcp" && fields[0] != "udp") ||
+      !base::StringToUint(fields[1], &port) || port == 0 || port > 65535) {
+    return false;
+  }
+  hole->protocol =
+      fields[0] == "tcp" ? firewalld::kProtocolTcp : firewalld::kProtocolUdp;
+  hole->port = static_cast<uint16_t>(port);
+
+  brillo::VariantDictionary options;
+  for (size_t i = 2; i < fields.size(); i++) {
+    const std::string& option = fields[i];
+    size_t equals = option.find('=');
+    if (equals == std::string::npos) {
+      options[option] = true;
+      continue;
+    }
+    unsigned value;
+    if (!base::StringToUint(option.substr(equals + 1), &value)) {
+      return false;
+    }
+    options[option.substr(0, equals)] = static_cast<uint32_t>(value);
+  }
+  hole->options = firewalld::HoleOptions();
+  return firewalld::ParseHoleOptions(options, hole->protocol, &hole->options);
+}
+
+}  // namespace
+
+namespace firewalld {
+
+bool ParseHoleProfiles(const std::string& contents, HoleProfiles* profiles) {
+  HoleProfiles parsed;
+  std::set<std::string> invalid;
+  std::set<std::tuple<std::string, ProtocolEnum, uint16_t>> seen;
+  const std::vector<std::string> lines = base::SplitString(
+      contents, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  for (size_t i = 0; i < lines.size(); i++) {
+    const std::string& line = lines[i];
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::vector<std::string> fields = base::SplitString(
+        line, " \t", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    const std::string name = fields[0];
+    fields.erase(fields.begin());
+    IpTables::GroupHole hole;
+    if (!IsValidProfileName(name) || !ParseProfileHole(fields, &hole)) {
+      LOG(ERROR) << "Invalid hole profile line " << i + 1 << ": '" << line
+                 << "'";
+      invalid.insert(name);
+      continue;
+    }
+    if (!seen.insert(std::make_tuple(name, hole.protocol, hole.port)).second) {
+      LOG(ERROR) << "Port " << hole.port << " appears twice in hole profile '"
+                 << name << "'";
+      invalid.insert(name);
+      continue;
+    }
+    parsed[name].push_back(hole);
+  }
+
+  for (const auto& profile : parsed) {
+    if (invalid.find(profile.first) == invalid.end()) {
+      (*profiles)[profile.first] = profile.second;
+    }
+  }
+  return invalid.empty();
+}
+
+bool LoadHoleProfiles(const base::FilePath& path, HoleProfiles* profiles) {
+  if (!base::PathExists(path)) {
+    return true;
+  }
+  std::string contents;
+  if (!base::ReadFileToString(path, &contents)) {
+    PLOG(ERROR) << "Could not read hole profiles from '" << path.value()
+                << "'";
+    return false;
+  }
+  return ParseHoleProfiles(contents, profiles);
+}
+
+}  // namespace firewalld
@@ -0,0 +1,50 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef FIREWALLD_HOLE_PROFILES_H_
+#define FIREWALLD_HOLE_PROFILES_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/files/file_path.h>
+
+#include "iptables.h"
+
+namespace firewalld {
+
+// Groups of holes that clients open together, e.g. for casting or mDNS, by
+// profile name.
+using HoleProfiles = std::map<std::string, std::vector<IpTables::GroupHole>>;
+
+// Adds the profiles described by |contents| to |profiles|. Each line adds a
+// hole to a profile:
+//
+//   <profile> <tcp|udp> <port> [<option>[=<value>] ...]
+//
+// where the options are those taken by the Punch*HoleWithOptions D-Bus
+// methods, with boolean options given by name alone. Blank lines and lines
+// starting with '#' are ignored. A profile with an invalid line is left out
+// entirely. Returns false if any profile was left out.
+bool ParseHoleProfiles(const std::string& contents, HoleProfiles* profiles);
+
+// Loads |profiles| from the file at |path|. A missing file means there are no
+// profiles.
+bool LoadHoleProfiles(const base::FilePath& path, HoleProfiles* profiles);
+
+}  // namespace firewalld
+
+#endif  // FIREWALLD_HOLE_PROFILES_H_
@@ -14,21 +14,43 @@
 
 #include "iptables.h"
 
+#include <arpa/inet.h>
 #include <linux/capability.h>
-
+#include <netinet/in.h>
+#include <pwd.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <set>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include <base/bind.h>
 #include <base/bind_helpers.h>
 #include <base/callback.h>
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <brillo/minijail/minijail.h>
 #include <brillo/process.h>
 
+#include "dbus_interface.h"
+#include "xtables_lock.h"
+
 namespace {
 
 using IpTablesCallback = base::Callback<bool(const std::string&, bool)>;
@@ -36,10 +58,18 @@ using IpTablesCallback = base::Callback<bool(const std::string&, bool)>;
 #if defined(__ANDROID__)
 const char kIpTablesPath[] = "/system/bin/iptables";
 const char kIp6TablesPath[] = "/system/bin/ip6tables";
+const char kIpTablesRestorePath[] = "/system/bin/iptables-restore";
+const char kIp6TablesRestorePath[] = "/system/bin/ip6tables-restore";
+const char kIpTablesSavePath[] = "/system/bin/iptables-save";
+const char kIp6TablesSavePath[] = "/system/bin/ip6tables-save";
 const char kIpPath[] = "/system/bin/ip";
 #else
 const char kIpTablesPath[] = "/sbin/iptables";
 const char kIp6TablesPath[] = "/sbin/ip6tables";
+const char kIpTablesRestorePath[] = "/sbin/iptables-restore";
+const char kIp6TablesRestorePath[] = "/sbin/ip6tables-restore";
+const char kIpTablesSavePath[] = "/sbin/iptables-save";
+const char kIp6TablesSavePath[] = "/sbin/ip6tables-save";
 const char kIpPath[] = "/bin/ip";
 const char kUnprivilegedUser[] = "nobody";
 #endif  // __ANDROID__
@@ -58,7 +88,52 @@ const size_t kInterfaceNameSize = 16;
 
 const char kMarkForUserTraffic[] = "1";
 
-const char kTableIdForUserTraffic[] = "1";
+const uint32_t kTableIdForUserTraffic = 1;
+
+const char kConntrackTcpLoosePath[] =
+    "/proc/sys/net/netfilter/nf_conntrack_tcp_loose";
+const char kConntrackTcpLooseDefault[] = "1";
+
+// SYNPROXY parameters announced to clients. The MSS is the IPv6 one for a
+// 1500-byte MTU, so that the same rule works for IPv4 and IPv6. SYN cookies
+// and TCP timestamps must be enabled, as they are by default.
+const char kSynProxyOptions[] =
+    "--sack-perm --timestamp --wscale 7 --mss 1440";
+
+// Every rule of a hole carries a comment identifying the hole and its
+// options, e.g. "firewalld:udp:53:eth0:notrack", from which a new instance of
+// the daemon rebuilds its state.
+const char kRuleTag[] = "firewalld";
+
+// The most packets per second a hashlimit rule can be given, and the burst
+// used when the caller doesn't pick one.
+const uint32_t kMaxRateLimit = 10000;
+const uint32_t kDefaultRateLimitBurst = 5;
+
+// Longest cgroup path a hole can be scoped to, which has to fit in the
+// comment of its rules along with the rest of the tag.
+const size_t kMaxCgroupPathLength = 128;
+
+// Port forwards on an interface are DNAT rules in a nat chain of its own,
+// which PREROUTING jumps to for the traffic coming in on the interface. Chain
+// names are limited to 28 characters, which leaves room for a short prefix
+// only.
+const char kPortForwardChainPrefix[] = "fwd-";
+// Flag ending the tag of a port forward's rule, e.g.
+// "firewalld:tcp:8080:eth0:fwd".
+const char kPortForwardFlag[] = "fwd";
+
+// Field following the rule tag in the comment of the rules locking VPN users
+// down to an interface, e.g. "firewalld:lockdown:tun0".
+const char kLockdownTag[] = "lockdown";
+
+// Most users a uidrange rule restored from the kernel can route. VPN users
+// are a handful of accounts, so a wider rule isn't one of ours.
+const uint64_t kMaxRestoredUidRangeSize = 65536;
+
+// Restore input buffers that a batch grew past this many bytes are released
+// instead of being kept for the next batch.
+const size_t kMaxRetainedRuleBatchSize = 64 * 1024;
 
 bool IsValidInterfaceName(const std::string& iface) {
   // |iface| should be shorter than |kInterfaceNameSize| chars and have only
@@ -80,6 +155,435 @@ bool IsValidInterfaceName(const std::string& iface) {
   return true;
 }
 
+// Whether |cgroup| is a path from the cgroup root such as "/apps/browser",
+// without characters that would need quoting in a rule's tag.
+bool IsValidCgroupPath(const std::string& cgroup) {
+  if (cgroup.size() < 2 || cgroup.size() > kMaxCgroupPathLength ||
+      cgroup[0] != '/') {
+    return false;
+  }
+  for (const auto& name : base::SplitString(cgroup.substr(1), "/",
+                                            base::KEEP_WHITESPACE,
+                                            base::SPLIT_WANT_ALL)) {
+    if (name.empty() || name == "." || name == "..") {
+      return false;
+    }
+    for (auto c : name) {
+      if (!std::isalnum(c) && c != '-' && c != '_' && c != '.') {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Appends to |tag| the comment that identifies the rules of a hole.
+void AppendHoleTag(firewalld::ProtocolEnum protocol,
+                   uint16_t port,
+                   const std::string& interface,
+                   const firewalld::HoleOptions& options,
+                   std::string* tag) {
+  base::StringAppendF(tag, "%s:%s:%u:", kRuleTag,
+                      protocol == firewalld::kProtocolTcp ? "tcp" : "udp",
+                      port);
+  *tag += interface;
+  char separator = ':';
+  auto append_flag = [tag, &separator](const char* flag) {
+    *tag += separator;
+    *tag += flag;
+    separator = ',';
+  };
+  if (options.egress) {
+    append_flag("out");
+  }
+  if (options.notrack) {
+    append_flag("notrack");
+  }
+  if (options.synproxy) {
+    append_flag("synproxy");
+  }
+  if (options.rate_limit) {
+    append_flag("rate=");
+    base::StringAppendF(tag, "%u", options.rate_limit);
+  }
+  if (options.rate_limit_burst) {
+    append_flag("burst=");
+    base::StringAppendF(tag, "%u", options.rate_limit_burst);
+  }
+  if (options.rate_limit_connections) {
+    append_flag("conn");
+  }
+  if (!options.cgroup.empty()) {
+    append_flag("cgroup=");
+    *tag += options.cgroup;
+  }
+  if (options.uid >= 0) {
+    append_flag("uid=");
+    base::StringAppendF(tag, "%u", static_cast<uint32_t>(options.uid));
+  }
+}
+
+bool ParseHoleTag(const std::string& tag,
+                  firewalld::ProtocolEnum* protocol,
+                  uint16_t* port,
+                  std::string* interface,
+                  firewalld::HoleOptions* options) {
+  std::vector<std::string> fields = base::SplitString(
+      tag, ":", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+  unsigned number;
+  if (fields.size() < 4 || fields.size() > 5 || fields[0] != kRuleTag ||
+      (fields[1] != "tcp" && fields[1] != "udp") ||
+      !base::StringToUint(fields[2], &number) || number == 0 ||
+      number > 65535) {
+    return false;
+  }
+  *protocol =
+      fields[1] == "tcp" ? firewalld::kProtocolTcp : firewalld::kProtocolUdp;
+  *port = static_cast<uint16_t>(number);
+  *interface = fields[3];
+  *options = firewalld::HoleOptions();
+  if (fields.size() < 5) {
+    return true;
+  }
+  for (const auto& flag : base::SplitString(fields[4], ",",
+                                            base::KEEP_WHITESPACE,
+                                            base::SPLIT_WANT_NONEMPTY)) {
+    if (flag == "out") {
+      options->egress = true;
+    } else if (flag == "notrack") {
+      options->notrack = true;
+    } else if (flag == "synproxy") {
+      options->synproxy = true;
+    } else if (flag == "conn") {
+      options->rate_limit_connections = true;
+    } else if (base::StartsWith(flag, "rate=", base::CompareCase::SENSITIVE) &&
+               base::StringToUint(flag.substr(5), &number)) {
+      options->rate_limit = number;
+    } else if (base::StartsWith(flag, "burst=",
+                                base::CompareCase::SENSITIVE) &&
+               base::StringToUint(flag.substr(6), &number)) {
+      options->rate_limit_burst = number;
+    } else if (base::StartsWith(flag, "cgroup=",
+                                base::CompareCase::SENSITIVE) &&
+               IsValidCgroupPath(flag.substr(7))) {
+      options->cgroup = flag.substr(7);
+    } else if (base::StartsWith(flag, "uid=", base::CompareCase::SENSITIVE) &&
+               base::StringToUint(flag.substr(4), &number)) {
+      options->uid = number;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the comment of the rule |line| of an 'iptables-save' dump, if it
+// has one.
+bool RuleComment(const std::string& line, std::string* comment) {
+  const std::string option = "--comment ";
+  size_t start = line.find(option);
+  if (start == std::string::npos) {
+    return false;
+  }
+  start += option.size();
+  size_t end;
+  if (start < line.size() && line[start] == '"') {
+    start++;
+    end = line.find('"', start);
+  } else {
+    end = line.find(' ', start);
+  }
+  *comment = line.substr(start, end == std::string::npos ? std::string::npos
+                                                         : end - start);
+  return true;
+}
+
+// Adds the holes tagged in the INPUT chain of the filter table of |dump|, the
+// output of 'iptables-save', to |holes|, and the egress holes tagged in its
+// OUTPUT chain to |egress_holes|.
+void ParseTaggedHoles(
+    const std::string& dump,
+    std::map<firewalld::IpTables::ProtocolHole, firewalld::HoleOptions>* holes,
+    std::map<firewalld::IpTables::ProtocolHole, firewalld::HoleOptions>*
+        egress_holes) {
+  bool in_filter_table = false;
+  for (const auto& line : base::SplitString(dump, "\n", base::TRIM_WHITESPACE,
+                                            base::SPLIT_WANT_NONEMPTY)) {
+    if (line[0] == '*') {
+      in_filter_table = line == "*filter";
+      continue;
+    }
+    std::string comment;
+    const bool input =
+        base::StartsWith(line, "-A INPUT ", base::CompareCase::SENSITIVE);
+    if (!in_filter_table ||
+        (!input && !base::StartsWith(line, "-A OUTPUT ",
+                                     base::CompareCase::SENSITIVE)) ||
+        !RuleComment(line, &comment)) {
+      continue;
+    }
+    firewalld::ProtocolEnum protocol;
+    uint16_t port;
+    std::string interface;
+    firewalld::HoleOptions options;
+    // Holes without connection tracking have OUTPUT rules as well.
+    if (!ParseHoleTag(comment, &protocol, &port, &interface, &options) ||
+        options.egress == input) {
+      continue;
+    }
+    (options.egress ? egress_holes : holes)->insert(std::make_pair(
+        std::make_pair(protocol, std::make_pair(port, interface)), options));
+  }
+}
+
+// Whether |destination| is an IPv4 address, optionally followed by ":" and a
+// port, e.g. "192.168.1.2:8080".
+bool IsValidPortForwardDestination(const std::string& destination) {
+  const size_t colon = destination.find(':');
+  struct in_addr address;
+  if (inet_pton(AF_INET, destination.substr(0, colon).c_str(), &address) != 1) {
+    return false;
+  }
+  unsigned port;
+  return colon == std::string::npos ||
+         (base::StringToUint(destination.substr(colon + 1), &port) &&
+          port > 0 && port <= 65535);
+}
+
+std::string PortForwardChain(const std::string& interface) {
+  return kPortForwardChainPrefix + interface;
+}
+
+// Returns the chain, match and target of the DNAT rule of a port forward.
+std::string PortForwardRule(firewalld::ProtocolEnum protocol,
+                            const std::string& interface,
+                            uint16_t port,
+                            const std::string& destination) {
+  std::string rule = PortForwardChain(interface);
+  base::StringAppendF(&rule, " -p %s --dport %u -m comment --comment ",
+                      protocol == firewalld::kProtocolTcp ? "tcp" : "udp",
+                      port);
+  AppendHoleTag(protocol, port, interface, firewalld::HoleOptions(), &rule);
+  rule += ':';
+  rule += kPortForwardFlag;
+  rule += " -j DNAT --to-destination ";
+  rule += destination;
+  return rule;
+}
+
+// Adds the port forwards tagged in the nat table of |dump|, the output of
+// 'iptables-save', to |port_forwards|, with their destination.
+void ParseTaggedPortForwards(
+    const std::string& dump,
+    std::map<firewalld::IpTables::ProtocolHole, std::string>* port_forwards) {
+  const std::string flag = std::string(":") + kPortForwardFlag;
+  const std::string target = "--to-destination ";
+  bool in_nat_table = false;
+  for (const auto& line : base::SplitString(dump, "\n", base::TRIM_WHITESPACE,
+                                            base::SPLIT_WANT_NONEMPTY)) {
+    if (line[0] == '*') {
+      in_nat_table = line == "*nat";
+      continue;
+    }
+    std::string comment;
+    if (!in_nat_table ||
+        !base::StartsWith(line, std::string("-A ") + kPortForwardChainPrefix,
+                          base::CompareCase::SENSITIVE) ||
+        !RuleComment(line, &comment) ||
+        !base::EndsWith(comment, flag, base::CompareCase::SENSITIVE)) {
+      continue;
+    }
+    firewalld::ProtocolEnum protocol;
+    uint16_t port;
+    std::string interface;
+    firewalld::HoleOptions options;
+    size_t start = line.find(target);
+    if (!ParseHoleTag(comment.substr(0, comment.size() - flag.size()),
+                      &protocol, &port, &interface, &options) ||
+        !(options == firewalld::HoleOptions()) || interface.empty() ||
+        start == std::string::npos) {
+      continue;
+    }
+    start += target.size();
+    const std::string destination =
+        line.substr(start, line.find(' ', start) - start);
+    if (IsValidPortForwardDestination(destination)) {
+      port_forwards->insert(std::make_pair(
+          std::make_pair(protocol, std::make_pair(port, interface)),
+          destination));
+    }
+  }
+}
+
+// Returns the comment of the rules locking VPN users down to |interface|.
+std::string LockdownTag(const std::string& interface) {
+  return std::string(kRuleTag) + ":" + kLockdownTag + ":" + interface;
+}
+
+// Returns the interface the lockdown rules tagged in the OUTPUT chain of the
+// filter table of |dump|, the output of 'iptables-save', lock VPN users down
+// to, if there are any.
+bool ParseTaggedLockdown(const std::string& dump, std::string* interface) {
+  const std::string prefix = LockdownTag("");
+  bool in_filter_table = false;
+  for (const auto& line : base::SplitString(dump, "\n", base::TRIM_WHITESPACE,
+                                            base::SPLIT_WANT_NONEMPTY)) {
+    if (line[0] == '*') {
+      in_filter_table = line == "*filter";
+      continue;
+    }
+    std::string comment;
+    if (!in_filter_table ||
+        !base::StartsWith(line, "-A OUTPUT ", base::CompareCase::SENSITIVE) ||
+        !RuleComment(line, &comment) ||
+        !base::StartsWith(comment, prefix, base::CompareCase::SENSITIVE)) {
+      continue;
+    }
+    const std::string tagged = comment.substr(prefix.size());
+    if (!tagged.empty() && IsValidInterfaceName(tagged)) {
+      *interface = tagged;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the match and target, i.e. everything but the command and chain,
+// of the INPUT rule that accepts |protocol| traffic to |port| on |interface|.
+std::vector<std::string> AcceptRuleSpec(firewalld::ProtocolEnum protocol,
+                                        uint16_t port,
+                                        const std::string& interface) {
+  std::vector<std::string> spec;
+  spec.push_back("-p");  // protocol
+  spec.push_back(protocol == firewalld::kProtocolTcp ? "tcp" : "udp");
+  spec.push_back("--dport");  // destination port
+  spec.push_back(std::to_string(port));
+  if (!interface.empty()) {
+    spec.push_back("-i");  // interface
+    spec.push_back(interface);
+  }
+  spec.push_back("-m");
+  spec.push_back("comment");
+  spec.push_back("--comment");
+  spec.push_back(std::string());
+  AppendHoleTag(protocol, port, interface, firewalld::HoleOptions(),
+                &spec.back());
+  spec.push_back("-j");
+  spec.push_back("ACCEPT");
+  return spec;
+}
+
+// Appends to |name| the name of the hashlimit table of a rate-limited hole,
+// which has to be unique per hole and fit in 15 characters: "fw", the
+// protocol, the port and a hash of the interface.
+void AppendHashLimitName(firewalld::ProtocolEnum protocol,
+                         uint16_t port,
+                         const std::string& interface,
+                         std::string* name) {
+  // 32-bit FNV-1a.
+  uint32_t hash = 2166136261u;
+  for (unsigned char c : interface) {
+    hash = (hash ^ c) * 16777619u;
+  }
+  base::StringAppendF(name, "fw%c%u_%06x",
+                      protocol == firewalld::kProtocolTcp ? 't' : 'u', port,
+                      hash & 0xffffff);
+}
+
+// Handoff state of a hole: everything but the protocol. The rules are handed
+// over as rendered, so that the new instance deletes exactly the rules the
+// old one added, even if it renders them differently.
+void WriteHole(const firewalld::IpTables::Hole& hole,
+               const firewalld::IpTables::HoleRecord& record,
+               base::Pickle* pickle) {
+  const firewalld::HoleOptions& options = record.options;
+  pickle->WriteUInt16(hole.first);
+  pickle->WriteString(hole.second);
+  pickle->WriteBool(options.notrack);
+  pickle->WriteBool(options.synproxy);
+  pickle->WriteUInt32(options.rate_limit);
+  pickle->WriteUInt32(options.rate_limit_burst);
+  pickle->WriteBool(options.rate_limit_connections);
+  pickle->WriteBool(options.egress);
+  pickle->WriteString(options.cgroup);
+  pickle->WriteInt64(options.uid);
+  pickle->WriteString(record.rules.filter);
+  pickle->WriteString(record.rules.raw);
+}
+
+bool ReadHole(base::PickleIterator* iterator,
+              firewalld::IpTables::Hole* hole,
+              firewalld::IpTables::HoleRecord* record) {
+  firewalld::HoleOptions* options = &record->options;
+  return iterator->ReadUInt16(&hole->first) &&
+         iterator->ReadString(&hole->second) &&
+         iterator->ReadBool(&options->notrack) &&
+         iterator->ReadBool(&options->synproxy) &&
+         iterator->ReadUInt32(&options->rate_limit) &&
+         iterator->ReadUInt32(&options->rate_limit_burst) &&
+         iterator->ReadBool(&options->rate_limit_connections) &&
+         iterator->ReadBool(&options->egress) &&
+         iterator->ReadString(&options->cgroup) &&
+         iterator->ReadInt64(&options->uid) &&
+         iterator->ReadString(&record->rules.filter) &&
+         iterator->ReadString(&record->rules.raw);
+}
+
+// Adds the rules a hole with |options| has in each IP version, keyed by
+// "<table>.<chain>", to |rules|. Mirrors |RuleBatch::AddHole|; holes without
+// options have the same single INPUT rule when added with 'iptables'.
+void CountHoleRules(const firewalld::HoleOptions& options,
+                    std::map<std::string, int64_t>* rules) {
+  if (options.egress) {
+    (*rules)["filter.OUTPUT"]++;
+    return;
+  }
+  int64_t& input = (*rules)["filter.INPUT"];
+  if (options.rate_limit == 0) {
+    input++;
+  } else {
+    input += options.rate_limit_connections ? 3 : 2;
+  }
+  if (options.notrack) {
+    (*rules)["filter.OUTPUT"]++;
+    (*rules)["raw.PREROUTING"]++;
+    (*rules)["raw.OUTPUT"]++;
+  }
+  if (options.synproxy) {
+    input += 2;
+    (*rules)["raw.PREROUTING"]++;
+  }
+}
+
+// Returns what the children reaped since |before| was taken used. Only the
+// largest resident set of any child is known, so it is left out unless that
+// child is one of them.
+struct rusage ChildrenUsageSince(const struct rusage& before) {
+  struct rusage after;
+  getrusage(RUSAGE_CHILDREN, &after);
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  timersub(&after.ru_utime, &before.ru_utime, &usage.ru_utime);
+  timersub(&after.ru_stime, &before.ru_stime, &usage.ru_stime);
+  if (after.ru_maxrss > before.ru_maxrss) {
+    usage.ru_maxrss = after.ru_maxrss;
+  }
+  usage.ru_minflt = after.ru_minflt - before.ru_minflt;
+  usage.ru_majflt = after.ru_majflt - before.ru_majflt;
+  return usage;
+}
+
+minijail* NewNonRootJail(brillo::Minijail* m, uint64_t capmask) {
+  minijail* jail = m->New();
+#if !defined(__ANDROID__)
+  // TODO(garnold) This needs to be re-enabled once we figure out which
+  // unprivileged user we want to use.
+  m->DropRoot(jail, kUnprivilegedUser, kUnprivilegedUser);
+#endif  // __ANDROID__
+  m->UseCapabilities(jail, capmask);
+  return jail;
+}
+
 bool RunForAllArguments(const IpTablesCallback& iptables_cmd,
                         const std::vector<std::string>& arguments,
                         bool add) {
@@ -101,43 +605,524 @@ bool RunForAllArguments(const IpTablesCallback& iptables_cmd,
 
 namespace firewalld {
 
-IpTables::IpTables() {
+bool ParseHoleOptions(const brillo::VariantDictionary& dictionary,
+                      ProtocolEnum protocol,
+                      HoleOptions* options) {
+  for (const auto& option : dictionary) {
+    if (protocol == kProtocolUdp && option.first == kHoleOptionNoTrack &&
+        option.second.IsTypeCompatible<bool>()) {
+      options->notrack = option.second.Get<bool>();
+    } else if (protocol == kProtocolTcp &&
+               option.first == kHoleOptionSynProxy &&
+               option.second.IsTypeCompatible<bool>()) {
+      options->synproxy = option.second.Get<bool>();
+    } else if (option.first == kHoleOptionRateLimit &&
+               option.second.IsTypeCompatible<uint32_t>()) {
+      options->rate_limit = option.second.Get<uint32_t>();
+    } else if (option.first == kHoleOptionRateLimitBurst &&
+               option.second.IsTypeCompatible<uint32_t>()) {
+      options->rate_limit_burst = option.second.Get<uint32_t>();
+    } else if (option.first == kHoleOptionRateLimitConnections &&
+               option.second.IsTypeCompatible<bool>()) {
+      options->rate_limit_connections = option.second.Get<bool>();
+    } else if (option.first == kHoleOptionCgroup &&
+               option.second.IsTypeCompatible<std::string>()) {
+      options->cgroup = option.second.Get<std::string>();
+    } else if (option.first == kHoleOptionUid &&
+               option.second.IsTypeCompatible<uint32_t>()) {
+      options->uid = option.second.Get<uint32_t>();
+    } else {
+      LOG(ERROR) << "Invalid " << (protocol == kProtocolTcp ? "TCP" : "UDP")
+                 << " hole option '" << option.first << "'";
+      return false;
+    }
+  }
+
+  if (options->rate_limit > kMaxRateLimit) {
+    LOG(ERROR) << "Rate limit " << options->rate_limit
+               << " is over the maximum of " << kMaxRateLimit;
+    return false;
+  }
+  if (options->rate_limit == 0 &&
+      (options->rate_limit_burst != 0 || options->rate_limit_connections)) {
+    LOG(ERROR) << "Rate limit options given without a rate limit";
+    return false;
+  }
+  if (options->rate_limit_connections && options->notrack) {
+    // Untracked traffic never shows up as new connections.
+    LOG(ERROR) << "Connection rate limits need connection tracking";
+    return false;
+  }
+  if (!options->cgroup.empty() && options->uid >= 0) {
+    LOG(ERROR) << "Holes are scoped to a cgroup or to a UID, not both";
+    return false;
+  }
+  if (!options->cgroup.empty() && !IsValidCgroupPath(options->cgroup)) {
+    LOG(ERROR) << "Invalid cgroup path '" << options->cgroup << "'";
+    return false;
+  }
+  return true;
+}
+
+// The rules of a batch of holes, grouped by table for 'iptables-restore'. The
+// batch refers to the rules rendered in the holes' records rather than
+// rendering them again, so that once |input_| has grown to the usual batch
+// size, the 'iptables-restore' input for a batch neither formats nor
+// allocates.
+class IpTables::RuleBatch {
+ public:
+  RuleBatch() = default;
+
+  // Starts a new batch, releasing buffers a large previous batch left behind.
+  void Clear();
+
+  // Renders the rules of a hole into |rules|. Rules are inserted at the top
+  // of their chain one after the other, so they end up in reverse order.
+  void Render(ProtocolEnum protocol,
+              uint16_t port,
+              const std::string& interface,
+              const HoleOptions& options,
+              RenderedRules* rules);
+
+  // Adds the rules of a hole, adding them to the IPv6 batch as well if
+  // |ip6|. |rules| must stay valid until the batch is cleared.
+  void AddHole(const RenderedRules& rules, bool ip6);
+
+  bool IsEmpty(bool ip6) const { return holes(ip6).empty(); }
+
+  // Returns the 'iptables-restore' input that adds or deletes the IPv4 or
+  // IPv6 rules, which is valid until the next call. The filter table comes
+  // first so that a failure never leaves untracked traffic without the rules
+  // accepting it.
+  const std::string& RestoreInput(bool ip6, bool add);
+
+ private:
+  const std::vector<const RenderedRules*>& holes(bool ip6) const {
+    return ip6 ? ip6_holes_ : holes_;
+  }
+
+  void AddRule(std::string* rules,
+               std::initializer_list<base::StringPiece> pieces);
+  void AppendTable(const char* table,
+                   std::string RenderedRules::*table_rules,
+                   bool ip6,
+                   bool add);
+
+  std::vector<const RenderedRules*> holes_;
+  std::vector<const RenderedRules*> ip6_holes_;
+  std::string input_;
+
+  // Pieces shared by the rules of the hole being rendered.
+  std::string match_;
+  std::string reply_match_;
+  std::string comment_;
+  std::string hashlimit_;
+
+  DISALLOW_COPY_AND_ASSIGN(RuleBatch);
+};
+
+void IpTables::RuleBatch::Clear() {
+  if (input_.capacity() > kMaxRetainedRuleBatchSize) {
+    std::string().swap(input_);
+    std::vector<const RenderedRules*>().swap(holes_);
+    std::vector<const RenderedRules*>().swap(ip6_holes_);
+  }
+  input_.clear();
+  holes_.clear();
+  ip6_holes_.clear();
+}
+
+void IpTables::RuleBatch::Render(ProtocolEnum protocol,
+                                 uint16_t port,
+                                 const std::string& interface,
+                                 const HoleOptions& options,
+                                 RenderedRules* rules) {
+  rules->filter.clear();
+  rules->raw.clear();
+  const char* sprotocol = protocol == kProtocolTcp ? "tcp" : "udp";
+  match_.clear();
+  base::StringAppendF(&match_, "-p %s --dport %u", sprotocol, port);
+  comment_.assign(" -m comment --comment ");
+  AppendHoleTag(protocol, port, interface, options, &comment_);
+  if (!interface.empty()) {
+    match_ += options.egress ? " -o " : " -i ";
+    match_ += interface;
+  }
+
+  if (options.egress) {
+    // Replies come back through the ESTABLISHED rule of the base ruleset.
+    AddRule(&rules->filter, {"OUTPUT ", match_, comment_, " -j ACCEPT"});
+    return;
+  }
+  if (options.rate_limit == 0) {
+    AddRule(&rules->filter, {"INPUT ", match_, comment_, " -j ACCEPT"});
+  } else {
+    // Traffic within the limit is accepted and the rest dropped, rather than
+    // left to the rules below, which may accept it anyway.
+    base::StringPiece connection_match;
+    if (options.rate_limit_connections) {
+      // Packets of accepted connections go through unlimited.
+      AddRule(&rules->filter, {"INPUT ", match_, comment_, " -j ACCEPT"});
+      connection_match = " -m conntrack --ctstate NEW";
+    }
+    AddRule(&rules->filter,
+            {"INPUT ", match_, connection_match, comment_, " -j DROP"});
+    hashlimit_.clear();
+    base::StringAppendF(
+        &hashlimit_,
+        " -m hashlimit --hashlimit-upto %u/sec --hashlimit-burst %u "
+        "--hashlimit-mode srcip --hashlimit-name ",
+        options.rate_limit, options.rate_limit_burst
+                                ? options.rate_limit_burst
+                                : kDefaultRateLimitBurst);
+    AppendHashLimitName(protocol, port, interface, &hashlimit_);
+    AddRule(&rules->filter, {"INPUT ", match_, connection_match, comment_,
+                             hashlimit_, " -j ACCEPT"});
+  }
+  if (options.notrack) {
+    // Untracked replies don't match the ESTABLISHED rules, so let them out
+    // explicitly.
+    reply_match_.clear();
+    base::StringAppendF(&reply_match_, "-p %s --sport %u", sprotocol, port);
+    if (!interface.empty()) {
+      reply_match_ += " -o ";
+      reply_match_ += interface;
+    }
+    AddRule(&rules->filter,
+            {"OUTPUT ", reply_match_, comment_, " -j ACCEPT"});
+    AddRule(&rules->raw,
+            {"PREROUTING ", match_, comment_, " -j CT --notrack"});
+    AddRule(&rules->raw,
+            {"OUTPUT ", reply_match_, comment_, " -j CT --notrack"});
+  }
+  if (options.synproxy) {
+    // SYNs skip conntrack and get a cookie from SYNPROXY, which only opens
+    // the connection to the listener once the handshake completes. The
+    // ACCEPT rule above then lets the established connection through.
+    AddRule(&rules->filter, {"INPUT ", match_, comment_,
+                             " -m conntrack --ctstate INVALID -j DROP"});
+    AddRule(&rules->filter,
+            {"INPUT ", match_, comment_,
+             " -m conntrack --ctstate INVALID,UNTRACKED -j SYNPROXY ",
+             kSynProxyOptions});
+    AddRule(&rules->raw, {"PREROUTING ", match_,
+                          " --tcp-flags FIN,SYN,RST,ACK SYN", comment_,
+                          " -j CT --notrack"});
+  }
+}
+
+void IpTables::RuleBatch::AddHole(const RenderedRules& rules, bool ip6) {
+  holes_.push_back(&rules);
+  if (ip6) {
+    ip6_holes_.push_back(&rules);
+  }
+}
+
+void IpTables::RuleBatch::AddRule(
+    std::string* rules,
+    std::initializer_list<base::StringPiece> pieces) {
+  for (const auto& piece : pieces) {
+    piece.AppendToString(rules);
+  }
+  *rules += '\n';
+}
+
+const std::string& IpTables::RuleBatch::RestoreInput(bool ip6, bool add) {
+  input_.clear();
+  AppendTable("filter", &RenderedRules::filter, ip6, add);
+  AppendTable("raw", &RenderedRules::raw, ip6, add);
+  return input_;
+}
+
+void IpTables::RuleBatch::AppendTable(const char* table,
+                                      std::string RenderedRules::*table_rules,
+                                      bool ip6,
+                                      bool add) {
+  const size_t table_start = input_.size();
+  input_ += '*';
+  input_ += table;
+  input_ += '\n';
+  const size_t rules_start = input_.size();
+  for (const RenderedRules* rules : holes(ip6)) {
+    const std::string& lines = rules->*table_rules;
+    size_t line = 0;
+    while (line < lines.size()) {
+      size_t next = lines.find('\n', line) + 1;
+      input_ += add ? "-I " : "-D ";
+      input_.append(lines, line, next - line);
+      line = next;
+    }
+  }
+  if (input_.size() == rules_start) {
+    input_.resize(table_start);
+    return;
+  }
+  input_ += "COMMIT\n";
+}
+
+IpTables::IpTables() : rule_batch_(new RuleBatch()) {
 }
 
 IpTables::~IpTables() {
   // Plug all holes when destructed.
   PlugAllHoles();
+  RemoveAllPortForwards();
 }
 
 bool IpTables::PunchTcpHole(uint16_t in_port, const std::string& in_interface) {
-  return PunchHole(in_port, in_interface, &tcp_holes_, kProtocolTcp);
+  return PunchHole(in_port, in_interface, HoleOptions(), &tcp_holes_,
+                   kProtocolTcp);
 }
 
 bool IpTables::PunchUdpHole(uint16_t in_port, const std::string& in_interface) {
-  return PunchHole(in_port, in_interface, &udp_holes_, kProtocolUdp);
+  return PunchHole(in_port, in_interface, HoleOptions(), &udp_holes_,
+                   kProtocolUdp);
+}
+
+bool IpTables::PunchTcpHoleWithOptions(
+    uint16_t in_port,
+    const std::string& in_interface,
+    const brillo::VariantDictionary& in_options) {
+  HoleOptions options;
+  if (!ParseHoleOptions(in_options, kProtocolTcp, &options)) {
+    return false;
+  }
+  return PunchHole(in_port, in_interface, options, &tcp_holes_, kProtocolTcp);
+}
+
+bool IpTables::PunchUdpHoleWithOptions(
+    uint16_t in_port,
+    const std::string& in_interface,
+    const brillo::VariantDictionary& in_options) {
+  HoleOptions options;
+  if (!ParseHoleOptions(in_options, kProtocolUdp, &options)) {
+    return false;
+  }
+  return PunchHole(in_port, in_interface, options, &udp_holes_, kProtocolUdp);
 }
 
 bool IpTables::PlugTcpHole(uint16_t in_port, const std::string& in_interface) {
-  return PlugHole(in_port, in_interface, &tcp_holes_, kProtocolTcp);
+  if (!PlugHole(in_port, in_interface, &tcp_holes_, kProtocolTcp)) {
+    return false;
+  }
+  FlushConntrack({std::make_pair(kProtocolTcp, Hole(in_port, in_interface))});
+  return true;
 }
 
 bool IpTables::PlugUdpHole(uint16_t in_port, const std::string& in_interface) {
-  return PlugHole(in_port, in_interface, &udp_holes_, kProtocolUdp);
+  if (!PlugHole(in_port, in_interface, &udp_holes_, kProtocolUdp)) {
+    return false;
+  }
+  FlushConntrack({std::make_pair(kProtocolUdp, Hole(in_port, in_interface))});
+  return true;
+}
+
+bool IpTables::PunchTcpEgressHole(uint16_t in_port,
+                                  const std::string& in_interface) {
+  HoleOptions options;
+  options.egress = true;
+  return PunchHole(in_port, in_interface, options, &tcp_egress_holes_,
+                   kProtocolTcp);
+}
+
+bool IpTables::PunchUdpEgressHole(uint16_t in_port,
+                                  const std::string& in_interface) {
+  HoleOptions options;
+  options.egress = true;
+  return PunchHole(in_port, in_interface, options, &udp_egress_holes_,
+                   kProtocolUdp);
+}
+
+bool IpTables::PlugTcpEgressHole(uint16_t in_port,
+                                 const std::string& in_interface) {
+  return PlugHole(in_port, in_interface, &tcp_egress_holes_, kProtocolTcp);
+}
+
+bool IpTables::PlugUdpEgressHole(uint16_t in_port,
+                                 const std::string& in_interface) {
+  return PlugHole(in_port, in_interface, &udp_egress_holes_, kProtocolUdp);
 }
 
 bool IpTables::RequestVpnSetup(const std::vector<std::string>& usernames,
                                const std::string& interface) {
-  return ApplyVpnSetup(usernames, interface, true /* add */);
+  return RequestVpnSetupWithOptions(usernames, interface,
+                                    brillo::VariantDictionary());
+}
+
+bool IpTables::RequestVpnSetupWithOptions(
+    const std::vector<std::string>& usernames,
+    const std::string& interface,
+    const brillo::VariantDictionary& options) {
+  bool lockdown = false;
+  for (const auto& option : options) {
+    if (option.first == kVpnOptionLockdown &&
+        option.second.IsTypeCompatible<bool>()) {
+      lockdown = option.second.Get<bool>();
+    } else {
+      LOG(ERROR) << "Invalid VPN option '" << option.first << "'";
+      return false;
+    }
+  }
+
+  // Lock the users down before routing them, so that none of their traffic
+  // gets out while the setup is applied.
+  bool locked_down = false;
+  if (lockdown && lockdown_interface_ != interface) {
+    if (!lockdown_interface_.empty()) {
+      LOG(ERROR) << "VPN users are already locked down to interface "
+                 << lockdown_interface_;
+      return false;
+    }
+    if (!SetVpnLockdown(interface, true /* enable */)) {
+      return false;
+    }
+    locked_down = true;
+  }
+
+  if (!ApplyVpnSetup(usernames, interface, true /* add */)) {
+    if (locked_down) {
+      SetVpnLockdown(interface, false /* disable */);
+    }
+    return false;
+  }
+  vpn_setups_[interface]++;
+  vpn_user_count_ += usernames.size();
+  return true;
 }
 
 bool IpTables::RemoveVpnSetup(const std::vector<std::string>& usernames,
                               const std::string& interface) {
-  return ApplyVpnSetup(usernames, interface, false /* delete */);
+  bool success = ApplyVpnSetup(usernames, interface, false /* delete */);
+  vpn_user_count_ = std::max<int64_t>(vpn_user_count_ - usernames.size(), 0);
+
+  auto setups = vpn_setups_.find(interface);
+  if (setups != vpn_setups_.end() && --setups->second == 0) {
+    vpn_setups_.erase(setups);
+    if (interface == lockdown_interface_ &&
+        !SetVpnLockdown(interface, false /* disable */)) {
+      success = false;
+    }
+  }
+  return success;
+}
+
+bool IpTables::AddPortForward(ProtocolEnum protocol,
+                              const std::string& interface,
+                              uint16_t port,
+                              const std::string& destination) {
+  if (port == 0 || interface.empty() || !IsValidInterfaceName(interface)) {
+    LOG(ERROR) << "Invalid port " << port << " or interface '" << interface
+               << "' to forward";
+    return false;
+  }
+  if (!IsValidPortForwardDestination(destination)) {
+    LOG(ERROR) << "Invalid port forward destination '" << destination << "'";
+    return false;
+  }
+
+  const ProtocolHole forward =
+      std::make_pair(protocol, std::make_pair(port, interface));
+  auto existing = port_forwards_.find(forward);
+  if (existing != port_forwards_.end()) {
+    if (existing->second != destination) {
+      LOG(ERROR) << "Port " << port << " on interface '" << interface
+                 << "' is already forwarded to " << existing->second;
+      return false;
+    }
+    return true;
+  }
+
+  LOG(INFO) << "Forwarding " << (protocol == kProtocolTcp ? "TCP" : "UDP")
+            << " port " << port << " on interface '" << interface << "' to "
+            << destination;
+  // The forwarded traffic has to get past the XDP program to be DNATed.
+  if (!AddXdpHole(forward)) {
+    LOG(ERROR) << "Adding port forward to the XDP filter failed.";
+    return false;
+  }
+  if (!ApplyPortForward(protocol, interface, port, destination,
+                        true /* add */)) {
+    RemoveXdpHole(forward);
+    return false;
+  }
+  port_forwards_[forward] = destination;
+  port_forward_counts_[interface]++;
+  return true;
+}
+
+bool IpTables::RemovePortForward(ProtocolEnum protocol,
+                                 const std::string& interface,
+                                 uint16_t port,
+                                 const std::string& destination) {
+  auto existing = port_forwards_.find(
+      std::make_pair(protocol, std::make_pair(port, interface)));
+  if (existing == port_forwards_.end() || existing->second != destination) {
+    LOG(ERROR) << "Port " << port << " on interface '" << interface
+               << "' is not forwarded to " << destination;
+    return false;
+  }
+
+  LOG(INFO) << "Removing forward of "
+            << (protocol == kProtocolTcp ? "TCP" : "UDP") << " port " << port
+            << " on interface '" << interface << "'";
+  if (!ApplyPortForward(protocol, interface, port, destination,
+                        false /* delete */)) {
+    return false;
+  }
+  RemoveXdpHole(existing->first);
+  port_forwards_.erase(existing);
+  if (--port_forward_counts_[interface] == 0) {
+    port_forward_counts_.erase(interface);
+  }
+  return true;
+}
+
+void IpTables::RemoveAllPortForwards() {
+  // Copy the container so that we can remove elements from the original.
+  const std::map<ProtocolHole, std::string> port_forwards = port_forwards_;
+  for (const auto& forward : port_forwards) {
+    RemovePortForward(forward.first.first, forward.first.second.second,
+                      forward.first.second.first, forward.second);
+  }
+  if (!port_forwards_.empty()) {
+    LOG(ERROR) << "Failed to remove " << port_forwards_.size()
+               << " port forwards.";
+    port_forwards_.clear();
+    port_forward_counts_.clear();
+  }
+}
+
+bool IpTables::ApplyPortForward(ProtocolEnum protocol,
+                                const std::string& interface,
+                                uint16_t port,
+                                const std::string& destination,
+                                bool add) {
+  auto count = port_forward_counts_.find(interface);
+  const bool first_or_last =
+      add ? count == port_forward_counts_.end() : count->second == 1;
+  const std::string chain = PortForwardChain(interface);
+
+  std::string input = "*nat\n";
+  if (add && first_or_last) {
+    input += ":" + chain + " - [0:0]\n";
+  }
+  input += add ? "-A " : "-D ";
+  input += PortForwardRule(protocol, interface, port, destination) + "\n";
+  if (first_or_last) {
+    input += add ? "-I" : "-D";
+    input += " PREROUTING -i " + interface + " -j " + chain + "\n";
+  }
+  if (!add && first_or_last) {
+    input += "-X " + chain + "\n";
+  }
+  input += "COMMIT\n";
+  return RunRestore(kIpTablesRestorePath, input);
 }
 
 bool IpTables::PunchHole(uint16_t port,
                          const std::string& interface,
-                         std::set<Hole>* holes,
+                         const HoleOptions& options,
+                         HoleMap* holes,
                          ProtocolEnum protocol) {
   if (port == 0) {
     // Port 0 is not a valid TCP/UDP port.
@@ -150,119 +1135,1422 @@ bool IpTables::PunchHole(uint16_t port,
   }
 
   Hole hole = std::make_pair(port, interface);
-  if (holes->find(hole) != holes->end()) {
+  auto existing = holes->find(hole);
+  if (existing != holes->end()) {
     // We have already punched a hole for |port| on |interface|.
-    // Be idempotent: do nothing and succeed.
+    // Be idempotent: do nothing and succeed, unless the hole was punched with
+    // different options.
+    if (!(existing->second.options == options)) {
+      LOG(ERROR) << "Hole for port " << port << " on interface '" << interface
+                 << "' already punched with different options";
+      return false;
+    }
+    // Punching an orphaned hole again claims it.
+    GetOrphanedHoles(options.egress)->erase(std::make_pair(protocol, hole));
     return true;
   }
 
   std::string sprotocol = protocol == kProtocolTcp ? "TCP" : "UDP";
-  LOG(INFO) << "Punching hole for " << sprotocol << " port " << port
-            << " on interface '" << interface << "'";
-  if (!AddAcceptRules(protocol, port, interface)) {
+  LOG(INFO) << "Punching " << (options.egress ? "egress " : "")
+            << "hole for " << sprotocol << " port " << port
+            << " on interface '" << interface << "'"
+            << (options.notrack ? " without connection tracking" : "")
+            << (options.synproxy ? " behind SYNPROXY" : "");
+  if (HasScopeConflict(protocol, port, options)) {
+    return false;
+  }
+  if (options.synproxy && !DisableTcpLooseForSynProxy()) {
+    return false;
+  }
+  // The scope is in place before the port opens.
+  if (!AddAppScope(protocol, port, options)) {
+    LOG(ERROR) << "Scoping hole to its app failed.";
+    return false;
+  }
+  HoleRecord record = NewHoleRecord(protocol, port, interface, options);
+  if (!AddAcceptRules(protocol, port, interface, record)) {
     // If the 'iptables' command fails, this method fails.
     LOG(ERROR) << "Adding ACCEPT rules failed.";
+    RemoveAppScope(protocol, port, options);
+    return false;
+  }
+  if (!options.egress && !AddXdpHole(std::make_pair(protocol, hole))) {
+    // The XDP program would drop the hole's traffic.
+    LOG(ERROR) << "Adding hole to the XDP filter failed.";
+    DeleteAcceptRules(protocol, port, interface, record);
+    RemoveAppScope(protocol, port, options);
+    return false;
+  }
+
+  // Track the hole we just punched.
+  holes->insert(std::make_pair(hole, std::move(record)));
+
+  return true;
+}
+
+bool IpTables::PlugHole(uint16_t port,
+                        const std::string& interface,
+                        HoleMap* holes,
+                        ProtocolEnum protocol) {
+  if (port == 0) {
+    // Port 0 is not a valid TCP/UDP port.
+    return false;
+  }
+
+  Hole hole = std::make_pair(port, interface);
+  auto existing = holes->find(hole);
+
+  if (existing == holes->end()) {
+    // There is no firewall hole for |port| on |interface|.
+    // Even though this makes |PlugHole| not idempotent,
+    // and Punch/Plug not entirely symmetrical, fail. It might help catch bugs.
+    return false;
+  }
+
+  const bool egress = existing->second.options.egress;
+  std::string sprotocol = protocol == kProtocolTcp ? "TCP" : "UDP";
+  LOG(INFO) << "Plugging " << (egress ? "egress " : "") << "hole for "
+            << sprotocol << " port " << port << " on interface '" << interface
+            << "'";
+  if (!DeleteAcceptRules(protocol, port, interface, existing->second)) {
+    // If the 'iptables' command fails, this method fails.
+    LOG(ERROR) << "Deleting ACCEPT rules failed.";
+    return false;
+  }
+  // A hole left in the XDP filter only lets packets on to the INPUT chain,
+  // which drops them now.
+  if (!egress) {
+    RemoveXdpHole(std::make_pair(protocol, hole));
+  }
+
+  RemoveAppScope(protocol, port, existing->second.options);
+
+  // Stop tracking the hole we just plugged.
+  holes->erase(existing);
+  GetOrphanedHoles(egress)->erase(std::make_pair(protocol, hole));
+  RestoreTcpLooseIfUnused();
+
+  return true;
+}
+
+std::vector<bool> IpTables::PunchHolesInBatch(
+    const std::vector<HoleRequest>& requests) {
+  std::vector<bool> results(requests.size(), false);
+
+  // Requests for holes that aren't punched yet, sorted so that the requests
+  // for a hole follow each other in the order they came in.
+  struct NewHole {
+    ProtocolHole hole;
+    HoleOptions options;
+    // Rendered for the first request of each hole only.
+    RenderedRules rules;
+    size_t request;
+  };
+  std::vector<NewHole> new_holes;
+  new_holes.reserve(requests.size());
+  for (size_t i = 0; i < requests.size(); i++) {
+    const HoleRequest& request = requests[i];
+    HoleOptions options;
+    if (!ParseHoleOptions(request.options, request.protocol, &options)) {
+      continue;
+    }
+    if (request.egress) {
+      if (!options.IsDefault()) {
+        LOG(ERROR) << "Egress holes take no options";
+        continue;
+      }
+      options.egress = true;
+    }
+    HoleMap* holes = GetHoleMap(request.protocol, request.egress);
+    if (options.IsScoped() &&
+        std::any_of(new_holes.begin(), new_holes.end(),
+                    [&request](const NewHole& new_hole) {
+                      return !new_hole.options.egress &&
+                             new_hole.hole.first == request.protocol &&
+                             new_hole.hole.second.first == request.port;
+                    })) {
+      LOG(ERROR) << "Port " << request.port << " is being opened to every "
+                 << "app";
+      continue;
+    }
+    // Holes scoped to an app are punched one at a time, so that the scope
+    // of each is in place before its port opens.
+    if (request.port == 0 || !IsValidInterfaceName(request.interface) ||
+        holes->find(Hole(request.port, request.interface)) != holes->end() ||
+        options.IsScoped()) {
+      // Nothing to batch; validation and idempotence work as usual.
+      results[i] = PunchHole(request.port, request.interface, options, holes,
+                             request.protocol);
+      continue;
+    }
+    if (HasScopeConflict(request.protocol, request.port, options)) {
+      continue;
+    }
+    NewHole new_hole;
+    new_hole.hole = ProtocolHole(request.protocol,
+                                 Hole(request.port, request.interface));
+    new_hole.options = options;
+    new_hole.request = i;
+    new_holes.push_back(new_hole);
+  }
+  // An egress hole and an incoming one on the same port are different holes.
+  auto key = [](const NewHole& new_hole) {
+    return std::tie(new_hole.options.egress, new_hole.hole);
+  };
+  std::sort(new_holes.begin(), new_holes.end(),
+            [&key](const NewHole& a, const NewHole& b) {
+              return std::make_pair(key(a), a.request) <
+                     std::make_pair(key(b), b.request);
+            });
+
+  // The first request for a hole picks its options.
+  size_t kept = 0;
+  for (size_t i = 0; i < new_holes.size(); i++) {
+    if (kept > 0 && key(new_holes[kept - 1]) == key(new_holes[i]) &&
+        !(new_holes[kept - 1].options == new_holes[i].options)) {
+      LOG(ERROR) << "Hole for port " << new_holes[i].hole.second.first
+                 << " on interface '" << new_holes[i].hole.second.second
+                 << "' requested with different options";
+      continue;
+    }
+    if (kept != i) {
+      new_holes[kept] = new_holes[i];
+    }
+    kept++;
+  }
+  new_holes.resize(kept);
+
+  bool needs_synproxy = false;
+  for (const auto& new_hole : new_holes) {
+    needs_synproxy |= new_hole.options.synproxy;
+  }
+  if (needs_synproxy && !DisableTcpLooseForSynProxy()) {
+    new_holes.erase(std::remove_if(new_holes.begin(), new_holes.end(),
+                                   [](const NewHole& new_hole) {
+                                     return new_hole.options.synproxy;
+                                   }),
+                    new_holes.end());
+  }
+  if (new_holes.empty()) {
+    return results;
+  }
+
+  auto same_hole = [&new_holes, &key](size_t i) {
+    return i > 0 && key(new_holes[i - 1]) == key(new_holes[i]);
+  };
+  size_t hole_count = 0;
+  RuleBatch* batch = rule_batch_.get();
+  batch->Clear();
+  for (size_t i = 0; i < new_holes.size(); i++) {
+    if (same_hole(i)) {
+      continue;
+    }
+    // Holes on an interface without an IPv6 address get their IPv6 rules
+    // along with the others on the interface once it gets one.
+    NewHole& new_hole = new_holes[i];
+    const ProtocolHole& hole = new_hole.hole;
+    batch->Render(hole.first, hole.second.first, hole.second.second,
+                  new_hole.options, &new_hole.rules);
+    batch->AddHole(new_hole.rules, HasIpv6Rules(hole.second.second));
+    hole_count++;
+  }
+  LOG(INFO) << "Punching " << hole_count << " firewall holes at once";
+
+  const bool batch_applied = AddBatchRules();
+  if (!batch_applied) {
+    LOG(WARNING) << "Batch punch failed, punching holes one at a time";
+  }
+
+  bool punched = false;
+  for (size_t i = 0; i < new_holes.size(); i++) {
+    NewHole& new_hole = new_holes[i];
+    if (same_hole(i)) {
+      results[new_hole.request] = punched;
+      continue;
+    }
+    ProtocolEnum protocol = new_hole.hole.first;
+    uint16_t port = new_hole.hole.second.first;
+    const std::string& interface = new_hole.hole.second.second;
+    HoleMap* holes = GetHoleMap(protocol, new_hole.options.egress);
+    HoleRecord record{new_hole.options, std::move(new_hole.rules)};
+    if (!batch_applied) {
+      // Don't let one bad hole keep the others closed.
+      punched = PunchHole(port, interface, new_hole.options, holes, protocol);
+    } else if (!new_hole.options.egress && !AddXdpHole(new_hole.hole)) {
+      LOG(ERROR) << "Adding hole to the XDP filter failed.";
+      DeleteAcceptRules(protocol, port, interface, record);
+      punched = false;
+    } else {
+      holes->insert(std::make_pair(new_hole.hole.second, std::move(record)));
+      punched = true;
+    }
+    results[new_hole.request] = punched;
+  }
+  return results;
+}
+
+bool IpTables::PunchHoleGroup(const std::vector<GroupHole>& holes,
+                              const std::string& interface) {
+  if (!IsValidInterfaceName(interface)) {
+    LOG(ERROR) << "Invalid interface name '" << interface << "'";
+    return false;
+  }
+
+  std::vector<const GroupHole*> new_holes;
+  std::vector<ProtocolHole> existing_holes;
+  bool needs_synproxy = false;
+  for (const auto& hole : holes) {
+    if (hole.port == 0) {
+      // Port 0 is not a valid TCP/UDP port.
+      return false;
+    }
+    if (hole.options.IsScoped()) {
+      LOG(ERROR) << "Holes scoped to an app can't be punched in a group";
+      return false;
+    }
+    const HoleMap& map =
+        hole.protocol == kProtocolTcp ? tcp_holes_ : udp_holes_;
+    auto existing = map.find(Hole(hole.port, interface));
+    if (existing == map.end()) {
+      if (HasScopeConflict(hole.protocol, hole.port, hole.options)) {
+        return false;
+      }
+      new_holes.push_back(&hole);
+      needs_synproxy |= hole.options.synproxy;
+    } else if (existing->second.options == hole.options) {
+      existing_holes.push_back(ProtocolHole(hole.protocol, existing->first));
+    } else {
+      LOG(ERROR) << "Hole for port " << hole.port << " on interface '"
+                 << interface << "' already punched with different options";
+      return false;
+    }
+  }
+
+  if (needs_synproxy && !DisableTcpLooseForSynProxy()) {
+    return false;
+  }
+
+  std::vector<HoleRecord> new_records;
+  new_records.reserve(new_holes.size());
+  for (const GroupHole* hole : new_holes) {
+    new_records.push_back(
+        NewHoleRecord(hole->protocol, hole->port, interface, hole->options));
+  }
+  if (!new_holes.empty()) {
+    LOG(INFO) << "Punching " << new_holes.size()
+              << " firewall holes at once on interface '" << interface << "'";
+    rule_batch_->Clear();
+    for (const auto& record : new_records) {
+      rule_batch_->AddHole(record.rules, HasIpv6Rules(interface));
+    }
+    if (!AddBatchRules()) {
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < new_holes.size(); i++) {
+    const GroupHole* hole = new_holes[i];
+    if (AddXdpHole(ProtocolHole(hole->protocol, Hole(hole->port, interface)))) {
+      continue;
+    }
+    // None of the group stays open.
+    LOG(ERROR) << "Adding hole to the XDP filter failed.";
+    for (size_t j = 0; j < new_holes.size(); j++) {
+      const GroupHole* added = new_holes[j];
+      if (j < i) {
+        RemoveXdpHole(
+            ProtocolHole(added->protocol, Hole(added->port, interface)));
+      }
+      DeleteAcceptRules(added->protocol, added->port, interface,
+                        new_records[j]);
+    }
+    return false;
+  }
+
+  for (size_t i = 0; i < new_holes.size(); i++) {
+    const GroupHole* hole = new_holes[i];
+    HoleMap* map = hole->protocol == kProtocolTcp ? &tcp_holes_ : &udp_holes_;
+    map->insert(std::make_pair(Hole(hole->port, interface),
+                               std::move(new_records[i])));
+  }
+  // Punching orphaned holes again claims them.
+  for (const auto& hole : existing_holes) {
+    orphaned_holes_.erase(hole);
+  }
+  return true;
+}
+
+bool IpTables::PlugHoleGroup(const std::vector<GroupHole>& holes,
+                             const std::string& interface) {
+  std::vector<ProtocolHole> group;
+  for (const auto& hole : holes) {
+    group.push_back(ProtocolHole(hole.protocol, Hole(hole.port, interface)));
+  }
+  LOG(INFO) << "Plugging " << group.size()
+            << " firewall holes at once on interface '" << interface << "'";
+  return PlugHolesInBatch(group, false /* egress */);
+}
+
+void IpTables::PlugAllHoles() {
+  // One batch per direction, however many holes there are.
+  for (bool egress : {false, true}) {
+    std::vector<ProtocolHole> holes;
+    for (const auto& protocol : {kProtocolTcp, kProtocolUdp}) {
+      for (const auto& hole : *GetHoleMap(protocol, egress)) {
+        holes.push_back(std::make_pair(protocol, hole.first));
+      }
+    }
+    if (holes.empty() || PlugHolesInBatch(holes, egress)) {
+      continue;
+    }
+
+    // Holes that 'iptables-restore' could not plug get one more try, with
+    // 'iptables' for the ones with default options. Copy the container so
+    // that we can remove elements from the original.
+    std::vector<ProtocolHole> plugged;
+    for (const auto& protocol : {kProtocolTcp, kProtocolUdp}) {
+      HoleMap* map = GetHoleMap(protocol, egress);
+      const HoleMap left = *map;
+      for (const auto& hole : left) {
+        if (PlugHole(hole.first.first /* port */,
+                     hole.first.second /* interface */, map, protocol) &&
+            !egress) {
+          plugged.push_back(std::make_pair(protocol, hole.first));
+        }
+      }
+    }
+    FlushConntrack(plugged);
+  }
+
+  CHECK(tcp_holes_.size() == 0) << "Failed to plug all TCP holes.";
+  CHECK(udp_holes_.size() == 0) << "Failed to plug all UDP holes.";
+  CHECK(tcp_egress_holes_.empty() && udp_egress_holes_.empty())
+      << "Failed to plug all egress holes.";
+}
+
+void IpTables::OrphanAllHoles() {
+  for (const auto& hole : tcp_holes_) {
+    orphaned_holes_.insert(std::make_pair(kProtocolTcp, hole.first));
+  }
+  for (const auto& hole : udp_holes_) {
+    orphaned_holes_.insert(std::make_pair(kProtocolUdp, hole.first));
+  }
+  for (const auto& hole : tcp_egress_holes_) {
+    orphaned_egress_holes_.insert(std::make_pair(kProtocolTcp, hole.first));
+  }
+  for (const auto& hole : udp_egress_holes_) {
+    orphaned_egress_holes_.insert(std::make_pair(kProtocolUdp, hole.first));
+  }
+  LOG(INFO) << orphaned_holes_.size() + orphaned_egress_holes_.size()
+            << " firewall holes orphaned";
+}
+
+void IpTables::ForgetAllHoles() {
+  LOG(INFO) << "Leaving "
+            << tcp_holes_.size() + udp_holes_.size() +
+                   tcp_egress_holes_.size() + udp_egress_holes_.size()
+            << " firewall holes open";
+  tcp_holes_.clear();
+  udp_holes_.clear();
+  tcp_egress_holes_.clear();
+  udp_egress_holes_.clear();
+  orphaned_holes_.clear();
+  orphaned_egress_holes_.clear();
+  if (!port_forwards_.empty()) {
+    LOG(INFO) << "Leaving " << port_forwards_.size() << " port forwards";
+  }
+  port_forwards_.clear();
+  port_forward_counts_.clear();
+  xdp_hole_counts_.clear();
+  // The SYNPROXY holes left open still need the pickup disabled.
+  conntrack_tcp_loose_disabled_ = false;
+  conntrack_tcp_loose_saved_.clear();
+}
+
+void IpTables::PlugOrphanedHoles() {
+  for (bool egress : {false, true}) {
+    const std::set<ProtocolHole>& orphaned = *GetOrphanedHoles(egress);
+    if (orphaned.empty()) {
+      continue;
+    }
+    LOG(INFO) << "Plugging " << orphaned.size() << " orphaned "
+              << (egress ? "egress " : "") << "firewall holes";
+    const std::vector<ProtocolHole> holes(orphaned.begin(), orphaned.end());
+    if (!PlugHolesInBatch(holes, egress)) {
+      LOG(ERROR) << "Failed to plug all orphaned holes.";
+    }
+  }
+}
+
+bool IpTables::ReclaimHoles(
+    const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_holes,
+    const std::vector<std::tuple<uint16_t, std::string>>& in_udp_holes) {
+  return ReclaimHolesWithEgress(in_tcp_holes, in_udp_holes, {}, {});
+}
+
+bool IpTables::ReclaimHolesWithEgress(
+    const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_holes,
+    const std::vector<std::tuple<uint16_t, std::string>>& in_udp_holes,
+    const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_egress_holes,
+    const std::vector<std::tuple<uint16_t, std::string>>&
+        in_udp_egress_holes) {
+  bool success = true;
+  std::set<ProtocolHole> unclaimed = orphaned_holes_;
+  std::set<ProtocolHole> unclaimed_egress = orphaned_egress_holes_;
+  for (const auto& hole : in_tcp_holes) {
+    success &= ReclaimHole(
+        ProtocolHole(kProtocolTcp, Hole(std::get<0>(hole), std::get<1>(hole))),
+        false /* egress */, &unclaimed);
+  }
+  for (const auto& hole : in_udp_holes) {
+    success &= ReclaimHole(
+        ProtocolHole(kProtocolUdp, Hole(std::get<0>(hole), std::get<1>(hole))),
+        false /* egress */, &unclaimed);
+  }
+  for (const auto& hole : in_tcp_egress_holes) {
+    success &= ReclaimHole(
+        ProtocolHole(kProtocolTcp, Hole(std::get<0>(hole), std::get<1>(hole))),
+        true /* egress */, &unclaimed_egress);
+  }
+  for (const auto& hole : in_udp_egress_holes) {
+    success &= ReclaimHole(
+        ProtocolHole(kProtocolUdp, Hole(std::get<0>(hole), std::get<1>(hole))),
+        true /* egress */, &unclaimed_egress);
+  }
+
+  // Everything that was asked for is claimed, whatever options it was
+  // punched with; the rest goes away.
+  for (bool egress : {false, true}) {
+    const std::set<ProtocolHole>& still_unclaimed =
+        egress ? unclaimed_egress : unclaimed;
+    for (const auto& hole : *GetOrphanedHoles(egress)) {
+      if (still_unclaimed.find(hole) == still_unclaimed.end()) {
+        LOG(INFO) << "Reclaimed " << (egress ? "egress " : "")
+                  << "hole for port " << hole.second.first
+                  << " on interface '" << hole.second.second << "'";
+      }
+    }
+  }
+  orphaned_holes_ = unclaimed;
+  orphaned_egress_holes_ = unclaimed_egress;
+  PlugOrphanedHoles();
+  return success;
+}
+
+bool IpTables::ReclaimHole(const ProtocolHole& hole,
+                           bool egress,
+                           std::set<ProtocolHole>* unclaimed) {
+  unclaimed->erase(hole);
+  HoleMap* holes = GetHoleMap(hole.first, egress);
+  if (holes->find(hole.second) != holes->end()) {
+    return true;
+  }
+  HoleOptions options;
+  options.egress = egress;
+  return PunchHole(hole.second.first, hole.second.second, options, holes,
+                   hole.first);
+}
+
+void IpTables::RestoreState() {
+  CHECK(!HasHoles()) << "State must be restored before punching holes.";
+
+  std::string dump;
+  std::map<ProtocolHole, HoleOptions> holes;
+  std::map<ProtocolHole, HoleOptions> egress_holes;
+  if (DumpRules(kIpTablesSavePath, &dump)) {
+    ParseTaggedHoles(dump, &holes, &egress_holes);
+    ParseTaggedPortForwards(dump, &port_forwards_);
+    ParseTaggedLockdown(dump, &lockdown_interface_);
+  } else {
+    LOG(ERROR) << "Could not dump IPv4 rules, not restoring holes.";
+  }
+  for (const auto& hole : holes) {
+    ProtocolEnum protocol = hole.first.first;
+    const Hole& port_interface = hole.first.second;
+    const HoleOptions& options = hole.second;
+    HoleMap* map = protocol == kProtocolTcp ? &tcp_holes_ : &udp_holes_;
+    map->insert(std::make_pair(
+        port_interface, NewHoleRecord(protocol, port_interface.first,
+                                      port_interface.second, options)));
+    // The sysctl outlives the daemon.
+    if (options.synproxy) {
+      conntrack_tcp_loose_disabled_ = true;
+    }
+    if (!AddXdpHole(hole.first)) {
+      LOG(ERROR) << "Adding restored hole for port " << port_interface.first
+                 << " to the XDP filter failed.";
+    }
+    if (!AddAppScope(protocol, port_interface.first, options)) {
+      LOG(ERROR) << "Scoping restored hole for port " << port_interface.first
+                 << " to its app failed.";
+    }
+  }
+  for (const auto& hole : egress_holes) {
+    ProtocolEnum protocol = hole.first.first;
+    const Hole& port_interface = hole.first.second;
+    GetHoleMap(protocol, true /* egress */)
+        ->insert(std::make_pair(
+            port_interface, NewHoleRecord(protocol, port_interface.first,
+                                          port_interface.second,
+                                          hole.second)));
+  }
+  if (!holes.empty() || !egress_holes.empty()) {
+    LOG(INFO) << "Restored " << holes.size() << " firewall holes and "
+              << egress_holes.size() << " egress holes";
+  }
+  for (const auto& forward : port_forwards_) {
+    port_forward_counts_[forward.first.second.second]++;
+    if (!AddXdpHole(forward.first)) {
+      LOG(ERROR) << "Adding restored port forward for port "
+                 << forward.first.second.first << " to the XDP filter failed.";
+    }
+  }
+  if (!port_forwards_.empty()) {
+    LOG(INFO) << "Restored " << port_forwards_.size() << " port forwards";
+  }
+
+  // With deferral, an interface has IPv6 rules for all of its holes or for
+  // none of them.
+  if (defer_ip6_rules_ && HasHoles()) {
+    holes.clear();
+    egress_holes.clear();
+    if (DumpRules(kIp6TablesSavePath, &dump)) {
+      ParseTaggedHoles(dump, &holes, &egress_holes);
+    } else {
+      LOG(ERROR) << "Could not dump IPv6 rules.";
+    }
+    for (const auto* restored : {&holes, &egress_holes}) {
+      for (const auto& hole : *restored) {
+        if (!hole.first.second.second.empty()) {
+          ip6_interfaces_.insert(hole.first.second.second);
+        }
+      }
+    }
+  }
+
+  // The ranges only tell which users are routed, not by how many setups, so
+  // each restored user counts once.
+  std::vector<UidRange> ranges;
+  if (uid_range_routing_ && GetUidRangeRules(&ranges) && !ranges.empty()) {
+    for (const auto& range : ranges) {
+      // Ranges that big were not made of VPN users, and are left alone.
+      if (static_cast<uint64_t>(range.last) - range.first >=
+          kMaxRestoredUidRangeSize) {
+        LOG(ERROR) << "Ignoring uidrange rule for users " << range.first
+                   << "-" << range.last << ", too many to be VPN users";
+        continue;
+      }
+      for (uint64_t uid = range.first; uid <= range.last; uid++) {
+        vpn_uids_.insert(static_cast<uid_t>(uid));
+      }
+      vpn_uid_ranges_.push_back(range);
+    }
+    LOG(INFO) << "Restored " << vpn_uids_.size() << " VPN users";
+  }
+  // A lockdown is lifted with the last setup on its interface, so it counts
+  // as one.
+  if (!lockdown_interface_.empty()) {
+    vpn_setups_[lockdown_interface_] = 1;
+    LOG(INFO) << "Restored lockdown of VPN users to interface "
+              << lockdown_interface_;
+  }
+}
+
+void IpTables::SaveState(base::Pickle* pickle) const {
+  for (const HoleMap* holes : {&tcp_holes_, &udp_holes_, &tcp_egress_holes_,
+                               &udp_egress_holes_}) {
+    pickle->WriteUInt32(holes->size());
+    for (const auto& hole : *holes) {
+      WriteHole(hole.first, hole.second, pickle);
+    }
+  }
+  for (bool egress : {false, true}) {
+    const std::set<ProtocolHole>& orphaned =
+        egress ? orphaned_egress_holes_ : orphaned_holes_;
+    pickle->WriteUInt32(orphaned.size());
+    for (const auto& hole : orphaned) {
+      pickle->WriteBool(hole.first == kProtocolTcp);
+      pickle->WriteUInt16(hole.second.first);
+      pickle->WriteString(hole.second.second);
+    }
+  }
+
+  pickle->WriteBool(ip6_enabled_);
+  pickle->WriteBool(defer_ip6_rules_);
+  pickle->WriteUInt32(ip6_interfaces_.size());
+  for (const auto& interface : ip6_interfaces_) {
+    pickle->WriteString(interface);
+  }
+  pickle->WriteUInt32(ip6_pending_interfaces_.size());
+  for (const auto& interface : ip6_pending_interfaces_) {
+    pickle->WriteString(interface);
+  }
+  pickle->WriteBool(conntrack_tcp_loose_disabled_);
+  pickle->WriteString(conntrack_tcp_loose_saved_);
+
+  pickle->WriteUInt32(vpn_uids_.size());
+  for (uid_t uid : vpn_uids_) {
+    pickle->WriteUInt32(uid);
+  }
+  pickle->WriteUInt32(vpn_uid_ranges_.size());
+  for (const auto& range : vpn_uid_ranges_) {
+    pickle->WriteUInt32(range.first);
+    pickle->WriteUInt32(range.last);
+  }
+  pickle->WriteUInt32(vpn_setups_.size());
+  for (const auto& setups : vpn_setups_) {
+    pickle->WriteString(setups.first);
+    pickle->WriteInt(setups.second);
+  }
+  pickle->WriteString(lockdown_interface_);
+  pickle->WriteInt64(vpn_user_count_);
+
+  pickle->WriteUInt32(port_forwards_.size());
+  for (const auto& forward : port_forwards_) {
+    pickle->WriteBool(forward.first.first == kProtocolTcp);
+    pickle->WriteUInt16(forward.first.second.first);
+    pickle->WriteString(forward.first.second.second);
+    pickle->WriteString(forward.second);
+  }
+}
+
+bool IpTables::AdoptState(base::PickleIterator* iterator) {
+  CHECK(!HasHoles()) << "State must be adopted before punching holes.";
+
+  HoleMap tcp_holes;
+  HoleMap udp_holes;
+  HoleMap tcp_egress_holes;
+  HoleMap udp_egress_holes;
+  for (HoleMap* holes :
+       {&tcp_holes, &udp_holes, &tcp_egress_holes, &udp_egress_holes}) {
+    uint32_t count;
+    if (!iterator->ReadUInt32(&count)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      Hole hole;
+      HoleRecord record;
+      if (!ReadHole(iterator, &hole, &record)) {
+        return false;
+      }
+      holes->insert(std::make_pair(hole, std::move(record)));
+    }
+  }
+  std::set<ProtocolHole> orphaned_holes;
+  std::set<ProtocolHole> orphaned_egress_holes;
+  uint32_t count;
+  for (bool egress : {false, true}) {
+    if (!iterator->ReadUInt32(&count)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      bool tcp;
+      Hole hole;
+      if (!iterator->ReadBool(&tcp) || !iterator->ReadUInt16(&hole.first) ||
+          !iterator->ReadString(&hole.second)) {
+        return false;
+      }
+      (egress ? orphaned_egress_holes : orphaned_holes)
+          .insert(std::make_pair(tcp ? kProtocolTcp : kProtocolUdp, hole));
+    }
+  }
+
+  bool ip6_enabled;
+  bool defer_ip6_rules;
+  std::set<std::string> ip6_interfaces;
+  if (!iterator->ReadBool(&ip6_enabled) ||
+      !iterator->ReadBool(&defer_ip6_rules) ||
+      !iterator->ReadUInt32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    std::string interface;
+    if (!iterator->ReadString(&interface)) {
+      return false;
+    }
+    ip6_interfaces.insert(interface);
+  }
+  std::set<std::string> ip6_pending_interfaces;
+  if (!iterator->ReadUInt32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    std::string interface;
+    if (!iterator->ReadString(&interface)) {
+      return false;
+    }
+    ip6_pending_interfaces.insert(interface);
+  }
+  bool conntrack_tcp_loose_disabled;
+  std::string conntrack_tcp_loose_saved;
+  if (!iterator->ReadBool(&conntrack_tcp_loose_disabled) ||
+      !iterator->ReadString(&conntrack_tcp_loose_saved)) {
+    return false;
+  }
+
+  std::multiset<uid_t> vpn_uids;
+  if (!iterator->ReadUInt32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t uid;
+    if (!iterator->ReadUInt32(&uid)) {
+      return false;
+    }
+    vpn_uids.insert(uid);
+  }
+  std::vector<UidRange> vpn_uid_ranges;
+  if (!iterator->ReadUInt32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t first;
+    uint32_t last;
+    if (!iterator->ReadUInt32(&first) || !iterator->ReadUInt32(&last)) {
+      return false;
+    }
+    vpn_uid_ranges.push_back(UidRange{first, last});
+  }
+  std::map<std::string, int> vpn_setups;
+  if (!iterator->ReadUInt32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    std::string interface;
+    int setups;
+    if (!iterator->ReadString(&interface) || !iterator->ReadInt(&setups)) {
+      return false;
+    }
+    vpn_setups[interface] = setups;
+  }
+  std::string lockdown_interface;
+  int64_t vpn_user_count;
+  if (!iterator->ReadString(&lockdown_interface) ||
+      !iterator->ReadInt64(&vpn_user_count)) {
+    return false;
+  }
+
+  std::map<ProtocolHole, std::string> port_forwards;
+  std::map<std::string, int> port_forward_counts;
+  if (!iterator->ReadUInt32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    bool tcp;
+    Hole hole;
+    std::string destination;
+    if (!iterator->ReadBool(&tcp) || !iterator->ReadUInt16(&hole.first) ||
+        !iterator->ReadString(&hole.second) ||
+        !iterator->ReadString(&destination)) {
+      return false;
+    }
+    port_forwards[std::make_pair(tcp ? kProtocolTcp : kProtocolUdp, hole)] =
+        destination;
+    port_forward_counts[hole.second]++;
+  }
+
+  tcp_holes_.swap(tcp_holes);
+  udp_holes_.swap(udp_holes);
+  tcp_egress_holes_.swap(tcp_egress_holes);
+  udp_egress_holes_.swap(udp_egress_holes);
+  orphaned_holes_.swap(orphaned_holes);
+  orphaned_egress_holes_.swap(orphaned_egress_holes);
+  ip6_enabled_ = ip6_enabled;
+  defer_ip6_rules_ = defer_ip6_rules;
+  ip6_interfaces_.swap(ip6_interfaces);
+  ip6_pending_interfaces_.swap(ip6_pending_interfaces);
+  conntrack_tcp_loose_disabled_ = conntrack_tcp_loose_disabled;
+  conntrack_tcp_loose_saved_.swap(conntrack_tcp_loose_saved);
+  vpn_uids_.swap(vpn_uids);
+  vpn_uid_ranges_.swap(vpn_uid_ranges);
+  vpn_setups_.swap(vpn_setups);
+  lockdown_interface_ = lockdown_interface;
+  vpn_user_count_ = vpn_user_count;
+  port_forwards_.swap(port_forwards);
+  port_forward_counts_.swap(port_forward_counts);
+
+  // An adopted XDP filter has the holes and port forwards already; adding
+  // them again is harmless, and fills a new one.
+  for (const auto& protocol : {kProtocolTcp, kProtocolUdp}) {
+    for (const auto& hole : *GetHoleMap(protocol, false /* egress */)) {
+      if (!AddXdpHole(ProtocolHole(protocol, hole.first))) {
+        LOG(ERROR) << "Adding adopted hole for port " << hole.first.first
+                   << " to the XDP filter failed.";
+      }
+    }
+  }
+  for (const auto& forward : port_forwards_) {
+    if (!AddXdpHole(forward.first)) {
+      LOG(ERROR) << "Adding adopted port forward for port "
+                 << forward.first.second.first << " to the XDP filter failed.";
+    }
+  }
+  // The app socket filter is never handed over.
+  for (const auto& protocol : {kProtocolTcp, kProtocolUdp}) {
+    for (const auto& hole : *GetHoleMap(protocol, false /* egress */)) {
+      if (!AddAppScope(protocol, hole.first.first, hole.second.options)) {
+        LOG(ERROR) << "Scoping adopted hole for port " << hole.first.first
+                   << " to its app failed.";
+      }
+    }
+  }
+  LOG(INFO) << "Took over "
+            << tcp_holes_.size() + udp_holes_.size() +
+                   tcp_egress_holes_.size() + udp_egress_holes_.size()
+            << " firewall holes, " << port_forwards_.size()
+            << " port forwards and " << vpn_uids_.size() << " VPN users";
+  return true;
+}
+
+std::map<std::string, int64_t> IpTables::GetGauges() const {
+  // Rules per "<table>.<chain>", for IPv4 and IPv6.
+  std::map<std::string, int64_t> rules[2];
+  for (const HoleMap* holes : {&tcp_holes_, &udp_holes_, &tcp_egress_holes_,
+                               &udp_egress_holes_}) {
+    for (const auto& hole : *holes) {
+      CountHoleRules(hole.second.options, &rules[0]);
+      if (ip6_enabled_ && HasIpv6Rules(hole.first.second)) {
+        CountHoleRules(hole.second.options, &rules[1]);
+      }
+    }
+  }
+  int64_t vpn_setups = 0;
+  for (const auto& setups : vpn_setups_) {
+    vpn_setups += setups.second;
+  }
+  for (auto& version_rules : rules) {
+    // One masquerade rule per setup, and one mark rule per user of each.
+    version_rules["nat.POSTROUTING"] += vpn_setups;
+    if (!uid_range_routing_) {
+      version_rules["mangle.OUTPUT"] += vpn_user_count_;
+    }
+    if (!lockdown_interface_.empty()) {
+      version_rules["filter.OUTPUT"] +=
+          uid_range_routing_ ? vpn_uid_ranges_.size() : 1;
+    }
+  }
+  // One jump per interface with port forwards, which are IPv4 only.
+  rules[0]["nat.PREROUTING"] += port_forward_counts_.size();
+
+  std::map<std::string, int64_t> gauges;
+  const char* const versions[] = {"ipv4", "ipv6"};
+  for (int i = 0; i < 2; i++) {
+    for (const auto& chain : rules[i]) {
+      if (chain.second > 0) {
+        gauges[std::string("rules.") + versions[i] + "." + chain.first] =
+            chain.second;
+      }
+    }
+  }
+  // Every hole is inserted ahead of the base ruleset.
+  gauges["input_depth"] =
+      std::max(rules[0]["filter.INPUT"], rules[1]["filter.INPUT"]);
+  gauges["vpn.users"] =
+      uid_range_routing_
+          ? std::set<uid_t>(vpn_uids_.begin(), vpn_uids_.end()).size()
+          : vpn_user_count_;
+  gauges["vpn.uid_ranges"] = vpn_uid_ranges_.size();
+  if (xdp_filter_) {
+    gauges["xdp.holes"] = xdp_filter_->hole_count();
+    gauges["xdp.capacity"] = XdpFilter::capacity();
+    gauges["xdp.occupancy_percent"] =
+        xdp_filter_->hole_count() * 100 / XdpFilter::capacity();
+  }
+  if (app_socket_filter_) {
+    gauges["app.holes"] = app_socket_filter_->hole_count();
+  }
+  gauges["port_forwards"] = port_forwards_.size();
+  return gauges;
+}
+
+bool IpTables::PlugHolesInBatch(const std::vector<ProtocolHole>& holes,
+                                bool egress) {
+  // The holes that are punched, and their records.
+  std::vector<std::pair<ProtocolHole, const HoleRecord*>> punched;
+  RuleBatch* batch = rule_batch_.get();
+  batch->Clear();
+  for (const auto& hole : holes) {
+    const HoleMap& map = *GetHoleMap(hole.first, egress);
+    auto existing = map.find(hole.second);
+    if (existing == map.end()) {
+      continue;
+    }
+    punched.push_back(std::make_pair(hole, &existing->second));
+    batch->AddHole(existing->second.rules,
+                   ip6_enabled_ && HasIpv6Rules(hole.second.second));
+  }
+
+  std::set<ProtocolHole> failed;
+  for (bool ip6 : {false, true}) {
+    const std::string restore_path =
+        ip6 ? kIp6TablesRestorePath : kIpTablesRestorePath;
+    if (batch->IsEmpty(ip6) ||
+        RunRestore(restore_path,
+                   batch->RestoreInput(ip6, false /* delete */))) {
+      continue;
+    }
+
+    // Don't let one bad hole keep the others open. The batch is still needed
+    // for IPv6, so each hole gets a batch of its own.
+    LOG(WARNING) << "Batch plug failed, plugging holes one at a time";
+    RuleBatch hole_batch;
+    for (const auto& hole : punched) {
+      const ProtocolHole& protocol_hole = hole.first;
+      if (ip6 &&
+          (!ip6_enabled_ || !HasIpv6Rules(protocol_hole.second.second))) {
+        continue;
+      }
+      hole_batch.Clear();
+      hole_batch.AddHole(hole.second->rules, ip6);
+      if (!RunRestore(restore_path,
+                      hole_batch.RestoreInput(ip6, false /* delete */))) {
+        failed.insert(protocol_hole);
+      }
+    }
+  }
+
+  std::vector<ProtocolHole> plugged;
+  for (const auto& hole_record : punched) {
+    const ProtocolHole& hole = hole_record.first;
+    if (failed.find(hole) != failed.end()) {
+      LOG(ERROR) << "Could not plug hole for port " << hole.second.first
+                 << " on interface '" << hole.second.second << "'";
+      continue;
+    }
+    if (!egress) {
+      RemoveXdpHole(hole);
+      RemoveAppScope(hole.first, hole.second.first,
+                     hole_record.second->options);
+      // Connections through outgoing holes were made from this host and
+      // are left alone.
+      plugged.push_back(hole);
+    }
+    GetHoleMap(hole.first, egress)->erase(hole.second);
+    GetOrphanedHoles(egress)->erase(hole);
+  }
+  FlushConntrack(plugged);
+  RestoreTcpLooseIfUnused();
+  return failed.empty() && punched.size() == holes.size();
+}
+
+bool IpTables::DisableConntrackTcpLoose() {
+  const base::FilePath path(kConntrackTcpLoosePath);
+  std::string saved;
+  if (!base::ReadFileToString(path, &saved)) {
+    PLOG(ERROR) << "Could not read '" << kConntrackTcpLoosePath << "'";
+    return false;
+  }
+  if (base::WriteFile(path, "0", 1) != 1) {
+    PLOG(ERROR) << "Could not write '" << kConntrackTcpLoosePath << "'";
+    return false;
+  }
+  base::TrimWhitespaceASCII(saved, base::TRIM_ALL,
+                            &conntrack_tcp_loose_saved_);
+  return true;
+}
+
+bool IpTables::RestoreConntrackTcpLoose() {
+  const std::string value = conntrack_tcp_loose_saved_.empty()
+                                ? kConntrackTcpLooseDefault
+                                : conntrack_tcp_loose_saved_;
+  if (base::WriteFile(base::FilePath(kConntrackTcpLoosePath), value.data(),
+                      value.size()) != static_cast<int>(value.size())) {
+    PLOG(ERROR) << "Could not write '" << kConntrackTcpLoosePath << "'";
+    return false;
+  }
+  return true;
+}
+
+bool IpTables::DisableTcpLooseForSynProxy() {
+  if (conntrack_tcp_loose_disabled_) {
+    return true;
+  }
+  conntrack_tcp_loose_disabled_ = DisableConntrackTcpLoose();
+  if (!conntrack_tcp_loose_disabled_) {
+    LOG(ERROR) << "Could not disable conntrack TCP pickup for SYNPROXY.";
+  }
+  return conntrack_tcp_loose_disabled_;
+}
+
+void IpTables::RestoreTcpLooseIfUnused() {
+  if (!conntrack_tcp_loose_disabled_) {
+    return;
+  }
+  for (const auto& hole : tcp_holes_) {
+    if (hole.second.options.synproxy) {
+      return;
+    }
+  }
+  LOG(INFO) << "Last SYNPROXY hole plugged, restoring conntrack TCP pickup";
+  if (!RestoreConntrackTcpLoose()) {
+    LOG(ERROR) << "Could not restore conntrack TCP pickup.";
+    return;
+  }
+  conntrack_tcp_loose_disabled_ = false;
+  conntrack_tcp_loose_saved_.clear();
+}
+
+void IpTables::FlushConntrack(const std::vector<ProtocolHole>& holes) {
+  if (!flush_conntrack_on_plug_ || holes.empty()) {
+    return;
+  }
+
+  std::vector<ConntrackMatch> matches;
+  for (const auto& hole : holes) {
+    ConntrackMatch match;
+    match.protocol = hole.first == kProtocolTcp ? IPPROTO_TCP : IPPROTO_UDP;
+    match.port = hole.second.first;
+    match.interface = hole.second.second;
+    matches.push_back(match);
+  }
+  if (!DeleteConntrackEntries(matches)) {
+    LOG(ERROR) << "Deleting conntrack entries failed.";
+  }
+}
+
+bool IpTables::DeleteConntrackEntries(
+    const std::vector<ConntrackMatch>& matches) {
+  int deleted = firewalld::DeleteConntrackEntries(matches);
+  if (deleted < 0) {
+    return false;
+  }
+  LOG(INFO) << "Requested the deletion of " << deleted
+            << " conntrack entries";
+  return true;
+}
+
+bool IpTables::AddAcceptRules(ProtocolEnum protocol,
+                              uint16_t port,
+                              const std::string& interface,
+                              const HoleRecord& record) {
+  if (!record.options.IsDefault()) {
+    return AddHoleRulesWithRestore(interface, record.rules);
+  }
+
+  if (!AddAcceptRule(kIpTablesPath, protocol, port, interface)) {
+    LOG(ERROR) << "Could not add ACCEPT rule using '" << kIpTablesPath << "'";
+    return false;
+  }
+
+  if (!HasIpv6Rules(interface)) {
+    // |interface| has no IPv6 address yet; the rule will be added along with
+    // the others on |interface| once it gets one.
+    return true;
+  }
+
+  if (AddAcceptRule(kIp6TablesPath, protocol, port, interface)) {
+    // This worked, record this fact and insist that it works thereafter.
+    ip6_enabled_ = true;
+  } else if (ip6_enabled_) {
+    // It's supposed to work, fail.
+    LOG(ERROR) << "Could not add ACCEPT rule using '" << kIp6TablesPath
+               << "', aborting operation.";
+    DeleteAcceptRule(kIpTablesPath, protocol, port, interface);
+    return false;
+  } else {
+    // It never worked, just ignore it.
+    LOG(WARNING) << "Could not add ACCEPT rule using '" << kIp6TablesPath
+                 << "', ignoring.";
+  }
+
+  return true;
+}
+
+bool IpTables::DeleteAcceptRules(ProtocolEnum protocol,
+                                 uint16_t port,
+                                 const std::string& interface,
+                                 const HoleRecord& record) {
+  if (!record.options.IsDefault()) {
+    return DeleteHoleRulesWithRestore(interface, record.rules);
+  }
+
+  bool ip4_success = DeleteAcceptRule(kIpTablesPath, protocol, port,
+                                      interface);
+  bool ip6_success = !ip6_enabled_ || !HasIpv6Rules(interface) ||
+                     DeleteAcceptRule(kIp6TablesPath, protocol, port,
+                                      interface);
+  return ip4_success && ip6_success;
+}
+
+bool IpTables::AddHoleRulesWithRestore(const std::string& interface,
+                                       const RenderedRules& rules) {
+  rule_batch_->Clear();
+  rule_batch_->AddHole(rules, HasIpv6Rules(interface));
+  return AddBatchRules();
+}
+
+IpTables::HoleRecord IpTables::NewHoleRecord(ProtocolEnum protocol,
+                                             uint16_t port,
+                                             const std::string& interface,
+                                             const HoleOptions& options) {
+  HoleRecord record;
+  record.options = options;
+  rule_batch_->Render(protocol, port, interface, options, &record.rules);
+  return record;
+}
+
+bool IpTables::AddBatchRules() {
+  RuleBatch* batch = rule_batch_.get();
+  if (!RunRestore(kIpTablesRestorePath,
+                  batch->RestoreInput(false /* ip6 */, true /* add */))) {
+    LOG(ERROR) << "Could not add rules using '" << kIpTablesRestorePath << "'";
+    return false;
+  }
+
+  if (batch->IsEmpty(true /* ip6 */)) {
+    // The interfaces have no IPv6 address yet; the rules will be added along
+    // with the others on each interface once it gets one.
+    return true;
+  }
+
+  if (RunRestore(kIp6TablesRestorePath,
+                 batch->RestoreInput(true /* ip6 */, true /* add */))) {
+    // This worked, record this fact and insist that it works thereafter.
+    ip6_enabled_ = true;
+  } else if (ip6_enabled_) {
+    // It's supposed to work, fail.
+    LOG(ERROR) << "Could not add rules using '" << kIp6TablesRestorePath
+               << "', aborting operation.";
+    RunRestore(kIpTablesRestorePath,
+               batch->RestoreInput(false /* ip6 */, false /* delete */));
+    return false;
+  } else {
+    // It never worked, just ignore it.
+    LOG(WARNING) << "Could not add rules using '" << kIp6TablesRestorePath
+                 << "', ignoring.";
+  }
+
+  return true;
+}
+
+bool IpTables::DeleteHoleRulesWithRestore(const std::string& interface,
+                                          const RenderedRules& rules) {
+  RuleBatch* batch = rule_batch_.get();
+  batch->Clear();
+  batch->AddHole(rules, ip6_enabled_ && HasIpv6Rules(interface));
+  bool ip4_success = RunRestore(
+      kIpTablesRestorePath,
+      batch->RestoreInput(false /* ip6 */, false /* delete */));
+  bool ip6_success =
+      batch->IsEmpty(true /* ip6 */) ||
+      RunRestore(kIp6TablesRestorePath,
+                 batch->RestoreInput(true /* ip6 */, false /* delete */));
+  return ip4_success && ip6_success;
+}
+
+void IpTables::EnableIpv6RuleDeferral() {
+  CHECK(!HasHoles())
+      << "IPv6 rule deferral must be enabled before punching holes.";
+  defer_ip6_rules_ = true;
+}
+
+void IpTables::SetXdpFilter(XdpFilter* xdp_filter) {
+  CHECK(tcp_holes_.empty() && udp_holes_.empty())
+      << "The XDP filter must be set before punching holes.";
+  xdp_filter_ = xdp_filter;
+}
+
+void IpTables::OnIpv6AddressChanged(const std::string& interface,
+                                    bool has_address) {
+  if (!has_address) {
+    ip6_pending_interfaces_.erase(interface);
+  }
+  if (!defer_ip6_rules_ || interface.empty() ||
+      has_address == HasIpv6Rules(interface)) {
+    return;
+  }
+
+  LOG(INFO) << (has_address ? "Adding" : "Removing")
+            << " IPv6 ACCEPT rules for interface '" << interface << "'";
+  if (!ApplyIpv6AcceptRulesForInterface(interface, has_address)) {
+    LOG(ERROR) << (has_address ? "Adding" : "Removing")
+               << " IPv6 ACCEPT rules failed for interface '" << interface
+               << "'";
+    if (has_address) {
+      // Plugging the holes must not try to delete rules that aren't there.
+      // The next commit tries again.
+      ip6_pending_interfaces_.insert(interface);
+      return;
+    }
+  }
+  if (has_address) {
+    ip6_pending_interfaces_.erase(interface);
+    ip6_interfaces_.insert(interface);
+  } else {
+    ip6_interfaces_.erase(interface);
+  }
+}
+
+void IpTables::RetryPendingIpv6Rules() {
+  // Interfaces that fail again stay pending.
+  const std::set<std::string> pending = ip6_pending_interfaces_;
+  for (const auto& interface : pending) {
+    OnIpv6AddressChanged(interface, true /* has_address */);
+  }
+}
+
+void IpTables::SetAppSocketFilter(AppSocketFilter* app_socket_filter) {
+  CHECK(!HasHoles())
+      << "The app socket filter must be set before punching holes.";
+  app_socket_filter_ = app_socket_filter;
+}
+
+void IpTables::OnCgroupRemoved(const std::string& cgroup) {
+  std::vector<ProtocolHole> holes;
+  for (const auto& protocol : {kProtocolTcp, kProtocolUdp}) {
+    for (const auto& hole : *GetHoleMap(protocol, false /* egress */)) {
+      if (hole.second.options.cgroup == cgroup) {
+        holes.push_back(ProtocolHole(protocol, hole.first));
+      }
+    }
+  }
+  if (holes.empty()) {
+    return;
+  }
+  LOG(INFO) << "Plugging " << holes.size() << " firewall holes of cgroup "
+            << cgroup;
+  if (!PlugHolesInBatch(holes, false /* egress */)) {
+    LOG(ERROR) << "Failed to plug all holes of cgroup " << cgroup;
+  }
+}
+
+bool IpTables::AddAppScope(ProtocolEnum protocol,
+                           uint16_t port,
+                           const HoleOptions& options) {
+  if (!options.IsScoped()) {
+    return true;
+  }
+  if (!app_socket_filter_) {
+    LOG(ERROR) << "Holes can't be scoped to an app without the app socket "
+               << "filter";
     return false;
   }
-
-  // Track the hole we just punched.
-  holes->insert(hole);
-
-  return true;
+  return app_socket_filter_->AddHole(
+      protocol == kProtocolTcp ? IPPROTO_TCP : IPPROTO_UDP, port,
+      options.cgroup, options.uid >= 0 ? options.uid : 0);
 }
 
-bool IpTables::PlugHole(uint16_t port,
-                        const std::string& interface,
-                        std::set<Hole>* holes,
-                        ProtocolEnum protocol) {
-  if (port == 0) {
-    // Port 0 is not a valid TCP/UDP port.
+bool IpTables::HasScopeConflict(ProtocolEnum protocol,
+                                uint16_t port,
+                                const HoleOptions& options) const {
+  if (options.egress) {
     return false;
   }
+  // The holes on |port| follow each other, ordered by interface.
+  const HoleMap& holes = *GetHoleMap(protocol, false /* egress */);
+  for (auto hole = holes.lower_bound(Hole(port, std::string()));
+       hole != holes.end() && hole->first.first == port; ++hole) {
+    const HoleOptions& existing = hole->second.options;
+    if (existing.cgroup != options.cgroup || existing.uid != options.uid) {
+      LOG(ERROR) << "Port " << port << " is open on interface '"
+                 << hole->first.second << "' to "
+                 << (existing.IsScoped() ? "another app" : "every app");
+      return true;
+    }
+  }
+  return false;
+}
 
-  Hole hole = std::make_pair(port, interface);
-
-  if (holes->find(hole) == holes->end()) {
-    // There is no firewall hole for |port| on |interface|.
-    // Even though this makes |PlugHole| not idempotent,
-    // and Punch/Plug not entirely symmetrical, fail. It might help catch bugs.
-    return false;
+void IpTables::RemoveAppScope(ProtocolEnum protocol,
+                              uint16_t port,
+                              const HoleOptions& options) {
+  if (options.IsScoped() && app_socket_filter_) {
+    app_socket_filter_->RemoveHole(
+        protocol == kProtocolTcp ? IPPROTO_TCP : IPPROTO_UDP, port);
   }
+}
 
-  std::string sprotocol = protocol == kProtocolTcp ? "TCP" : "UDP";
-  LOG(INFO) << "Plugging hole for " << sprotocol << " port " << port
-            << " on interface '" << interface << "'";
-  if (!DeleteAcceptRules(protocol, port, interface)) {
-    // If the 'iptables' command fails, this method fails.
-    LOG(ERROR) << "Deleting ACCEPT rules failed.";
-    return false;
+IpTables::HoleMap* IpTables::GetHoleMap(ProtocolEnum protocol, bool egress) {
+  if (egress) {
+    return protocol == kProtocolTcp ? &tcp_egress_holes_ : &udp_egress_holes_;
   }
+  return protocol == kProtocolTcp ? &tcp_holes_ : &udp_holes_;
+}
 
-  // Stop tracking the hole we just plugged.
-  holes->erase(hole);
+const IpTables::HoleMap* IpTables::GetHoleMap(ProtocolEnum protocol,
+                                              bool egress) const {
+  return const_cast<IpTables*>(this)->GetHoleMap(protocol, egress);
+}
 
-  return true;
+std::set<IpTables::ProtocolHole>* IpTables::GetOrphanedHoles(bool egress) {
+  return egress ? &orphaned_egress_holes_ : &orphaned_holes_;
 }
 
-void IpTables::PlugAllHoles() {
-  // Copy the container so that we can remove elements from the original.
-  // TCP
-  std::set<Hole> holes = tcp_holes_;
-  for (auto hole : holes) {
-    PlugHole(hole.first /* port */, hole.second /* interface */, &tcp_holes_,
-             kProtocolTcp);
+bool IpTables::AddXdpHole(const ProtocolHole& hole) {
+  if (!xdp_filter_) {
+    return true;
+  }
+  int& count = xdp_hole_counts_[hole];
+  if (count == 0 &&
+      !xdp_filter_->AddHole(
+          hole.first == kProtocolTcp ? IPPROTO_TCP : IPPROTO_UDP,
+          hole.second.first, hole.second.second)) {
+    xdp_hole_counts_.erase(hole);
+    return false;
   }
+  count++;
+  return true;
+}
 
-  // UDP
-  holes = udp_holes_;
-  for (auto hole : holes) {
-    PlugHole(hole.first /* port */, hole.second /* interface */, &udp_holes_,
-             kProtocolUdp);
+void IpTables::RemoveXdpHole(const ProtocolHole& hole) {
+  auto count = xdp_hole_counts_.find(hole);
+  if (!xdp_filter_ || count == xdp_hole_counts_.end()) {
+    return;
+  }
+  if (--count->second == 0) {
+    xdp_hole_counts_.erase(count);
+    xdp_filter_->RemoveHole(
+        hole.first == kProtocolTcp ? IPPROTO_TCP : IPPROTO_UDP,
+        hole.second.first, hole.second.second);
   }
+}
 
-  CHECK(tcp_holes_.size() == 0) << "Failed to plug all TCP holes.";
-  CHECK(udp_holes_.size() == 0) << "Failed to plug all UDP holes.";
+bool IpTables::HasIpv6Rules(const std::string& interface) const {
+  // Holes on all interfaces cannot wait for any particular one.
+  return !defer_ip6_rules_ || interface.empty() ||
+         ip6_interfaces_.find(interface) != ip6_interfaces_.end();
 }
 
-bool IpTables::AddAcceptRules(ProtocolEnum protocol,
-                              uint16_t port,
-                              const std::string& interface) {
-  if (!AddAcceptRule(kIpTablesPath, protocol, port, interface)) {
-    LOG(ERROR) << "Could not add ACCEPT rule using '" << kIpTablesPath << "'";
-    return false;
+bool IpTables::ApplyIpv6AcceptRulesForInterface(const std::string& interface,
+                                                bool add) {
+  RuleBatch* batch = rule_batch_.get();
+  batch->Clear();
+  for (bool egress : {false, true}) {
+    for (const auto& protocol : {kProtocolTcp, kProtocolUdp}) {
+      for (const auto& hole : *GetHoleMap(protocol, egress)) {
+        if (hole.first.second == interface) {
+          batch->AddHole(hole.second.rules, true /* ip6 */);
+        }
+      }
+    }
   }
+  const std::string& input = batch->RestoreInput(true /* ip6 */, add);
 
-  if (AddAcceptRule(kIp6TablesPath, protocol, port, interface)) {
-    // This worked, record this fact and insist that it works thereafter.
-    ip6_enabled_ = true;
-  } else if (ip6_enabled_) {
-    // It's supposed to work, fail.
-    LOG(ERROR) << "Could not add ACCEPT rule using '" << kIp6TablesPath
-               << "', aborting operation.";
-    DeleteAcceptRule(kIpTablesPath, protocol, port, interface);
-    return false;
-  } else {
-    // It never worked, just ignore it.
-    LOG(WARNING) << "Could not add ACCEPT rule using '" << kIp6TablesPath
-                 << "', ignoring.";
+  if (input.empty()) {
+    return true;
   }
 
-  return true;
-}
-
-bool IpTables::DeleteAcceptRules(ProtocolEnum protocol,
-                                 uint16_t port,
-                                 const std::string& interface) {
-  bool ip4_success = DeleteAcceptRule(kIpTablesPath, protocol, port,
-                                      interface);
-  bool ip6_success = !ip6_enabled_ || DeleteAcceptRule(kIp6TablesPath, protocol,
-                                                       port, interface);
-  return ip4_success && ip6_success;
+  if (add && !ip6_enabled_) {
+    // Adding IPv6 rules has never worked; try, but don't insist.
+    ip6_enabled_ = RunRestore(kIp6TablesRestorePath, input);
+    LOG_IF(WARNING, !ip6_enabled_) << "Could not add ACCEPT rules using '"
+                                   << kIp6TablesRestorePath << "', ignoring.";
+    return true;
+  }
+  if (!add && !ip6_enabled_) {
+    // Nothing was added.
+    return true;
+  }
+  return RunRestore(kIp6TablesRestorePath, input);
 }
 
 bool IpTables::ApplyVpnSetup(const std::vector<std::string>& usernames,
                              const std::string& interface,
                              bool add) {
+  if (uid_range_routing_) {
+    return ApplyVpnSetupWithUidRanges(usernames, interface, add);
+  }
+
   bool success = true;
   std::vector<std::string> added_usernames;
 
@@ -298,6 +2586,194 @@ bool IpTables::ApplyVpnSetup(const std::vector<std::string>& usernames,
   return success;
 }
 
+bool IpTables::ApplyVpnSetupWithUidRanges(
+    const std::vector<std::string>& usernames,
+    const std::string& interface,
+    bool add) {
+  bool success = true;
+  std::vector<uid_t> uids;
+  for (const auto& username : usernames) {
+    uid_t uid;
+    if (!LookUpUid(username, &uid)) {
+      if (add) {
+        return false;
+      }
+      success = false;
+      continue;
+    }
+    uids.push_back(uid);
+  }
+
+  std::multiset<uid_t> vpn_uids = vpn_uids_;
+  for (uid_t uid : uids) {
+    if (add) {
+      vpn_uids.insert(uid);
+    } else {
+      auto it = vpn_uids.find(uid);
+      if (it != vpn_uids.end()) {
+        vpn_uids.erase(it);
+      }
+    }
+  }
+
+  if (!ApplyMasquerade(interface, add)) {
+    if (add) {
+      ApplyMasquerade(interface, false /* remove */);
+      return false;
+    }
+    success = false;
+  }
+
+  if (!SetVpnUids(vpn_uids)) {
+    if (add) {
+      ApplyMasquerade(interface, false /* remove */);
+      return false;
+    }
+    success = false;
+  }
+
+  return success;
+}
+
+bool IpTables::SetVpnUids(const std::multiset<uid_t>& uids) {
+  const std::vector<UidRange> ranges =
+      CoalesceUids(std::set<uid_t>(uids.begin(), uids.end()));
+
+  std::vector<UidRange> added_ranges;
+  for (const auto& range : ranges) {
+    if (std::find(vpn_uid_ranges_.begin(), vpn_uid_ranges_.end(), range) !=
+        vpn_uid_ranges_.end()) {
+      continue;
+    }
+    if (!ApplyVpnUidRange(range, true /* add */)) {
+      // The rule may have been added for one IP version only.
+      ApplyVpnUidRange(range, false /* remove */);
+      for (const auto& added_range : added_ranges) {
+        ApplyVpnUidRange(added_range, false /* remove */);
+      }
+      return false;
+    }
+    added_ranges.push_back(range);
+  }
+
+  bool success = true;
+  std::vector<UidRange> installed_ranges = ranges;
+  for (const auto& range : vpn_uid_ranges_) {
+    if (std::find(ranges.begin(), ranges.end(), range) != ranges.end()) {
+      continue;
+    }
+    if (!ApplyVpnUidRange(range, false /* remove */)) {
+      // Keep track of the rule so that removing it can be retried later.
+      installed_ranges.push_back(range);
+      success = false;
+    }
+  }
+
+  vpn_uids_ = uids;
+  vpn_uid_ranges_ = installed_ranges;
+  return success;
+}
+
+bool IpTables::LookUpUid(const std::string& username, uid_t* uid) {
+  struct passwd entry;
+  struct passwd* result = nullptr;
+  char buffer[1024];
+  int error = getpwnam_r(username.c_str(), &entry, buffer, sizeof(buffer),
+                         &result);
+  if (error != 0 || !result) {
+    LOG(ERROR) << "Could not look up user " << username;
+    return false;
+  }
+  *uid = result->pw_uid;
+  return true;
+}
+
+bool IpTables::ApplyUidRangeRule(const UidRange& range, bool add) {
+  const IpTablesCallback apply_rule =
+      base::Bind(&IpTables::ApplyUidRangeRuleWithVersion,
+                 base::Unretained(this),
+                 range);
+
+  return RunForAllArguments(apply_rule, {kIPv4, kIPv6}, add);
+}
+
+bool IpTables::GetUidRangeRules(std::vector<UidRange>* ranges) {
+  // Rules are always added for both IP versions.
+  return firewalld::GetUidRangeRules(AF_INET, kTableIdForUserTraffic, ranges);
+}
+
+bool IpTables::ApplyVpnUidRange(const UidRange& range, bool add) {
+  if (lockdown_interface_.empty()) {
+    return ApplyUidRangeRule(range, add);
+  }
+  if (add) {
+    return ApplyLockdownRuleForRange(range, lockdown_interface_,
+                                     true /* add */) &&
+           ApplyUidRangeRule(range, true /* add */);
+  }
+  bool success = ApplyUidRangeRule(range, false /* remove */);
+  return ApplyLockdownRuleForRange(range, lockdown_interface_,
+                                   false /* remove */) &&
+         success;
+}
+
+bool IpTables::SetVpnLockdown(const std::string& interface, bool enable) {
+  bool success = true;
+  if (!uid_range_routing_) {
+    if (!ApplyLockdownRule(interface, enable)) {
+      if (enable) {
+        // The rule may have been added for one IP version only.
+        ApplyLockdownRule(interface, false /* remove */);
+        return false;
+      }
+      success = false;
+    }
+  } else {
+    std::vector<UidRange> locked_ranges;
+    for (const auto& range : vpn_uid_ranges_) {
+      if (!ApplyLockdownRuleForRange(range, interface, enable)) {
+        if (enable) {
+          ApplyLockdownRuleForRange(range, interface, false /* remove */);
+          for (const auto& locked_range : locked_ranges) {
+            ApplyLockdownRuleForRange(locked_range, interface,
+                                      false /* remove */);
+          }
+          return false;
+        }
+        success = false;
+      }
+      locked_ranges.push_back(range);
+    }
+  }
+
+  lockdown_interface_ = enable ? interface : std::string();
+  return success;
+}
+
+bool IpTables::ApplyLockdownRule(const std::string& interface, bool add) {
+  const IpTablesCallback apply_lockdown = base::Bind(
+      &IpTables::ApplyLockdownRuleWithExecutable, base::Unretained(this),
+      std::vector<std::string>{"-m", "mark", "--mark", kMarkForUserTraffic},
+      interface);
+
+  return RunForAllArguments(
+      apply_lockdown, {kIpTablesPath, kIp6TablesPath}, add);
+}
+
+bool IpTables::ApplyLockdownRuleForRange(const UidRange& range,
+                                         const std::string& interface,
+                                         bool add) {
+  const IpTablesCallback apply_lockdown = base::Bind(
+      &IpTables::ApplyLockdownRuleWithExecutable, base::Unretained(this),
+      std::vector<std::string>{"-m", "owner", "--uid-owner",
+                               std::to_string(range.first) + "-" +
+                                   std::to_string(range.last)},
+      interface);
+
+  return RunForAllArguments(
+      apply_lockdown, {kIpTablesPath, kIp6TablesPath}, add);
+}
+
 bool IpTables::ApplyMasquerade(const std::string& interface, bool add) {
   const IpTablesCallback apply_masquerade =
       base::Bind(&IpTables::ApplyMasqueradeWithExecutable,
@@ -332,16 +2808,9 @@ bool IpTables::AddAcceptRule(const std::string& executable_path,
   argv.push_back(executable_path);
   argv.push_back("-I");  // insert
   argv.push_back("INPUT");
-  argv.push_back("-p");  // protocol
-  argv.push_back(protocol == kProtocolTcp ? "tcp" : "udp");
-  argv.push_back("--dport");  // destination port
-  argv.push_back(std::to_string(port));
-  if (!interface.empty()) {
-    argv.push_back("-i");  // interface
-    argv.push_back(interface);
+  for (const auto& arg : AcceptRuleSpec(protocol, port, interface)) {
+    argv.push_back(arg);
   }
-  argv.push_back("-j");
-  argv.push_back("ACCEPT");
   argv.push_back("-w");  // Wait for xtables lock.
 
   // Use CAP_NET_ADMIN|CAP_NET_RAW.
@@ -356,22 +2825,48 @@ bool IpTables::DeleteAcceptRule(const std::string& executable_path,
   argv.push_back(executable_path);
   argv.push_back("-D");  // delete
   argv.push_back("INPUT");
-  argv.push_back("-p");  // protocol
-  argv.push_back(protocol == kProtocolTcp ? "tcp" : "udp");
-  argv.push_back("--dport");  // destination port
-  argv.push_back(std::to_string(port));
-  if (interface != "") {
-    argv.push_back("-i");  // interface
-    argv.push_back(interface);
+  for (const auto& arg : AcceptRuleSpec(protocol, port, interface)) {
+    argv.push_back(arg);
   }
-  argv.push_back("-j");
-  argv.push_back("ACCEPT");
   argv.push_back("-w");  // Wait for xtables lock.
 
   // Use CAP_NET_ADMIN|CAP_NET_RAW.
   return ExecvNonRoot(argv, kIpTablesCapMask) == 0;
 }
 
+bool IpTables::RunRestore(const std::string& restore_path,
+                          const std::string& input) {
+  std::vector<std::string> argv;
+  argv.push_back(restore_path);
+  argv.push_back("--noflush");  // Only touch the rules in |input|.
+  argv.push_back("-w");  // Wait for xtables lock.
+
+  // Use CAP_NET_ADMIN|CAP_NET_RAW.
+  bool success = ExecvNonRootWithInput(argv, kIpTablesCapMask, input) == 0;
+
+  if (!success) {
+    LOG(ERROR) << "Applying rules failed using '" << restore_path << "'";
+  }
+  return success;
+}
+
+bool IpTables::XtablesLockIsFree(std::string* holder) {
+  return firewalld::XtablesLockIsFree(holder);
+}
+
+bool IpTables::DumpRules(const std::string& save_path, std::string* output) {
+  std::vector<std::string> argv;
+  argv.push_back(save_path);
+
+  // Use CAP_NET_ADMIN|CAP_NET_RAW.
+  bool success = ExecvNonRootWithOutput(argv, kIpTablesCapMask, output) == 0;
+
+  if (!success) {
+    LOG(ERROR) << "Dumping rules failed using '" << save_path << "'";
+  }
+  return success;
+}
+
 bool IpTables::ApplyMasqueradeWithExecutable(const std::string& interface,
                                              const std::string& executable_path,
                                              bool add) {
@@ -425,6 +2920,45 @@ bool IpTables::ApplyMarkForUserTrafficWithExecutable(
   return success;
 }
 
+bool IpTables::ApplyLockdownRuleWithExecutable(
+    const std::vector<std::string>& match,
+    const std::string& interface,
+    const std::string& executable_path,
+    bool add) {
+  std::vector<std::string> argv;
+  argv.push_back(executable_path);
+  // Ahead of the rules accepting the replies of holes.
+  argv.push_back(add ? "-I" : "-D");  // rule
+  argv.push_back("OUTPUT");
+  argv.insert(argv.end(), match.begin(), match.end());
+  argv.push_back("!");
+  argv.push_back("-o");  // output interface
+  argv.push_back(interface);
+  // Local traffic never goes through the VPN.
+  argv.push_back("-m");
+  argv.push_back("addrtype");
+  argv.push_back("!");
+  argv.push_back("--dst-type");
+  argv.push_back("LOCAL");
+  // Tagged so that a new instance of the daemon keeps the lockdown.
+  argv.push_back("-m");
+  argv.push_back("comment");
+  argv.push_back("--comment");
+  argv.push_back(LockdownTag(interface));
+  argv.push_back("-j");
+  argv.push_back("REJECT");
+
+  // Use CAP_NET_ADMIN|CAP_NET_RAW.
+  bool success = ExecvNonRoot(argv, kIpTablesCapMask) == 0;
+
+  if (!success) {
+    LOG(ERROR) << (add ? "Adding" : "Removing")
+               << " lockdown failed for interface " << interface
+               << " using '" << executable_path << "'";
+  }
+  return success;
+}
+
 bool IpTables::ApplyRuleForUserTrafficWithVersion(const std::string& ip_version,
                                                   bool add) {
   brillo::ProcessImpl ip;
@@ -436,9 +2970,14 @@ bool IpTables::ApplyRuleForUserTrafficWithVersion(const std::string& ip_version,
   ip.AddArg("fwmark");
   ip.AddArg(kMarkForUserTraffic);
   ip.AddArg("table");
-  ip.AddArg(kTableIdForUserTraffic);
+  ip.AddArg(std::to_string(kTableIdForUserTraffic));
 
+  // brillo::Process reaps the child itself, so its usage is what the
+  // children of the daemon used during the run.
+  struct rusage before;
+  getrusage(RUSAGE_CHILDREN, &before);
   bool success = ip.Run() == 0;
+  RecordChildUsage(kIpPath, ChildrenUsageSince(before));
 
   if (!success) {
     LOG(ERROR) << (add ? "Adding" : "Removing") << " rule for " << ip_version
@@ -447,16 +2986,103 @@ bool IpTables::ApplyRuleForUserTrafficWithVersion(const std::string& ip_version,
   return success;
 }
 
+bool IpTables::ApplyUidRangeRuleWithVersion(const UidRange& range,
+                                            const std::string& ip_version,
+                                            bool add) {
+  bool success = firewalld::ApplyUidRangeRule(
+      ip_version == kIPv6 ? AF_INET6 : AF_INET, range,
+      kTableIdForUserTraffic, add);
+
+  if (!success) {
+    LOG(ERROR) << (add ? "Adding" : "Removing") << " " << ip_version
+               << " rule for users " << range.first << "-" << range.last
+               << " failed";
+  }
+  return success;
+}
+
+bool IpTables::WaitForChild(const std::string& executable_path,
+                            pid_t pid,
+                            int* status) {
+  struct rusage usage;
+  if (HANDLE_EINTR(wait4(pid, status, 0, &usage)) != pid) {
+    PLOG(ERROR) << "Could not wait for '" << executable_path << "'";
+    return false;
+  }
+  RecordChildUsage(executable_path, usage);
+  return true;
+}
+
+void IpTables::RecordChildUsage(const std::string& executable_path,
+                                const struct rusage& usage) {
+  ChildUsage& total =
+      child_usage_[base::FilePath(executable_path).BaseName().value()];
+  total.runs++;
+  total.user_time += base::TimeDelta::FromTimeVal(usage.ru_utime);
+  total.system_time += base::TimeDelta::FromTimeVal(usage.ru_stime);
+  total.max_rss_kb = std::max<int64_t>(total.max_rss_kb, usage.ru_maxrss);
+  total.minor_faults += usage.ru_minflt;
+  total.major_faults += usage.ru_majflt;
+}
+
 int IpTables::ExecvNonRoot(const std::vector<std::string>& argv,
                            uint64_t capmask) {
   brillo::Minijail* m = brillo::Minijail::GetInstance();
-  minijail* jail = m->New();
-#if !defined(__ANDROID__)
-  // TODO(garnold) This needs to be re-enabled once we figure out which
-  // unprivileged user we want to use.
-  m->DropRoot(jail, kUnprivilegedUser, kUnprivilegedUser);
-#endif  // __ANDROID__
-  m->UseCapabilities(jail, capmask);
+  minijail* jail = NewNonRootJail(m, capmask);
+
+  std::vector<char*> args;
+  for (const auto& arg : argv) {
+    args.push_back(const_cast<char*>(arg.c_str()));
+  }
+  args.push_back(nullptr);
+
+  pid_t pid;
+  if (!m->RunAndDestroy(jail, args, &pid)) {
+    return -1;
+  }
+  int status;
+  if (!WaitForChild(argv[0], pid, &status) || !WIFEXITED(status)) {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+int IpTables::ExecvNonRootWithInput(const std::vector<std::string>& argv,
+                                    uint64_t capmask,
+                                    const std::string& input) {
+  brillo::Minijail* m = brillo::Minijail::GetInstance();
+  minijail* jail = NewNonRootJail(m, capmask);
+
+  std::vector<char*> args;
+  for (const auto& arg : argv) {
+    args.push_back(const_cast<char*>(arg.c_str()));
+  }
+  args.push_back(nullptr);
+
+  pid_t pid;
+  int stdin_fd;
+  if (!m->RunPipeAndDestroy(jail, args, &pid, &stdin_fd)) {
+    return -1;
+  }
+  bool written = base::WriteFileDescriptor(stdin_fd, input.data(),
+                                           input.size());
+  IGNORE_EINTR(close(stdin_fd));
+
+  int status;
+  if (!WaitForChild(argv[0], pid, &status)) {
+    return -1;
+  }
+  if (!written || !WIFEXITED(status)) {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+int IpTables::ExecvNonRootWithOutput(const std::vector<std::string>& argv,
+                                     uint64_t capmask,
+                                     std::string* output) {
+  brillo::Minijail* m = brillo::Minijail::GetInstance();
+  minijail* jail = NewNonRootJail(m, capmask);
 
   std::vector<char*> args;
   for (const auto& arg : argv) {
@@ -464,9 +3090,27 @@ int IpTables::ExecvNonRoot(const std::vector<std::string>& argv,
   }
   args.push_back(nullptr);
 
+  pid_t pid;
+  int stdout_fd;
+  if (!m->RunPipesAndDestroy(jail, args, &pid, nullptr, &stdout_fd, nullptr)) {
+    return -1;
+  }
+  output->clear();
+  char buffer[4096];
+  ssize_t length;
+  while ((length = HANDLE_EINTR(read(stdout_fd, buffer, sizeof(buffer)))) > 0) {
+    output->append(buffer, length);
+  }
+  IGNORE_EINTR(close(stdout_fd));
+
   int status;
-  bool ran = m->RunSyncAndDestroy(jail, args, &status);
-  return ran ? status : -1;
+  if (!WaitForChild(argv[0], pid, &status)) {
+    return -1;
+  }
+  if (length < 0 || !WIFEXITED(status)) {
+    return -1;
+  }
+  return WEXITSTATUS(status);
 }
 
 }  // namespace firewalld
@@ -16,42 +16,303 @@
 #define FIREWALLD_IPTABLES_H_
 
 #include <stdint.h>
+#include <sys/resource.h>
+#include <sys/types.h>
 
+#include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 #include <base/macros.h>
+#include <base/pickle.h>
+#include <base/time/time.h>
 #include <brillo/errors/error.h>
+#include <brillo/variant_dictionary.h>
 
-#include "dbus_bindings/org.chromium.Firewalld.h"
+#include "app_socket_filter.h"
+#include "conntrack.h"
+#include "uid_range_rules.h"
+#include "xdp_filter.h"
 
 namespace firewalld {
 
 enum ProtocolEnum { kProtocolTcp, kProtocolUdp };
 
-class IpTables : public org::chromium::FirewalldInterface {
+// Options a hole is punched with. They are tracked along with the hole so
+// that plugging it removes exactly the rules that punching it added.
+struct HoleOptions {
+  // Exempt the hole's traffic from connection tracking (UDP only).
+  bool notrack = false;
+  // Answer new connections with SYN cookies from the kernel's SYNPROXY, so
+  // that SYN floods never reach conntrack or the listener (TCP only).
+  bool synproxy = false;
+  // Per-source limit, in packets per second, on what the hole accepts; 0
+  // means no limit. Packets over the limit are dropped.
+  uint32_t rate_limit = 0;
+  // How many packets a source can send at once before |rate_limit| applies.
+  uint32_t rate_limit_burst = 0;
+  // Count new connections against |rate_limit| instead of packets, leaving
+  // the packets of accepted connections alone.
+  bool rate_limit_connections = false;
+  // Accept outgoing traffic to the port, in the OUTPUT chain, instead of
+  // incoming traffic. Set by the Punch*EgressHole methods; an egress hole
+  // takes no other option.
+  bool egress = false;
+  // The app the hole is scoped to: only sockets in the cgroup v2 at this
+  // path from the cgroup root, or below it, receive the hole's traffic, or
+  // if there is no cgroup, only sockets of this UID (-1 for none).
+  std::string cgroup;
+  int64_t uid = -1;
+
+  bool IsScoped() const { return !cgroup.empty() || uid >= 0; }
+  bool IsDefault() const {
+    return !notrack && !synproxy && rate_limit == 0 && !egress && !IsScoped();
+  }
+  bool operator==(const HoleOptions& other) const {
+    return notrack == other.notrack && synproxy == other.synproxy &&
+           egress == other.egress && cgroup == other.cgroup &&
+           uid == other.uid &&
+           rate_limit == other.rate_limit &&
+           rate_limit_burst == other.rate_limit_burst &&
+           rate_limit_connections == other.rate_limit_connections;
+  }
+};
+
+// Sets |options| from the options dictionary of a |protocol| hole request,
+// as taken by the Punch*HoleWithOptions D-Bus methods. Returns false, logging
+// why, if the dictionary has unknown or inconsistent options.
+bool ParseHoleOptions(const brillo::VariantDictionary& dictionary,
+                      ProtocolEnum protocol,
+                      HoleOptions* options);
+
+class IpTables {
  public:
+  // The rules of a hole as 'iptables-restore' rule specifications, one line
+  // per rule starting with the chain, by table. They are rendered once, when
+  // the hole is punched, and kept with it, so that plugging it, alone or in a
+  // batch, and adding or removing its IPv6 rules later only copies them.
+  struct RenderedRules {
+    std::string filter;
+    std::string raw;
+  };
+
+  // A punched hole: the options it was punched with, and its rules.
+  struct HoleRecord {
+    HoleOptions options;
+    RenderedRules rules;
+  };
+
   typedef std::pair<uint16_t, std::string> Hole;
+  typedef std::map<Hole, HoleRecord> HoleMap;
+  typedef std::pair<ProtocolEnum, Hole> ProtocolHole;
+
+  // A hole to punch, as requested over D-Bus.
+  struct HoleRequest {
+    ProtocolEnum protocol;
+    uint16_t port;
+    std::string interface;
+    brillo::VariantDictionary options;
+    // Whether this is an egress hole, which takes no options.
+    bool egress;
+  };
+
+  // A hole of a group punched or plugged as a whole, on an interface given
+  // along with the group.
+  struct GroupHole {
+    ProtocolEnum protocol;
+    uint16_t port;
+    HoleOptions options;
+  };
+
+  // Resources used by the processes spawned for one kind of operation,
+  // summed over all of its runs.
+  struct ChildUsage {
+    uint64_t runs = 0;
+    base::TimeDelta user_time;
+    base::TimeDelta system_time;
+    // Largest resident set of a single run, in KiB.
+    int64_t max_rss_kb = 0;
+    uint64_t minor_faults = 0;
+    uint64_t major_faults = 0;
+  };
 
   IpTables();
-  ~IpTables();
+  virtual ~IpTables();
 
-  // D-Bus methods.
-  bool PunchTcpHole(uint16_t in_port, const std::string& in_interface) override;
-  bool PunchUdpHole(uint16_t in_port, const std::string& in_interface) override;
-  bool PlugTcpHole(uint16_t in_port, const std::string& in_interface) override;
-  bool PlugUdpHole(uint16_t in_port, const std::string& in_interface) override;
+  // Operations that FirewallService exports over D-Bus.
+  bool PunchTcpHole(uint16_t in_port, const std::string& in_interface);
+  bool PunchTcpHoleWithOptions(uint16_t in_port,
+                               const std::string& in_interface,
+                               const brillo::VariantDictionary& in_options);
+  bool PunchUdpHole(uint16_t in_port, const std::string& in_interface);
+  bool PunchUdpHoleWithOptions(uint16_t in_port,
+                               const std::string& in_interface,
+                               const brillo::VariantDictionary& in_options);
+  bool PlugTcpHole(uint16_t in_port, const std::string& in_interface);
+  bool PlugUdpHole(uint16_t in_port, const std::string& in_interface);
+  bool PunchTcpEgressHole(uint16_t in_port, const std::string& in_interface);
+  bool PunchUdpEgressHole(uint16_t in_port, const std::string& in_interface);
+  bool PlugTcpEgressHole(uint16_t in_port, const std::string& in_interface);
+  bool PlugUdpEgressHole(uint16_t in_port, const std::string& in_interface);
+  bool ReclaimHoles(
+      const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_holes,
+      const std::vector<std::tuple<uint16_t, std::string>>& in_udp_holes);
+  bool ReclaimHolesWithEgress(
+      const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_holes,
+      const std::vector<std::tuple<uint16_t, std::string>>& in_udp_holes,
+      const std::vector<std::tuple<uint16_t, std::string>>& in_tcp_egress_holes,
+      const std::vector<std::tuple<uint16_t, std::string>>&
+          in_udp_egress_holes);
 
   bool RequestVpnSetup(const std::vector<std::string>& usernames,
-                       const std::string& interface) override;
+                       const std::string& interface);
+  bool RequestVpnSetupWithOptions(const std::vector<std::string>& usernames,
+                                  const std::string& interface,
+                                  const brillo::VariantDictionary& options);
   bool RemoveVpnSetup(const std::vector<std::string>& usernames,
-                      const std::string& interface) override;
+                      const std::string& interface);
+
+  // Forwards |protocol| traffic coming in on |interface| to |port| to
+  // |destination|, an IPv4 address with an optional ":port", by rewriting its
+  // destination. Whether the forwarded traffic gets through is up to the
+  // FORWARD chain of the base ruleset. Adding a forward again succeeds, but
+  // forwarding a port that is already forwarded elsewhere fails. Each change
+  // is a single commit of the nat table.
+  bool AddPortForward(ProtocolEnum protocol,
+                      const std::string& interface,
+                      uint16_t port,
+                      const std::string& destination);
+  bool RemovePortForward(ProtocolEnum protocol,
+                         const std::string& interface,
+                         uint16_t port,
+                         const std::string& destination);
+
+  // Removes every port forward.
+  void RemoveAllPortForwards();
+
+  // Punches the holes of |requests| with one 'iptables-restore' run per IP
+  // version, falling back to punching them one at a time if the batch fails.
+  // Returns whether each request succeeded, in order.
+  std::vector<bool> PunchHolesInBatch(const std::vector<HoleRequest>& requests);
+
+  // Punches all of |holes| on |interface| with one 'iptables-restore' run per
+  // IP version, or none of them. Holes already punched with the same options
+  // are left as they are.
+  bool PunchHoleGroup(const std::vector<GroupHole>& holes,
+                      const std::string& interface);
+
+  // Plugs |holes| on |interface| in a single batch. Returns false if any of
+  // them wasn't punched.
+  bool PlugHoleGroup(const std::vector<GroupHole>& holes,
+                     const std::string& interface);
 
   // Close all outstanding firewall holes.
   void PlugAllHoles();
 
+  // Stops tracking every hole and port forward without removing it, so that
+  // its rules outlive the daemon and are picked up by |RestoreState| in the
+  // next instance.
+  void ForgetAllHoles();
+
+  // Rebuilds the holes, the port forwards, the VPN lockdown, and the VPN
+  // users in uidrange mode, from the rules a previous instance of the daemon
+  // left in the kernel. Each hole's rules are tagged with the hole and its
+  // options, so one 'iptables-save' dump is enough. Must be called before any
+  // hole is punched or port forwarded.
+  void RestoreState();
+
+  // Live upgrade: |SaveState| writes the holes, with their options and
+  // whether they are orphaned, the IPv6 and conntrack settings in effect, the
+  // VPN users and the port forwards to |pickle|. A new instance of the daemon
+  // takes them over with |AdoptState| instead of calling |RestoreState|,
+  // leaving the rules as they are. Returns false, adopting nothing, on
+  // malformed state.
+  void SaveState(base::Pickle* pickle) const;
+  bool AdoptState(base::PickleIterator* iterator);
+
+  bool HasHoles() const {
+    return !tcp_holes_.empty() || !udp_holes_.empty() ||
+           !tcp_egress_holes_.empty() || !udp_egress_holes_.empty();
+  }
+  bool HasVpnSetups() const { return !vpn_setups_.empty(); }
+
+  // Marks every hole, incoming or outgoing, as orphaned, e.g. when the
+  // process that punched them goes away. Orphaned holes stay open until they
+  // are punched again, reclaimed with |ReclaimHolesWithEgress|, or plugged by
+  // |PlugOrphanedHoles|.
+  void OrphanAllHoles();
+
+  // Plugs the holes that are still orphaned, in a single batch.
+  void PlugOrphanedHoles();
+
+  // Whether the xtables lock, which the commands wait for, is free right now.
+  // See |firewalld::XtablesLockIsFree|.
+  virtual bool XtablesLockIsFree(std::string* holder);
+
+  // Whether plugging holes also deletes the conntrack entries of the
+  // connections through them, so that established flows don't outlive the
+  // holes.
+  void set_flush_conntrack_on_plug(bool flush) {
+    flush_conntrack_on_plug_ = flush;
+  }
+
+  // Defers IPv6 rules for holes on interfaces that have no IPv6 address.
+  // Must be called before any hole is punched. Once enabled, the IPv6 rules
+  // for an interface are installed and removed by |OnIpv6AddressChanged|.
+  void EnableIpv6RuleDeferral();
+
+  // Called when |interface| gains its first, or loses its last, global or
+  // link-local IPv6 address. Installs or removes the IPv6 rules of every hole
+  // on |interface| in a single batch.
+  void OnIpv6AddressChanged(const std::string& interface, bool has_address);
+  // Retries adding the IPv6 rules of the interfaces where
+  // |OnIpv6AddressChanged| failed to, which only report address changes on
+  // the first and last address. Called before each commit.
+  void RetryPendingIpv6Rules();
+
+  // Routes VPN users with policy routing rules matching their user IDs,
+  // instead of marking their packets in the mangle table and routing on the
+  // mark. Must be called before any VPN setup is requested, and only if
+  // |UidRangeRulesSupported| returns true.
+  void EnableUidRangeRouting() { uid_range_routing_ = true; }
+
+  // Keeps the hole map of |xdp_filter|, which is not owned, in sync with the
+  // holes. Must be called before any hole is punched.
+  void SetXdpFilter(XdpFilter* xdp_filter);
+
+  // Enforces the scope of holes scoped to an app with |app_socket_filter|,
+  // which is not owned. Without it, such holes can't be punched. Must be
+  // called before any hole is punched.
+  void SetAppSocketFilter(AppSocketFilter* app_socket_filter);
+
+  // Called when |cgroup| is removed. Plugs the holes scoped to it in a
+  // single batch.
+  void OnCgroupRemoved(const std::string& cgroup);
+
+  // Resource usage of the processes spawned so far, by executable name, e.g.
+  // "iptables-restore".
+  const std::map<std::string, ChildUsage>& child_usage() const {
+    return child_usage_;
+  }
+
+  // Sizes of what the daemon installed, worked out from its own state
+  // without dumping anything from the kernel:
+  //  - "rules.<ipv4|ipv6>.<table>.<chain>": the rules it owns in a chain;
+  //  - "input_depth": the most of its rules a packet goes through in INPUT
+  //    before reaching the base ruleset, i.e. when it matches no hole;
+  //  - "vpn.users" and "vpn.uid_ranges": the VPN user set and, in uidrange
+  //    mode, the ranges routing it;
+  //  - "xdp.holes", "xdp.capacity" and "xdp.occupancy_percent": the XDP
+  //    hole map, if there is an XDP filter;
+  //  - "app.holes": the ports scoped to an app, if there is an app socket
+  //    filter;
+  //  - "port_forwards": the port forwards on all interfaces.
+  std::map<std::string, int64_t> GetGauges() const;
+
  private:
   friend class IpTablesTest;
   FRIEND_TEST(IpTablesTest, ApplyVpnSetupAdd_Success);
@@ -60,22 +321,85 @@ class IpTables : public org::chromium::FirewalldInterface {
   FRIEND_TEST(IpTablesTest, ApplyVpnSetupAdd_FailureInRuleForUserTraffic);
   FRIEND_TEST(IpTablesTest, ApplyVpnSetupRemove_Success);
   FRIEND_TEST(IpTablesTest, ApplyVpnSetupRemove_Failure);
+  FRIEND_TEST(IpTablesTest, Ipv6RulesDeferredUntilAddressAppears);
+  FRIEND_TEST(IpTablesTest, Ipv6RulesRemovedWhenAddressGoesAway);
+  FRIEND_TEST(IpTablesTest, Ipv6RulesNotTrackedWhenAddingThemFails);
+  FRIEND_TEST(IpTablesTest, Ipv6RulesRetriedAfterAddingThemFails);
+  FRIEND_TEST(IpTablesTest, ApplyVpnSetupWithUidRanges);
+  FRIEND_TEST(IpTablesTest, ApplyVpnSetupWithUidRanges_FailureInRule);
+  FRIEND_TEST(IpTablesTest, RestoreStateWithUidRanges);
+  FRIEND_TEST(IpTablesTest, VpnLockdown);
+  FRIEND_TEST(IpTablesTest, VpnLockdownWithUidRanges);
+  FRIEND_TEST(IpTablesTest, RestoreStateWithLockdown);
+  FRIEND_TEST(IpTablesTest, ChildUsageIsAggregatedPerExecutable);
+  FRIEND_TEST(IpTablesTest, GaugesFollowHolesAndVpnSetups);
+
+  // Renders the rules of holes for 'iptables-restore', and batches rendered
+  // rules into input buffers that are reused from one batch to the next.
+  // Defined in iptables.cc.
+  class RuleBatch;
 
   bool PunchHole(uint16_t port,
                  const std::string& interface,
-                 std::set<Hole>* holes,
+                 const HoleOptions& options,
+                 HoleMap* holes,
                  ProtocolEnum protocol);
   bool PlugHole(uint16_t port,
                 const std::string& interface,
-                std::set<Hole>* holes,
+                HoleMap* holes,
                 ProtocolEnum protocol);
 
+  // Plugs |holes|, incoming or outgoing ones as per |egress|, with one
+  // 'iptables-restore' run per IP version, falling back to one run per hole
+  // if the batch fails. Returns whether all of them were plugged.
+  bool PlugHolesInBatch(const std::vector<ProtocolHole>& holes, bool egress);
+
+  // SYNPROXY needs conntrack to treat ACKs of unknown connections as
+  // INVALID rather than picking them up mid-stream. The setting is system
+  // wide: disabling the pickup saves it, and restoring puts it back.
+  virtual bool DisableConntrackTcpLoose();
+  virtual bool RestoreConntrackTcpLoose();
+  // Disables the pickup for a SYNPROXY hole, unless it already is.
+  bool DisableTcpLooseForSynProxy();
+  // Restores the pickup once the last SYNPROXY hole is plugged.
+  void RestoreTcpLooseIfUnused();
+
+  // Deletes the conntrack entries of the connections through |holes|, if
+  // enabled, with a single pass over the conntrack table.
+  void FlushConntrack(const std::vector<ProtocolHole>& holes);
+  virtual bool DeleteConntrackEntries(
+      const std::vector<ConntrackMatch>& matches);
+
+  // Add or delete the rules of |record|. Holes with default options have a
+  // single rule, added with 'iptables'; the others go through
+  // 'iptables-restore' with the rules rendered in |record|.
   bool AddAcceptRules(ProtocolEnum protocol,
                       uint16_t port,
-                      const std::string& interface);
+                      const std::string& interface,
+                      const HoleRecord& record);
   bool DeleteAcceptRules(ProtocolEnum protocol,
                          uint16_t port,
-                         const std::string& interface);
+                         const std::string& interface,
+                         const HoleRecord& record);
+
+  // Adds the rules of |rule_batch_| with one 'iptables-restore' run per IP
+  // version, removing the IPv4 rules again if the IPv6 ones are required and
+  // fail.
+  bool AddBatchRules();
+
+  // Holes with non-default options are made of several rules, possibly in
+  // several tables. These are applied with 'iptables-restore' so that each
+  // table is updated atomically.
+  bool AddHoleRulesWithRestore(const std::string& interface,
+                               const RenderedRules& rules);
+  bool DeleteHoleRulesWithRestore(const std::string& interface,
+                                  const RenderedRules& rules);
+
+  // Returns the record of a new hole, with its rules rendered.
+  HoleRecord NewHoleRecord(ProtocolEnum protocol,
+                           uint16_t port,
+                           const std::string& interface,
+                           const HoleOptions& options);
 
   virtual bool AddAcceptRule(const std::string& executable_path,
                              ProtocolEnum protocol,
@@ -86,6 +410,56 @@ class IpTables : public org::chromium::FirewalldInterface {
                                 uint16_t port,
                                 const std::string& interface);
 
+  // Puts the app scope of a hole with |options|, if it has one, in the app
+  // socket filter, or takes it out again.
+  bool AddAppScope(ProtocolEnum protocol,
+                   uint16_t port,
+                   const HoleOptions& options);
+  void RemoveAppScope(ProtocolEnum protocol,
+                      uint16_t port,
+                      const HoleOptions& options);
+  // Whether an incoming hole on |port| over |protocol|, on some interface,
+  // has another scope than |options|. The app socket filter scopes a port on
+  // every interface, so such holes can't be punched together.
+  bool HasScopeConflict(ProtocolEnum protocol,
+                        uint16_t port,
+                        const HoleOptions& options) const;
+
+  // The holes of |protocol| for incoming or outgoing traffic.
+  HoleMap* GetHoleMap(ProtocolEnum protocol, bool egress);
+  const HoleMap* GetHoleMap(ProtocolEnum protocol, bool egress) const;
+  // The orphaned holes for incoming or outgoing traffic.
+  std::set<ProtocolHole>* GetOrphanedHoles(bool egress);
+
+  // Lets |hole|'s traffic past the XDP filter, or stops letting it. An
+  // incoming hole and a port forward on the same port share the entry,
+  // which goes away with the last of them.
+  bool AddXdpHole(const ProtocolHole& hole);
+  void RemoveXdpHole(const ProtocolHole& hole);
+
+  // Claims |hole| if it is orphaned, or punches it if it doesn't exist.
+  bool ReclaimHole(const ProtocolHole& hole,
+                   bool egress,
+                   std::set<ProtocolHole>* unclaimed);
+
+  // Returns whether holes on |interface| currently have IPv6 rules.
+  bool HasIpv6Rules(const std::string& interface) const;
+
+  // Adds or deletes, in a single 'ip6tables-restore' run, the IPv6 ACCEPT
+  // rules of every hole on |interface|.
+  bool ApplyIpv6AcceptRulesForInterface(const std::string& interface,
+                                        bool add);
+
+  // Sets |output| to the rules of every table, as printed by |save_path|
+  // ('iptables-save' or 'ip6tables-save').
+  virtual bool DumpRules(const std::string& save_path, std::string* output);
+
+  // Feeds |input| to |restore_path| ('iptables-restore' or
+  // 'ip6tables-restore') without flushing the existing rules. Each table in
+  // |input| is committed atomically.
+  virtual bool RunRestore(const std::string& restore_path,
+                          const std::string& input);
+
   bool ApplyVpnSetup(const std::vector<std::string>& usernames,
                      const std::string& interface,
                      bool add);
@@ -104,11 +478,77 @@ class IpTables : public org::chromium::FirewalldInterface {
   bool ApplyRuleForUserTrafficWithVersion(const std::string& ip_version,
                                           bool add);
 
-  int ExecvNonRoot(const std::vector<std::string>& argv, uint64_t capmask);
+  // VPN setup in uidrange mode. The users of all setups are routed by one
+  // rule per range of consecutive user IDs, so adding or removing users only
+  // updates the ranges that change.
+  bool ApplyVpnSetupWithUidRanges(const std::vector<std::string>& usernames,
+                                  const std::string& interface,
+                                  bool add);
+  // Replaces the VPN users with |uids|, adding rules for new ranges before
+  // deleting the ones that went away.
+  bool SetVpnUids(const std::multiset<uid_t>& uids);
+  virtual bool LookUpUid(const std::string& username, uid_t* uid);
+  virtual bool ApplyUidRangeRule(const UidRange& range, bool add);
+  bool ApplyUidRangeRuleWithVersion(const UidRange& range,
+                                    const std::string& ip_version,
+                                    bool add);
+  // Sets |ranges| to the uidrange rules installed for VPN users.
+  virtual bool GetUidRangeRules(std::vector<UidRange>* ranges);
+  // Routes the users in |range| through the VPN, once they are locked down
+  // if lockdown is on, or undoes it.
+  bool ApplyVpnUidRange(const UidRange& range, bool add);
+
+  // Locks VPN users down to |interface|, or lifts the lockdown. VPN users are
+  // matched by the mark of their traffic, so a single rule covers all of
+  // them, or in uidrange mode, which has no mark, by one rule per range.
+  bool SetVpnLockdown(const std::string& interface, bool enable);
+  virtual bool ApplyLockdownRule(const std::string& interface, bool add);
+  virtual bool ApplyLockdownRuleForRange(const UidRange& range,
+                                         const std::string& interface,
+                                         bool add);
+  bool ApplyLockdownRuleWithExecutable(const std::vector<std::string>& match,
+                                       const std::string& interface,
+                                       const std::string& executable_path,
+                                       bool add);
+
+  // Adds or deletes the DNAT rule of a port forward, along with the chain of
+  // |interface| and the jump to it when the forward is its first or last
+  // one, with a single 'iptables-restore' run.
+  bool ApplyPortForward(ProtocolEnum protocol,
+                        const std::string& interface,
+                        uint16_t port,
+                        const std::string& destination,
+                        bool add);
+
+  // Reaps |pid|, spawned from |executable_path|, into |status|, and accounts
+  // for the resources it used.
+  bool WaitForChild(const std::string& executable_path,
+                    pid_t pid,
+                    int* status);
+  void RecordChildUsage(const std::string& executable_path,
+                        const struct rusage& usage);
+
+  // Every 'iptables' family process the daemon spawns goes through one of
+  // these.
+  virtual int ExecvNonRoot(const std::vector<std::string>& argv,
+                           uint64_t capmask);
+  virtual int ExecvNonRootWithInput(const std::vector<std::string>& argv,
+                                    uint64_t capmask,
+                                    const std::string& input);
+  virtual int ExecvNonRootWithOutput(const std::vector<std::string>& argv,
+                                     uint64_t capmask,
+                                     std::string* output);
 
   // Keep track of firewall holes to avoid adding redundant firewall rules.
-  std::set<Hole> tcp_holes_;
-  std::set<Hole> udp_holes_;
+  HoleMap tcp_holes_;
+  HoleMap udp_holes_;
+  // Holes for outgoing traffic. They are not in the XDP filter, which only
+  // sees incoming traffic.
+  HoleMap tcp_egress_holes_;
+  HoleMap udp_egress_holes_;
+  // Holes whose owner went away and that haven't been reclaimed yet.
+  std::set<ProtocolHole> orphaned_holes_;
+  std::set<ProtocolHole> orphaned_egress_holes_;
 
   // Tracks whether IPv6 filtering is enabled. If set to |true| (the default),
   // then it is required to be working. If |false|, then adding of IPv6 rules is
@@ -116,6 +556,50 @@ class IpTables : public org::chromium::FirewalldInterface {
   // then it'll be changed to |true| and enforced thereafter.
   bool ip6_enabled_ = true;
 
+  // Whether IPv6 rules are only installed on interfaces with IPv6 addresses,
+  // and the set of interfaces that currently have one.
+  bool defer_ip6_rules_ = false;
+  std::set<std::string> ip6_interfaces_;
+  // Interfaces with an IPv6 address whose rules could not be added.
+  std::set<std::string> ip6_pending_interfaces_;
+
+  bool flush_conntrack_on_plug_ = false;
+
+  // Whether |DisableConntrackTcpLoose| has succeeded, and the setting it
+  // replaced. The setting is unknown after restoring the state from the
+  // kernel, and the kernel's default is put back then.
+  bool conntrack_tcp_loose_disabled_ = false;
+  std::string conntrack_tcp_loose_saved_;
+
+  // Whether VPN users are routed with uidrange rules, the user IDs of every
+  // VPN setup, and the ranges currently installed for them.
+  bool uid_range_routing_ = false;
+  std::multiset<uid_t> vpn_uids_;
+  std::vector<UidRange> vpn_uid_ranges_;
+  // Setups per VPN interface, and the interface VPN users are locked down
+  // to, if any.
+  std::map<std::string, int> vpn_setups_;
+  // Users of all setups, which each have a mark rule when not in uidrange
+  // mode.
+  int64_t vpn_user_count_ = 0;
+  std::string lockdown_interface_;
+
+  // Port forwards, keyed like holes, with their destination, and the number
+  // of them on each interface, which has a nat chain for as long as it has
+  // any.
+  std::map<ProtocolHole, std::string> port_forwards_;
+  std::map<std::string, int> port_forward_counts_;
+  // References to each entry of the XDP filter's hole map.
+  std::map<ProtocolHole, int> xdp_hole_counts_;
+
+  XdpFilter* xdp_filter_ = nullptr;
+  AppSocketFilter* app_socket_filter_ = nullptr;
+
+  std::map<std::string, ChildUsage> child_usage_;
+
+  // Shared by every operation that renders rules, one at a time.
+  std::unique_ptr<RuleBatch> rule_batch_;
+
   DISALLOW_COPY_AND_ASSIGN(IpTables);
 };
 
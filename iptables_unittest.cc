@@ -14,24 +14,44 @@
 
 #include "iptables.h"
 
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+
+#include <base/files/file_path.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
 #include <gtest/gtest.h>
 
+#include "dbus_interface.h"
+#include "mock_app_socket_filter.h"
 #include "mock_iptables.h"
+#include "mock_xdp_filter.h"
+#include "xtables_lock.h"
 
 namespace {
 #if defined(__ANDROID__)
 const char kIpTablesPath[] = "/system/bin/iptables";
 const char kIp6TablesPath[] = "/system/bin/ip6tables";
+const char kIpTablesRestorePath[] = "/system/bin/iptables-restore";
+const char kIp6TablesRestorePath[] = "/system/bin/ip6tables-restore";
+const char kIpTablesSavePath[] = "/system/bin/iptables-save";
 #else
 const char kIpTablesPath[] = "/sbin/iptables";
 const char kIp6TablesPath[] = "/sbin/ip6tables";
+const char kIpTablesRestorePath[] = "/sbin/iptables-restore";
+const char kIp6TablesRestorePath[] = "/sbin/ip6tables-restore";
+const char kIpTablesSavePath[] = "/sbin/iptables-save";
 #endif  // __ANDROID__
 }  // namespace
 
 namespace firewalld {
 
 using testing::_;
+using testing::DoAll;
 using testing::Return;
+using testing::SetArgPointee;
 
 class IpTablesTest : public testing::Test {
  public:
@@ -187,6 +207,1006 @@ TEST_F(IpTablesTest, PunchUdpHoleIpv6Fails) {
   ASSERT_FALSE(mock_iptables.PunchUdpHole(53, "iface"));
 }
 
+TEST_F(IpTablesTest, PunchUdpHoleNoTrack) {
+  const std::string add_input =
+      "*filter\n"
+      "-I INPUT -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j ACCEPT\n"
+      "-I OUTPUT -p udp --sport 53 -o iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j ACCEPT\n"
+      "COMMIT\n"
+      "*raw\n"
+      "-I PREROUTING -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j CT --notrack\n"
+      "-I OUTPUT -p udp --sport 53 -o iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j CT --notrack\n"
+      "COMMIT\n";
+  const std::string delete_input =
+      "*filter\n"
+      "-D INPUT -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j ACCEPT\n"
+      "-D OUTPUT -p udp --sport 53 -o iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j ACCEPT\n"
+      "COMMIT\n"
+      "*raw\n"
+      "-D PREROUTING -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j CT --notrack\n"
+      "-D OUTPUT -p udp --sport 53 -o iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j CT --notrack\n"
+      "COMMIT\n";
+  const brillo::VariantDictionary options{{"notrack", true}};
+
+  MockIpTables mock_iptables;
+  // All of the rules go through 'iptables-restore'.
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_CALL(mock_iptables, DeleteAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, add_input))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, add_input))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchUdpHoleWithOptions(53, "iface", options));
+  // Punch again, should still succeed.
+  EXPECT_TRUE(mock_iptables.PunchUdpHoleWithOptions(53, "iface", options));
+  // Punching the same hole without the option fails.
+  EXPECT_FALSE(mock_iptables.PunchUdpHole(53, "iface"));
+
+  // Plugging the hole removes every rule.
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, delete_input))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, delete_input))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PlugUdpHole(53, "iface"));
+}
+
+TEST_F(IpTablesTest, PunchUdpHoleNoTrackIpv6Fails) {
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, _))
+      .WillOnce(Return(false));
+  // The IPv4 rules are removed again and the punch fails.
+  EXPECT_FALSE(mock_iptables.PunchUdpHoleWithOptions(
+      53, "iface", {{"notrack", true}}));
+}
+
+TEST_F(IpTablesTest, PunchUdpHoleInvalidOption) {
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_FALSE(mock_iptables.PunchUdpHoleWithOptions(
+      53, "iface", {{"no_such_option", true}}));
+  EXPECT_FALSE(mock_iptables.PunchUdpHoleWithOptions(
+      53, "iface", {{"notrack", std::string("yes")}}));
+}
+
+TEST_F(IpTablesTest, PunchTcpHoleSynProxy) {
+  const std::string add_input =
+      "*filter\n"
+      "-I INPUT -p tcp --dport 80 -i iface "
+      "-m comment --comment firewalld:tcp:80:iface:synproxy -j ACCEPT\n"
+      "-I INPUT -p tcp --dport 80 -i iface "
+      "-m comment --comment firewalld:tcp:80:iface:synproxy "
+      "-m conntrack --ctstate INVALID -j DROP\n"
+      "-I INPUT -p tcp --dport 80 -i iface "
+      "-m comment --comment firewalld:tcp:80:iface:synproxy "
+      "-m conntrack --ctstate INVALID,UNTRACKED -j SYNPROXY --sack-perm --timestamp --wscale 7 "
+      "--mss 1440\n"
+      "COMMIT\n"
+      "*raw\n"
+      "-I PREROUTING -p tcp --dport 80 -i iface "
+      "--tcp-flags FIN,SYN,RST,ACK SYN "
+      "-m comment --comment firewalld:tcp:80:iface:synproxy -j CT --notrack\n"
+      "COMMIT\n";
+  const brillo::VariantDictionary options{{"synproxy", true}};
+
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_CALL(mock_iptables, DisableConntrackTcpLoose())
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(_, add_input))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchTcpHoleWithOptions(80, "iface", options));
+
+  // The conntrack setting is only changed once.
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("--dport 443")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchTcpHoleWithOptions(443, "iface", options));
+
+  // Plugging removes the whole pipeline.
+  EXPECT_CALL(mock_iptables,
+              RunRestore(_, testing::AllOf(testing::HasSubstr("-D INPUT"),
+                                           testing::HasSubstr("SYNPROXY"),
+                                           testing::HasSubstr("-D PREROUTING"),
+                                           testing::HasSubstr("--dport 80"))))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  // The conntrack setting stays while a SYNPROXY hole is left.
+  EXPECT_CALL(mock_iptables, RestoreConntrackTcpLoose()).Times(0);
+  EXPECT_TRUE(mock_iptables.PlugTcpHole(80, "iface"));
+
+  // And is restored with the last one.
+  EXPECT_CALL(mock_iptables, RestoreConntrackTcpLoose())
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PlugTcpHole(443, "iface"));
+
+  // The next SYNPROXY hole disables the pickup again.
+  EXPECT_CALL(mock_iptables, DisableConntrackTcpLoose())
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(_, add_input))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchTcpHoleWithOptions(80, "iface", options));
+  // Which is plugged on destruction.
+  EXPECT_CALL(mock_iptables, RestoreConntrackTcpLoose())
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+}
+
+TEST_F(IpTablesTest, PunchTcpHoleSynProxyFailsWithoutConntrackSetting) {
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables, DisableConntrackTcpLoose())
+      .WillOnce(Return(false));
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      80, "iface", {{"synproxy", true}}));
+}
+
+TEST_F(IpTablesTest, HoleOptionsAreProtocolSpecific) {
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      80, "iface", {{"notrack", true}}));
+  EXPECT_FALSE(mock_iptables.PunchUdpHoleWithOptions(
+      53, "iface", {{"synproxy", true}}));
+}
+
+TEST_F(IpTablesTest, PunchUdpHoleRateLimit) {
+  const std::string add_input =
+      "*filter\n"
+      "-I INPUT -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface:rate=100 -j DROP\n"
+      "-I INPUT -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface:rate=100 "
+      "-m hashlimit --hashlimit-upto "
+      "100/sec --hashlimit-burst 5 --hashlimit-mode srcip --hashlimit-name "
+      "fwu53_965ef5 -j ACCEPT\n"
+      "COMMIT\n";
+  const brillo::VariantDictionary options{{"rate_limit", uint32_t{100}}};
+
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_CALL(mock_iptables, RunRestore(_, add_input))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchUdpHoleWithOptions(53, "iface", options));
+  // A different limit is a different hole.
+  EXPECT_FALSE(mock_iptables.PunchUdpHoleWithOptions(
+      53, "iface", {{"rate_limit", uint32_t{200}}}));
+
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PlugUdpHole(53, "iface"));
+}
+
+TEST_F(IpTablesTest, PunchTcpHoleConnectionRateLimit) {
+  const std::string add_input =
+      "*filter\n"
+      "-I INPUT -p tcp --dport 22 "
+      "-m comment --comment firewalld:tcp:22::rate=3,burst=10,conn -j ACCEPT\n"
+      "-I INPUT -p tcp --dport 22 -m conntrack --ctstate NEW "
+      "-m comment --comment firewalld:tcp:22::rate=3,burst=10,conn -j DROP\n"
+      "-I INPUT -p tcp --dport 22 -m conntrack --ctstate NEW "
+      "-m comment --comment firewalld:tcp:22::rate=3,burst=10,conn -m hashlimit "
+      "--hashlimit-upto 3/sec --hashlimit-burst 10 --hashlimit-mode srcip "
+      "--hashlimit-name fwt22_1c9dc5 -j ACCEPT\n"
+      "COMMIT\n";
+  const brillo::VariantDictionary options{
+      {"rate_limit", uint32_t{3}},
+      {"rate_limit_burst", uint32_t{10}},
+      {"rate_limit_connections", true}};
+
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables, RunRestore(_, add_input))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchTcpHoleWithOptions(22, "", options));
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+}
+
+TEST_F(IpTablesTest, PunchHoleInvalidRateLimit) {
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  // Over the maximum.
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      80, "iface", {{"rate_limit", uint32_t{10001}}}));
+  // Burst without a limit.
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      80, "iface", {{"rate_limit_burst", uint32_t{10}}}));
+  // Wrong type.
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      80, "iface", {{"rate_limit", std::string("100")}}));
+  // Untracked traffic has no connections to count.
+  EXPECT_FALSE(mock_iptables.PunchUdpHoleWithOptions(
+      53, "iface", {{"notrack", true},
+                    {"rate_limit", uint32_t{100}},
+                    {"rate_limit_connections", true}}));
+}
+
+TEST_F(IpTablesTest, PunchEgressHoles) {
+  const std::string add_input =
+      "*filter\n"
+      "-I OUTPUT -p tcp --dport 443 -o iface "
+      "-m comment --comment firewalld:tcp:443:iface:out -j ACCEPT\n"
+      "COMMIT\n";
+
+  MockXdpFilter xdp_filter;
+  MockIpTables mock_iptables;
+  mock_iptables.SetXdpFilter(&xdp_filter);
+  // Outgoing traffic never goes through the XDP program.
+  EXPECT_CALL(xdp_filter, AddHole(_, _, _)).Times(0);
+  EXPECT_CALL(xdp_filter, RemoveHole(_, _, _)).Times(0);
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_CALL(mock_iptables, RunRestore(_, add_input))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchTcpEgressHole(443, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchTcpEgressHole(443, "iface"));
+  // It isn't an incoming hole.
+  EXPECT_FALSE(mock_iptables.PlugTcpHole(443, "iface"));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  // Egress holes are batched along with incoming ones, even on the same port.
+  std::vector<IpTables::HoleRequest> requests;
+  requests.push_back({kProtocolUdp, 53, "iface", {}, true /* egress */});
+  requests.push_back({kProtocolUdp, 53, "iface", {}, true /* egress */});
+  requests.push_back(
+      {kProtocolUdp, 53, "iface", {{"notrack", true}}, true /* egress */});
+  EXPECT_CALL(mock_iptables,
+              RunRestore(_, testing::HasSubstr(
+                                "-I OUTPUT -p udp --dport 53 -o iface "
+                                "-m comment --comment firewalld:udp:53:iface:"
+                                "out -j ACCEPT\n")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_EQ((std::vector<bool>{true, true, false}),
+            mock_iptables.PunchHolesInBatch(requests));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D OUTPUT")))
+      .Times(4)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PlugUdpEgressHole(53, "iface"));
+  EXPECT_FALSE(mock_iptables.PlugUdpEgressHole(53, "iface"));
+  EXPECT_TRUE(mock_iptables.PlugTcpEgressHole(443, "iface"));
+  EXPECT_FALSE(mock_iptables.HasHoles());
+}
+
+TEST_F(IpTablesTest, XdpFilterFollowsHoles) {
+  MockXdpFilter xdp_filter;
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  mock_iptables.SetXdpFilter(&xdp_filter);
+
+  EXPECT_CALL(xdp_filter, AddHole(IPPROTO_TCP, 80, "iface"))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+  // Punching again doesn't touch the filter.
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+
+  EXPECT_CALL(xdp_filter, RemoveHole(IPPROTO_TCP, 80, "iface"))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PlugTcpHole(80, "iface"));
+}
+
+TEST_F(IpTablesTest, XdpFilterFollowsPortForwards) {
+  MockXdpFilter xdp_filter;
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  mock_iptables.SetXdpFilter(&xdp_filter);
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, _))
+      .WillRepeatedly(Return(true));
+
+  // A forward and a hole on the same port share the filter's entry.
+  EXPECT_CALL(xdp_filter, AddHole(IPPROTO_TCP, 8080, "eth0"))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.AddPortForward(kProtocolTcp, "eth0", 8080,
+                                           "192.168.1.2"));
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(8080, "eth0"));
+  EXPECT_CALL(xdp_filter, RemoveHole(_, _, _)).Times(0);
+  EXPECT_TRUE(mock_iptables.PlugTcpHole(8080, "eth0"));
+  testing::Mock::VerifyAndClearExpectations(&xdp_filter);
+
+  // The entry goes away with the last of them.
+  EXPECT_CALL(xdp_filter, RemoveHole(IPPROTO_TCP, 8080, "eth0"))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.RemovePortForward(kProtocolTcp, "eth0", 8080,
+                                              "192.168.1.2"));
+  testing::Mock::VerifyAndClearExpectations(&xdp_filter);
+
+  // A forward the filter can't take isn't added.
+  EXPECT_CALL(xdp_filter, AddHole(IPPROTO_UDP, 5353, "eth0"))
+      .WillOnce(Return(false));
+  EXPECT_FALSE(mock_iptables.AddPortForward(kProtocolUdp, "eth0", 5353,
+                                            "192.168.1.2"));
+  EXPECT_FALSE(mock_iptables.RemovePortForward(kProtocolUdp, "eth0", 5353,
+                                               "192.168.1.2"));
+}
+
+TEST_F(IpTablesTest, XdpFilterFailureFailsPunch) {
+  MockXdpFilter xdp_filter;
+  MockIpTables mock_iptables;
+  mock_iptables.SetXdpFilter(&xdp_filter);
+
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, kProtocolUdp, 53, "iface"))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(xdp_filter, AddHole(IPPROTO_UDP, 53, "iface"))
+      .WillOnce(Return(false));
+  // The rules are removed again.
+  EXPECT_CALL(mock_iptables, DeleteAcceptRule(_, kProtocolUdp, 53, "iface"))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_FALSE(mock_iptables.PunchUdpHole(53, "iface"));
+}
+
+TEST_F(IpTablesTest, ReclaimHoles) {
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(22, ""));
+  EXPECT_TRUE(mock_iptables.PunchUdpHole(53, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchUdpHole(5353, "iface"));
+  mock_iptables.OrphanAllHoles();
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  // Punching an orphaned hole again claims it.
+  EXPECT_TRUE(mock_iptables.PunchUdpHole(5353, "iface"));
+
+  // Holes that weren't open are punched, claimed ones are left alone, and the
+  // rest are plugged with one run per IP version.
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, kProtocolTcp, 443, "iface"))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, DeleteAcceptRule(_, _, _, _)).Times(0);
+  const std::string delete_input =
+      "*filter\n"
+      "-D INPUT -p tcp --dport 22 -m comment --comment firewalld:tcp:22: "
+      "-j ACCEPT\n"
+      "-D INPUT -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface -j ACCEPT\n"
+      "COMMIT\n";
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, delete_input))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, delete_input))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.ReclaimHoles(
+      {std::make_tuple(80, "iface"), std::make_tuple(443, "iface")}, {}));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  // Nothing is left to plug once the grace period is over.
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  mock_iptables.PlugOrphanedHoles();
+  EXPECT_FALSE(mock_iptables.PlugTcpHole(22, ""));
+  EXPECT_FALSE(mock_iptables.PlugUdpHole(53, "iface"));
+
+  // The remaining holes are plugged on destruction with one run per IP
+  // version.
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+}
+
+TEST_F(IpTablesTest, ReclaimEgressHoles) {
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-I OUTPUT")))
+      .Times(6)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchTcpEgressHole(443, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchTcpEgressHole(8080, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchUdpEgressHole(53, "iface"));
+  mock_iptables.OrphanAllHoles();
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  // Egress holes are claimed or punched like incoming ones, and the
+  // unclaimed ones are plugged with one run per IP version.
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_CALL(mock_iptables,
+              RunRestore(_, testing::HasSubstr(
+                                "-I OUTPUT -p tcp --dport 993 -o iface ")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables,
+              RunRestore(_, testing::AllOf(
+                                testing::HasSubstr("-D OUTPUT -p tcp "
+                                                   "--dport 8080 -o iface "),
+                                testing::HasSubstr("-D OUTPUT -p udp "
+                                                   "--dport 53 -o iface "),
+                                testing::Not(testing::HasSubstr("443")))))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.ReclaimHolesWithEgress(
+      {std::make_tuple(80, "iface")}, {},
+      {std::make_tuple(443, "iface"), std::make_tuple(993, "iface")}, {}));
+  EXPECT_FALSE(mock_iptables.PlugUdpEgressHole(53, "iface"));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  // Orphaned egress holes are plugged along with incoming ones once the
+  // grace period is over.
+  mock_iptables.OrphanAllHoles();
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables,
+              RunRestore(_, testing::AllOf(testing::HasSubstr("--dport 443"),
+                                           testing::HasSubstr("--dport 993"))))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  mock_iptables.PlugOrphanedHoles();
+  EXPECT_FALSE(mock_iptables.HasHoles());
+}
+
+TEST_F(IpTablesTest, PlugOrphanedHolesFallsBackToOneAtATime) {
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(443, "iface"));
+  mock_iptables.OrphanAllHoles();
+
+  // The batch fails because of one hole whose rule is gone.
+  EXPECT_CALL(mock_iptables,
+              RunRestore(_, testing::AllOf(testing::HasSubstr("--dport 80"),
+                                           testing::HasSubstr("--dport 443"))))
+      .Times(2)
+      .WillRepeatedly(Return(false));
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::Not(testing::HasSubstr(
+                                               "--dport 443"))))
+      .Times(2)
+      .WillRepeatedly(Return(false));
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::Not(testing::HasSubstr(
+                                               "--dport 80 "))))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  mock_iptables.PlugOrphanedHoles();
+
+  // The other hole is plugged.
+  EXPECT_FALSE(mock_iptables.PlugTcpHole(443, "iface"));
+  EXPECT_TRUE(mock_iptables.PlugTcpHole(80, "iface"));
+}
+
+TEST_F(IpTablesTest, PunchHolesInBatch) {
+  const std::string add_input =
+      "*filter\n"
+      "-I INPUT -p tcp --dport 80 -i iface "
+      "-m comment --comment firewalld:tcp:80:iface -j ACCEPT\n"
+      "-I INPUT -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j ACCEPT\n"
+      "-I OUTPUT -p udp --sport 53 -o iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j ACCEPT\n"
+      "COMMIT\n"
+      "*raw\n"
+      "-I PREROUTING -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j CT --notrack\n"
+      "-I OUTPUT -p udp --sport 53 -o iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j CT --notrack\n"
+      "COMMIT\n";
+
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(22, ""));
+
+  // New holes are punched with one run per IP version, whatever their
+  // options; the rest is handled one request at a time.
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, add_input))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, add_input))
+      .WillOnce(Return(true));
+  const std::vector<bool> results = mock_iptables.PunchHolesInBatch({
+      {kProtocolTcp, 80, "iface", {}},
+      {kProtocolUdp, 53, "iface", {{"notrack", true}}},
+      {kProtocolTcp, 80, "iface", {}},
+      {kProtocolTcp, 22, "", {}},
+      {kProtocolTcp, 80, "iface", {{"synproxy", true}}},
+      {kProtocolTcp, 0, "iface", {}},
+      {kProtocolUdp, 123, "iface", {{"no_such_option", true}}},
+  });
+  EXPECT_EQ(std::vector<bool>({true, true, true, true, false, false, false}),
+            results);
+
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PlugUdpHole(53, "iface"));
+
+  // The remaining holes are plugged on destruction with one run per IP
+  // version.
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+}
+
+TEST_F(IpTablesTest, PunchHolesInBatchFallsBackToOneAtATime) {
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, _))
+      .WillOnce(Return(false));
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, kProtocolTcp, 80, "iface"))
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, kProtocolTcp, 443, "iface"))
+      .WillRepeatedly(Return(false));
+  EXPECT_EQ(std::vector<bool>({true, false}),
+            mock_iptables.PunchHolesInBatch({{kProtocolTcp, 80, "iface", {}},
+                                             {kProtocolTcp, 443, "iface", {}}}));
+
+  SetMockExpectations(&mock_iptables, true /* success */);
+  EXPECT_FALSE(mock_iptables.PlugTcpHole(443, "iface"));
+
+  // The remaining hole is plugged on destruction.
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+}
+
+TEST_F(IpTablesTest, RuleBuffersStartOverWithEachBatch) {
+  const std::string add_input =
+      "*filter\n"
+      "-I INPUT -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j ACCEPT\n"
+      "-I OUTPUT -p udp --sport 53 -o iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j ACCEPT\n"
+      "COMMIT\n"
+      "*raw\n"
+      "-I PREROUTING -p udp --dport 53 -i iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j CT --notrack\n"
+      "-I OUTPUT -p udp --sport 53 -o iface "
+      "-m comment --comment firewalld:udp:53:iface:notrack -j CT --notrack\n"
+      "COMMIT\n";
+
+  MockIpTables mock_iptables;
+  // A batch large enough for its buffers to be released afterwards.
+  std::vector<IpTables::HoleRequest> requests;
+  for (uint16_t port = 1000; port < 2000; port++) {
+    requests.push_back(
+        {kProtocolTcp, port, "iface", {{"rate_limit", uint32_t{10}}}});
+  }
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).WillRepeatedly(Return(true));
+  EXPECT_EQ(std::vector<bool>(requests.size(), true),
+            mock_iptables.PunchHolesInBatch(requests));
+
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, add_input))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, add_input))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchUdpHoleWithOptions(53, "iface",
+                                                    {{"notrack", true}}));
+
+  SetMockExpectations(&mock_iptables, true /* success */);
+}
+
+TEST_F(IpTablesTest, RulesRenderedOnPunchAreReplayed) {
+  MockIpTables mock_iptables;
+  mock_iptables.EnableIpv6RuleDeferral();
+  EXPECT_CALL(mock_iptables, DisableConntrackTcpLoose())
+      .WillOnce(Return(true));
+  std::string add_input;
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, _))
+      .WillOnce(testing::DoAll(testing::SaveArg<1>(&add_input), Return(true)));
+  ASSERT_TRUE(mock_iptables.PunchTcpHoleWithOptions(
+      80, "iface", {{kHoleOptionRateLimit, static_cast<uint32_t>(10)},
+                    {kHoleOptionSynProxy, true}}));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  // The IPv6 rules added later, and the rules deleted by plugging the hole,
+  // are the ones rendered when it was punched.
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, add_input))
+      .WillOnce(Return(true));
+  mock_iptables.OnIpv6AddressChanged("iface", true /* has_address */);
+  std::string delete_input;
+  for (const auto& line : base::SplitString(add_input, "\n",
+                                            base::KEEP_WHITESPACE,
+                                            base::SPLIT_WANT_NONEMPTY)) {
+    delete_input += base::StartsWith(line, "-I ", base::CompareCase::SENSITIVE)
+                        ? "-D " + line.substr(3)
+                        : line;
+    delete_input += '\n';
+  }
+  EXPECT_CALL(mock_iptables, RunRestore(_, delete_input))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, RestoreConntrackTcpLoose())
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PlugTcpHole(80, "iface"));
+}
+
+TEST_F(IpTablesTest, PunchHoleGroup) {
+  const std::string add_input =
+      "*filter\n"
+      "-I INPUT -p tcp --dport 8008 -i wlan0 "
+      "-m comment --comment firewalld:tcp:8008:wlan0 -j ACCEPT\n"
+      "-I INPUT -p udp --dport 5353 -i wlan0 "
+      "-m comment --comment firewalld:udp:5353:wlan0:notrack -j ACCEPT\n"
+      "-I OUTPUT -p udp --sport 5353 -o wlan0 "
+      "-m comment --comment firewalld:udp:5353:wlan0:notrack -j ACCEPT\n"
+      "COMMIT\n"
+      "*raw\n"
+      "-I PREROUTING -p udp --dport 5353 -i wlan0 "
+      "-m comment --comment firewalld:udp:5353:wlan0:notrack -j CT --notrack\n"
+      "-I OUTPUT -p udp --sport 5353 -o wlan0 "
+      "-m comment --comment firewalld:udp:5353:wlan0:notrack -j CT --notrack\n"
+      "COMMIT\n";
+  const std::string delete_input =
+      "*filter\n"
+      "-D INPUT -p tcp --dport 8008 -i wlan0 "
+      "-m comment --comment firewalld:tcp:8008:wlan0 -j ACCEPT\n"
+      "-D INPUT -p udp --dport 5353 -i wlan0 "
+      "-m comment --comment firewalld:udp:5353:wlan0:notrack -j ACCEPT\n"
+      "-D OUTPUT -p udp --sport 5353 -o wlan0 "
+      "-m comment --comment firewalld:udp:5353:wlan0:notrack -j ACCEPT\n"
+      "COMMIT\n"
+      "*raw\n"
+      "-D PREROUTING -p udp --dport 5353 -i wlan0 "
+      "-m comment --comment firewalld:udp:5353:wlan0:notrack -j CT --notrack\n"
+      "-D OUTPUT -p udp --sport 5353 -o wlan0 "
+      "-m comment --comment firewalld:udp:5353:wlan0:notrack -j CT --notrack\n"
+      "COMMIT\n";
+  HoleOptions notrack;
+  notrack.notrack = true;
+  const std::vector<IpTables::GroupHole> group = {
+      {kProtocolTcp, 8008, HoleOptions()},
+      {kProtocolUdp, 5353, notrack},
+  };
+
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  EXPECT_TRUE(mock_iptables.PunchUdpHole(5353, "wlan0"));
+
+  // A hole of the group that is punched with other options fails the group.
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  EXPECT_FALSE(mock_iptables.PunchHoleGroup(group, "wlan0"));
+  EXPECT_TRUE(mock_iptables.PlugUdpHole(5353, "wlan0"));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  // The whole group goes in one run per IP version, and comes out the same
+  // way.
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, add_input))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, add_input))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchHoleGroup(group, "wlan0"));
+  EXPECT_TRUE(mock_iptables.PunchHoleGroup(group, "wlan0"));
+
+  EXPECT_CALL(mock_iptables, RunRestore(kIpTablesRestorePath, delete_input))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, delete_input))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PlugHoleGroup(group, "wlan0"));
+  EXPECT_FALSE(mock_iptables.PlugUdpHole(5353, "wlan0"));
+}
+
+TEST_F(IpTablesTest, PunchHoleGroupIsAllOrNothing) {
+  const std::vector<IpTables::GroupHole> group = {
+      {kProtocolTcp, 8008, HoleOptions()},
+      {kProtocolTcp, 8009, HoleOptions()},
+  };
+
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables,
+              RunRestore(kIpTablesRestorePath, testing::HasSubstr("-I INPUT")))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, _))
+      .WillOnce(Return(false));
+  EXPECT_CALL(mock_iptables,
+              RunRestore(kIpTablesRestorePath, testing::HasSubstr("-D INPUT")))
+      .WillOnce(Return(true));
+  EXPECT_FALSE(mock_iptables.PunchHoleGroup(group, "wlan0"));
+
+  // Nothing was punched.
+  SetMockExpectations(&mock_iptables, true /* success */);
+  EXPECT_FALSE(mock_iptables.PlugTcpHole(8008, "wlan0"));
+  EXPECT_FALSE(mock_iptables.PlugTcpHole(8009, "wlan0"));
+}
+
+TEST_F(IpTablesTest, RestoreStateFromTaggedRules) {
+  const std::string dump =
+      "# Generated by iptables-save\n"
+      "*raw\n"
+      ":PREROUTING ACCEPT [0:0]\n"
+      "-A PREROUTING -i iface -p udp -m udp --dport 53 "
+      "-m comment --comment \"firewalld:udp:53:iface:notrack\" "
+      "-j CT --notrack\n"
+      "COMMIT\n"
+      "*filter\n"
+      ":INPUT DROP [0:0]\n"
+      "-A INPUT -i iface -p udp -m udp --dport 53 "
+      "-m comment --comment \"firewalld:udp:53:iface:notrack\" -j ACCEPT\n"
+      "-A INPUT -p tcp -m tcp --dport 22 "
+      "-m comment --comment firewalld:tcp:22: -j ACCEPT\n"
+      "-A INPUT -p tcp -m tcp --dport 8080 -j ACCEPT\n"
+      "-A INPUT -p tcp -m tcp --dport 8081 "
+      "-m comment --comment \"not ours\" -j ACCEPT\n"
+      "-A OUTPUT -o iface -p udp -m udp --sport 53 "
+      "-m comment --comment \"firewalld:udp:53:iface:notrack\" -j ACCEPT\n"
+      "-A OUTPUT -o iface -p tcp -m tcp --dport 443 "
+      "-m comment --comment \"firewalld:tcp:443:iface:out\" -j ACCEPT\n"
+      "COMMIT\n";
+
+  MockIpTables mock_iptables;
+  MockXdpFilter xdp_filter;
+  mock_iptables.SetXdpFilter(&xdp_filter);
+  EXPECT_CALL(mock_iptables, DumpRules(kIpTablesSavePath, _))
+      .WillOnce(DoAll(SetArgPointee<1>(dump), Return(true)));
+  EXPECT_CALL(xdp_filter, AddHole(IPPROTO_UDP, 53, "iface"))
+      .WillOnce(Return(true));
+  EXPECT_CALL(xdp_filter, AddHole(IPPROTO_TCP, 22, ""))
+      .WillOnce(Return(true));
+  mock_iptables.RestoreState();
+  EXPECT_TRUE(mock_iptables.HasHoles());
+
+  // Restored holes are already punched, with the options they were tagged
+  // with.
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(22, ""));
+  EXPECT_TRUE(mock_iptables.PunchUdpHoleWithOptions(53, "iface",
+                                                    {{"notrack", true}}));
+  EXPECT_FALSE(mock_iptables.PunchUdpHole(53, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchTcpEgressHole(443, "iface"));
+  EXPECT_FALSE(mock_iptables.PlugTcpHole(443, "iface"));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  // Plugging them removes all of their rules.
+  EXPECT_CALL(mock_iptables,
+              RunRestore(_, testing::AllOf(testing::HasSubstr("-D OUTPUT"),
+                                           testing::HasSubstr("--notrack"))))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(xdp_filter, RemoveHole(IPPROTO_UDP, 53, "iface"))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PlugUdpHole(53, "iface"));
+
+  // Forgotten holes are left open on destruction.
+  mock_iptables.ForgetAllHoles();
+  EXPECT_FALSE(mock_iptables.HasHoles());
+  EXPECT_CALL(mock_iptables, DeleteAcceptRule(_, _, _, _)).Times(0);
+}
+
+TEST_F(IpTablesTest, AdoptStateFromRunningInstance) {
+  base::Pickle state;
+  {
+    MockIpTables running;
+    SetMockExpectations(&running, true /* success */);
+    EXPECT_CALL(running, RunRestore(_, _)).WillRepeatedly(Return(true));
+    EXPECT_TRUE(running.PunchTcpHole(22, ""));
+    EXPECT_TRUE(running.PunchUdpHoleWithOptions(53, "iface",
+                                                {{"notrack", true}}));
+    running.OrphanAllHoles();
+    EXPECT_TRUE(running.PunchTcpHole(22, ""));
+    running.SaveState(&state);
+
+    // The running instance leaves the rules in place once it has handed
+    // them over.
+    running.ForgetAllHoles();
+    testing::Mock::VerifyAndClearExpectations(&running);
+    EXPECT_CALL(running, RunRestore(_, _)).Times(0);
+    EXPECT_CALL(running, DeleteAcceptRule(_, _, _, _)).Times(0);
+  }
+
+  // Malformed state is rejected as a whole.
+  MockIpTables mock_iptables;
+  base::Pickle truncated(static_cast<const char*>(state.data()),
+                         static_cast<int>(state.size()) - 1);
+  base::PickleIterator truncated_iterator(truncated);
+  EXPECT_FALSE(mock_iptables.AdoptState(&truncated_iterator));
+  EXPECT_FALSE(mock_iptables.HasHoles());
+
+  // Adopting the state touches no rule, only fills the XDP filter.
+  MockXdpFilter xdp_filter;
+  mock_iptables.SetXdpFilter(&xdp_filter);
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  EXPECT_CALL(mock_iptables, AddAcceptRule(_, _, _, _)).Times(0);
+  EXPECT_CALL(xdp_filter, AddHole(IPPROTO_TCP, 22, ""))
+      .WillOnce(Return(true));
+  EXPECT_CALL(xdp_filter, AddHole(IPPROTO_UDP, 53, "iface"))
+      .WillOnce(Return(true));
+  base::PickleIterator iterator(state);
+  ASSERT_TRUE(mock_iptables.AdoptState(&iterator));
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(22, ""));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  // The hole that was still orphaned is plugged, with all of its rules, once
+  // the grace period is over.
+  EXPECT_CALL(mock_iptables,
+              RunRestore(_, testing::HasSubstr("firewalld:udp:53:iface:"
+                                               "notrack")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(xdp_filter, RemoveHole(IPPROTO_UDP, 53, "iface"))
+      .WillOnce(Return(true));
+  mock_iptables.PlugOrphanedHoles();
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  mock_iptables.ForgetAllHoles();
+}
+
+TEST_F(IpTablesTest, PlugHoleFlushesConntrack) {
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  mock_iptables.set_flush_conntrack_on_plug(true);
+
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+  EXPECT_CALL(mock_iptables, DeleteConntrackEntries(_))
+      .WillOnce(testing::Invoke(
+          [](const std::vector<ConntrackMatch>& matches) {
+            EXPECT_EQ(1u, matches.size());
+            EXPECT_EQ(IPPROTO_TCP, matches[0].protocol);
+            EXPECT_EQ(80, matches[0].port);
+            EXPECT_EQ("iface", matches[0].interface);
+            return true;
+          }));
+  EXPECT_TRUE(mock_iptables.PlugTcpHole(80, "iface"));
+
+  // Failing to plug leaves conntrack alone.
+  EXPECT_FALSE(mock_iptables.PlugTcpHole(80, "iface"));
+}
+
+TEST_F(IpTablesTest, PlugAllHolesFlushesConntrackOnce) {
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  mock_iptables.set_flush_conntrack_on_plug(true);
+
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(443, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchUdpHole(53, ""));
+  EXPECT_CALL(mock_iptables, DeleteConntrackEntries(testing::SizeIs(3)))
+      .WillOnce(Return(true));
+  mock_iptables.PlugAllHoles();
+}
+
+TEST_F(IpTablesTest, PlugHoleWithoutConntrackFlush) {
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  EXPECT_CALL(mock_iptables, DeleteConntrackEntries(_)).Times(0);
+
+  EXPECT_TRUE(mock_iptables.PunchUdpHole(53, "iface"));
+  EXPECT_TRUE(mock_iptables.PlugUdpHole(53, "iface"));
+}
+
+TEST_F(IpTablesTest, Ipv6RulesDeferredUntilAddressAppears) {
+  MockIpTables mock_iptables;
+  mock_iptables.EnableIpv6RuleDeferral();
+  SetMockExpectationsPerExecutable(
+      &mock_iptables, true /* ip4_success */, true /* ip6_success */);
+  EXPECT_CALL(mock_iptables, AddAcceptRule(kIp6TablesPath, _, _, "iface"))
+      .Times(0);
+
+  // Without an IPv6 address, only the IPv4 rules are added.
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+  EXPECT_TRUE(mock_iptables.PunchUdpHole(53, "iface"));
+  // Holes on other interfaces are left alone.
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(22, ""));
+
+  // Once the interface gets an address, all of its IPv6 rules are added at
+  // once.
+  EXPECT_CALL(mock_iptables,
+              RunRestore(kIp6TablesRestorePath,
+                         "*filter\n"
+                         "-I INPUT -p tcp --dport 80 -i iface "
+                         "-m comment --comment firewalld:tcp:80:iface "
+                         "-j ACCEPT\n"
+                         "-I INPUT -p udp --dport 53 -i iface "
+                         "-m comment --comment firewalld:udp:53:iface "
+                         "-j ACCEPT\n"
+                         "COMMIT\n"))
+      .WillOnce(Return(true));
+  mock_iptables.OnIpv6AddressChanged("iface", true /* has_address */);
+  EXPECT_TRUE(mock_iptables.HasIpv6Rules("iface"));
+
+  // Repeated notifications are ignored.
+  mock_iptables.OnIpv6AddressChanged("iface", true /* has_address */);
+
+  // The remaining holes are plugged on destruction with one run per IP
+  // version.
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+}
+
+TEST_F(IpTablesTest, Ipv6RulesNotTrackedWhenAddingThemFails) {
+  MockIpTables mock_iptables;
+  mock_iptables.EnableIpv6RuleDeferral();
+  SetMockExpectationsPerExecutable(
+      &mock_iptables, true /* ip4_success */, true /* ip6_success */);
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, _))
+      .WillOnce(Return(false));
+  mock_iptables.OnIpv6AddressChanged("iface", true /* has_address */);
+  EXPECT_FALSE(mock_iptables.HasIpv6Rules("iface"));
+
+  // Plugging the hole leaves IPv6 alone, since it has no IPv6 rule.
+  EXPECT_CALL(mock_iptables, DeleteAcceptRule(kIp6TablesPath, _, _, _))
+      .Times(0);
+  EXPECT_TRUE(mock_iptables.PlugTcpHole(80, "iface"));
+}
+
+TEST_F(IpTablesTest, Ipv6RulesRetriedAfterAddingThemFails) {
+  MockIpTables mock_iptables;
+  mock_iptables.EnableIpv6RuleDeferral();
+  SetMockExpectationsPerExecutable(
+      &mock_iptables, true /* ip4_success */, true /* ip6_success */);
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+
+  EXPECT_CALL(mock_iptables, RunRestore(kIp6TablesRestorePath, _))
+      .WillOnce(Return(false))
+      .WillOnce(Return(true));
+  mock_iptables.OnIpv6AddressChanged("iface", true /* has_address */);
+  EXPECT_FALSE(mock_iptables.HasIpv6Rules("iface"));
+
+  // The interface keeps its address, so no change is reported: the retry
+  // adds the rules.
+  mock_iptables.RetryPendingIpv6Rules();
+  EXPECT_TRUE(mock_iptables.HasIpv6Rules("iface"));
+  mock_iptables.RetryPendingIpv6Rules();
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+  SetMockExpectationsPerExecutable(
+      &mock_iptables, true /* ip4_success */, true /* ip6_success */);
+
+  // Holes punched since get their IPv6 rule right away.
+  EXPECT_CALL(mock_iptables,
+              AddAcceptRule(kIp6TablesPath, kProtocolTcp, 443, "iface"))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(443, "iface"));
+}
+
+TEST_F(IpTablesTest, Ipv6RulesRemovedWhenAddressGoesAway) {
+  MockIpTables mock_iptables;
+  mock_iptables.EnableIpv6RuleDeferral();
+  SetMockExpectationsPerExecutable(
+      &mock_iptables, true /* ip4_success */, true /* ip6_success */);
+
+  // With no holes on the interface, there is nothing to add.
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  mock_iptables.OnIpv6AddressChanged("iface", true /* has_address */);
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+  SetMockExpectationsPerExecutable(
+      &mock_iptables, true /* ip4_success */, true /* ip6_success */);
+
+  // With an address, the IPv6 rule is added right away.
+  EXPECT_CALL(mock_iptables, AddAcceptRule(kIp6TablesPath, kProtocolTcp, 80,
+                                           "iface"))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchTcpHole(80, "iface"));
+
+  EXPECT_CALL(mock_iptables,
+              RunRestore(kIp6TablesRestorePath,
+                         "*filter\n"
+                         "-D INPUT -p tcp --dport 80 -i iface "
+                         "-m comment --comment firewalld:tcp:80:iface "
+                         "-j ACCEPT\n"
+                         "COMMIT\n"))
+      .WillOnce(Return(true));
+  mock_iptables.OnIpv6AddressChanged("iface", false /* has_address */);
+  EXPECT_FALSE(mock_iptables.HasIpv6Rules("iface"));
+
+  // The hole is still tracked, and plugging it leaves IPv6 alone.
+  EXPECT_CALL(mock_iptables, DeleteAcceptRule(kIp6TablesPath, _, _, "iface"))
+      .Times(0);
+  EXPECT_TRUE(mock_iptables.PlugTcpHole(80, "iface"));
+}
+
 TEST_F(IpTablesTest, ApplyVpnSetupAdd_Success) {
   const std::vector<std::string> usernames = {"testuser0", "testuser1"};
   const std::string interface = "ifc0";
@@ -350,4 +1370,712 @@ TEST_F(IpTablesTest, ApplyVpnSetupRemove_Failure) {
   ASSERT_FALSE(mock_iptables.ApplyVpnSetup(usernames, interface, remove));
 }
 
+TEST_F(IpTablesTest, ApplyVpnSetupWithUidRanges) {
+  const std::string interface = "ifc0";
+  const bool remove = false;
+  const bool add = true;
+
+  MockIpTables mock_iptables;
+  mock_iptables.EnableUidRangeRouting();
+  EXPECT_CALL(mock_iptables, LookUpUid("user0", _))
+      .WillRepeatedly(DoAll(SetArgPointee<1>(1000), Return(true)));
+  EXPECT_CALL(mock_iptables, LookUpUid("user1", _))
+      .WillRepeatedly(DoAll(SetArgPointee<1>(1001), Return(true)));
+  EXPECT_CALL(mock_iptables, LookUpUid("user2", _))
+      .WillRepeatedly(DoAll(SetArgPointee<1>(1002), Return(true)));
+  EXPECT_CALL(mock_iptables, LookUpUid("user5", _))
+      .WillRepeatedly(DoAll(SetArgPointee<1>(1005), Return(true)));
+  // Nothing goes through the mangle table.
+  EXPECT_CALL(mock_iptables, ApplyMarkForUserTraffic(_, _)).Times(0);
+  EXPECT_CALL(mock_iptables, ApplyRuleForUserTraffic(_)).Times(0);
+  EXPECT_CALL(mock_iptables, ApplyMasquerade(interface, _))
+      .WillRepeatedly(Return(true));
+
+  // Consecutive user IDs share a rule.
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1000, 1001}, add))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1005, 1005}, add))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(mock_iptables.ApplyVpnSetup({"user0", "user1", "user5"},
+                                          interface, add));
+
+  // Adding a user only replaces the range it extends.
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1000, 1002}, add))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1000, 1001}, remove))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(mock_iptables.ApplyVpnSetup({"user2"}, interface, add));
+
+  // Removing the first setup leaves the second one's user routed.
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1002, 1002}, add))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1000, 1002}, remove))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1005, 1005}, remove))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(mock_iptables.ApplyVpnSetup({"user0", "user1", "user5"},
+                                          interface, remove));
+}
+
+TEST_F(IpTablesTest, ApplyVpnSetupWithUidRanges_FailureInRule) {
+  const std::string interface = "ifc0";
+  const bool remove = false;
+  const bool add = true;
+
+  MockIpTables mock_iptables;
+  mock_iptables.EnableUidRangeRouting();
+  EXPECT_CALL(mock_iptables, LookUpUid("user0", _))
+      .WillOnce(DoAll(SetArgPointee<1>(1000), Return(true)));
+  EXPECT_CALL(mock_iptables, LookUpUid("user5", _))
+      .WillOnce(DoAll(SetArgPointee<1>(1005), Return(true)));
+  EXPECT_CALL(mock_iptables, ApplyMasquerade(interface, add))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1000, 1000}, add))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1005, 1005}, add))
+      .WillOnce(Return(false));
+
+  // Everything is rolled back.
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1005, 1005}, remove))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1000, 1000}, remove))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyMasquerade(interface, remove))
+      .WillOnce(Return(true));
+
+  ASSERT_FALSE(mock_iptables.ApplyVpnSetup({"user0", "user5"}, interface, add));
+}
+
+TEST_F(IpTablesTest, RestoreStateWithUidRanges) {
+  const std::string interface = "ifc0";
+  const bool remove = false;
+  const bool add = true;
+
+  MockIpTables mock_iptables;
+  mock_iptables.EnableUidRangeRouting();
+  EXPECT_CALL(mock_iptables, DumpRules(_, _)).WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, GetUidRangeRules(_))
+      .WillOnce(DoAll(SetArgPointee<0>(std::vector<UidRange>{
+                          {1000, 1001}, {0, 4294967294u}}),
+                      Return(true)));
+  mock_iptables.RestoreState();
+  EXPECT_FALSE(mock_iptables.HasHoles());
+  // The range no VPN could have set up is ignored.
+  EXPECT_EQ(2, mock_iptables.GetGauges()["vpn.users"]);
+  EXPECT_EQ(1, mock_iptables.GetGauges()["vpn.uid_ranges"]);
+
+  // Removing a restored user only replaces the range it was part of.
+  EXPECT_CALL(mock_iptables, LookUpUid("user1", _))
+      .WillOnce(DoAll(SetArgPointee<1>(1001), Return(true)));
+  EXPECT_CALL(mock_iptables, ApplyMasquerade(interface, remove))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1000, 1000}, add))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1000, 1001}, remove))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(mock_iptables.ApplyVpnSetup({"user1"}, interface, remove));
+}
+
+TEST_F(IpTablesTest, RestoreStateWithLockdown) {
+  const std::string dump =
+      "*filter\n"
+      ":OUTPUT ACCEPT [0:0]\n"
+      "-A OUTPUT ! -o ifc0 -m owner --uid-owner 1000-1001 "
+      "-m addrtype ! --dst-type LOCAL "
+      "-m comment --comment firewalld:lockdown:ifc0 "
+      "-j REJECT --reject-with icmp-port-unreachable\n"
+      "COMMIT\n";
+  const bool remove = false;
+
+  MockIpTables mock_iptables;
+  mock_iptables.EnableUidRangeRouting();
+  EXPECT_CALL(mock_iptables, DumpRules(kIpTablesSavePath, _))
+      .WillOnce(DoAll(SetArgPointee<1>(dump), Return(true)));
+  EXPECT_CALL(mock_iptables, GetUidRangeRules(_))
+      .WillOnce(DoAll(SetArgPointee<0>(std::vector<UidRange>{{1000, 1001}}),
+                      Return(true)));
+  mock_iptables.RestoreState();
+  EXPECT_EQ("ifc0", mock_iptables.lockdown_interface_);
+  EXPECT_TRUE(mock_iptables.HasVpnSetups());
+
+  // Removing the restored setup lifts the lockdown.
+  EXPECT_CALL(mock_iptables, LookUpUid("user0", _))
+      .WillOnce(DoAll(SetArgPointee<1>(1000), Return(true)));
+  EXPECT_CALL(mock_iptables, LookUpUid("user1", _))
+      .WillOnce(DoAll(SetArgPointee<1>(1001), Return(true)));
+  EXPECT_CALL(mock_iptables, ApplyMasquerade("ifc0", remove))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(UidRange{1000, 1001}, remove))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyLockdownRuleForRange(UidRange{1000, 1001},
+                                                       "ifc0", remove))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(mock_iptables.RemoveVpnSetup({"user0", "user1"}, "ifc0"));
+  EXPECT_TRUE(mock_iptables.lockdown_interface_.empty());
+  EXPECT_FALSE(mock_iptables.HasVpnSetups());
+}
+
+TEST_F(IpTablesTest, VpnLockdown) {
+  const bool remove = false;
+  const bool add = true;
+  const brillo::VariantDictionary lockdown = {{kVpnOptionLockdown, true}};
+
+  MockIpTables mock_iptables;
+  EXPECT_CALL(mock_iptables, ApplyRuleForUserTraffic(_))
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyMasquerade(_, _))
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyMarkForUserTraffic(_, _))
+      .WillRepeatedly(Return(true));
+
+  // One rule locks down every user, whichever setup they come from.
+  EXPECT_CALL(mock_iptables, ApplyLockdownRule("ifc0", add))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(mock_iptables.RequestVpnSetupWithOptions({"user0"}, "ifc0",
+                                                       lockdown));
+  ASSERT_TRUE(mock_iptables.RequestVpnSetupWithOptions({"user1"}, "ifc0",
+                                                       lockdown));
+  ASSERT_TRUE(mock_iptables.RequestVpnSetup({"user2"}, "ifc0"));
+  EXPECT_EQ("ifc0", mock_iptables.lockdown_interface_);
+
+  // Users can't be locked down to two interfaces at once.
+  EXPECT_FALSE(mock_iptables.RequestVpnSetupWithOptions({"user3"}, "ifc1",
+                                                        lockdown));
+  EXPECT_FALSE(mock_iptables.RequestVpnSetupWithOptions(
+      {"user3"}, "ifc0", {{"kill_switch", true}}));
+
+  // The lockdown is lifted with the last setup on its interface.
+  ASSERT_TRUE(mock_iptables.RemoveVpnSetup({"user0"}, "ifc0"));
+  ASSERT_TRUE(mock_iptables.RemoveVpnSetup({"user1"}, "ifc0"));
+  EXPECT_CALL(mock_iptables, ApplyLockdownRule("ifc0", remove))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(mock_iptables.RemoveVpnSetup({"user2"}, "ifc0"));
+  EXPECT_TRUE(mock_iptables.lockdown_interface_.empty());
+
+  // A failed setup takes its lockdown back.
+  EXPECT_CALL(mock_iptables, ApplyLockdownRule("ifc1", add))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyMarkForUserTraffic("user4", add))
+      .WillOnce(Return(false));
+  EXPECT_CALL(mock_iptables, ApplyLockdownRule("ifc1", remove))
+      .WillOnce(Return(true));
+  EXPECT_FALSE(mock_iptables.RequestVpnSetupWithOptions({"user4"}, "ifc1",
+                                                        lockdown));
+  EXPECT_TRUE(mock_iptables.lockdown_interface_.empty());
+}
+
+TEST_F(IpTablesTest, VpnLockdownWithUidRanges) {
+  const std::string interface = "ifc0";
+  const bool remove = false;
+  const bool add = true;
+
+  MockIpTables mock_iptables;
+  mock_iptables.EnableUidRangeRouting();
+  EXPECT_CALL(mock_iptables, LookUpUid("user0", _))
+      .WillRepeatedly(DoAll(SetArgPointee<1>(1000), Return(true)));
+  EXPECT_CALL(mock_iptables, LookUpUid("user1", _))
+      .WillRepeatedly(DoAll(SetArgPointee<1>(1001), Return(true)));
+  EXPECT_CALL(mock_iptables, ApplyMasquerade(interface, _))
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyUidRangeRule(_, _))
+      .WillRepeatedly(Return(true));
+
+  // Users routed before the lockdown are locked down along with it.
+  ASSERT_TRUE(mock_iptables.RequestVpnSetup({"user0"}, interface));
+  EXPECT_CALL(mock_iptables,
+              ApplyLockdownRuleForRange(UidRange{1000, 1000}, interface, add))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables,
+              ApplyLockdownRuleForRange(UidRange{1000, 1001}, interface, add))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyLockdownRuleForRange(UidRange{1000, 1000},
+                                                       interface, remove))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(mock_iptables.RequestVpnSetupWithOptions(
+      {"user1"}, interface, {{kVpnOptionLockdown, true}}));
+
+  EXPECT_CALL(mock_iptables, ApplyLockdownRuleForRange(UidRange{1000, 1000},
+                                                       interface, add))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyLockdownRuleForRange(UidRange{1000, 1001},
+                                                       interface, remove))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(mock_iptables.RemoveVpnSetup({"user1"}, interface));
+  EXPECT_CALL(mock_iptables, ApplyLockdownRuleForRange(UidRange{1000, 1000},
+                                                       interface, remove))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(mock_iptables.RemoveVpnSetup({"user0"}, interface));
+  EXPECT_TRUE(mock_iptables.lockdown_interface_.empty());
+}
+
+TEST_F(IpTablesTest, PunchAppScopedHoles) {
+  MockAppSocketFilter app_socket_filter;
+  MockIpTables mock_iptables;
+  // Without the filter, holes can't be scoped.
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      8080, "iface", {{kHoleOptionCgroup, std::string("/apps/foo")}}));
+  mock_iptables.SetAppSocketFilter(&app_socket_filter);
+
+  {
+    // The scope is in place before the port opens.
+    testing::InSequence sequence;
+    EXPECT_CALL(app_socket_filter, AddHole(IPPROTO_TCP, 8080, "/apps/foo", 0))
+        .WillOnce(Return(true));
+    EXPECT_CALL(mock_iptables,
+                RunRestore(_, testing::HasSubstr(
+                                  "firewalld:tcp:8080:iface:cgroup=/apps/foo "
+                                  "-j ACCEPT\n")))
+        .Times(2)
+        .WillRepeatedly(Return(true));
+  }
+  EXPECT_TRUE(mock_iptables.PunchTcpHoleWithOptions(
+      8080, "iface", {{kHoleOptionCgroup, std::string("/apps/foo")}}));
+  EXPECT_CALL(app_socket_filter, AddHole(IPPROTO_UDP, 53, "", 1000))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables,
+              RunRestore(_, testing::HasSubstr("firewalld:udp:53::uid=1000")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PunchUdpHoleWithOptions(
+      53, "", {{kHoleOptionUid, static_cast<uint32_t>(1000)}}));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+  testing::Mock::VerifyAndClearExpectations(&app_socket_filter);
+
+  // A hole the filter can't scope isn't punched.
+  EXPECT_CALL(app_socket_filter, AddHole(IPPROTO_TCP, 22, "/apps/bar", 0))
+      .WillOnce(Return(false));
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      22, "iface", {{kHoleOptionCgroup, std::string("/apps/bar")}}));
+  // Nor is one with a malformed scope.
+  EXPECT_CALL(app_socket_filter, AddHole(_, _, _, _)).Times(0);
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      22, "iface", {{kHoleOptionCgroup, std::string("/apps/../bar")}}));
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      22, "iface", {{kHoleOptionCgroup, std::string("apps/bar")}}));
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      22, "iface", {{kHoleOptionCgroup, std::string("/apps/bar")},
+                    {kHoleOptionUid, static_cast<uint32_t>(1000)}}));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+  testing::Mock::VerifyAndClearExpectations(&app_socket_filter);
+
+  EXPECT_CALL(app_socket_filter, RemoveHole(IPPROTO_UDP, 53))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_TRUE(mock_iptables.PlugUdpHole(53, ""));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  // The holes of a removed cgroup are plugged together.
+  EXPECT_CALL(app_socket_filter, RemoveHole(IPPROTO_TCP, 8080))
+      .WillOnce(Return(true));
+  EXPECT_CALL(mock_iptables, RunRestore(_, testing::HasSubstr("-D INPUT")))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  mock_iptables.OnCgroupRemoved("/apps/other");
+  EXPECT_TRUE(mock_iptables.HasHoles());
+  mock_iptables.OnCgroupRemoved("/apps/foo");
+  EXPECT_FALSE(mock_iptables.HasHoles());
+}
+
+TEST_F(IpTablesTest, AppScopedPortsAreNotSharedWithOtherScopes) {
+  MockAppSocketFilter app_socket_filter;
+  MockIpTables mock_iptables;
+  mock_iptables.SetAppSocketFilter(&app_socket_filter);
+  SetMockExpectations(&mock_iptables, true /* success */);
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).WillRepeatedly(Return(true));
+  const brillo::VariantDictionary scope{
+      {kHoleOptionCgroup, std::string("/apps/foo")}};
+
+  // A scoped hole first: the port can only be opened to the same app on
+  // other interfaces.
+  EXPECT_CALL(app_socket_filter, AddHole(IPPROTO_TCP, 8080, "/apps/foo", 0))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  ASSERT_TRUE(mock_iptables.PunchTcpHoleWithOptions(8080, "eth0", scope));
+  EXPECT_TRUE(mock_iptables.PunchTcpHoleWithOptions(8080, "wlan0", scope));
+  EXPECT_FALSE(mock_iptables.PunchTcpHole(8080, "wlan1"));
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(
+      8080, "wlan1", {{kHoleOptionUid, static_cast<uint32_t>(1000)}}));
+  EXPECT_EQ(std::vector<bool>{false},
+            mock_iptables.PunchHolesInBatch(
+                {{kProtocolTcp, 8080, "wlan1", {}, false /* egress */}}));
+  EXPECT_FALSE(mock_iptables.PunchHoleGroup(
+      {{kProtocolTcp, 8080, HoleOptions()}}, "wlan1"));
+  // Other ports, protocols and directions are unaffected.
+  EXPECT_TRUE(mock_iptables.PunchUdpHole(8080, "wlan1"));
+  EXPECT_TRUE(mock_iptables.PunchTcpEgressHole(8080, "wlan1"));
+  testing::Mock::VerifyAndClearExpectations(&app_socket_filter);
+
+  // An unscoped hole first: the port can't be scoped on other interfaces.
+  EXPECT_CALL(app_socket_filter, AddHole(_, _, _, _)).Times(0);
+  ASSERT_TRUE(mock_iptables.PunchTcpHole(443, "eth0"));
+  EXPECT_FALSE(mock_iptables.PunchTcpHoleWithOptions(443, "wlan0", scope));
+  EXPECT_EQ(std::vector<bool>{false},
+            mock_iptables.PunchHolesInBatch(
+                {{kProtocolTcp, 443, "wlan0", scope, false /* egress */}}));
+  // Nor in the batch that opens it.
+  EXPECT_EQ((std::vector<bool>{true, false}),
+            mock_iptables.PunchHolesInBatch(
+                {{kProtocolTcp, 22, "eth0", {}, false /* egress */},
+                 {kProtocolTcp, 22, "wlan0", scope, false /* egress */}}));
+
+  EXPECT_CALL(app_socket_filter, RemoveHole(IPPROTO_TCP, 8080))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+}
+
+TEST_F(IpTablesTest, GaugesFollowHolesAndVpnSetups) {
+  MockIpTables mock_iptables;
+  SetMockExpectations(&mock_iptables, true /* success */);
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyRuleForUserTraffic(_))
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyMasquerade(_, _))
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyMarkForUserTraffic(_, _))
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_iptables, ApplyLockdownRule(_, _))
+      .WillRepeatedly(Return(true));
+  mock_iptables.EnableIpv6RuleDeferral();
+
+  // Holes on "iface" have no IPv6 rules until it has an IPv6 address.
+  ASSERT_TRUE(mock_iptables.PunchTcpHole(22, ""));
+  ASSERT_TRUE(mock_iptables.PunchUdpHoleWithOptions(
+      53, "iface", {{kHoleOptionNoTrack, true}}));
+  ASSERT_TRUE(mock_iptables.PunchTcpHoleWithOptions(
+      80, "iface", {{kHoleOptionRateLimit, static_cast<uint32_t>(10)},
+                    {kHoleOptionRateLimitConnections, true}}));
+  std::map<std::string, int64_t> gauges = mock_iptables.GetGauges();
+  EXPECT_EQ(5, gauges["rules.ipv4.filter.INPUT"]);
+  EXPECT_EQ(1, gauges["rules.ipv4.filter.OUTPUT"]);
+  EXPECT_EQ(1, gauges["rules.ipv4.raw.PREROUTING"]);
+  EXPECT_EQ(1, gauges["rules.ipv4.raw.OUTPUT"]);
+  EXPECT_EQ(1, gauges["rules.ipv6.filter.INPUT"]);
+  EXPECT_EQ(5, gauges["input_depth"]);
+
+  mock_iptables.OnIpv6AddressChanged("iface", true /* has_address */);
+  gauges = mock_iptables.GetGauges();
+  EXPECT_EQ(5, gauges["rules.ipv6.filter.INPUT"]);
+  EXPECT_EQ(1, gauges["rules.ipv6.raw.OUTPUT"]);
+
+  ASSERT_TRUE(mock_iptables.RequestVpnSetupWithOptions(
+      {"user0", "user1"}, "ifc0", {{kVpnOptionLockdown, true}}));
+  gauges = mock_iptables.GetGauges();
+  EXPECT_EQ(2, gauges["vpn.users"]);
+  EXPECT_EQ(2, gauges["rules.ipv4.mangle.OUTPUT"]);
+  EXPECT_EQ(1, gauges["rules.ipv6.nat.POSTROUTING"]);
+  // The lockdown rule and the notrack hole's reply rule.
+  EXPECT_EQ(2, gauges["rules.ipv4.filter.OUTPUT"]);
+
+  ASSERT_TRUE(mock_iptables.RemoveVpnSetup({"user0", "user1"}, "ifc0"));
+  mock_iptables.PlugAllHoles();
+  gauges = mock_iptables.GetGauges();
+  EXPECT_EQ(0, gauges["input_depth"]);
+  EXPECT_EQ(0, gauges["vpn.users"]);
+  EXPECT_EQ(0, gauges.count("rules.ipv4.filter.INPUT"));
+  EXPECT_EQ(0, gauges.count("rules.ipv4.mangle.OUTPUT"));
+}
+
+TEST_F(IpTablesTest, AddAndRemovePortForwards) {
+  MockIpTables mock_iptables;
+
+  // The first forward on an interface creates its chain.
+  EXPECT_CALL(mock_iptables,
+              RunRestore(kIpTablesRestorePath,
+                         "*nat\n"
+                         ":fwd-eth0 - [0:0]\n"
+                         "-A fwd-eth0 -p tcp --dport 8080 "
+                         "-m comment --comment firewalld:tcp:8080:eth0:fwd "
+                         "-j DNAT --to-destination 100.115.92.2:80\n"
+                         "-I PREROUTING -i eth0 -j fwd-eth0\n"
+                         "COMMIT\n"))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.AddPortForward(kProtocolTcp, "eth0", 8080,
+                                           "100.115.92.2:80"));
+  // The others are a single rule each.
+  EXPECT_CALL(mock_iptables,
+              RunRestore(kIpTablesRestorePath,
+                         "*nat\n"
+                         "-A fwd-eth0 -p udp --dport 5353 "
+                         "-m comment --comment firewalld:udp:5353:eth0:fwd "
+                         "-j DNAT --to-destination 100.115.92.2\n"
+                         "COMMIT\n"))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.AddPortForward(kProtocolUdp, "eth0", 5353,
+                                           "100.115.92.2"));
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  EXPECT_CALL(mock_iptables, RunRestore(_, _)).Times(0);
+  // Adding a forward again is a no-op, forwarding it elsewhere fails.
+  EXPECT_TRUE(mock_iptables.AddPortForward(kProtocolTcp, "eth0", 8080,
+                                           "100.115.92.2:80"));
+  EXPECT_FALSE(mock_iptables.AddPortForward(kProtocolTcp, "eth0", 8080,
+                                            "100.115.92.3:80"));
+  EXPECT_FALSE(mock_iptables.AddPortForward(kProtocolTcp, "eth0", 0,
+                                            "100.115.92.2"));
+  EXPECT_FALSE(mock_iptables.AddPortForward(kProtocolTcp, "", 22,
+                                            "100.115.92.2"));
+  EXPECT_FALSE(mock_iptables.AddPortForward(kProtocolTcp, "eth0", 22,
+                                            "100.115.92.2:0"));
+  EXPECT_FALSE(mock_iptables.AddPortForward(kProtocolTcp, "eth0", 22,
+                                            "fe80::1"));
+  EXPECT_FALSE(mock_iptables.RemovePortForward(kProtocolTcp, "eth0", 8080,
+                                               "100.115.92.3:80"));
+  EXPECT_FALSE(mock_iptables.RemovePortForward(kProtocolUdp, "eth0", 8080,
+                                               "100.115.92.2:80"));
+
+  std::map<std::string, int64_t> gauges = mock_iptables.GetGauges();
+  EXPECT_EQ(2, gauges["port_forwards"]);
+  EXPECT_EQ(1, gauges["rules.ipv4.nat.PREROUTING"]);
+  testing::Mock::VerifyAndClearExpectations(&mock_iptables);
+
+  EXPECT_CALL(mock_iptables,
+              RunRestore(kIpTablesRestorePath,
+                         "*nat\n"
+                         "-D fwd-eth0 -p udp --dport 5353 "
+                         "-m comment --comment firewalld:udp:5353:eth0:fwd "
+                         "-j DNAT --to-destination 100.115.92.2\n"
+                         "COMMIT\n"))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.RemovePortForward(kProtocolUdp, "eth0", 5353,
+                                              "100.115.92.2"));
+  // The last one takes the chain with it, here on destruction.
+  EXPECT_CALL(mock_iptables,
+              RunRestore(kIpTablesRestorePath,
+                         "*nat\n"
+                         "-D fwd-eth0 -p tcp --dport 8080 "
+                         "-m comment --comment firewalld:tcp:8080:eth0:fwd "
+                         "-j DNAT --to-destination 100.115.92.2:80\n"
+                         "-D PREROUTING -i eth0 -j fwd-eth0\n"
+                         "-X fwd-eth0\n"
+                         "COMMIT\n"))
+      .WillOnce(Return(true));
+}
+
+TEST_F(IpTablesTest, PortForwardsOutliveTheDaemon) {
+  const std::string dump =
+      "*nat\n"
+      ":PREROUTING ACCEPT [0:0]\n"
+      ":fwd-eth0 - [0:0]\n"
+      "-A PREROUTING -i eth0 -j fwd-eth0\n"
+      "-A fwd-eth0 -p tcp -m tcp --dport 8080 "
+      "-m comment --comment firewalld:tcp:8080:eth0:fwd "
+      "-j DNAT --to-destination 100.115.92.2:80\n"
+      "-A fwd-eth0 -p tcp -m tcp --dport 8081 "
+      "-j DNAT --to-destination 100.115.92.2:81\n"
+      "COMMIT\n";
+
+  base::Pickle state;
+  {
+    MockIpTables restarted;
+    EXPECT_CALL(restarted, DumpRules(kIpTablesSavePath, _))
+        .WillOnce(DoAll(SetArgPointee<1>(dump), Return(true)));
+    restarted.RestoreState();
+    EXPECT_EQ(1, restarted.GetGauges()["port_forwards"]);
+
+    // Restored forwards are already added.
+    EXPECT_CALL(restarted, RunRestore(_, _)).Times(0);
+    EXPECT_TRUE(restarted.AddPortForward(kProtocolTcp, "eth0", 8080,
+                                         "100.115.92.2:80"));
+    restarted.SaveState(&state);
+    restarted.ForgetAllHoles();
+  }
+
+  MockIpTables mock_iptables;
+  base::PickleIterator iterator(state);
+  ASSERT_TRUE(mock_iptables.AdoptState(&iterator));
+  EXPECT_CALL(mock_iptables,
+              RunRestore(kIpTablesRestorePath,
+                         testing::HasSubstr("-X fwd-eth0\n")))
+      .WillOnce(Return(true));
+  EXPECT_TRUE(mock_iptables.RemovePortForward(kProtocolTcp, "eth0", 8080,
+                                              "100.115.92.2:80"));
+}
+
+TEST_F(IpTablesTest, ChildUsageIsAggregatedPerExecutable) {
+  MockIpTables mock_iptables;
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  usage.ru_utime.tv_usec = 1500;
+  usage.ru_stime.tv_sec = 1;
+  usage.ru_maxrss = 2048;
+  usage.ru_minflt = 100;
+  usage.ru_majflt = 1;
+  mock_iptables.RecordChildUsage(kIpTablesRestorePath, usage);
+  usage.ru_maxrss = 1024;
+  mock_iptables.RecordChildUsage(kIpTablesRestorePath, usage);
+  mock_iptables.RecordChildUsage(kIpTablesPath, usage);
+
+  const auto& child_usage = mock_iptables.child_usage();
+  ASSERT_EQ(2u, child_usage.size());
+  const IpTables::ChildUsage& restore = child_usage.at("iptables-restore");
+  EXPECT_EQ(2u, restore.runs);
+  EXPECT_EQ(3000, restore.user_time.InMicroseconds());
+  EXPECT_EQ(2000000, restore.system_time.InMicroseconds());
+  EXPECT_EQ(2048, restore.max_rss_kb);
+  EXPECT_EQ(200u, restore.minor_faults);
+  EXPECT_EQ(2u, restore.major_faults);
+  EXPECT_EQ(1u, child_usage.at("iptables").runs);
+  EXPECT_EQ(1024, child_usage.at("iptables").max_rss_kb);
+}
+
+// Stands in for the kernel and the processes the daemon spawns. It counts
+// spawns per executable, and commits, which are the tables an 'iptables' run
+// updates or the routing rules updated over netlink. Everything succeeds.
+class CountingIpTables : public IpTables {
+ public:
+  CountingIpTables() = default;
+  ~CountingIpTables() override { PlugAllHoles(); }
+
+  void ResetCounts() {
+    spawns_.clear();
+    commits_ = 0;
+  }
+
+  int spawns() const {
+    int total = 0;
+    for (const auto& spawns : spawns_) {
+      total += spawns.second;
+    }
+    return total;
+  }
+  int spawns(const std::string& executable) const {
+    auto spawns = spawns_.find(executable);
+    return spawns != spawns_.end() ? spawns->second : 0;
+  }
+  int commits() const { return commits_; }
+
+ private:
+  void CountSpawn(const std::vector<std::string>& argv) {
+    spawns_[base::FilePath(argv[0]).BaseName().value()]++;
+  }
+
+  int ExecvNonRoot(const std::vector<std::string>& argv,
+                   uint64_t capmask) override {
+    CountSpawn(argv);
+    commits_++;
+    return 0;
+  }
+  int ExecvNonRootWithInput(const std::vector<std::string>& argv,
+                            uint64_t capmask,
+                            const std::string& input) override {
+    CountSpawn(argv);
+    for (size_t pos = input.find("COMMIT\n"); pos != std::string::npos;
+         pos = input.find("COMMIT\n", pos + 1)) {
+      commits_++;
+    }
+    return 0;
+  }
+  int ExecvNonRootWithOutput(const std::vector<std::string>& argv,
+                             uint64_t capmask,
+                             std::string* output) override {
+    CountSpawn(argv);
+    output->clear();
+    return 0;
+  }
+
+  // 'ip rule' is run for each IP version outside of the jail.
+  bool ApplyRuleForUserTraffic(bool add) override {
+    spawns_["ip"] += 2;
+    commits_ += 2;
+    return true;
+  }
+  bool ApplyUidRangeRule(const UidRange& range, bool add) override {
+    commits_ += 2;
+    return true;
+  }
+  // Users are named after their user ID.
+  bool LookUpUid(const std::string& username, uid_t* uid) override {
+    *uid = std::stoul(username.substr(strlen("user")));
+    return true;
+  }
+
+  std::map<std::string, int> spawns_;
+  int commits_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(CountingIpTables);
+};
+
+std::vector<std::string> VpnUsers(int count) {
+  std::vector<std::string> usernames;
+  for (int i = 0; i < count; i++) {
+    usernames.push_back("user" + std::to_string(10000 + i));
+  }
+  return usernames;
+}
+
+TEST(IpTablesScalingTest, PlugAllHolesIsBatched) {
+  const brillo::VariantDictionary notrack{{"notrack", true}};
+  for (int count : {1, 64}) {
+    CountingIpTables iptables;
+    for (int i = 0; i < count; i++) {
+      ASSERT_TRUE(iptables.PunchTcpHole(1000 + i, "iface"));
+      ASSERT_TRUE(iptables.PunchUdpHoleWithOptions(1000 + i, "", notrack));
+      ASSERT_TRUE(iptables.PunchTcpEgressHole(1000 + i, "iface"));
+    }
+    iptables.ResetCounts();
+    iptables.PlugAllHoles();
+    EXPECT_FALSE(iptables.HasHoles());
+
+    // One run per IP version and direction, each committing the filter
+    // table, and the raw table for incoming holes without tracking.
+    EXPECT_EQ(4, iptables.spawns()) << count << " holes";
+    EXPECT_EQ(2, iptables.spawns("iptables-restore")) << count << " holes";
+    EXPECT_EQ(2, iptables.spawns("ip6tables-restore")) << count << " holes";
+    EXPECT_EQ(6, iptables.commits()) << count << " holes";
+  }
+}
+
+TEST(IpTablesScalingTest, VpnSetupWithUidRangesIsConstant) {
+  for (int count : {1, 64}) {
+    CountingIpTables iptables;
+    iptables.EnableUidRangeRouting();
+    ASSERT_TRUE(iptables.RequestVpnSetup(VpnUsers(count), "ifc0"));
+    // Masquerading for each IP version, and a single range of users.
+    EXPECT_EQ(2, iptables.spawns()) << count << " users";
+    EXPECT_EQ(4, iptables.commits()) << count << " users";
+
+    iptables.ResetCounts();
+    ASSERT_TRUE(iptables.RemoveVpnSetup(VpnUsers(count), "ifc0"));
+    EXPECT_EQ(2, iptables.spawns()) << count << " users";
+    EXPECT_EQ(4, iptables.commits()) << count << " users";
+  }
+}
+
+TEST(IpTablesScalingTest, VpnSetupWithMarksIsPerUser) {
+  // Each user gets an owner match of its own, for each IP version.
+  for (int count : {1, 64}) {
+    CountingIpTables iptables;
+    ASSERT_TRUE(iptables.RequestVpnSetup(VpnUsers(count), "ifc0"));
+    EXPECT_EQ(1 + count, iptables.spawns("iptables")) << count << " users";
+    EXPECT_EQ(1 + count, iptables.spawns("ip6tables")) << count << " users";
+    EXPECT_EQ(2, iptables.spawns("ip")) << count << " users";
+    EXPECT_EQ(4 + 2 * count, iptables.commits()) << count << " users";
+  }
+}
+
+TEST(UidRangeRulesTest, CoalesceUids) {
+  EXPECT_TRUE(CoalesceUids({}).empty());
+  const std::vector<UidRange> ranges =
+      CoalesceUids({1000, 1001, 1002, 1005, 2000, 2001});
+  ASSERT_EQ(3u, ranges.size());
+  EXPECT_EQ((UidRange{1000, 1002}), ranges[0]);
+  EXPECT_EQ((UidRange{1005, 1005}), ranges[1]);
+  EXPECT_EQ((UidRange{2000, 2001}), ranges[2]);
+}
+
+TEST(XtablesLockTest, FindFlockHolder) {
+  const std::string proc_locks =
+      "1: POSIX  ADVISORY  WRITE 812 fd:00:4242 0 EOF\n"
+      "2: FLOCK  ADVISORY  WRITE 1234 fd:00:4242 0 EOF\n"
+      "2: -> FLOCK  ADVISORY  WRITE 1300 fd:00:4242 0 EOF\n"
+      "3: FLOCK  ADVISORY  WRITE 99 fd:01:4242 0 EOF\n";
+  EXPECT_EQ(1234, FindFlockHolder(proc_locks, makedev(0xfd, 0), 4242));
+  EXPECT_EQ(99, FindFlockHolder(proc_locks, makedev(0xfd, 1), 4242));
+  EXPECT_EQ(-1, FindFlockHolder(proc_locks, makedev(0xfd, 0), 4243));
+  EXPECT_EQ(-1, FindFlockHolder("", makedev(0xfd, 0), 4242));
+}
+
 }  // namespace firewalld
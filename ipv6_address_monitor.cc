@@ -0,0 +1,295 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ipv6_address_monitor.h"
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <utility>
+
+#include <base/bind.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+namespace {
+
+const size_t kReceiveBufferSize = 32768;
+
+}  // namespace
+
+namespace firewalld {
+
+Ipv6AddressMonitor::Ipv6AddressMonitor() {
+}
+
+Ipv6AddressMonitor::~Ipv6AddressMonitor() {
+  if (watch_task_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(watch_task_);
+  }
+}
+
+bool Ipv6AddressMonitor::Start(const AddressCallback& callback) {
+  socket_.reset(socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                       NETLINK_ROUTE));
+  if (!socket_.is_valid()) {
+    PLOG(ERROR) << "Could not open rtnetlink socket";
+    return false;
+  }
+
+  struct sockaddr_nl local;
+  memset(&local, 0, sizeof(local));
+  local.nl_family = AF_NETLINK;
+  local.nl_groups = RTMGRP_IPV6_IFADDR;
+  if (bind(socket_.get(), reinterpret_cast<struct sockaddr*>(&local),
+           sizeof(local)) < 0) {
+    PLOG(ERROR) << "Could not bind rtnetlink socket";
+    socket_.reset();
+    return false;
+  }
+
+  if (!RequestDump()) {
+    socket_.reset();
+    return false;
+  }
+
+  Watch(callback);
+  return true;
+}
+
+void Ipv6AddressMonitor::Save(base::Pickle* pickle,
+                              std::vector<int>* fds) const {
+  pickle->WriteUInt32(addresses_.size());
+  for (const auto& addresses : addresses_) {
+    pickle->WriteInt(addresses.first);
+    auto name = interface_names_.find(addresses.first);
+    pickle->WriteString(name != interface_names_.end() ? name->second
+                                                       : std::string());
+    pickle->WriteUInt32(addresses.second.size());
+    for (const auto& address : addresses.second) {
+      pickle->WriteString(address);
+    }
+  }
+  pickle->WriteUInt32(resync_interfaces_.size());
+  for (const auto& interface : resync_interfaces_) {
+    pickle->WriteInt(interface.first);
+    pickle->WriteString(interface.second);
+  }
+  fds->push_back(socket_.get());
+}
+
+void Ipv6AddressMonitor::Release() {
+  if (watch_task_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(watch_task_);
+    watch_task_ = brillo::MessageLoop::kTaskIdNull;
+  }
+  socket_.reset();
+}
+
+bool Ipv6AddressMonitor::Adopt(base::ScopedFD socket,
+                               base::PickleIterator* iterator,
+                               const AddressCallback& callback) {
+  std::map<int, std::set<std::string>> addresses;
+  std::map<int, std::string> interface_names;
+  std::map<int, std::string> resync_interfaces;
+  uint32_t count;
+  if (!iterator->ReadUInt32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    int index;
+    std::string name;
+    uint32_t address_count;
+    if (!iterator->ReadInt(&index) || !iterator->ReadString(&name) ||
+        !iterator->ReadUInt32(&address_count)) {
+      return false;
+    }
+    for (uint32_t j = 0; j < address_count; j++) {
+      std::string address;
+      if (!iterator->ReadString(&address)) {
+        return false;
+      }
+      addresses[index].insert(address);
+    }
+    if (!name.empty()) {
+      interface_names[index] = name;
+    }
+  }
+  if (!iterator->ReadUInt32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    int index;
+    std::string name;
+    if (!iterator->ReadInt(&index) || !iterator->ReadString(&name)) {
+      return false;
+    }
+    resync_interfaces[index] = name;
+  }
+  if (!socket.is_valid()) {
+    return false;
+  }
+
+  socket_ = std::move(socket);
+  addresses_.swap(addresses);
+  interface_names_.swap(interface_names);
+  resync_interfaces_.swap(resync_interfaces);
+  // Changes that arrived during the handoff are waiting on the socket.
+  Watch(callback);
+  return true;
+}
+
+void Ipv6AddressMonitor::Watch(const AddressCallback& callback) {
+  callback_ = callback;
+  watch_task_ = brillo::MessageLoop::current()->WatchFileDescriptor(
+      FROM_HERE, socket_.get(), brillo::MessageLoop::kWatchRead,
+      true /* persistent */,
+      base::Bind(&Ipv6AddressMonitor::OnSocketReadable,
+                 base::Unretained(this)));
+}
+
+bool Ipv6AddressMonitor::RequestDump() {
+  struct {
+    struct nlmsghdr header;
+    struct ifaddrmsg message;
+  } request;
+  memset(&request, 0, sizeof(request));
+  request.header.nlmsg_len = sizeof(request);
+  request.header.nlmsg_type = RTM_GETADDR;
+  request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.message.ifa_family = AF_INET6;
+
+  if (HANDLE_EINTR(send(socket_.get(), &request, sizeof(request), 0)) < 0) {
+    PLOG(ERROR) << "Could not request IPv6 address dump";
+    return false;
+  }
+  return true;
+}
+
+void Ipv6AddressMonitor::OnSocketReadable() {
+  char buffer[kReceiveBufferSize];
+  while (true) {
+    ssize_t length = HANDLE_EINTR(recv(socket_.get(), buffer, sizeof(buffer),
+                                       MSG_DONTWAIT));
+    if (length < 0) {
+      if (errno == ENOBUFS) {
+        // Events were dropped. Start over from a fresh dump, and report the
+        // interfaces that are not in it once it is done.
+        LOG(WARNING) << "rtnetlink receive buffer overflowed, resyncing";
+        for (const auto& addresses : addresses_) {
+          resync_interfaces_[addresses.first] =
+              interface_names_[addresses.first];
+        }
+        addresses_.clear();
+        interface_names_.clear();
+        RequestDump();
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        PLOG(ERROR) << "Could not read from rtnetlink socket";
+      }
+      return;
+    }
+
+    size_t remaining = static_cast<size_t>(length);
+    for (const struct nlmsghdr* header =
+             reinterpret_cast<const struct nlmsghdr*>(buffer);
+         NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+      switch (header->nlmsg_type) {
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+          HandleAddressMessage(header);
+          break;
+        case NLMSG_DONE:
+          OnDumpDone();
+          break;
+        case NLMSG_ERROR:
+          LOG(ERROR) << "rtnetlink returned an error";
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+void Ipv6AddressMonitor::HandleAddressMessage(const struct nlmsghdr* header) {
+  if (header->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg))) {
+    return;
+  }
+  const struct ifaddrmsg* message =
+      reinterpret_cast<const struct ifaddrmsg*>(NLMSG_DATA(header));
+  if (message->ifa_family != AF_INET6 ||
+      (message->ifa_scope != RT_SCOPE_UNIVERSE &&
+       message->ifa_scope != RT_SCOPE_LINK)) {
+    return;
+  }
+
+  std::string address;
+  int attributes_length = IFA_PAYLOAD(header);
+  for (const struct rtattr* attribute = IFA_RTA(message);
+       RTA_OK(attribute, attributes_length);
+       attribute = RTA_NEXT(attribute, attributes_length)) {
+    if (attribute->rta_type == IFA_ADDRESS &&
+        RTA_PAYLOAD(attribute) == sizeof(struct in6_addr)) {
+      address.assign(reinterpret_cast<const char*>(RTA_DATA(attribute)),
+                     sizeof(struct in6_addr));
+    }
+  }
+  if (address.empty()) {
+    return;
+  }
+
+  int index = static_cast<int>(message->ifa_index);
+  if (header->nlmsg_type == RTM_NEWADDR) {
+    std::set<std::string>& addresses = addresses_[index];
+    if (!addresses.insert(address).second || addresses.size() > 1) {
+      return;
+    }
+    char name[IF_NAMESIZE];
+    if (!if_indextoname(index, name)) {
+      // The interface went away already.
+      addresses_.erase(index);
+      return;
+    }
+    interface_names_[index] = name;
+    resync_interfaces_.erase(index);
+    callback_.Run(interface_names_[index], true /* has_address */);
+  } else {
+    auto addresses = addresses_.find(index);
+    if (addresses == addresses_.end() ||
+        addresses->second.erase(address) == 0 ||
+        !addresses->second.empty()) {
+      return;
+    }
+    std::string name = interface_names_[index];
+    addresses_.erase(addresses);
+    interface_names_.erase(index);
+    callback_.Run(name, false /* has_address */);
+  }
+}
+
+void Ipv6AddressMonitor::OnDumpDone() {
+  std::map<int, std::string> gone;
+  gone.swap(resync_interfaces_);
+  for (const auto& interface : gone) {
+    callback_.Run(interface.second, false /* has_address */);
+  }
+}
+
+}  // namespace firewalld
@@ -0,0 +1,85 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIREWALLD_IPV6_ADDRESS_MONITOR_H_
+#define FIREWALLD_IPV6_ADDRESS_MONITOR_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/callback.h>
+#include <base/files/scoped_file.h>
+#include <base/macros.h>
+#include <base/pickle.h>
+#include <brillo/message_loops/message_loop.h>
+
+struct nlmsghdr;
+
+namespace firewalld {
+
+// Watches rtnetlink for IPv6 address changes and reports when an interface
+// gains its first, or loses its last, global or link-local IPv6 address.
+class Ipv6AddressMonitor {
+ public:
+  using AddressCallback =
+      base::Callback<void(const std::string& interface, bool has_address)>;
+
+  Ipv6AddressMonitor();
+  ~Ipv6AddressMonitor();
+
+  // Opens the rtnetlink socket, requests a dump of the current addresses and
+  // starts watching for changes, reporting them through |callback|.
+  bool Start(const AddressCallback& callback);
+
+  // Whether |Start| or |Adopt| succeeded.
+  bool IsStarted() const { return socket_.is_valid(); }
+
+  // Handoff to a new instance of the daemon. |Save| writes the addresses seen
+  // so far to |pickle| and appends the socket to |fds|. Once it is sent,
+  // |Release| stops watching it. The new instance picks it up with |Adopt|,
+  // along with the changes that arrived in between.
+  void Save(base::Pickle* pickle, std::vector<int>* fds) const;
+  void Release();
+  bool Adopt(base::ScopedFD socket,
+             base::PickleIterator* iterator,
+             const AddressCallback& callback);
+
+ private:
+  void Watch(const AddressCallback& callback);
+  bool RequestDump();
+  void OnSocketReadable();
+  void HandleAddressMessage(const struct nlmsghdr* header);
+  void OnDumpDone();
+
+  base::ScopedFD socket_;
+  brillo::MessageLoop::TaskId watch_task_{brillo::MessageLoop::kTaskIdNull};
+  AddressCallback callback_;
+
+  // Global and link-local addresses, as raw bytes, per interface index.
+  std::map<int, std::set<std::string>> addresses_;
+  // Names of the interfaces in |addresses_|, which can no longer be looked up
+  // once the interface is gone.
+  std::map<int, std::string> interface_names_;
+  // Interfaces that had addresses before the receive buffer overflowed and a
+  // new dump was requested.
+  std::map<int, std::string> resync_interfaces_;
+
+  DISALLOW_COPY_AND_ASSIGN(Ipv6AddressMonitor);
+};
+
+}  // namespace firewalld
+
+#endif  // FIREWALLD_IPV6_ADDRESS_MONITOR_H_
@@ -12,17 +12,113 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <base/command_line.h>
+#include <signal.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/time/time.h>
+#include <brillo/flag_helper.h>
 #include <brillo/syslog_logging.h>
 
 #include "firewall_daemon.h"
 
 using firewalld::FirewallDaemon;
+using firewalld::FirewallService;
 
 int main(int argc, char** argv) {
-  base::CommandLine::Init(argc, argv);
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+
+  DEFINE_bool(flush_conntrack_on_plug, false,
+              "Delete the conntrack entries of plugged holes so that "
+              "established connections through them stop.");
+  DEFINE_bool(uid_range_vpn_routing, false,
+              "Route VPN users with uidrange policy routing rules instead of "
+              "marking their packets, if the kernel supports it.");
+  DEFINE_string(xdp_interfaces, "",
+                "Comma-separated interfaces on which an XDP program drops "
+                "unsolicited traffic to ports without a hole.");
+  DEFINE_string(xdp_udp_interfaces, "",
+                "Comma-separated interfaces of --xdp_interfaces on which the "
+                "XDP program also drops UDP to ports below the ephemeral "
+                "range without a hole. It runs before conntrack, so this "
+                "drops replies to traffic sent from a fixed low port, e.g. "
+                "NTP or mDNS, as well.");
+  DEFINE_bool(app_scoped_holes, false,
+              "Allow holes scoped to the sockets of an app's cgroup or UID.");
+  DEFINE_int32(permission_broker_grace_period, 30,
+               "Seconds the firewall holes of a permission_broker that went "
+               "away stay open for its next instance to reclaim. 0 plugs "
+               "them right away.");
+  DEFINE_int32(idle_exit_timeout, 0,
+               "Seconds without a request after which the daemon exits, to be "
+               "started again by D-Bus activation. 0 never exits.");
+  DEFINE_string(base_rules_ready_path, "",
+                "File that appears once the base ruleset is loaded. Requests "
+                "are queued until then and applied as a batch.");
+  DEFINE_int32(max_batch_size, 64,
+               "Most requests committed together.");
+  DEFINE_int32(max_commit_delay_ms, 5,
+               "Most milliseconds a commit waits for more requests under "
+               "load.");
+  DEFINE_bool(xtables_lock_backoff, false,
+              "Queue requests while another process holds the xtables lock, "
+              "retrying with backoff, instead of blocking on it.");
+  DEFINE_string(profiles_path, "",
+                "File defining the hole profiles that clients can apply by "
+                "name.");
+  DEFINE_string(handoff_socket_path, "",
+                "Unix socket over which a running instance hands its state "
+                "over to a new one for a live upgrade.");
+  DEFINE_string(gauge_thresholds, "",
+                "Comma-separated gauge=value pairs, e.g. "
+                "'input_depth=200,xdp.occupancy_percent=90'. A D-Bus signal "
+                "is emitted when a gauge goes over its value or back.");
+  brillo::FlagHelper::Init(argc, argv, "Firewall daemon");
   brillo::InitLog(brillo::kLogToSyslog);
 
-  FirewallDaemon daemon;
+  FirewallService::Options options;
+  options.flush_conntrack_on_plug = FLAGS_flush_conntrack_on_plug;
+  options.uid_range_vpn_routing = FLAGS_uid_range_vpn_routing;
+  options.app_scoped_holes = FLAGS_app_scoped_holes;
+  options.permission_broker_grace_period =
+      base::TimeDelta::FromSeconds(FLAGS_permission_broker_grace_period);
+  options.idle_exit_timeout =
+      base::TimeDelta::FromSeconds(FLAGS_idle_exit_timeout);
+  options.start_time = start_time;
+  options.base_rules_ready_path = FLAGS_base_rules_ready_path;
+  options.max_batch_size = std::max(FLAGS_max_batch_size, 1);
+  options.max_commit_delay =
+      base::TimeDelta::FromMilliseconds(std::max(FLAGS_max_commit_delay_ms, 0));
+  options.xtables_lock_backoff = FLAGS_xtables_lock_backoff;
+  options.profiles_path = FLAGS_profiles_path;
+  options.handoff_socket_path = FLAGS_handoff_socket_path;
+  options.xdp_interfaces =
+      base::SplitString(FLAGS_xdp_interfaces, ",", base::TRIM_WHITESPACE,
+                        base::SPLIT_WANT_NONEMPTY);
+  options.xdp_udp_interfaces =
+      base::SplitString(FLAGS_xdp_udp_interfaces, ",", base::TRIM_WHITESPACE,
+                        base::SPLIT_WANT_NONEMPTY);
+  for (const auto& pair :
+       base::SplitString(FLAGS_gauge_thresholds, ",", base::TRIM_WHITESPACE,
+                         base::SPLIT_WANT_NONEMPTY)) {
+    const std::vector<std::string> gauge = base::SplitString(
+        pair, "=", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    int64_t threshold;
+    if (gauge.size() != 2 || gauge[0].empty() ||
+        !base::StringToInt64(gauge[1], &threshold)) {
+      LOG(WARNING) << "Ignoring invalid gauge threshold '" << pair << "'";
+      continue;
+    }
+    options.gauge_thresholds[gauge[0]] = threshold;
+  }
+
+  // Rules are fed to 'iptables-restore' through a pipe. If it exits early,
+  // the write fails with EPIPE rather than killing the daemon.
+  signal(SIGPIPE, SIG_IGN);
+
+  FirewallDaemon daemon(options);
   return daemon.Run();
 }
@@ -18,6 +18,7 @@ namespace firewalld {
 
 MockIpTables::~MockIpTables() {
   PlugAllHoles();
+  RemoveAllPortForwards();
 }
 
 }  // namespace firewalld
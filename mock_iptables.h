@@ -16,6 +16,7 @@
 #define FIREWALLD_MOCK_IPTABLES_H_
 
 #include <string>
+#include <vector>
 
 #include <base/macros.h>
 #include <gmock/gmock.h>
@@ -37,9 +38,23 @@ class MockIpTables : public IpTables {
       DeleteAcceptRule,
       bool(const std::string&, ProtocolEnum, uint16_t, const std::string&));
 
+  MOCK_METHOD2(RunRestore, bool(const std::string&, const std::string&));
+  MOCK_METHOD0(DisableConntrackTcpLoose, bool());
+  MOCK_METHOD0(RestoreConntrackTcpLoose, bool());
+  MOCK_METHOD1(DeleteConntrackEntries,
+               bool(const std::vector<ConntrackMatch>&));
+
   MOCK_METHOD2(ApplyMasquerade, bool(const std::string&, bool));
   MOCK_METHOD2(ApplyMarkForUserTraffic, bool(const std::string&, bool));
   MOCK_METHOD1(ApplyRuleForUserTraffic, bool(bool));
+  MOCK_METHOD2(LookUpUid, bool(const std::string&, uid_t*));
+  MOCK_METHOD2(ApplyUidRangeRule, bool(const UidRange&, bool));
+  MOCK_METHOD1(GetUidRangeRules, bool(std::vector<UidRange>*));
+  MOCK_METHOD2(ApplyLockdownRule, bool(const std::string&, bool));
+  MOCK_METHOD3(ApplyLockdownRuleForRange,
+               bool(const UidRange&, const std::string&, bool));
+  MOCK_METHOD2(DumpRules, bool(const std::string&, std::string*));
+  MOCK_METHOD1(XtablesLockIsFree, bool(std::string*));
 
  private:
   DISALLOW_COPY_AND_ASSIGN(MockIpTables);
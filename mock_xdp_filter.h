@@ -0,0 +1,41 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIREWALLD_MOCK_XDP_FILTER_H_
+#define FIREWALLD_MOCK_XDP_FILTER_H_
+
+#include <string>
+
+#include <base/macros.h>
+#include <gmock/gmock.h>
+
+#include "xdp_filter.h"
+
+namespace firewalld {
+
+class MockXdpFilter : public XdpFilter {
+ public:
+  MockXdpFilter() = default;
+  ~MockXdpFilter() override = default;
+
+  MOCK_METHOD3(AddHole, bool(uint8_t, uint16_t, const std::string&));
+  MOCK_METHOD3(RemoveHole, bool(uint8_t, uint16_t, const std::string&));
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(MockXdpFilter);
+};
+
+}  // namespace firewalld
+
+#endif  // FIREWALLD_MOCK_XDP_FILTER_H_
@@ -0,0 +1,204 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Measures the control path of hole punching without touching the kernel:
+// batches of holes are punched and plugged through IpTables with the
+// 'iptables-restore' runs stubbed out. Reports, per hole and in steady
+// state, the heap allocations and the time spent decoding requests,
+// rendering rules and emitting 'iptables-restore' input.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <brillo/flag_helper.h>
+#include <brillo/variant_dictionary.h>
+
+#include "dbus_interface.h"
+#include "iptables.h"
+
+namespace {
+
+std::atomic<uint64_t> g_allocations{0};
+
+uint64_t NowNanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+// Applies nothing, but accounts for the input it is given.
+class NullIpTables : public firewalld::IpTables {
+ public:
+  NullIpTables() = default;
+  ~NullIpTables() override { PlugAllHoles(); }
+
+  uint64_t emitted_bytes() const { return emitted_bytes_; }
+
+ private:
+  bool RunRestore(const std::string& restore_path,
+                  const std::string& input) override {
+    emitted_bytes_ += input.size();
+    return true;
+  }
+  bool AddAcceptRule(const std::string& executable_path,
+                     firewalld::ProtocolEnum protocol,
+                     uint16_t port,
+                     const std::string& interface) override {
+    return true;
+  }
+  bool DeleteAcceptRule(const std::string& executable_path,
+                        firewalld::ProtocolEnum protocol,
+                        uint16_t port,
+                        const std::string& interface) override {
+    return true;
+  }
+  bool DisableConntrackTcpLoose() override { return true; }
+
+  uint64_t emitted_bytes_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(NullIpTables);
+};
+
+// A mix of the holes clients ask for: plain TCP, UDP without conntrack and
+// rate-limited UDP, spread over a few interfaces.
+std::vector<firewalld::IpTables::HoleRequest> MakeRequests(int holes) {
+  const char* const kInterfaces[] = {"eth0", "wlan0", "", "usb0"};
+  std::vector<firewalld::IpTables::HoleRequest> requests;
+  for (int i = 0; i < holes; i++) {
+    firewalld::IpTables::HoleRequest request{};
+    request.port = static_cast<uint16_t>(10000 + i);
+    request.interface = kInterfaces[i % 4];
+    switch (i % 3) {
+      case 0:
+        request.protocol = firewalld::kProtocolTcp;
+        break;
+      case 1:
+        request.protocol = firewalld::kProtocolUdp;
+        request.options[firewalld::kHoleOptionNoTrack] = true;
+        break;
+      default:
+        request.protocol = firewalld::kProtocolUdp;
+        request.options[firewalld::kHoleOptionRateLimit] = uint32_t{100};
+        break;
+    }
+    requests.push_back(request);
+  }
+  return requests;
+}
+
+struct Result {
+  double punch_allocations;
+  double plug_allocations;
+  double punch_ns;
+  double plug_ns;
+  double emitted_bytes;
+};
+
+Result Measure(int holes, int rounds) {
+  const std::vector<firewalld::IpTables::HoleRequest> requests =
+      MakeRequests(holes);
+  NullIpTables iptables;
+  uint64_t punch_allocations = 0;
+  uint64_t plug_allocations = 0;
+  uint64_t punch_ns = 0;
+  uint64_t plug_ns = 0;
+  uint64_t emitted_bytes = 0;
+  // The first round warms up whatever is reused from one batch to the next.
+  for (int round = 0; round <= rounds; round++) {
+    const uint64_t bytes_before = iptables.emitted_bytes();
+    uint64_t allocations = g_allocations;
+    uint64_t start = NowNanoseconds();
+    iptables.PunchHolesInBatch(requests);
+    uint64_t punched = NowNanoseconds();
+    uint64_t punch_round_allocations = g_allocations - allocations;
+
+    allocations = g_allocations;
+    iptables.OrphanAllHoles();
+    iptables.PlugOrphanedHoles();
+    uint64_t plugged = NowNanoseconds();
+    uint64_t plug_round_allocations = g_allocations - allocations;
+
+    if (round == 0) {
+      continue;
+    }
+    punch_allocations += punch_round_allocations;
+    plug_allocations += plug_round_allocations;
+    punch_ns += punched - start;
+    plug_ns += plugged - punched;
+    emitted_bytes += iptables.emitted_bytes() - bytes_before;
+  }
+
+  const double operations = static_cast<double>(holes) * rounds;
+  Result result;
+  result.punch_allocations = punch_allocations / operations;
+  result.plug_allocations = plug_allocations / operations;
+  result.punch_ns = punch_ns / operations;
+  result.plug_ns = plug_ns / operations;
+  result.emitted_bytes = emitted_bytes / operations;
+  return result;
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  g_allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t size) noexcept {
+  free(p);
+}
+
+int main(int argc, char** argv) {
+  DEFINE_string(holes, "1,16,64,256", "Comma-separated batch sizes.");
+  DEFINE_int32(rounds, 200, "Batches punched and plugged at each size.");
+  brillo::FlagHelper::Init(argc, argv, "firewalld pipeline benchmark");
+  // Every batch is logged, which would otherwise dominate the numbers.
+  logging::SetMinLogLevel(logging::LOG_WARNING);
+
+  printf("%8s %14s %14s %12s %12s %12s\n", "holes", "punch allocs",
+         "plug allocs", "punch ns", "plug ns", "bytes");
+  for (const auto& holes_string :
+       base::SplitString(FLAGS_holes, ",", base::TRIM_WHITESPACE,
+                         base::SPLIT_WANT_NONEMPTY)) {
+    int holes;
+    if (!base::StringToInt(holes_string, &holes) || holes <= 0) {
+      fprintf(stderr, "Invalid batch size '%s'\n", holes_string.c_str());
+      return 1;
+    }
+    const Result result = Measure(holes, FLAGS_rounds);
+    printf("%8d %14.1f %14.1f %12.0f %12.0f %12.0f\n", holes,
+           result.punch_allocations, result.plug_allocations, result.punch_ns,
+           result.plug_ns, result.emitted_bytes);
+  }
+  return 0;
+}
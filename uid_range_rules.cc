@@ -0,0 +1,295 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "uid_range_rules.h"
+
+#include <linux/fib_rules.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <string>
+
+#include <base/files/scoped_file.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+namespace {
+
+const size_t kReceiveBufferSize = 8192;
+
+// Priority of the rule installed to probe for uidrange support. No-op rules
+// don't affect routing, wherever they are.
+const uint32_t kProbePriority = 65535;
+
+void AppendPadded(const void* data, size_t length, std::string* out) {
+  out->append(reinterpret_cast<const char*>(data), length);
+  out->append(NLMSG_ALIGN(length) - length, '\0');
+}
+
+void AppendAttribute(uint16_t type,
+                     const void* data,
+                     size_t length,
+                     std::string* out) {
+  struct nlattr attribute;
+  attribute.nla_len = NLA_HDRLEN + length;
+  attribute.nla_type = type;
+  AppendPadded(&attribute, sizeof(attribute), out);
+  AppendPadded(data, length, out);
+}
+
+std::string RuleRequest(uint16_t message_type,
+                        uint16_t flags,
+                        int family,
+                        uint8_t action,
+                        uint32_t table,
+                        uint32_t priority,
+                        const firewalld::UidRange& range) {
+  struct fib_rule_hdr rule;
+  memset(&rule, 0, sizeof(rule));
+  rule.family = family;
+  rule.action = action;
+
+  std::string attributes;
+  if (table != 0) {
+    AppendAttribute(FRA_TABLE, &table, sizeof(table), &attributes);
+  }
+  if (priority != 0) {
+    AppendAttribute(FRA_PRIORITY, &priority, sizeof(priority), &attributes);
+  }
+  struct fib_rule_uid_range uid_range;
+  uid_range.start = range.first;
+  uid_range.end = range.last;
+  AppendAttribute(FRA_UID_RANGE, &uid_range, sizeof(uid_range), &attributes);
+
+  struct nlmsghdr header;
+  memset(&header, 0, sizeof(header));
+  header.nlmsg_len =
+      NLMSG_LENGTH(NLMSG_ALIGN(sizeof(rule))) + attributes.size();
+  header.nlmsg_type = message_type;
+  header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+
+  std::string request;
+  AppendPadded(&header, sizeof(header), &request);
+  AppendPadded(&rule, sizeof(rule), &request);
+  request += attributes;
+  return request;
+}
+
+// Returns the attribute of |type| of the rule message |header|, or null.
+const struct nlattr* FindAttribute(const struct nlmsghdr* header,
+                                   uint16_t type) {
+  const size_t offset = NLMSG_LENGTH(NLMSG_ALIGN(sizeof(struct fib_rule_hdr)));
+  if (header->nlmsg_len < offset) {
+    return nullptr;
+  }
+  const char* data = reinterpret_cast<const char*>(header) + offset;
+  size_t length = header->nlmsg_len - offset;
+  while (length >= NLA_HDRLEN) {
+    const struct nlattr* attribute =
+        reinterpret_cast<const struct nlattr*>(data);
+    if (attribute->nla_len < NLA_HDRLEN || attribute->nla_len > length) {
+      return nullptr;
+    }
+    if ((attribute->nla_type & NLA_TYPE_MASK) == type) {
+      return attribute;
+    }
+    size_t aligned_length = NLA_ALIGN(attribute->nla_len);
+    if (aligned_length >= length) {
+      return nullptr;
+    }
+    data += aligned_length;
+    length -= aligned_length;
+  }
+  return nullptr;
+}
+
+bool HasUidRange(const struct nlmsghdr* header) {
+  return FindAttribute(header, FRA_UID_RANGE) != nullptr;
+}
+
+// Appends the UID range of the rule message |header| to |ranges| if the rule
+// sends traffic to |table|.
+void CollectUidRange(const struct nlmsghdr* header,
+                     uint32_t table,
+                     std::vector<firewalld::UidRange>* ranges) {
+  if (header->nlmsg_len <
+      NLMSG_LENGTH(NLMSG_ALIGN(sizeof(struct fib_rule_hdr)))) {
+    return;
+  }
+  const struct fib_rule_hdr* rule =
+      reinterpret_cast<const struct fib_rule_hdr*>(NLMSG_DATA(header));
+  uint32_t rule_table = rule->table;
+  const struct nlattr* table_attribute = FindAttribute(header, FRA_TABLE);
+  if (table_attribute && table_attribute->nla_len >= NLA_HDRLEN + 4) {
+    memcpy(&rule_table, reinterpret_cast<const char*>(table_attribute) +
+                            NLA_HDRLEN,
+           sizeof(rule_table));
+  }
+  const struct nlattr* uid_attribute = FindAttribute(header, FRA_UID_RANGE);
+  if (rule->action != FR_ACT_TO_TBL || rule_table != table || !uid_attribute ||
+      uid_attribute->nla_len <
+          NLA_HDRLEN + sizeof(struct fib_rule_uid_range)) {
+    return;
+  }
+  struct fib_rule_uid_range uid_range;
+  memcpy(&uid_range, reinterpret_cast<const char*>(uid_attribute) + NLA_HDRLEN,
+         sizeof(uid_range));
+  ranges->push_back({uid_range.start, uid_range.end});
+}
+
+// Sends |request| and waits for its acknowledgement. If |echoed_uid_range| is
+// given, sets it to whether a rule echoed back carried a UID range.
+bool Transact(const std::string& request, bool* echoed_uid_range) {
+  base::ScopedFD fd(socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE));
+  if (!fd.is_valid()) {
+    PLOG(ERROR) << "Could not open rtnetlink socket";
+    return false;
+  }
+  if (HANDLE_EINTR(send(fd.get(), request.data(), request.size(), 0)) !=
+      static_cast<ssize_t>(request.size())) {
+    PLOG(ERROR) << "Could not write to rtnetlink socket";
+    return false;
+  }
+
+  if (echoed_uid_range) {
+    *echoed_uid_range = false;
+  }
+  char buffer[kReceiveBufferSize];
+  while (true) {
+    ssize_t length = HANDLE_EINTR(recv(fd.get(), buffer, sizeof(buffer), 0));
+    if (length < 0) {
+      PLOG(ERROR) << "Could not read from rtnetlink socket";
+      return false;
+    }
+    size_t remaining = static_cast<size_t>(length);
+    for (const struct nlmsghdr* header =
+             reinterpret_cast<const struct nlmsghdr*>(buffer);
+         NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+      if (header->nlmsg_type == RTM_NEWRULE && echoed_uid_range) {
+        *echoed_uid_range = HasUidRange(header);
+      } else if (header->nlmsg_type == NLMSG_ERROR) {
+        const struct nlmsgerr* error =
+            reinterpret_cast<const struct nlmsgerr*>(NLMSG_DATA(header));
+        if (error->error != 0) {
+          LOG(ERROR) << "rtnetlink rule request failed: "
+                     << strerror(-error->error);
+          return false;
+        }
+        return true;
+      }
+    }
+  }
+}
+
+bool DumpRules(int family,
+               uint32_t table,
+               std::vector<firewalld::UidRange>* ranges) {
+  base::ScopedFD fd(socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE));
+  if (!fd.is_valid()) {
+    PLOG(ERROR) << "Could not open rtnetlink socket";
+    return false;
+  }
+  struct {
+    struct nlmsghdr header;
+    struct fib_rule_hdr rule;
+  } request;
+  memset(&request, 0, sizeof(request));
+  request.header.nlmsg_len = sizeof(request);
+  request.header.nlmsg_type = RTM_GETRULE;
+  request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.rule.family = family;
+  if (HANDLE_EINTR(send(fd.get(), &request, sizeof(request), 0)) !=
+      static_cast<ssize_t>(sizeof(request))) {
+    PLOG(ERROR) << "Could not request policy routing rule dump";
+    return false;
+  }
+
+  char buffer[kReceiveBufferSize];
+  while (true) {
+    ssize_t length = HANDLE_EINTR(recv(fd.get(), buffer, sizeof(buffer), 0));
+    if (length < 0) {
+      PLOG(ERROR) << "Could not read from rtnetlink socket";
+      return false;
+    }
+    size_t remaining = static_cast<size_t>(length);
+    for (const struct nlmsghdr* header =
+             reinterpret_cast<const struct nlmsghdr*>(buffer);
+         NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+      if (header->nlmsg_type == NLMSG_DONE) {
+        return true;
+      }
+      if (header->nlmsg_type == NLMSG_ERROR) {
+        const struct nlmsgerr* error =
+            reinterpret_cast<const struct nlmsgerr*>(NLMSG_DATA(header));
+        LOG(ERROR) << "Policy routing rule dump failed: "
+                   << strerror(-error->error);
+        return false;
+      }
+      if (header->nlmsg_type == RTM_NEWRULE) {
+        CollectUidRange(header, table, ranges);
+      }
+    }
+  }
+}
+
+}  // namespace
+
+namespace firewalld {
+
+std::vector<UidRange> CoalesceUids(const std::set<uid_t>& uids) {
+  std::vector<UidRange> ranges;
+  for (uid_t uid : uids) {
+    if (!ranges.empty() && ranges.back().last + 1 == uid) {
+      ranges.back().last = uid;
+    } else {
+      ranges.push_back({uid, uid});
+    }
+  }
+  return ranges;
+}
+
+bool UidRangeRulesSupported() {
+  const UidRange range{0, 0};
+  bool echoed_uid_range;
+  if (!Transact(RuleRequest(RTM_NEWRULE, NLM_F_CREATE | NLM_F_ECHO, AF_INET,
+                            FR_ACT_NOP, 0, kProbePriority, range),
+                &echoed_uid_range)) {
+    return false;
+  }
+  Transact(RuleRequest(RTM_DELRULE, 0, AF_INET, FR_ACT_NOP, 0, kProbePriority,
+                       range),
+           nullptr);
+  return echoed_uid_range;
+}
+
+bool ApplyUidRangeRule(int family,
+                       const UidRange& range,
+                       uint32_t table,
+                       bool add) {
+  return Transact(
+      RuleRequest(add ? RTM_NEWRULE : RTM_DELRULE, add ? NLM_F_CREATE : 0,
+                  family, FR_ACT_TO_TBL, table, 0, range),
+      nullptr);
+}
+
+bool GetUidRangeRules(int family,
+                      uint32_t table,
+                      std::vector<UidRange>* ranges) {
+  ranges->clear();
+  return DumpRules(family, table, ranges);
+}
+
+}  // namespace firewalld
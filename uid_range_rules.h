@@ -0,0 +1,60 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIREWALLD_UID_RANGE_RULES_H_
+#define FIREWALLD_UID_RANGE_RULES_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <set>
+#include <vector>
+
+namespace firewalld {
+
+// An inclusive range of user IDs.
+struct UidRange {
+  uid_t first;
+  uid_t last;
+
+  bool operator==(const UidRange& other) const {
+    return first == other.first && last == other.last;
+  }
+};
+
+// Returns the fewest ranges covering exactly |uids|, in ascending order.
+std::vector<UidRange> CoalesceUids(const std::set<uid_t>& uids);
+
+// Whether the kernel understands policy routing rules that match on the
+// user ID of the socket ('ip rule ... uidrange'). Kernels that predate them
+// silently ignore the attribute, so this installs a no-op rule and checks
+// that the kernel reports the range back.
+bool UidRangeRulesSupported();
+
+// Adds or deletes, over rtnetlink, the |family| policy routing rule sending
+// traffic from the users in |range| to routing |table|.
+bool ApplyUidRangeRule(int family,
+                       const UidRange& range,
+                       uint32_t table,
+                       bool add);
+
+// Sets |ranges| to the UID ranges of the |family| policy routing rules
+// sending traffic to routing |table|, read with a single rtnetlink dump.
+bool GetUidRangeRules(int family,
+                      uint32_t table,
+                      std::vector<UidRange>* ranges);
+
+}  // namespace firewalld
+
+#endif  // FIREWALLD_UID_RANGE_RULES_H_
@@ -0,0 +1,457 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "xdp_filter.h"
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <utility>
+#include <vector>
+
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+
+#include "bpf_program.h"
+
+namespace {
+
+const char kLocalPortRangePath[] = "/proc/sys/net/ipv4/ip_local_port_range";
+const uint16_t kDefaultEphemeralPortStart = 32768;
+
+const uint16_t kDhcpClientPort = 68;
+const uint16_t kDhcpv6ClientPort = 546;
+
+const uint32_t kMaxHoles = 16384;
+
+// Port of the hole map entry that opts an interface in to UDP filtering. No
+// hole is punched for port 0.
+const uint16_t kUdpFilteringPort = 0;
+
+// Key of the hole map. Holes on all interfaces use interface index 0.
+struct HoleKey {
+  uint32_t ifindex;
+  uint8_t protocol;
+  uint8_t pad;
+  uint16_t port;  // network byte order
+};
+
+uint16_t EphemeralPortStart() {
+  std::string range;
+  if (!base::ReadFileToString(base::FilePath(kLocalPortRangePath), &range)) {
+    return kDefaultEphemeralPortStart;
+  }
+  std::vector<std::string> ports = base::SplitString(
+      range, " \t\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  unsigned start;
+  if (ports.empty() || !base::StringToUint(ports[0], &start) || start == 0 ||
+      start > 65535) {
+    return kDefaultEphemeralPortStart;
+  }
+  return static_cast<uint16_t>(start);
+}
+
+// The program. Offsets are those of Ethernet, IPv4, IPv6, TCP, UDP and
+// struct xdp_md.
+std::vector<struct bpf_insn> FilterProgram(int map_fd,
+                                           uint16_t ephemeral_port_start) {
+  const uint8_t r0 = BPF_REG_0, r1 = BPF_REG_1, r2 = BPF_REG_2,
+                r3 = BPF_REG_3, r4 = BPF_REG_4, r5 = BPF_REG_5,
+                r6 = BPF_REG_6, r7 = BPF_REG_7, r8 = BPF_REG_8,
+                r9 = BPF_REG_9, fp = BPF_REG_10;
+  enum Label {
+    kPass,
+    kIpv4,
+    kIpv6,
+    kTransport,
+    kTcp,
+    kUdp,
+    kLookup,
+    kLabelCount
+  };
+  firewalld::BpfAssembler a(kLabelCount);
+
+  // r6 = ctx, r2 = data, r3 = data_end.
+  a.Mov(r6, r1);
+  a.Load(BPF_W, r2, r6, offsetof(struct xdp_md, data));
+  a.Load(BPF_W, r3, r6, offsetof(struct xdp_md, data_end));
+  a.Mov(r4, r2);
+  a.Alu(BPF_ADD, r4, 14);
+  a.JumpReg(BPF_JGT, r4, r3, kPass);
+  a.Load(BPF_H, r5, r2, 12);  // EtherType
+  a.JumpImm(BPF_JEQ, r5, htons(ETH_P_IP), kIpv4);
+  a.JumpImm(BPF_JEQ, r5, htons(ETH_P_IPV6), kIpv6);
+  a.Goto(kPass);
+
+  // IPv4: r7 = protocol, r2 = transport header.
+  a.Bind(kIpv4);
+  a.Mov(r4, r2);
+  a.Alu(BPF_ADD, r4, 14 + 20);
+  a.JumpReg(BPF_JGT, r4, r3, kPass);
+  a.Load(BPF_H, r5, r2, 14 + 6);  // fragment offset
+  a.Alu(BPF_AND, r5, htons(0x1fff));
+  a.JumpImm(BPF_JNE, r5, 0, kPass);
+  a.Load(BPF_B, r7, r2, 14 + 9);
+  a.Load(BPF_B, r5, r2, 14);  // header length
+  a.Alu(BPF_AND, r5, 0x0f);
+  a.Alu(BPF_LSH, r5, 2);
+  a.JumpImm(BPF_JLT, r5, 20, kPass);
+  a.Alu(BPF_ADD, r2, 14);
+  a.AddReg(r2, r5);
+  a.Goto(kTransport);
+
+  // IPv6: r7 = next header, r2 = transport header.
+  a.Bind(kIpv6);
+  a.Mov(r4, r2);
+  a.Alu(BPF_ADD, r4, 14 + 40);
+  a.JumpReg(BPF_JGT, r4, r3, kPass);
+  a.Load(BPF_B, r7, r2, 14 + 6);
+  a.Alu(BPF_ADD, r2, 14 + 40);
+
+  a.Bind(kTransport);
+  a.JumpImm(BPF_JEQ, r7, IPPROTO_TCP, kTcp);
+  a.JumpImm(BPF_JEQ, r7, IPPROTO_UDP, kUdp);
+  a.Goto(kPass);
+
+  // TCP: only bare SYNs open connections.
+  a.Bind(kTcp);
+  a.Mov(r4, r2);
+  a.Alu(BPF_ADD, r4, 14);
+  a.JumpReg(BPF_JGT, r4, r3, kPass);
+  a.Load(BPF_B, r5, r2, 13);  // flags
+  a.Alu(BPF_AND, r5, 0x12);  // SYN | ACK
+  a.JumpImm(BPF_JNE, r5, 0x02, kPass);
+  a.Load(BPF_H, r8, r2, 2);  // destination port
+  a.Goto(kLookup);
+
+  // UDP: most replies go to ephemeral ports.
+  a.Bind(kUdp);
+  a.Mov(r4, r2);
+  a.Alu(BPF_ADD, r4, 8);
+  a.JumpReg(BPF_JGT, r4, r3, kPass);
+  a.Load(BPF_H, r8, r2, 2);  // destination port
+  a.Mov(r5, r8);
+  a.NetworkToHost16(r5);
+  a.JumpImm(BPF_JGE, r5, ephemeral_port_start, kPass);
+  a.JumpImm(BPF_JEQ, r5, kDhcpClientPort, kPass);
+  a.JumpImm(BPF_JEQ, r5, kDhcpv6ClientPort, kPass);
+  // Only interfaces that opted in to UDP filtering drop it.
+  a.Load(BPF_W, r9, r6, offsetof(struct xdp_md, ingress_ifindex));
+  a.Store(BPF_W, fp, -8, r9);
+  a.Store(BPF_B, fp, -4, r7);
+  a.StoreImm(BPF_B, fp, -3, 0);
+  a.StoreImm(BPF_H, fp, -2, htons(kUdpFilteringPort));
+  a.LoadMapFd(r1, map_fd);
+  a.Mov(r2, fp);
+  a.Alu(BPF_ADD, r2, -8);
+  a.Call(BPF_FUNC_map_lookup_elem);
+  a.JumpImm(BPF_JEQ, r0, 0, kPass);
+
+  // Look the hole up on the interface, then on all interfaces. r8 is the
+  // destination port.
+  a.Bind(kLookup);
+  a.Load(BPF_W, r9, r6, offsetof(struct xdp_md, ingress_ifindex));
+  a.Store(BPF_W, fp, -8, r9);
+  a.Store(BPF_B, fp, -4, r7);
+  a.StoreImm(BPF_B, fp, -3, 0);
+  a.Store(BPF_H, fp, -2, r8);
+  a.LoadMapFd(r1, map_fd);
+  a.Mov(r2, fp);
+  a.Alu(BPF_ADD, r2, -8);
+  a.Call(BPF_FUNC_map_lookup_elem);
+  a.JumpImm(BPF_JNE, r0, 0, kPass);
+  a.StoreImm(BPF_W, fp, -8, 0);
+  a.LoadMapFd(r1, map_fd);
+  a.Mov(r2, fp);
+  a.Alu(BPF_ADD, r2, -8);
+  a.Call(BPF_FUNC_map_lookup_elem);
+  a.JumpImm(BPF_JNE, r0, 0, kPass);
+  a.MovImm(r0, XDP_DROP);
+  a.Exit();
+
+  a.Bind(kPass);
+  a.MovImm(r0, XDP_PASS);
+  a.Exit();
+  return a.Finish();
+}
+
+void AppendPadded(const void* data, size_t length, std::string* out) {
+  out->append(reinterpret_cast<const char*>(data), length);
+  out->append(NLMSG_ALIGN(length) - length, '\0');
+}
+
+void AppendAttribute(uint16_t type,
+                     const void* data,
+                     size_t length,
+                     std::string* out) {
+  struct nlattr attribute;
+  attribute.nla_len = NLA_HDRLEN + length;
+  attribute.nla_type = type;
+  AppendPadded(&attribute, sizeof(attribute), out);
+  AppendPadded(data, length, out);
+}
+
+// Sets the XDP program of interface |ifindex| to |program_fd|, or removes it
+// if |program_fd| is -1.
+bool SetLinkXdpProgram(int ifindex, int program_fd, uint32_t flags) {
+  std::string xdp;
+  AppendAttribute(IFLA_XDP_FD, &program_fd, sizeof(program_fd), &xdp);
+  AppendAttribute(IFLA_XDP_FLAGS, &flags, sizeof(flags), &xdp);
+  std::string attributes;
+  AppendAttribute(IFLA_XDP | NLA_F_NESTED, xdp.data(), xdp.size(),
+                  &attributes);
+
+  struct ifinfomsg link;
+  memset(&link, 0, sizeof(link));
+  link.ifi_family = AF_UNSPEC;
+  link.ifi_index = ifindex;
+
+  struct nlmsghdr header;
+  memset(&header, 0, sizeof(header));
+  header.nlmsg_len =
+      NLMSG_LENGTH(NLMSG_ALIGN(sizeof(link))) + attributes.size();
+  header.nlmsg_type = RTM_SETLINK;
+  header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+
+  std::string request;
+  AppendPadded(&header, sizeof(header), &request);
+  AppendPadded(&link, sizeof(link), &request);
+  request += attributes;
+
+  base::ScopedFD fd(socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE));
+  if (!fd.is_valid()) {
+    PLOG(ERROR) << "Could not open rtnetlink socket";
+    return false;
+  }
+  if (HANDLE_EINTR(send(fd.get(), request.data(), request.size(), 0)) !=
+      static_cast<ssize_t>(request.size())) {
+    PLOG(ERROR) << "Could not write to rtnetlink socket";
+    return false;
+  }
+  char buffer[4096];
+  ssize_t length = HANDLE_EINTR(recv(fd.get(), buffer, sizeof(buffer), 0));
+  if (length < 0) {
+    PLOG(ERROR) << "Could not read from rtnetlink socket";
+    return false;
+  }
+  const struct nlmsghdr* reply =
+      reinterpret_cast<const struct nlmsghdr*>(buffer);
+  if (!NLMSG_OK(reply, static_cast<size_t>(length)) ||
+      reply->nlmsg_type != NLMSG_ERROR) {
+    LOG(ERROR) << "Unexpected rtnetlink reply";
+    return false;
+  }
+  const struct nlmsgerr* error =
+      reinterpret_cast<const struct nlmsgerr*>(NLMSG_DATA(reply));
+  if (error->error != 0) {
+    LOG(ERROR) << "Setting XDP program failed: " << strerror(-error->error);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+namespace firewalld {
+
+XdpFilter::XdpFilter() {
+}
+
+XdpFilter::~XdpFilter() {
+  for (const auto& interface : interfaces_) {
+    SetLinkXdpProgram(interface.second, -1, XDP_FLAGS_SKB_MODE);
+  }
+}
+
+bool XdpFilter::Init() {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_HASH;
+  attr.key_size = sizeof(HoleKey);
+  attr.value_size = sizeof(uint8_t);
+  attr.max_entries = kMaxHoles;
+  map_fd_.reset(Bpf(BPF_MAP_CREATE, &attr));
+  if (!map_fd_.is_valid()) {
+    PLOG(ERROR) << "Could not create XDP hole map";
+    return false;
+  }
+
+  program_fd_ = LoadBpfProgram(
+      BPF_PROG_TYPE_XDP, static_cast<enum bpf_attach_type>(0),
+      FilterProgram(map_fd_.get(), EphemeralPortStart()));
+  if (!program_fd_.is_valid()) {
+    LOG(ERROR) << "Could not load XDP program";
+    map_fd_.reset();
+    return false;
+  }
+  return true;
+}
+
+bool XdpFilter::Attach(const std::string& interface, bool filter_udp) {
+  if (IsAttached(interface)) {
+    return true;
+  }
+  int ifindex = if_nametoindex(interface.c_str());
+  if (ifindex == 0) {
+    PLOG(ERROR) << "Could not find interface " << interface;
+    return false;
+  }
+  if (filter_udp) {
+    HoleKey key;
+    memset(&key, 0, sizeof(key));
+    key.ifindex = ifindex;
+    key.protocol = IPPROTO_UDP;
+    key.port = htons(kUdpFilteringPort);
+    uint8_t value = 1;
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd_.get();
+    attr.key = PointerToU64(&key);
+    attr.value = PointerToU64(&value);
+    if (Bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+      PLOG(ERROR) << "Could not enable XDP UDP filtering on " << interface;
+      return false;
+    }
+  }
+  if (!SetLinkXdpProgram(ifindex, program_fd_.get(),
+                         XDP_FLAGS_SKB_MODE | XDP_FLAGS_UPDATE_IF_NOEXIST)) {
+    LOG(ERROR) << "Could not attach XDP program to " << interface;
+    return false;
+  }
+  interfaces_[interface] = ifindex;
+  return true;
+}
+
+bool XdpFilter::IsAttached(const std::string& interface) const {
+  return interfaces_.find(interface) != interfaces_.end();
+}
+
+bool XdpFilter::AddHole(uint8_t protocol,
+                        uint16_t port,
+                        const std::string& interface) {
+  return UpdateHole(protocol, port, interface, true /* add */);
+}
+
+bool XdpFilter::RemoveHole(uint8_t protocol,
+                           uint16_t port,
+                           const std::string& interface) {
+  return UpdateHole(protocol, port, interface, false /* remove */);
+}
+
+// static
+size_t XdpFilter::capacity() {
+  return kMaxHoles;
+}
+
+void XdpFilter::Save(base::Pickle* pickle, std::vector<int>* fds) const {
+  pickle->WriteUInt32(interfaces_.size());
+  for (const auto& interface : interfaces_) {
+    pickle->WriteString(interface.first);
+    pickle->WriteInt(interface.second);
+  }
+  pickle->WriteUInt32(hole_count_);
+  fds->push_back(map_fd_.get());
+  fds->push_back(program_fd_.get());
+}
+
+void XdpFilter::Release() {
+  interfaces_.clear();
+  hole_count_ = 0;
+  map_fd_.reset();
+  program_fd_.reset();
+}
+
+bool XdpFilter::Adopt(base::ScopedFD map_fd,
+                      base::ScopedFD program_fd,
+                      base::PickleIterator* iterator) {
+  uint32_t count;
+  if (!iterator->ReadUInt32(&count)) {
+    return false;
+  }
+  std::map<std::string, int> interfaces;
+  for (uint32_t i = 0; i < count; i++) {
+    std::string interface;
+    int ifindex;
+    if (!iterator->ReadString(&interface) || !iterator->ReadInt(&ifindex)) {
+      return false;
+    }
+    interfaces[interface] = ifindex;
+  }
+  uint32_t hole_count;
+  if (!iterator->ReadUInt32(&hole_count) || !map_fd.is_valid() ||
+      !program_fd.is_valid()) {
+    return false;
+  }
+  map_fd_ = std::move(map_fd);
+  program_fd_ = std::move(program_fd);
+  interfaces_.swap(interfaces);
+  hole_count_ = hole_count;
+  return true;
+}
+
+bool XdpFilter::UpdateHole(uint8_t protocol,
+                           uint16_t port,
+                           const std::string& interface,
+                           bool add) {
+  HoleKey key;
+  memset(&key, 0, sizeof(key));
+  if (!interface.empty()) {
+    auto it = interfaces_.find(interface);
+    if (it == interfaces_.end()) {
+      return true;
+    }
+    key.ifindex = it->second;
+  }
+  key.protocol = protocol;
+  key.port = htons(port);
+  uint8_t value = 1;
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd_.get();
+  attr.key = PointerToU64(&key);
+  if (add) {
+    attr.value = PointerToU64(&value);
+    // Only new entries count towards |hole_count_|.
+    attr.flags = BPF_NOEXIST;
+  }
+  if (Bpf(add ? BPF_MAP_UPDATE_ELEM : BPF_MAP_DELETE_ELEM, &attr) < 0) {
+    if (errno == (add ? EEXIST : ENOENT)) {
+      return true;
+    }
+    PLOG(ERROR) << "Could not " << (add ? "add" : "remove") << " XDP hole "
+                << port << " on " << (interface.empty() ? "all" : interface);
+    return false;
+  }
+  if (add) {
+    hole_count_++;
+  } else if (hole_count_ > 0) {
+    hole_count_--;
+  }
+  return true;
+}
+
+}  // namespace firewalld
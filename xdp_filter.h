@@ -0,0 +1,106 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIREWALLD_XDP_FILTER_H_
+#define FIREWALLD_XDP_FILTER_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/files/scoped_file.h>
+#include <base/macros.h>
+#include <base/pickle.h>
+
+namespace firewalld {
+
+// Drops unsolicited TCP and UDP traffic to ports without a hole before the
+// kernel allocates an skb for it, using an XDP program attached in generic
+// mode to the interfaces that opt in. The program drops:
+//  - TCP SYNs without ACK, i.e. new inbound connections, which the INPUT
+//    chain would refuse anyway, and
+//  - on the interfaces that also opt in to it, UDP to ports below the
+//    ephemeral range. XDP runs before conntrack, so this drops replies to
+//    outbound traffic from a fixed low port too, e.g. NTP (123) or mDNS
+//    (5353), and replies NATed to a low port, which the INPUT chain would
+//    have accepted as ESTABLISHED. The DHCP client ports are always passed,
+//    as DHCP clients receive through packet sockets, which XDP runs before.
+// Everything else, including IP fragments and packets with IPv6 extension
+// headers, goes to the normal stack. Holes are looked up in a BPF hash map
+// keyed by interface index, protocol and port; an entry for UDP port 0 opts
+// its interface in to UDP filtering.
+class XdpFilter {
+ public:
+  XdpFilter();
+  virtual ~XdpFilter();
+
+  // Creates the hole map and loads the program. Must succeed before the
+  // other methods are used.
+  bool Init();
+
+  // Whether |Init| or |Adopt| succeeded.
+  bool IsInitialized() const { return program_fd_.is_valid(); }
+
+  // Attaches the program to |interface|, dropping UDP there as well if
+  // |filter_udp|. It is detached again when the filter is destroyed.
+  bool Attach(const std::string& interface, bool filter_udp);
+
+  // Whether the program is attached to |interface|.
+  bool IsAttached(const std::string& interface) const;
+
+  // Adds or removes the hole for |port| over |protocol| (IPPROTO_TCP or
+  // IPPROTO_UDP) on |interface|, or on all interfaces if |interface| is
+  // empty. Holes on interfaces without the program are ignored.
+  virtual bool AddHole(uint8_t protocol,
+                       uint16_t port,
+                       const std::string& interface);
+  virtual bool RemoveHole(uint8_t protocol,
+                          uint16_t port,
+                          const std::string& interface);
+
+  // Entries in the hole map, and how many it can hold.
+  size_t hole_count() const { return hole_count_; }
+  static size_t capacity();
+
+  // Handoff to a new instance of the daemon. |Save| writes the attached
+  // interfaces and the hole count to |pickle| and appends the hole map and
+  // program descriptors to |fds|. Once they are sent, |Release| lets go of
+  // them without detaching the program. The new instance picks them up with
+  // |Adopt|, holes and all.
+  void Save(base::Pickle* pickle, std::vector<int>* fds) const;
+  void Release();
+  bool Adopt(base::ScopedFD map_fd,
+             base::ScopedFD program_fd,
+             base::PickleIterator* iterator);
+
+ private:
+  bool UpdateHole(uint8_t protocol,
+                  uint16_t port,
+                  const std::string& interface,
+                  bool add);
+
+  base::ScopedFD map_fd_;
+  base::ScopedFD program_fd_;
+  // Interfaces the program is attached to, by name, with their indexes.
+  std::map<std::string, int> interfaces_;
+  size_t hole_count_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(XdpFilter);
+};
+
+}  // namespace firewalld
+
+#endif  // FIREWALLD_XDP_FILTER_H_
@@ -0,0 +1,116 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "xtables_lock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/files/scoped_file.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+
+namespace {
+
+#if defined(__ANDROID__)
+const char kXtablesLockPath[] = "/system/etc/xtables.lock";
+#else
+const char kXtablesLockPath[] = "/run/xtables.lock";
+#endif  // __ANDROID__
+
+const char kProcLocksPath[] = "/proc/locks";
+
+}  // namespace
+
+namespace firewalld {
+
+bool XtablesLockIsFree(std::string* holder) {
+  base::ScopedFD fd(
+      HANDLE_EINTR(open(kXtablesLockPath, O_RDONLY | O_CLOEXEC)));
+  if (!fd.is_valid()) {
+    // No command has taken the lock yet, or this iptables doesn't lock a
+    // file. Either way, there is nothing to wait for.
+    return true;
+  }
+  // The lock is only taken for as long as it takes to test it.
+  if (flock(fd.get(), LOCK_EX | LOCK_NB) == 0) {
+    flock(fd.get(), LOCK_UN);
+    return true;
+  }
+  if (errno != EWOULDBLOCK) {
+    PLOG(WARNING) << "Could not test the xtables lock";
+    return true;
+  }
+
+  if (!holder) {
+    return false;
+  }
+  holder->clear();
+  struct stat lock_stat;
+  std::string locks;
+  if (fstat(fd.get(), &lock_stat) < 0 ||
+      !base::ReadFileToString(base::FilePath(kProcLocksPath), &locks)) {
+    return false;
+  }
+  pid_t pid = FindFlockHolder(locks, lock_stat.st_dev, lock_stat.st_ino);
+  if (pid < 0) {
+    return false;
+  }
+  std::string name;
+  if (base::ReadFileToString(
+          base::FilePath(base::StringPrintf("/proc/%d/comm", pid)), &name)) {
+    base::TrimWhitespaceASCII(name, base::TRIM_TRAILING, holder);
+  }
+  if (holder->empty()) {
+    // The holder exited in the meantime.
+    *holder = base::IntToString(pid);
+  }
+  return false;
+}
+
+pid_t FindFlockHolder(const std::string& proc_locks,
+                      dev_t device,
+                      ino_t inode) {
+  // Locks look like "1: FLOCK  ADVISORY  WRITE 1234 fd:00:5678 0 EOF". Those
+  // that processes are waiting for have "->" before the type.
+  const std::string file =
+      base::StringPrintf("%02x:%02x:%llu", major(device), minor(device),
+                         static_cast<unsigned long long>(inode));
+  for (const auto& line :
+       base::SplitString(proc_locks, "\n", base::TRIM_WHITESPACE,
+                         base::SPLIT_WANT_NONEMPTY)) {
+    const std::vector<std::string> fields = base::SplitString(
+        line, " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    int pid;
+    if (fields.size() < 6 || fields[1] != "FLOCK" || fields[5] != file ||
+        !base::StringToInt(fields[4], &pid) || pid <= 0) {
+      continue;
+    }
+    return pid;
+  }
+  return -1;
+}
+
+}  // namespace firewalld
@@ -0,0 +1,37 @@
+// Copyright 2015 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIREWALLD_XTABLES_LOCK_H_
+#define FIREWALLD_XTABLES_LOCK_H_
+
+#include <sys/types.h>
+
+#include <string>
+
+namespace firewalld {
+
+// Whether the xtables lock, which iptables, ip6tables and their restore tools
+// hold while they change the rules, is free right now. Never blocks. If the
+// lock is held and |holder| is not null, sets |holder| to the name of the
+// process holding it, or leaves it empty if that can't be told.
+bool XtablesLockIsFree(std::string* holder);
+
+// Returns the PID of the process holding an flock() on the file with |inode|
+// on |device|, according to |proc_locks|, the contents of /proc/locks, or -1
+// if there is none.
+pid_t FindFlockHolder(const std::string& proc_locks, dev_t device, ino_t inode);
+
+}  // namespace firewalld
+
+#endif  // FIREWALLD_XTABLES_LOCK_H_